@@ -0,0 +1,312 @@
+/*
+
+  Copyright (c) 2012, Samsung R&D Institute Russia
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*! @file death_handler-inl.h
+ *  @brief The signal handler templates of DeathHandler, instantiated only
+ *  for the policies which are used. Included by death_handler.h.
+ *  @author Markovtsev Vadim <gmarkhor@gmail.com>
+ *  @version 1.0
+ *  @license Simplified BSD License
+ *  @copyright 2012 Samsung R&D Institute Russia, 2016 Moscow Institute of Physics and Technology
+ */
+
+#ifndef DEATH_HANDLER_INL_H_
+#define DEATH_HANDLER_INL_H_
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace Debug {
+
+template <class Policy>
+void DeathHandler::PrintStackTrace(void** trace, const char* const* notes,
+                                   int trace_size, pid_t pid, bool raw,
+                                   bool live, char* memory) {
+#ifdef __linux__
+  char* name_buf;
+  char* cwd;
+  memory = BeginStackTrace(memory, &name_buf, &cwd, live);
+  char* prev_memory = memory;
+
+  int stackOffset = trace_size > 2 && trace[2] == trace[1]? 2 : 1;
+  for (int i = stackOffset; i < trace_size; i++) {
+    memory = prev_memory;
+    const char* note = notes != NULL? notes[i] : NULL;
+    if (raw) {
+      PrintRawFrame(i - stackOffset, trace[i], note, name_buf, memory);
+      continue;
+    }
+    // The return addresses point after the call
+    char *line = SymbolizeFrame(trace[i], i > stackOffset, name_buf,
+                                Policy::color_output(), live, &memory);
+    if (line == NULL) {
+      memory = prev_memory;
+      PrintRawFrame(i - stackOffset, trace[i], note, name_buf, memory);
+      continue;
+    }
+
+    char *function_name_end = strstr(line, "\n");
+    if (function_name_end != NULL) {
+      *function_name_end = 0;
+      {
+        // "\033[34;1m[%s]\033[0m \033[33;1m(%i)\033[0m\n
+        char* msg = memory;
+        const int msg_max_length = 512;
+        if (Policy::color_output()) {
+          strcpy(msg, "\033[34;1m");  // NOLINT(runtime/printf)
+        } else {
+          msg[0] = 0;
+        }
+        strcat(msg, "[");  // NOLINT(runtime/printf)
+        strcat(msg, line);  // NOLINT(runtime/printf)
+        strcat(msg, "]");  // NOLINT(runtime/printf)
+        if (Policy::append_pid()) {
+          if (Policy::color_output()) {
+            strcat(msg, "\033[0m\033[33;1m");  // NOLINT(runtime/printf)
+          }
+          strcat(msg, " (");  // NOLINT(runtime/printf)
+          strcat(msg, FormatNumber(pid, msg + msg_max_length));  // NOLINT(*)
+          strcat(msg, ")");  // NOLINT(runtime/printf)
+          if (Policy::color_output()) {
+            strcat(msg, "\033[0m");  // NOLINT(runtime/printf)
+          }
+          strcat(msg, "\n");  // NOLINT(runtime/printf)
+        } else {
+          if (Policy::color_output()) {
+            strcat(msg, "\033[0m");  // NOLINT(runtime/printf)
+          }
+          strcat(msg, "\n");  // NOLINT(runtime/printf)
+        }
+        print(msg);
+      }
+      line = function_name_end + 1;
+
+      // Remove the common path root
+      if (Policy::cut_common_path_root()) {
+        int cpi;
+        for (cpi = 0; cwd[cpi] == line[cpi]; cpi++) {};
+        if (line[cpi - 1] != '/') {
+          for (; line[cpi - 1] != '/'; cpi--) {};
+        }
+        if (cpi > 1) {
+          line = line + cpi;
+        }
+      }
+
+      // Remove relative path root
+      if (Policy::cut_relative_paths()) {
+        char *path_cut_pos = strstr(line, "../");
+        if (path_cut_pos != NULL) {
+          path_cut_pos += 3;
+          while (!strncmp(path_cut_pos, "../", 3)) {
+            path_cut_pos += 3;
+          }
+          line = path_cut_pos;
+        }
+      }
+
+      // Mark line number
+      if (Policy::color_output()) {
+        char* number_pos = strstr(line, ":");
+        if (number_pos != NULL) {
+          char* line_number = memory;  // 128
+          strcpy(line_number, number_pos);  // NOLINT(runtime/printf)
+          // Overwrite the new line char
+          line_number[strlen(line_number) - 1] = 0;
+          // \033[32;1m%s\033[0m\n
+          strcpy(number_pos, "\033[32;1m");  // NOLINT(runtime/printf)
+          strcat(line, line_number);  // NOLINT(runtime/printf)
+          strcat(line, "\033[0m\n");  // NOLINT(runtime/printf)
+        }
+      }
+    }
+
+    // Overwrite the new line char
+    line[strlen(line) - 1] = 0;
+
+    if (note != NULL) {
+      strcat(line, note);  // NOLINT(runtime/printf)
+    }
+
+    // Append pid
+    if (Policy::append_pid()) {
+      // %s\033[33;1m(%i)\033[0m\n
+      strcat(line, " ");  // NOLINT(runtime/printf)
+      if (Policy::color_output()) {
+        strcat(line, "\033[33;1m");  // NOLINT(runtime/printf)
+      }
+      strcat(line, "(");  // NOLINT(runtime/printf)
+      strcat(line, FormatNumber(pid, memory));  // NOLINT(runtime/printf)
+      strcat(line, ")");  // NOLINT(runtime/printf)
+      if (Policy::color_output()) {
+        strcat(line, "\033[0m");  // NOLINT(runtime/printf)
+      }
+    }
+
+    strcat(line, "\n");  // NOLINT(runtime/printf)
+    print(line);
+  }
+#elif defined(__APPLE__)
+  (void)notes;
+  (void)pid;
+  (void)raw;
+  (void)live;
+  for (int i = 0; i < trace_size; i++) {
+    FormatPointer(trace[i], memory);
+    strcat(memory, "\n");  // NOLINT(runtime/printf)
+    print(memory);
+  }
+#endif
+}
+
+template <class Policy>
+void DeathHandler::HandleSignal(int sig, void *info, void *secret) {
+  // Under a crash loop, print the raw addresses and exit right away
+  bool minimal = BeginHandling();
+  // Stop all other running threads by forking
+  pid_t forkedPid = minimal? 0 : fork();
+  if (forkedPid != 0) {
+    int status;
+    if (Policy::thread_safe()) {
+      // Freeze the original process, until it's child prints the stack trace
+      kill(getpid(), SIGSTOP);
+      // Wait for the child without blocking and exit as soon as possible,
+      // so that no zombies are left.
+      waitpid(forkedPid, &status, WNOHANG);
+    } else {
+      // Wait for the child, blocking only the current thread.
+      // All other threads will continue to run, potentially crashing the parent.
+      waitpid(forkedPid, &status, 0);
+    }
+    EndHandling();
+    if (Policy::generate_core_dump()) {
+      AbortWithCoreDump();
+    } else if (Policy::cleanup()) {
+      exit(EXIT_FAILURE);
+    } else {
+      _Exit(EXIT_FAILURE);
+    }
+  }
+
+  // The crashed process
+  pid_t pid = minimal? getpid() : getppid();
+
+  if (dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {  // redirect stdout to stderr
+    print("Failed to redirect stdout to stderr\n");
+  }
+  char* memory = memory_;
+  {
+    char* msg = memory;
+    const int msg_max_length = 128;
+    if (Policy::color_output()) {
+      // \033[31;1mSegmentation fault\033[0m \033[33;1m(%i)\033[0m\n
+      strcpy(msg, "\033[31;1m");  // NOLINT(runtime/printf)
+    } else {
+      msg[0] = '\0';
+    }
+    switch (sig) {
+      case SIGSEGV:
+        strcat(msg, "Segmentation fault");  // NOLINT(runtime/printf)
+        break;
+      case SIGABRT:
+        strcat(msg, "Aborted");  // NOLINT(runtime/printf)
+        break;
+      case SIGFPE:
+        strcat(msg, "Floating point exception");  // NOLINT(runtime/printf)
+        break;
+      default:
+        strcat(msg, "Caught signal ");  // NOLINT(runtime/printf)
+        strcat(msg, FormatNumber(sig, msg + msg_max_length));  // NOLINT(*)
+        break;
+    }
+    if (Policy::color_output()) {
+      strcat(msg, "\033[0m");  // NOLINT(runtime/printf)
+    }
+    strcat(msg, " (thread ");  // NOLINT(runtime/printf)
+    if (Policy::color_output()) {
+      strcat(msg, "\033[33;1m");  // NOLINT(runtime/printf)
+    }
+  #ifndef __APPLE__
+    strcat(msg, FormatNumber(pthread_self(), msg + msg_max_length));  // NOLINT
+  #else
+    strcat(msg, FormatPointer(pthread_self(), msg + msg_max_length));  // NOLINT
+  #endif
+    if (Policy::color_output()) {
+      strcat(msg, "\033[0m");  // NOLINT(runtime/printf)
+    }
+    strcat(msg, ", pid ");  // NOLINT(runtime/printf)
+    if (Policy::color_output()) {
+      strcat(msg, "\033[33;1m");  // NOLINT(runtime/printf)
+    }
+    strcat(msg, FormatNumber(pid, msg + msg_max_length));  // NOLINT(*)
+    if (Policy::color_output()) {
+      strcat(msg, "\033[0m");  // NOLINT(runtime/printf)
+    }
+    strcat(msg, ")");  // NOLINT(runtime/printf)
+    print(msg);
+  }
+
+  if (minimal) {
+    print("\nCrash loop detected, the report is minimal");
+  }
+  if (!Policy::symbolize() || minimal) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    print("\nTime: ");
+    print(FormatNumber(now.tv_sec, memory));
+  }
+  print("\nStack trace:\n");
+  void** trace;
+  const char** notes;
+  int trace_size = CaptureStackTrace(secret, Policy::frames_count(), &trace,
+                                     &notes, &memory);
+  PrintStackTrace<Policy>(trace, notes, trace_size, pid,
+                          !Policy::symbolize() || minimal, false, memory);
+  EndReport(info, trace_size == Policy::frames_count() + 2, minimal,
+            Policy::color_output());
+  if (minimal) {
+    // There is no child process, this is the crashed one. The core dump
+    // and the cleanup are skipped to keep each iteration of the loop cheap
+    _Exit(EXIT_FAILURE);
+  }
+  if (Policy::thread_safe()) {
+    // Resume the parent process
+    kill(getppid(), SIGCONT);
+  }
+
+  // This is called in the child process
+  _Exit(EXIT_SUCCESS);
+}
+
+}  // namespace Debug
+
+#endif  // DEATH_HANDLER_INL_H_
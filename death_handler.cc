@@ -35,6 +35,7 @@
  */
 
 #include "death_handler.h"
+#include "death_handler_call_site.h"
 #include <assert.h>
 #include <execinfo.h>
 #include <pthread.h>
@@ -43,23 +44,181 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #ifndef _GNU_SOURCE
 #define _GNU_SOURCE
 #endif
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <limits.h>
+#ifdef __linux__
+#include <errno.h>
+#include <link.h>
+#include <malloc.h>
+#include <semaphore.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#endif
 #ifdef __APPLE__
 #include <malloc/malloc.h>
-#include <sys/mman.h>
 #endif
 
 #define INLINE __attribute__((always_inline)) inline
+#ifdef __linux__
+/// @brief Places the function into the section locked by lock_crash_path.
+/// @details The template instantiations are COMDAT and cannot share it,
+/// they are located with the symbol table instead.
+#define CRASH_PATH __attribute__((section("death_handler_text")))
+extern "C" {
+// Defined by the linker
+extern const char __start_death_handler_text[];
+extern const char __stop_death_handler_text[];
+}
+#else
+#define CRASH_PATH
+#endif
 
 namespace Debug {
 namespace Safe {
   INLINE void print(const char *msg, size_t len = 0);
 }  // namespace Safe
+
+#ifdef __linux__
+/// @brief The malloc() and free() latency histograms, see
+/// set_malloc_sampling(): a histogram per thread, so that no locks are
+/// needed, by operation, by size class (<= 16 bytes, <= 32 bytes, ...,
+/// above 8 MiB) and by floor(log2(latency ticks)).
+static const int kMallocSizeClasses = 21;
+static const int kMallocLatencyBuckets = 40;
+static const int kMaxSampledThreads = 256;
+static const int kMaxMallocOutliers = 16;
+static const int kMallocOutlierFrames = 18;
+
+struct MallocHistogram {
+  /// @brief [0] is malloc(), [1] is free().
+  uint64_t counts[2][kMallocSizeClasses][kMallocLatencyBuckets];
+};
+
+/// @brief One of the slowest sampled calls.
+struct MallocOutlier {
+  uint64_t ticks;
+  size_t size;
+  pid_t tid;
+  int operation;
+  int frame_count;
+  void* frames[kMallocOutlierFrames];
+};
+
+/// @brief kMaxSampledThreads histograms, plus one shared by the rest of
+/// the threads and updated atomically.
+static MallocHistogram* malloc_histograms = NULL;
+static int sampled_threads = 0;
+static uint64_t ticks_per_ms = 0;
+static MallocOutlier slowest_allocations[kMaxMallocOutliers];
+static volatile uint64_t slowest_allocation_floor = 0;
+static int slowest_allocations_busy = 0;
+
+#define INITIAL_EXEC __attribute__((tls_model("initial-exec")))
+/// @brief Separate for malloc() and free(), which often alternate.
+static __thread int malloc_countdown[2] INITIAL_EXEC;
+static __thread int malloc_histogram_slot INITIAL_EXEC;
+static __thread bool malloc_sampler_busy INITIAL_EXEC;
+
+INLINE static uint64_t ReadCycleCounter() {
+#if defined(__x86_64__) || defined(__i386__)
+  uint32_t low, high;
+  asm volatile("rdtsc" : "=a"(low), "=d"(high));
+  return (static_cast<uint64_t>(high) << 32) | low;
+#elif defined(__aarch64__)
+  uint64_t value;
+  asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+  return value;
+#else
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+/// @brief Returns true once in rate calls of the operation made by this
+/// thread.
+INLINE static bool MallocSampleDue(int operation, int rate) {
+  if (malloc_sampler_busy || --malloc_countdown[operation] > 0) {
+    return false;
+  }
+  malloc_countdown[operation] = rate;
+  return true;
+}
+
+/// @brief Keeps the call if it is among the outliers slowest ones. Another
+/// thread updating the outliers at the same time wins, nobody waits.
+static void RecordMallocOutlier(int operation, size_t size, uint64_t ticks,
+                                int outliers) {
+  MallocOutlier outlier;
+  outlier.ticks = ticks;
+  outlier.size = size;
+  outlier.operation = operation;
+  outlier.tid = syscall(SYS_gettid);
+  outlier.frame_count = backtrace(outlier.frames, kMallocOutlierFrames);
+  if (__sync_lock_test_and_set(&slowest_allocations_busy, 1)) {
+    return;
+  }
+  int fastest = 0;
+  for (int i = 1; i < outliers; i++) {
+    if (slowest_allocations[i].ticks < slowest_allocations[fastest].ticks) {
+      fastest = i;
+    }
+  }
+  if (slowest_allocations[fastest].ticks < ticks) {
+    slowest_allocations[fastest] = outlier;
+  }
+  uint64_t floor = ticks;
+  for (int i = 0; i < outliers; i++) {
+    if (slowest_allocations[i].ticks < floor) {
+      floor = slowest_allocations[i].ticks;
+    }
+  }
+  slowest_allocation_floor = floor;
+  __sync_lock_release(&slowest_allocations_busy);
+}
+
+static void RecordMallocSample(int operation, size_t size, uint64_t ticks,
+                               int outliers) {
+  malloc_sampler_busy = true;
+  int slot = malloc_histogram_slot - 1;
+  if (slot < 0) {
+    slot = __sync_fetch_and_add(&sampled_threads, 1);
+    if (slot >= kMaxSampledThreads) {
+      slot = kMaxSampledThreads;
+    }
+    malloc_histogram_slot = slot + 1;
+  }
+  int size_class = 0;
+  for (size_t bound = 16; size > bound && size_class < kMallocSizeClasses - 1;
+       bound <<= 1) {
+    size_class++;
+  }
+  int bucket = 63 - __builtin_clzll(ticks | 1);
+  if (bucket >= kMallocLatencyBuckets) {
+    bucket = kMallocLatencyBuckets - 1;
+  }
+  uint64_t* count =
+      &malloc_histograms[slot].counts[operation][size_class][bucket];
+  if (slot == kMaxSampledThreads) {
+    __sync_fetch_and_add(count, 1);
+  } else {
+    ++*count;
+  }
+  if (outliers > 0 && ticks > slowest_allocation_floor) {
+    RecordMallocOutlier(operation, size, ticks, outliers);
+  }
+  malloc_sampler_busy = false;
+}
+#endif  // #ifdef __linux__
 }  // namespace Debug
 
 extern "C" {
@@ -87,6 +246,14 @@ void* malloc(size_t size) throw() {
       Debug::DeathHandler::malloc_ = dlsym(RTLD_NEXT, "malloc");
       Debug::DeathHandler::heap_trap_active_ = false;
     }
+    int rate = Debug::DeathHandler::malloc_sampling_;
+    if (rate > 0 && Debug::MallocSampleDue(0, rate)) {
+      uint64_t start = Debug::ReadCycleCounter();
+      void* result = ((void*(*)(size_t))Debug::DeathHandler::malloc_)(size);
+      Debug::RecordMallocSample(0, size, Debug::ReadCycleCounter() - start,
+                                Debug::DeathHandler::malloc_outliers_);
+      return result;
+    }
     return ((void*(*)(size_t))Debug::DeathHandler::malloc_)(size);
   }
   return __malloc_impl(size);
@@ -101,6 +268,15 @@ void free(void* ptr) throw() {
       Debug::DeathHandler::free_ = dlsym(RTLD_NEXT, "free");
       Debug::DeathHandler::heap_trap_active_ = false;
     }
+    int rate = Debug::DeathHandler::malloc_sampling_;
+    if (rate > 0 && ptr != NULL && Debug::MallocSampleDue(1, rate)) {
+      size_t size = malloc_usable_size(ptr);
+      uint64_t start = Debug::ReadCycleCounter();
+      ((void(*)(void*))Debug::DeathHandler::free_)(ptr);
+      Debug::RecordMallocSample(1, size, Debug::ReadCycleCounter() - start,
+                                Debug::DeathHandler::malloc_outliers_);
+      return;
+    }
     ((void(*)(void*))Debug::DeathHandler::free_)(ptr);
   }
   // no-op
@@ -200,11 +376,27 @@ namespace Safe {
     return result;
   }
 
+  /// @brief Converts the leading decimal digits of a string to an unsigned
+  /// integer.
+  INLINE uint64_t atou(const char* str, const char** end = NULL) {
+    uint64_t val = 0;
+    for (; *str >= '0' && *str <= '9'; str++) {
+      val = val * 10 + (*str - '0');
+    }
+    if (end != NULL) {
+      *end = str;
+    }
+    return val;
+  }
+
+  CRASH_PATH
   ssize_t write2stderr(const char* msg, size_t len) {
     return write(STDERR_FILENO, msg, len);
   }
 }  // namespace Safe
 
+const uint32_t HandlerMetrics::kMagic;
+const int HandlerMetrics::kDurationBuckets;
 const size_t DeathHandler::kNeededMemory = 1 << 16;
 bool DeathHandler::generate_core_dump_ = true;
 bool DeathHandler::cleanup_ = true;
@@ -217,26 +409,75 @@ bool DeathHandler::cut_relative_paths_ = true;
 bool DeathHandler::append_pid_ = false;
 bool DeathHandler::color_output_ = true;
 bool DeathHandler::thread_safe_ = true;
+bool DeathHandler::symbolize_ = true;
+#ifdef __linux__
+bool DeathHandler::resource_snapshot_ = true;
+int DeathHandler::statm_fd_ = -1;
+int DeathHandler::stat_fd_ = -1;
+int DeathHandler::memory_events_fd_ = -1;
+int DeathHandler::memory_pressure_fd_ = -1;
+int DeathHandler::task_fd_ = -1;
+bool DeathHandler::stack_usage_tracking_ = false;
+int DeathHandler::stack_usage_threshold_ = 90;
+int DeathHandler::malloc_sampling_ = 0;
+int DeathHandler::malloc_outliers_ = 0;
+char DeathHandler::crash_loop_file_[PATH_MAX];
+void* DeathHandler::crash_loop_state_ = NULL;
+char DeathHandler::metrics_page_name_[NAME_MAX + 1];
+HandlerMetrics* DeathHandler::metrics_ = NULL;
+int DeathHandler::crash_loop_threshold_ = 5;
+int DeathHandler::crash_loop_window_ = 60;
+int DeathHandler::crash_loop_quiet_period_ = 300;
+int DeathHandler::shutdown_timeout_ = 0;
+int DeathHandler::warn_interval_ = -1;
+int DeathHandler::line_table_threads_ = 1;
+bool DeathHandler::shutdown_force_exit_ = false;
+bool DeathHandler::lock_crash_path_ = false;
+size_t DeathHandler::locked_memory_ = 0;
+void* DeathHandler::pthread_create_ = NULL;
+#endif
 char DeathHandler::memory_[1 << 16];  // static allocation of 64KiB
+char DeathHandler::altstack_[1 << 16];
 void* DeathHandler::malloc_ = NULL;
 void* DeathHandler::free_ = NULL;
 bool DeathHandler::heap_trap_active_ = false;
 DeathHandler::OutputCallback DeathHandler::output_callback_ = Safe::write2stderr;
+bool DeathHandler::compress_output_ = false;
+DeathHandler::SignalHandler DeathHandler::signal_handler_ = NULL;
+void* DeathHandler::ballast_ = NULL;
+size_t DeathHandler::ballast_size_ = 0;
+DeathHandler::TracePrinter DeathHandler::trace_printer_ = NULL;
 
 typedef void (*sa_sigaction_handler) (int, siginfo_t *, void *);
 
 DeathHandler::DeathHandler(bool altstack) {
+  Install(altstack, HandleSignal<RuntimePolicy>,
+          PrintStackTrace<RuntimePolicy>);
+}
+
+DeathHandler::DeathHandler(bool altstack, SignalHandler handler,
+                           TracePrinter printer) {
+  Install(altstack, handler, printer);
+}
+
+void DeathHandler::Install(bool altstack, SignalHandler handler,
+                           TracePrinter printer) {
+  signal_handler_ = handler;
+  trace_printer_ = printer;
+  // backtrace() loads the unwinder and allocates on its first call
+  void* trace[2];
+  backtrace(trace, 2);
   if (altstack) {
     stack_t altstack;
-    altstack.ss_sp = memory_ + kNeededMemory;
-    altstack.ss_size = MINSIGSTKSZ;
+    altstack.ss_sp = altstack_;
+    altstack.ss_size = sizeof(altstack_);
     altstack.ss_flags = 0;
     if (sigaltstack(&altstack, NULL) < 0) {
       perror("DeathHandler - sigaltstack()");
     }
   }
   struct sigaction sa;
-  sa.sa_sigaction = (sa_sigaction_handler)HandleSignal;
+  sa.sa_sigaction = (sa_sigaction_handler)handler;
   sigemptyset(&sa.sa_mask);
   sa.sa_flags = SA_RESTART | SA_SIGINFO | (altstack? SA_ONSTACK : 0);
   if (sigaction(SIGSEGV, &sa, NULL) < 0) {
@@ -248,6 +489,9 @@ DeathHandler::DeathHandler(bool altstack) {
   if (sigaction(SIGFPE, &sa, NULL) < 0) {
     perror("DeathHandler - sigaction(SIGFPE)");
   }
+  #ifdef __linux__
+  OpenResourceFiles();
+  #endif
   #ifdef __APPLE__
   malloc_zone_t* zone = malloc_default_zone();
   if (!zone) {
@@ -282,18 +526,182 @@ DeathHandler::~DeathHandler() {
   sa.sa_handler = SIG_DFL;
   sigaction(SIGFPE, &sa, NULL);
 
+  set_memory_ballast(0);
+  #ifdef __linux__
+  CloseResourceFiles();
+  UnpinModules();
+  set_shutdown_timeout(0);
+  #endif
+
   #ifdef __APPLE__
   malloc_zone_t* zone = malloc_default_zone();
   SetMallocZone(zone, malloc_, free_);
   #endif
 }
 
+/// @brief The state of the report compressor, see set_compress_output().
+/// The matches may reach back kCompressionWindow bytes across the blocks.
+static const size_t kCompressionBlock = 16 << 10;
+static const size_t kCompressionWindow = 64 << 10;
+static const int kCompressionHashBits = 13;
+/// @brief The compressed blocks follow this magic, each prefixed with its
+/// compressed and raw sizes (32-bit little endian); the empty block ends
+/// the stream.
+static const char kCompressionMagic[] = "DHZ1";
+
+static struct {
+  /// @brief The history (up to kCompressionWindow bytes) followed by the
+  /// pending bytes.
+  unsigned char data[kCompressionWindow + kCompressionBlock];
+  /// @brief The stream positions + 1 of the last 4-byte sequences.
+  uint32_t hash[1 << kCompressionHashBits];
+  unsigned char output[8 + kCompressionBlock + kCompressionBlock / 255 + 16];
+  /// @brief The stream position of data[0].
+  uint32_t base;
+  size_t size;
+  size_t pending;
+  bool started;
+} compression;
+
+CRASH_PATH
+static unsigned char* AppendLength(unsigned char* out, size_t length) {
+  for (; length >= 255; length -= 255) {
+    *out++ = 255;
+  }
+  *out++ = length;
+  return out;
+}
+
+/// @brief Writes a sequence in the LZ4 block format: the token, the literals
+/// and, if match_length is not 0, the match. Async-signal-safe.
+CRASH_PATH
+static unsigned char* AppendSequence(unsigned char* out,
+                                     const unsigned char* literals,
+                                     size_t literal_length, size_t offset,
+                                     size_t match_length) {
+  size_t match_code = match_length > 0? match_length - 4 : 0;
+  *out++ = ((literal_length < 15? literal_length : 15) << 4) |
+      (match_code < 15? match_code : 15);
+  if (literal_length >= 15) {
+    out = AppendLength(out, literal_length - 15);
+  }
+  memcpy(out, literals, literal_length);
+  out += literal_length;
+  if (match_length == 0) {
+    return out;
+  }
+  *out++ = offset & 0xff;
+  *out++ = offset >> 8;
+  if (match_code >= 15) {
+    out = AppendLength(out, match_code - 15);
+  }
+  return out;
+}
+
+/// @brief Compresses the pending bytes into compression.output with
+/// the greedy LZ4 parser. Async-signal-safe.
+/// @return The size of the output, including the block header.
+CRASH_PATH
+static size_t CompressPendingBlock() {
+  const unsigned char* data = compression.data;
+  size_t end = compression.size;
+  size_t position = end - compression.pending;
+  size_t anchor = position;
+  unsigned char* out = compression.output + 8;
+  // The last 5 bytes are always literals, as in LZ4
+  while (position + 12 <= end) {
+    uint32_t sequence;
+    memcpy(&sequence, data + position, sizeof(sequence));
+    uint32_t* bucket = &compression.hash[(sequence * 2654435761U) >>
+                                         (32 - kCompressionHashBits)];
+    uint32_t candidate = *bucket;
+    uint32_t stream_position = compression.base + position;
+    *bucket = stream_position + 1;
+    if (candidate == 0 || candidate - 1 < compression.base ||
+        stream_position - (candidate - 1) > 0xffff) {
+      position++;
+      continue;
+    }
+    size_t reference = candidate - 1 - compression.base;
+    if (memcmp(data + reference, data + position, 4) != 0) {
+      position++;
+      continue;
+    }
+    size_t length = 4;
+    while (position + length < end - 5 &&
+           data[reference + length] == data[position + length]) {
+      length++;
+    }
+    out = AppendSequence(out, data + anchor, position - anchor,
+                         position - reference, length);
+    position += length;
+    anchor = position;
+  }
+  out = AppendSequence(out, data + anchor, end - anchor, 0, 0);
+  uint32_t sizes[2] = {
+    static_cast<uint32_t>(out - compression.output - 8),
+    static_cast<uint32_t>(compression.pending)
+  };
+  for (int i = 0; i < 8; i++) {
+    compression.output[i] = sizes[i / 4] >> (8 * (i % 4));
+  }
+  compression.pending = 0;
+  // Keep only the window
+  if (compression.size > kCompressionWindow) {
+    size_t shift = compression.size - kCompressionWindow;
+    memmove(compression.data, compression.data + shift, kCompressionWindow);
+    compression.base += shift;
+    compression.size = kCompressionWindow;
+  }
+  return out - compression.output;
+}
+
 void DeathHandler::print(const char* msg, size_t len) {
-  if (len > 0) {
+  if (len == 0) {
+    len = strlen(msg);
+  }
+  if (!compress_output_) {
     checked(output_callback_(msg, len));
-  } else {
-    checked(output_callback_(msg, strlen(msg)));
+    return;
+  }
+  if (!compression.started) {
+    checked(output_callback_(kCompressionMagic, 4));
+    compression.started = true;
+  }
+  while (len > 0) {
+    size_t chunk = kCompressionBlock - compression.pending;
+    if (chunk > len) {
+      chunk = len;
+    }
+    memcpy(compression.data + compression.size, msg, chunk);
+    compression.size += chunk;
+    compression.pending += chunk;
+    msg += chunk;
+    len -= chunk;
+    if (compression.pending == kCompressionBlock) {
+      size_t size = CompressPendingBlock();
+      checked(output_callback_(reinterpret_cast<char*>(compression.output),
+                               size));
+    }
+  }
+}
+
+CRASH_PATH
+void DeathHandler::FlushOutput() {
+  if (!compression.started) {
+    return;
   }
+  if (compression.pending > 0) {
+    size_t size = CompressPendingBlock();
+    checked(output_callback_(reinterpret_cast<char*>(compression.output),
+                             size));
+  }
+  static const char end[8] = { 0 };
+  checked(output_callback_(end, sizeof(end)));
+  // The next report is a new stream
+  memset(compression.hash, 0, sizeof(compression.hash));
+  compression.size = 0;
+  compression.started = false;
 }
 
 bool DeathHandler::generate_core_dump() const {
@@ -371,6 +779,42 @@ void DeathHandler::set_thread_safe(bool value) {
   thread_safe_ = value;
 }
 
+bool DeathHandler::symbolize() const {
+  return symbolize_;
+}
+
+void DeathHandler::set_symbolize(bool value) {
+  symbolize_ = value;
+}
+
+size_t DeathHandler::memory_ballast() const {
+  return ballast_size_;
+}
+
+void DeathHandler::set_memory_ballast(size_t value) {
+  void* ballast = __sync_lock_test_and_set(&ballast_, NULL);
+  if (ballast != NULL) {
+    munmap(ballast, ballast_size_);
+  }
+  ballast_size_ = 0;
+  if (value == 0) {
+    return;
+  }
+  ballast = mmap(NULL, value, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ballast == MAP_FAILED) {
+    perror("DeathHandler - mmap(ballast)");
+    return;
+  }
+  // The untouched pages would not be charged
+  const size_t page_size = getpagesize();
+  for (size_t offset = 0; offset < value; offset += page_size) {
+    reinterpret_cast<volatile char*>(ballast)[offset] = 1;
+  }
+  ballast_size_ = value;
+  ballast_ = ballast;
+}
+
 DeathHandler::OutputCallback DeathHandler::output_callback() const {
   return output_callback_;
 }
@@ -379,355 +823,5335 @@ void DeathHandler::set_output_callback(DeathHandler::OutputCallback value) {
   output_callback_ = value;
 }
 
-INLINE static void safe_abort() {
-  struct sigaction sa;
-  sigaction(SIGABRT, NULL, &sa);
-  sa.sa_handler = SIG_DFL;
-  kill(getppid(), SIGCONT);
-  sigaction(SIGABRT, &sa, NULL);
-  abort();
+bool DeathHandler::compress_output() const {
+  return compress_output_;
 }
 
-/// @brief Invokes addr2line utility to determine the function name
-/// and the line information from an address in the code segment.
-static char *addr2line(const char *image, void *addr, bool color_output,
-                       char** memory) {
-  int pipefd[2];
-  if (pipe(pipefd) != 0) {
-    safe_abort();
+void DeathHandler::set_compress_output(bool value) {
+  compress_output_ = value;
+}
+
+#ifdef __linux__
+bool DeathHandler::resource_snapshot() const {
+  return resource_snapshot_;
+}
+
+void DeathHandler::set_resource_snapshot(bool value) {
+  resource_snapshot_ = value;
+}
+
+/// @brief The process which opened the resource files; the /proc/self
+/// descriptors keep referring to it after fork().
+static pid_t resource_files_pid = 0;
+
+CRASH_PATH
+void DeathHandler::OpenResourceFiles() {
+  if (statm_fd_ >= 0) {
+    return;
   }
-  pid_t pid = fork();
-  if (pid == 0) {
-    close(pipefd[0]);
-    dup2(pipefd[1], STDOUT_FILENO);
-    dup2(pipefd[1], STDERR_FILENO);
-    if (execlp("addr2line", "addr2line",
-               Safe::ptoa(addr, *memory), "-f", "-C", "-e", image,
-               reinterpret_cast<void*>(NULL)) == -1) {
-      safe_abort();
-    }
+  resource_files_pid = getpid();
+  statm_fd_ = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+  stat_fd_ = open("/proc/self/stat", O_RDONLY | O_CLOEXEC);
+  task_fd_ = open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  // cgroup v2 only: "0::/path/to/cgroup"
+  char cgroup[1024];
+  int fd = open("/proc/self/cgroup", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return;
   }
-
-  close(pipefd[1]);
-  const int line_max_length = 4096;
-  char* line = *memory;
-  *memory += line_max_length;
-  ssize_t len = read(pipefd[0], line, line_max_length);
-  close(pipefd[0]);
-  if (len == 0) {
-    safe_abort();
+  ssize_t len = read(fd, cgroup, sizeof(cgroup) - 1);
+  close(fd);
+  if (len <= 0) {
+    return;
   }
-  line[len] = 0;
-
-  if (waitpid(pid, NULL, 0) != pid) {
-    safe_abort();
+  cgroup[len] = 0;
+  char* path = strstr(cgroup, "0::/");
+  if (path == NULL || (path != cgroup && path[-1] != '\n')) {
+    return;
   }
-  if (line[0] == '?') {
-    char* straddr = Safe::ptoa(addr, *memory);
-    if (color_output) {
-      strcpy(line, "\033[32;1m");  // NOLINT(runtime/printf)
-    }
-    strcat(line, straddr);  // NOLINT(runtime/printf)
-    if (color_output) {
-      strcat(line, "\033[0m");  // NOLINT(runtime/printf)
-    }
-    strcat(line, " at ");  // NOLINT(runtime/printf)
-    strcat(line, image);  // NOLINT(runtime/printf)
-    strcat(line, " ");  // NOLINT(runtime/printf)
-  } else {
-    if (*(strstr(line, "\n") + 1) == '?') {
-      char* straddr = Safe::ptoa(addr, *memory);
-      strcpy(strstr(line, "\n") + 1, image);  // NOLINT(runtime/printf)
-      strcat(line, ":");  // NOLINT(runtime/printf)
-      strcat(line, straddr);  // NOLINT(runtime/printf)
-      strcat(line, "\n");  // NOLINT(runtime/printf)
-    }
+  path += 3;
+  char* path_end = strstr(path, "\n");
+  if (path_end != NULL) {
+    *path_end = 0;
   }
-  return line;
+  char file[1024 + 32];
+  strcpy(file, "/sys/fs/cgroup");  // NOLINT(runtime/printf)
+  strncat(file, path, sizeof(cgroup));  // NOLINT(runtime/printf)
+  size_t file_length = strlen(file);
+  strcpy(file + file_length, "/memory.events");  // NOLINT(runtime/printf)
+  memory_events_fd_ = open(file, O_RDONLY | O_CLOEXEC);
+  strcpy(file + file_length, "/memory.pressure");  // NOLINT(runtime/printf)
+  memory_pressure_fd_ = open(file, O_RDONLY | O_CLOEXEC);
 }
 
-#if (__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6)
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
-#endif
-#ifdef __clang__
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wdeprecated-declarations"
-#endif
+CRASH_PATH
+void DeathHandler::ReopenResourceFiles() {
+  if (resource_files_pid == 0 || resource_files_pid == getpid()) {
+    return;
+  }
+  CloseResourceFiles();
+  OpenResourceFiles();
+}
 
-void DeathHandler::HandleSignal(int sig, void * /* info */, void *secret) {
-  // Stop all other running threads by forking
-  pid_t forkedPid = fork();
-  if (forkedPid != 0) {
-    int status;
-    if (thread_safe_) {
-      // Freeze the original process, until it's child prints the stack trace
-      kill(getpid(), SIGSTOP);
-      // Wait for the child without blocking and exit as soon as possible,
-      // so that no zombies are left.
-      waitpid(forkedPid, &status, WNOHANG);
-    } else {
-      // Wait for the child, blocking only the current thread.
-      // All other threads will continue to run, potentially crashing the parent.
-      waitpid(forkedPid, &status, 0);
-    }
-#ifdef QUICK_EXIT
-    if (quick_exit_) {
-      ::quick_exit(EXIT_FAILURE);
-    }
-#endif
-    if (generate_core_dump_) {
-      struct sigaction sa;
-      sigaction(SIGABRT, NULL, &sa);
-      sa.sa_handler = SIG_DFL;
-      sigaction(SIGABRT, &sa, NULL);
-      abort();
-    } else {
-      if (cleanup_) {
-        exit(EXIT_FAILURE);
-      } else {
-        _Exit(EXIT_FAILURE);
-      }
+CRASH_PATH
+void DeathHandler::CloseResourceFiles() {
+  int* fds[] = { &statm_fd_, &stat_fd_, &memory_events_fd_,
+                 &memory_pressure_fd_, &task_fd_ };
+  for (size_t i = 0; i < sizeof(fds) / sizeof(fds[0]); i++) {
+    if (*fds[i] >= 0) {
+      close(*fds[i]);
+      *fds[i] = -1;
     }
   }
+}
 
-  ucontext_t *uc = reinterpret_cast<ucontext_t *>(secret);
+/// @brief Reads the whole small /proc or cgroup file into a preallocated
+/// buffer. Async-signal-safe.
+CRASH_PATH
+static bool ReadResourceFile(int fd, char* buffer, size_t size) {
+  if (fd < 0) {
+    return false;
+  }
+  ssize_t len = pread(fd, buffer, size - 1, 0);
+  if (len <= 0) {
+    return false;
+  }
+  buffer[len] = 0;
+  return true;
+}
 
-  if (dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {  // redirect stdout to stderr
-    print("Failed to redirect stdout to stderr\n");
+/// @brief Skips the specified number of space separated fields.
+CRASH_PATH
+static const char* SkipFields(const char* str, int count) {
+  for (; count > 0 && *str != 0; count--) {
+    for (; *str != ' ' && *str != 0; str++) {}
+    for (; *str == ' '; str++) {}
   }
-  char* memory = memory_;
-  {
-    char* msg = memory;
-    const int msg_max_length = 128;
-    if (color_output_) {
-      // \033[31;1mSegmentation fault\033[0m \033[33;1m(%i)\033[0m\n
-      strcpy(msg, "\033[31;1m");  // NOLINT(runtime/printf)
-    } else {
-      msg[0] = '\0';
-    }
-    switch (sig) {
-      case SIGSEGV:
-        strcat(msg, "Segmentation fault");  // NOLINT(runtime/printf)
-        break;
-      case SIGABRT:
-        strcat(msg, "Aborted");  // NOLINT(runtime/printf)
-        break;
-      case SIGFPE:
-        strcat(msg, "Floating point exception");  // NOLINT(runtime/printf)
-        break;
-      default:
-        strcat(msg, "Caught signal ");  // NOLINT(runtime/printf)
-        strcat(msg, Safe::itoa(sig, msg + msg_max_length));  // NOLINT(*)
-        break;
-    }
-    if (color_output_) {
-      strcat(msg, "\033[0m");  // NOLINT(runtime/printf)
-    }
-    strcat(msg, " (thread ");  // NOLINT(runtime/printf)
-    if (color_output_) {
-      strcat(msg, "\033[33;1m");  // NOLINT(runtime/printf)
-    }
-  #ifndef __APPLE__
-    strcat(msg, Safe::utoa(pthread_self(), msg + msg_max_length));  // NOLINT(*)
-  #else
-    strcat(msg, Safe::ptoa(pthread_self(), msg + msg_max_length));  // NOLINT(*)
-  #endif
-    if (color_output_) {
-      strcat(msg, "\033[0m");  // NOLINT(runtime/printf)
-    }
-    strcat(msg, ", pid ");  // NOLINT(runtime/printf)
-    if (color_output_) {
-      strcat(msg, "\033[33;1m");  // NOLINT(runtime/printf)
+  return str;
+}
+
+/// @brief Appends ", <key> <value>" from a "key value" per line file.
+CRASH_PATH
+static void AppendKeyedValue(char* msg, const char* text, const char* key) {
+  size_t key_length = strlen(key);
+  for (const char* line = text; line != NULL && *line != 0;) {
+    if (!strncmp(line, key, key_length) && line[key_length] == ' ') {
+      const char* value = line + key_length + 1;
+      const char* value_end = strstr(value, "\n");
+      size_t msg_length = strlen(msg);
+      msg[msg_length++] = ' ';
+      strcpy(msg + msg_length, key);  // NOLINT(runtime/printf)
+      msg_length += key_length;
+      msg[msg_length++] = ' ';
+      size_t value_length = value_end != NULL?
+          value_end - value : strlen(value);
+      memcpy(msg + msg_length, value, value_length);
+      msg[msg_length + value_length] = 0;
+      return;
     }
-    strcat(msg, Safe::itoa(getppid(), msg + msg_max_length));  // NOLINT(*)
-    if (color_output_) {
-      strcat(msg, "\033[0m");  // NOLINT(runtime/printf)
+    line = strstr(line, "\n");
+    if (line != NULL) {
+      line++;
     }
-    strcat(msg, ")");  // NOLINT(runtime/printf)
-    print(msg);
   }
+}
 
-  print("\nStack trace:\n");
-  void **trace = reinterpret_cast<void**>(memory);
-  memory += (frames_count_ + 2) * sizeof(void*);
-  // Workaround malloc() inside backtrace()
-  heap_trap_active_ = true;
-  int trace_size = backtrace(trace, frames_count_ + 2);
-  heap_trap_active_ = false;
-  if (trace_size <= 2) {
-    safe_abort();
+CRASH_PATH
+void DeathHandler::PrintResourceSnapshot() {
+  char text[512];
+  char buffer[32];
+  char msg[512];
+  strcpy(msg, "Resources:");  // NOLINT(runtime/printf)
+  if (ReadResourceFile(statm_fd_, text, sizeof(text))) {
+    // size resident shared text lib data dt
+    uint64_t rss = Safe::atou(SkipFields(text, 1)) * getpagesize();
+    strcat(msg, " rss ");  // NOLINT(runtime/printf)
+    strcat(msg, Safe::utoa(rss >> 10, buffer));  // NOLINT(runtime/printf)
+    strcat(msg, " KiB,");  // NOLINT(runtime/printf)
   }
-
-  // Overwrite sigaction with caller's address
-#ifdef __linux__
-#if defined(__arm__) 
-  trace[1] = reinterpret_cast<void *>(uc->uc_mcontext.arm_pc);
-#else
-#if defined(__aarch64__)
-  trace[1] = reinterpret_cast<void *>(uc->uc_mcontext.pc);
-#else
-#if !defined(__i386__) && !defined(__x86_64__)
-#error Only ARM, AARCH64, x86 and x86-64 are supported
-#endif
-#if defined(__x86_64__)
-  trace[1] = reinterpret_cast<void *>(uc->uc_mcontext.gregs[REG_RIP]);
-#else
-  trace[1] = reinterpret_cast<void *>(uc->uc_mcontext.gregs[REG_EIP]);
-#endif
-#endif
-#endif
-
-  const int path_max_length = 2048;
-  char* name_buf = memory;
-  ssize_t name_buf_length = readlink("/proc/self/exe", name_buf,
-                                     path_max_length - 1);
-  if (name_buf_length < 1) {
-    safe_abort();
+  if (ReadResourceFile(stat_fd_, text, sizeof(text))) {
+    // pid (comm) state ppid ... minflt cminflt majflt ... num_threads
+    const char* fields = strrchr(text, ')');
+    if (fields != NULL) {
+      fields += 2;
+      uint64_t minflt = Safe::atou(SkipFields(fields, 10 - 3));
+      uint64_t majflt = Safe::atou(SkipFields(fields, 12 - 3));
+      uint64_t threads = Safe::atou(SkipFields(fields, 20 - 3));
+      strcat(msg, " faults ");  // NOLINT(runtime/printf)
+      strcat(msg, Safe::utoa(majflt, buffer));  // NOLINT(runtime/printf)
+      strcat(msg, " major / ");  // NOLINT(runtime/printf)
+      strcat(msg, Safe::utoa(minflt, buffer));  // NOLINT(runtime/printf)
+      strcat(msg, " minor, threads ");  // NOLINT(runtime/printf)
+      strcat(msg, Safe::utoa(threads, buffer));  // NOLINT(runtime/printf)
+    }
   }
-  name_buf[name_buf_length] = 0;
-  memory += name_buf_length + 1;
-  char* cwd = memory;
-  if (getcwd(cwd, path_max_length) == NULL) {
-    safe_abort();
+  strcat(msg, "\n");  // NOLINT(runtime/printf)
+  print(msg);
+  if (memory_events_fd_ < 0 && memory_pressure_fd_ < 0) {
+    return;
   }
-  strcat(cwd, "/");  // NOLINT(runtime/printf)
-  memory += strlen(cwd) + 1;
-  char* prev_memory = memory;
-
-  int stackOffset = trace[2] == trace[1]? 2 : 1;
-  for (int i = stackOffset; i < trace_size; i++) {
-    memory = prev_memory;
-    char *line;
-    Dl_info dlinf;
-    if (dladdr(trace[i], &dlinf) == 0 || dlinf.dli_fname[0] != '/' ||
-        !strcmp(name_buf, dlinf.dli_fname)) {
-      line = addr2line(name_buf, trace[i], color_output_, &memory);
-    } else {
-      line = addr2line(dlinf.dli_fname, reinterpret_cast<void *>(
-          reinterpret_cast<char *>(trace[i]) -
-          reinterpret_cast<char *>(dlinf.dli_fbase)),
-          color_output_, &memory);
-    }
-
-    char *function_name_end = strstr(line, "\n");
-    if (function_name_end != NULL) {
-      *function_name_end = 0;
-      {
-        // "\033[34;1m[%s]\033[0m \033[33;1m(%i)\033[0m\n
-        char* msg = memory;
-        const int msg_max_length = 512;
-        if (color_output_) {
-          strcpy(msg, "\033[34;1m");  // NOLINT(runtime/printf)
-        } else {
-          msg[0] = 0;
-        }
-        strcat(msg, "[");  // NOLINT(runtime/printf)
-        strcat(msg, line);  // NOLINT(runtime/printf)
-        strcat(msg, "]");  // NOLINT(runtime/printf)
-        if (append_pid_) {
-          if (color_output_) {
-            strcat(msg, "\033[0m\033[33;1m");  // NOLINT(runtime/printf)
-          }
-          strcat(msg, " (");  // NOLINT(runtime/printf)
-          strcat(msg, Safe::itoa(getppid(), msg + msg_max_length));  // NOLINT(*)
-          strcat(msg, ")");  // NOLINT(runtime/printf)
-          if (color_output_) {
-            strcat(msg, "\033[0m");  // NOLINT(runtime/printf)
-          }
-          strcat(msg, "\n");  // NOLINT(runtime/printf)
-        } else {
-          if (color_output_) {
-            strcat(msg, "\033[0m");  // NOLINT(runtime/printf)
-          }
-          strcat(msg, "\n");  // NOLINT(runtime/printf)
-        }
-        print(msg);
-      }
-      line = function_name_end + 1;
+  strcpy(msg, "cgroup memory:");  // NOLINT(runtime/printf)
+  if (ReadResourceFile(memory_events_fd_, text, sizeof(text))) {
+    AppendKeyedValue(msg, text, "high");
+    AppendKeyedValue(msg, text, "max");
+    AppendKeyedValue(msg, text, "oom");
+    AppendKeyedValue(msg, text, "oom_kill");
+  }
+  if (ReadResourceFile(memory_pressure_fd_, text, sizeof(text))) {
+    // some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+    strcat(msg, ", pressure");  // NOLINT(runtime/printf)
+    AppendKeyedValue(msg, text, "some");
+    AppendKeyedValue(msg, text, "full");
+  }
+  strcat(msg, "\n");  // NOLINT(runtime/printf)
+  print(msg);
+}
 
-      // Remove the common path root
-      if (cut_common_path_root_) {
-        int cpi;
-        for (cpi = 0; cwd[cpi] == line[cpi]; cpi++) {};
-        if (line[cpi - 1] != '/') {
-          for (; line[cpi - 1] != '/'; cpi--) {};
-        }
-        if (cpi > 1) {
-          line = line + cpi;
-        }
-      }
+/// @brief The layout of crash_loop_file.
+struct CrashLoopState {
+  static const uint32_t kMagic = 0x4C4F4F50;  // "LOOP"
+  static const int kMaxCrashes = 32;
 
-      // Remove relative path root
-      if (cut_relative_paths_) {
-        char *path_cut_pos = strstr(line, "../");
-        if (path_cut_pos != NULL) {
-          path_cut_pos += 3;
-          while (!strncmp(path_cut_pos, "../", 3)) {
-            path_cut_pos += 3;
-          }
-          line = path_cut_pos;
-        }
-      }
+  uint32_t magic;
+  uint32_t next;
+  int64_t minimal_since;
+  int64_t times[kMaxCrashes];
+};
 
-      // Mark line number
-      if (color_output_) {
-        char* number_pos = strstr(line, ":");
-        if (number_pos != NULL) {
-          char* line_number = memory;  // 128
-          strcpy(line_number, number_pos);  // NOLINT(runtime/printf)
-          // Overwrite the new line char
-          line_number[strlen(line_number) - 1] = 0;
-          // \033[32;1m%s\033[0m\n
-          strcpy(number_pos, "\033[32;1m");  // NOLINT(runtime/printf)
-          strcat(line, line_number);  // NOLINT(runtime/printf)
-          strcat(line, "\033[0m\n");  // NOLINT(runtime/printf)
-        }
-      }
-    }
+const char* DeathHandler::crash_loop_file() const {
+  return crash_loop_state_ != NULL? crash_loop_file_ : NULL;
+}
 
-    // Overwrite the new line char
-    line[strlen(line) - 1] = 0;
+bool DeathHandler::set_crash_loop_file(const char* path) {
+  if (crash_loop_state_ != NULL) {
+    munmap(crash_loop_state_, sizeof(CrashLoopState));
+    crash_loop_state_ = NULL;
+  }
+  if (path == NULL) {
+    return true;
+  }
+  if (strlen(path) >= sizeof(crash_loop_file_)) {
+    return false;
+  }
+  strcpy(crash_loop_file_, path);  // NOLINT(runtime/printf)
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (st.st_size < (off_t)sizeof(CrashLoopState) &&
+                              ftruncate(fd, sizeof(CrashLoopState)) != 0)) {
+    close(fd);
+    return false;
+  }
+  void* state = mmap(NULL, sizeof(CrashLoopState), PROT_READ | PROT_WRITE,
+                     MAP_SHARED, fd, 0);
+  close(fd);
+  if (state == MAP_FAILED) {
+    return false;
+  }
+  CrashLoopState* loop = reinterpret_cast<CrashLoopState*>(state);
+  if (loop->magic != CrashLoopState::kMagic) {
+    memset(loop, 0, sizeof(*loop));
+    loop->magic = CrashLoopState::kMagic;
+  }
+  crash_loop_state_ = state;
+  return true;
+}
+
+int DeathHandler::crash_loop_threshold() const {
+  return crash_loop_threshold_;
+}
+
+void DeathHandler::set_crash_loop_threshold(int value) {
+  assert(value > 0 && value <= CrashLoopState::kMaxCrashes);
+  crash_loop_threshold_ = value;
+}
+
+int DeathHandler::crash_loop_window() const {
+  return crash_loop_window_;
+}
+
+void DeathHandler::set_crash_loop_window(int value) {
+  assert(value > 0);
+  crash_loop_window_ = value;
+}
+
+int DeathHandler::crash_loop_quiet_period() const {
+  return crash_loop_quiet_period_;
+}
+
+void DeathHandler::set_crash_loop_quiet_period(int value) {
+  assert(value >= 0);
+  crash_loop_quiet_period_ = value;
+}
+
+CRASH_PATH
+bool DeathHandler::UpdateCrashLoopState() {
+  CrashLoopState* loop = reinterpret_cast<CrashLoopState*>(crash_loop_state_);
+  if (loop == NULL) {
+    return false;
+  }
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  // Several processes may share the file
+  uint32_t index = __sync_fetch_and_add(&loop->next, 1);
+  int64_t previous = 0;
+  int recent = 0;
+  for (int i = 0; i < CrashLoopState::kMaxCrashes; i++) {
+    int64_t time = loop->times[i];
+    if (time > previous) {
+      previous = time;
+    }
+    if (time > now.tv_sec - crash_loop_window_) {
+      recent++;
+    }
+  }
+  if (now.tv_sec - previous >= crash_loop_quiet_period_) {
+    // The loop is over, start counting anew
+    memset(loop->times, 0, sizeof(loop->times));
+    loop->minimal_since = 0;
+    recent = 0;
+  }
+  loop->times[index % CrashLoopState::kMaxCrashes] = now.tv_sec;
+  recent++;
+  if (loop->minimal_since == 0 && recent >= crash_loop_threshold_) {
+    loop->minimal_since = now.tv_sec;
+  }
+  return loop->minimal_since != 0;
+}
+
+const char* DeathHandler::metrics_page() const {
+  return metrics_ != NULL? metrics_page_name_ : NULL;
+}
+
+bool DeathHandler::set_metrics_page(const char* name) {
+  if (metrics_ != NULL) {
+    munmap(metrics_, sizeof(HandlerMetrics));
+    metrics_ = NULL;
+  }
+  if (name == NULL) {
+    return true;
+  }
+  if (name[0] != '/' || strchr(name + 1, '/') != NULL ||
+      strlen(name) >= sizeof(metrics_page_name_)) {
+    return false;
+  }
+  strcpy(metrics_page_name_, name);  // NOLINT(runtime/printf)
+  // The same as shm_open(), which needs -lrt with the older glibc
+  char path[sizeof(metrics_page_name_) + 16];
+  strcpy(path, "/dev/shm");  // NOLINT(runtime/printf)
+  strcat(path, name);  // NOLINT(runtime/printf)
+  int fd = open(path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (st.st_size < (off_t)sizeof(HandlerMetrics) &&
+                              ftruncate(fd, sizeof(HandlerMetrics)) != 0)) {
+    close(fd);
+    return false;
+  }
+  void* page = mmap(NULL, sizeof(HandlerMetrics), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+  close(fd);
+  if (page == MAP_FAILED) {
+    return false;
+  }
+  HandlerMetrics* metrics = reinterpret_cast<HandlerMetrics*>(page);
+  if (metrics->magic != HandlerMetrics::kMagic) {
+    memset(metrics, 0, sizeof(*metrics));
+    metrics->size = sizeof(*metrics);
+    __atomic_store_n(&metrics->magic, HandlerMetrics::kMagic,
+                     __ATOMIC_RELEASE);
+  }
+  metrics_ = metrics;
+  return true;
+}
+
+/// @brief Increments a counter of the metrics page. Async-signal-safe.
+CRASH_PATH
+static void CountMetric(uint64_t* counter, uint64_t value) {
+  __atomic_fetch_add(counter, value, __ATOMIC_RELAXED);
+}
+
+/// @brief Counts the time since started in HandlerMetrics::handler_duration.
+CRASH_PATH
+static void RecordHandlerDuration(HandlerMetrics* metrics,
+                                  const struct timespec& started) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t milliseconds = (now.tv_sec - started.tv_sec) * 1000 +
+      (now.tv_nsec - started.tv_nsec) / 1000000;
+  int bucket = 0;
+  while (bucket < HandlerMetrics::kDurationBuckets - 1 &&
+         milliseconds >= (static_cast<int64_t>(1) << bucket)) {
+    bucket++;
+  }
+  CountMetric(&metrics->handler_duration[bucket], 1);
+}
+
+/// @brief The state of a thread started through the pthread_create() wrapper.
+struct TrackedThread {
+  enum State {
+    kFree,
+    kStarting,
+    kRunning
+  };
+
+  volatile int state;
+  pthread_t thread;
+  pid_t pid;
+  pid_t tid;
+  void* (*start_routine)(void*);
+  void* arg;
+  bool own_stack;
+  char* stack_low;
+  char* stack_high;
+  size_t guard_size;
+  void* altstack;
+};
+
+/// @brief The stack high-water mark of the exited threads with the same name.
+struct StackUsageRecord {
+  char name[16];
+  size_t max_used;
+  size_t stack_size;
+  unsigned threads;
+};
+
+static const int kMaxTrackedThreads = 4096;
+static const int kMaxStackUsageRecords = 256;
+static const size_t kThreadAltStackSize = 1 << 16;
+/// @brief kMaxTrackedThreads entries, mapped by the first
+/// set_stack_usage_tracking(true) together with stack_usage_records.
+static TrackedThread* tracked_threads = NULL;
+/// @brief kMaxStackUsageRecords entries.
+static StackUsageRecord* stack_usage_records = NULL;
+static int stack_usage_records_lock = 0;
+static pthread_key_t tracked_thread_key;
+static pthread_once_t tracked_thread_key_once = PTHREAD_ONCE_INIT;
+
+/// @brief Finds out how deep the stack between low and high has ever grown.
+/// @details The pages which were never touched are not resident, so
+/// the lowest resident page is the deepest one, and the lowest non-zero
+/// word inside it is the high-water mark. Async-signal-safe.
+CRASH_PATH
+static size_t MeasureStackUsage(char* low, char* high) {
+  const size_t page_size = getpagesize();
+  unsigned char residency[256];
+  char* pos = reinterpret_cast<char*>(
+      reinterpret_cast<uintptr_t>(low) & ~(page_size - 1));
+  while (pos < high) {
+    size_t pages = (high - pos + page_size - 1) / page_size;
+    if (pages > sizeof(residency)) {
+      pages = sizeof(residency);
+    }
+    if (mincore(pos, pages * page_size, residency) != 0) {
+      return 0;
+    }
+    for (size_t i = 0; i < pages; i++, pos += page_size) {
+      if ((residency[i] & 1) == 0) {
+        continue;
+      }
+      uintptr_t* word = reinterpret_cast<uintptr_t*>(pos < low? low : pos);
+      for (; reinterpret_cast<char*>(word) < high && *word == 0; word++) {}
+      return high - reinterpret_cast<char*>(word);
+    }
+  }
+  return 0;
+}
+
+/// @brief Reads the name of the specified thread. Async-signal-safe.
+CRASH_PATH
+static char* ReadThreadName(pid_t pid, pid_t tid, char* memory) {
+  char* name = memory;
+  strcpy(name, "/proc/");  // NOLINT(runtime/printf)
+  strcat(name, Safe::itoa(pid, memory + 64));  // NOLINT(runtime/printf)
+  strcat(name, "/task/");  // NOLINT(runtime/printf)
+  strcat(name, Safe::itoa(tid, memory + 64));  // NOLINT(runtime/printf)
+  strcat(name, "/comm");  // NOLINT(runtime/printf)
+  int fd = open(name, O_RDONLY | O_CLOEXEC);
+  ssize_t len = fd < 0? -1 : read(fd, name, 15);
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (len <= 0) {
+    strcpy(name, "?");  // NOLINT(runtime/printf)
+    return name;
+  }
+  name[len] = 0;
+  char* newline = strstr(name, "\n");
+  if (newline != NULL) {
+    *newline = 0;
+  }
+  return name;
+}
+
+/// @brief Merges the high-water mark of an exited thread into
+/// stack_usage_records.
+static void RecordStackUsage(const char* name, size_t used, size_t size) {
+  while (__sync_lock_test_and_set(&stack_usage_records_lock, 1)) {
+    sched_yield();
+  }
+  for (int i = 0; i < kMaxStackUsageRecords; i++) {
+    StackUsageRecord& record = stack_usage_records[i];
+    if (record.threads == 0) {
+      for (size_t j = 0; j < sizeof(record.name) - 1 && name[j] != 0; j++) {
+        record.name[j] = name[j];
+      }
+    } else if (strcmp(record.name, name)) {
+      continue;
+    }
+    record.threads++;
+    if (used * 100 / size >= record.max_used * 100 / (record.stack_size + 1)) {
+      record.max_used = used;
+      record.stack_size = size;
+    }
+    break;
+  }
+  __sync_lock_release(&stack_usage_records_lock);
+}
+
+static void TrackedThreadExit(void* arg) {
+  TrackedThread* tracked = reinterpret_cast<TrackedThread*>(arg);
+  if (tracked->stack_high != NULL) {
+    char name[16] = {0};
+    prctl(PR_GET_NAME, name, 0, 0, 0);
+    RecordStackUsage(name, MeasureStackUsage(tracked->stack_low,
+                                             tracked->stack_high),
+                     tracked->stack_high - tracked->stack_low);
+  }
+  if (tracked->altstack != NULL) {
+    stack_t altstack;
+    altstack.ss_sp = NULL;
+    altstack.ss_size = 0;
+    altstack.ss_flags = SS_DISABLE;
+    sigaltstack(&altstack, NULL);
+    munmap(tracked->altstack, kThreadAltStackSize);
+  }
+  __sync_synchronize();
+  tracked->state = TrackedThread::kFree;
+}
+
+static void CreateTrackedThreadKey() {
+  pthread_key_create(&tracked_thread_key, TrackedThreadExit);
+}
+
+static void* TrackedThreadStart(void* arg) {
+  TrackedThread* tracked = reinterpret_cast<TrackedThread*>(arg);
+  tracked->thread = pthread_self();
+  tracked->pid = getpid();
+  tracked->tid = syscall(SYS_gettid);
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+    void* stack_addr;
+    size_t stack_size;
+    if (pthread_attr_getstack(&attr, &stack_addr, &stack_size) == 0) {
+      tracked->stack_low = reinterpret_cast<char*>(stack_addr);
+      tracked->stack_high = tracked->stack_low + stack_size;
+    }
+    pthread_attr_getguardsize(&attr, &tracked->guard_size);
+    pthread_attr_destroy(&attr);
+  }
+  if (tracked->own_stack && tracked->stack_low != NULL) {
+    // glibc reuses the stacks of the exited threads, so discard the pages
+    // left below this frame for the residency to reflect only this thread
+    const uintptr_t page_size = getpagesize();
+    char* discard_end = reinterpret_cast<char*>(
+        (reinterpret_cast<uintptr_t>(&attr) - 2 * page_size) &
+        ~(page_size - 1));
+    if (discard_end > tracked->stack_low) {
+      madvise(tracked->stack_low, discard_end - tracked->stack_low,
+              MADV_DONTNEED);
+    }
+  }
+  // A dedicated signal stack lets the handler report a stack overflow
+  void* altstack_memory = mmap(NULL, kThreadAltStackSize,
+                               PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (altstack_memory != MAP_FAILED) {
+    stack_t altstack;
+    altstack.ss_sp = altstack_memory;
+    altstack.ss_size = kThreadAltStackSize;
+    altstack.ss_flags = 0;
+    if (sigaltstack(&altstack, NULL) == 0) {
+      tracked->altstack = altstack_memory;
+    } else {
+      munmap(altstack_memory, kThreadAltStackSize);
+    }
+  }
+  pthread_setspecific(tracked_thread_key, tracked);
+  __sync_synchronize();
+  tracked->state = TrackedThread::kRunning;
+  return tracked->start_routine(tracked->arg);
+}
+
+bool DeathHandler::stack_usage_tracking() const {
+  return stack_usage_tracking_;
+}
+
+void DeathHandler::set_stack_usage_tracking(bool value) {
+  if (value && tracked_threads == NULL) {
+    void* memory = mmap(NULL, kMaxTrackedThreads * sizeof(TrackedThread) +
+                        kMaxStackUsageRecords * sizeof(StackUsageRecord),
+                        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1, 0);
+    if (memory == MAP_FAILED) {
+      perror("DeathHandler - mmap()");
+      return;
+    }
+    stack_usage_records = reinterpret_cast<StackUsageRecord*>(
+        reinterpret_cast<TrackedThread*>(memory) + kMaxTrackedThreads);
+    tracked_threads = reinterpret_cast<TrackedThread*>(memory);
+    __sync_synchronize();
+  }
+  if (value) {
+    pthread_once(&tracked_thread_key_once, CreateTrackedThreadKey);
+    if (!stack_usage_tracking_) {
+      atexit(PrintStackUsageAtExit);
+    }
+    // Run the handler on the per-thread signal stacks
+    struct sigaction sa;
+    sigaction(SIGSEGV, NULL, &sa);
+    if (sa.sa_sigaction == (sa_sigaction_handler)signal_handler_) {
+      sa.sa_flags |= SA_ONSTACK;
+      sigaction(SIGSEGV, &sa, NULL);
+    }
+  }
+  stack_usage_tracking_ = value;
+}
+
+int DeathHandler::stack_usage_threshold() const {
+  return stack_usage_threshold_;
+}
+
+void DeathHandler::set_stack_usage_threshold(int value) {
+  assert(value > 0 && value <= 100);
+  stack_usage_threshold_ = value;
+}
+
+void DeathHandler::PrintStackUsage() const {
+  PrintStackUsageReport(NULL, color_output_);
+}
+
+void DeathHandler::PrintStackUsageAtExit() {
+  if (stack_usage_tracking_) {
+    PrintStackUsageReport(NULL, color_output_);
+  }
+}
+
+/// @brief Appends "<used> of <size> bytes (<percent>%)" to msg, flagging
+/// the usage above the threshold.
+CRASH_PATH
+static void FormatStackUsage(char* msg, size_t used, size_t size,
+                             int threshold, bool color_output) {
+  char buffer[32];
+  int percent = size > 0? static_cast<int>(used * 100 / size) : 0;
+  strcat(msg, Safe::utoa(used, buffer));  // NOLINT(runtime/printf)
+  strcat(msg, " of ");  // NOLINT(runtime/printf)
+  strcat(msg, Safe::utoa(size, buffer));  // NOLINT(runtime/printf)
+  strcat(msg, " bytes (");  // NOLINT(runtime/printf)
+  strcat(msg, Safe::itoa(percent, buffer));  // NOLINT(runtime/printf)
+  strcat(msg, "%)");  // NOLINT(runtime/printf)
+  if (percent >= threshold) {
+    if (color_output) {
+      strcat(msg, " \033[31;1mNEAR OVERFLOW\033[0m");  // NOLINT(*)
+    } else {
+      strcat(msg, " NEAR OVERFLOW");  // NOLINT(runtime/printf)
+    }
+  }
+  strcat(msg, "\n");  // NOLINT(runtime/printf)
+}
+
+CRASH_PATH
+void DeathHandler::PrintStackUsageReport(const void* fault_address,
+                                         bool color_output) {
+  char msg[256];
+  char buffer[96];
+  // Nothing is mapped until the tracking is enabled
+  const int tracked_count = tracked_threads != NULL? kMaxTrackedThreads : 0;
+  const int record_count = tracked_threads != NULL? kMaxStackUsageRecords : 0;
+  for (int i = 0; i < tracked_count; i++) {
+    const TrackedThread& tracked = tracked_threads[i];
+    if (tracked.state != TrackedThread::kRunning ||
+        !pthread_equal(tracked.thread, pthread_self()) ||
+        fault_address == NULL) {
+      continue;
+    }
+    const char* fault = reinterpret_cast<const char*>(fault_address);
+    if (fault < tracked.stack_low + getpagesize() &&
+        fault >= tracked.stack_low - tracked.guard_size - getpagesize()) {
+      if (color_output) {
+        print("\033[31;1mStack overflow\033[0m in thread ");
+      } else {
+        print("Stack overflow in thread ");
+      }
+      print(ReadThreadName(tracked.pid, tracked.tid, buffer));
+      print("\n");
+    }
+  }
+  print("Stack usage (high-water mark):\n");
+  for (int i = 0; i < record_count; i++) {
+    const StackUsageRecord& record = stack_usage_records[i];
+    if (record.threads == 0) {
+      break;
+    }
+    strcpy(msg, "  ");  // NOLINT(runtime/printf)
+    strcat(msg, record.name);  // NOLINT(runtime/printf)
+    strcat(msg, " (");  // NOLINT(runtime/printf)
+    strcat(msg, Safe::utoa(record.threads, buffer));  // NOLINT(*)
+    strcat(msg, " exited): ");  // NOLINT(runtime/printf)
+    FormatStackUsage(msg, record.max_used, record.stack_size,
+                     stack_usage_threshold_, color_output);
+    print(msg);
+  }
+  for (int i = 0; i < tracked_count; i++) {
+    const TrackedThread& tracked = tracked_threads[i];
+    if (tracked.state != TrackedThread::kRunning ||
+        tracked.stack_high == NULL) {
+      continue;
+    }
+    strcpy(msg, "  ");  // NOLINT(runtime/printf)
+    strcat(msg,  // NOLINT(runtime/printf)
+           ReadThreadName(tracked.pid, tracked.tid, buffer));
+    strcat(msg, " (tid ");  // NOLINT(runtime/printf)
+    strcat(msg, Safe::itoa(tracked.tid, buffer));  // NOLINT(*)
+    strcat(msg, "): ");  // NOLINT(runtime/printf)
+    FormatStackUsage(msg, MeasureStackUsage(tracked.stack_low,
+                                            tracked.stack_high),
+                     tracked.stack_high - tracked.stack_low,
+                     stack_usage_threshold_, color_output);
+    print(msg);
+  }
+}
+
+int DeathHandler::malloc_sampling() const {
+  return malloc_sampling_;
+}
+
+void DeathHandler::set_malloc_sampling(int value) {
+  assert(value >= 0);
+  if (value > 0 && malloc_histograms == NULL) {
+    void* histograms = mmap(NULL, (kMaxSampledThreads + 1) *
+                            sizeof(MallocHistogram), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (histograms == MAP_FAILED) {
+      perror("DeathHandler - mmap()");
+      return;
+    }
+    // Calibrate the cycle counter against the monotonic clock
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    uint64_t start_ticks = ReadCycleCounter();
+    int64_t elapsed;
+    do {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      elapsed = (now.tv_sec - start.tv_sec) * 1000000000LL +
+          now.tv_nsec - start.tv_nsec;
+    } while (elapsed < 2000000);
+    ticks_per_ms = (ReadCycleCounter() - start_ticks) * 1000000 / elapsed;
+    malloc_histograms = reinterpret_cast<MallocHistogram*>(histograms);
+    __sync_synchronize();
+    atexit(PrintMallocLatencyAtExit);
+  }
+  malloc_sampling_ = value;
+}
+
+int DeathHandler::malloc_outliers() const {
+  return malloc_outliers_;
+}
+
+void DeathHandler::set_malloc_outliers(int value) {
+  assert(value >= 0 && value <= kMaxMallocOutliers);
+  malloc_outliers_ = value;
+}
+
+void DeathHandler::PrintMallocLatency() const {
+  PrintMallocLatencyReport();
+}
+
+void DeathHandler::PrintMallocLatencyAtExit() {
+  if (malloc_sampling_ > 0) {
+    PrintMallocLatencyReport();
+  }
+}
+
+/// @brief Converts the upper bound of a latency bucket to nanoseconds.
+static uint64_t MallocBucketNanoseconds(int bucket) {
+  uint64_t ticks = 2ULL << bucket;
+  return ticks_per_ms > 0? ticks * 1000000 / ticks_per_ms : ticks;
+}
+
+void DeathHandler::PrintMallocLatencyReport() {
+  if (malloc_histograms == NULL) {
+    return;
+  }
+  static const char* const kOperations[] = { "malloc", "free" };
+  static const int kPercentiles[] = { 500, 900, 990, 999 };
+  static const char* const kPercentileNames[] = {
+    "p50", "p90", "p99", "p99.9"
+  };
+  char msg[512];
+  char buffer[32];
+  int slots = sampled_threads < kMaxSampledThreads?
+      sampled_threads : kMaxSampledThreads + 1;
+  print("Allocation latency, 1 in ");
+  print(Safe::itoa(malloc_sampling_, buffer));
+  print(" calls sampled in ");
+  print(Safe::itoa(sampled_threads, buffer));
+  print(" threads:\n");
+  for (int operation = 0; operation < 2; operation++) {
+    for (int size_class = 0; size_class < kMallocSizeClasses; size_class++) {
+      uint64_t counts[kMallocLatencyBuckets];
+      uint64_t total = 0;
+      for (int bucket = 0; bucket < kMallocLatencyBuckets; bucket++) {
+        counts[bucket] = 0;
+        for (int slot = 0; slot < slots; slot++) {
+          counts[bucket] +=
+              malloc_histograms[slot].counts[operation][size_class][bucket];
+        }
+        total += counts[bucket];
+      }
+      if (total == 0) {
+        continue;
+      }
+      strcpy(msg, "  ");  // NOLINT(runtime/printf)
+      strcat(msg, kOperations[operation]);  // NOLINT(runtime/printf)
+      if (size_class < kMallocSizeClasses - 1) {
+        strcat(msg, " <= ");  // NOLINT(runtime/printf)
+        strcat(msg, Safe::utoa(16ULL << size_class, buffer));  // NOLINT
+      } else {
+        strcat(msg, " > ");  // NOLINT(runtime/printf)
+        strcat(msg, Safe::utoa(8ULL << size_class, buffer));  // NOLINT
+      }
+      strcat(msg, " bytes: ");  // NOLINT(runtime/printf)
+      strcat(msg, Safe::utoa(total, buffer));  // NOLINT(runtime/printf)
+      strcat(msg, " samples");  // NOLINT(runtime/printf)
+      uint64_t seen = 0;
+      int percentile = 0;
+      int max_bucket = 0;
+      for (int bucket = 0; bucket < kMallocLatencyBuckets; bucket++) {
+        if (counts[bucket] == 0) {
+          continue;
+        }
+        seen += counts[bucket];
+        max_bucket = bucket;
+        for (; percentile < 4 &&
+             seen * 1000 >= total * kPercentiles[percentile]; percentile++) {
+          strcat(msg, ", ");  // NOLINT(runtime/printf)
+          strcat(msg, kPercentileNames[percentile]);  // NOLINT(*)
+          strcat(msg, " <= ");  // NOLINT(runtime/printf)
+          strcat(msg, Safe::utoa(MallocBucketNanoseconds(bucket),  // NOLINT
+                                 buffer));
+        }
+      }
+      strcat(msg, ", max <= ");  // NOLINT(runtime/printf)
+      strcat(msg, Safe::utoa(MallocBucketNanoseconds(max_bucket),  // NOLINT
+                             buffer));
+      strcat(msg, " ns\n");  // NOLINT(runtime/printf)
+      print(msg);
+    }
+  }
+  if (malloc_outliers_ == 0 || slowest_allocations[0].ticks == 0) {
+    return;
+  }
+  print("Slowest sampled calls:\n");
+  // Copy the outliers, the sampled threads may be updating them
+  MallocOutlier outliers[kMaxMallocOutliers];
+  memcpy(outliers, slowest_allocations, sizeof(outliers));
+  char memory[kNeededMemory];
+  for (int i = 0; i < malloc_outliers_; i++) {
+    int slowest = i;
+    for (int j = i + 1; j < malloc_outliers_; j++) {
+      if (outliers[j].ticks > outliers[slowest].ticks) {
+        slowest = j;
+      }
+    }
+    MallocOutlier outlier = outliers[slowest];
+    outliers[slowest] = outliers[i];
+    if (outlier.ticks == 0) {
+      break;
+    }
+    strcpy(msg, kOperations[outlier.operation]);  // NOLINT(runtime/printf)
+    strcat(msg, "(");  // NOLINT(runtime/printf)
+    strcat(msg, Safe::utoa(outlier.size, buffer));  // NOLINT(runtime/printf)
+    strcat(msg, ") took ");  // NOLINT(runtime/printf)
+    strcat(msg, Safe::utoa(ticks_per_ms > 0?  // NOLINT(runtime/printf)
+        outlier.ticks * 1000000 / ticks_per_ms : outlier.ticks, buffer));
+    strcat(msg, " ns in thread ");  // NOLINT(runtime/printf)
+    strcat(msg, Safe::itoa(outlier.tid, buffer));  // NOLINT(runtime/printf)
+    strcat(msg, ":\n");  // NOLINT(runtime/printf)
+    print(msg);
+    if (trace_printer_ != NULL) {
+      trace_printer_(outlier.frames, NULL, outlier.frame_count, getpid(),
+                     !symbolize_, true, memory);
+    }
+  }
+  FlushOutput();
+}
+#endif  // #ifdef __linux__
+
+INLINE static void safe_abort() {
+  struct sigaction sa;
+  sigaction(SIGABRT, NULL, &sa);
+  sa.sa_handler = SIG_DFL;
+  kill(getppid(), SIGCONT);
+  sigaction(SIGABRT, &sa, NULL);
+  abort();
+}
+
+/// @brief Aborts in the crashed process; a live one carries on.
+/// @return NULL.
+CRASH_PATH
+static char* SymbolizationFailed(bool live) {
+  if (!live) {
+    safe_abort();
+  }
+  return NULL;
+}
+
+/// @brief Invokes addr2line utility to determine the function name
+/// and the line information from an address in the code segment.
+/// @param file The path addr2line reads image from.
+/// @param live If true, the failures are not fatal.
+/// @return NULL if live and addr2line failed.
+CRASH_PATH
+static char *addr2line(const char *image, const char *file, void *addr,
+                       bool color_output, bool live, char** memory) {
+  int pipefd[2];
+  if (pipe(pipefd) != 0) {
+    return SymbolizationFailed(live);
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    if (execlp("addr2line", "addr2line",
+               Safe::ptoa(addr, *memory), "-f", "-C", "-e", file,
+               reinterpret_cast<void*>(NULL)) == -1) {
+      if (live) {
+        // The parent reads nothing and prints the raw frame
+        _exit(EXIT_FAILURE);
+      }
+      safe_abort();
+    }
+  }
+
+  close(pipefd[1]);
+  if (pid < 0) {
+    close(pipefd[0]);
+    return SymbolizationFailed(live);
+  }
+  const int line_max_length = 4096;
+  char* line = *memory;
+  *memory += line_max_length;
+  ssize_t len = read(pipefd[0], line, line_max_length - 1);
+  close(pipefd[0]);
+  // A live process may reap its children with a SIGCHLD handler
+  if (waitpid(pid, NULL, 0) != pid && !live) {
+    safe_abort();
+  }
+  if (len <= 0) {
+    return SymbolizationFailed(live);
+  }
+  line[len] = 0;
+  if (strstr(line, "\n") == NULL) {
+    return SymbolizationFailed(live);
+  }
+
+  if (line[0] == '?') {
+    char* straddr = Safe::ptoa(addr, *memory);
+    if (color_output) {
+      strcpy(line, "\033[32;1m");  // NOLINT(runtime/printf)
+    }
+    strcat(line, straddr);  // NOLINT(runtime/printf)
+    if (color_output) {
+      strcat(line, "\033[0m");  // NOLINT(runtime/printf)
+    }
+    strcat(line, " at ");  // NOLINT(runtime/printf)
+    strcat(line, image);  // NOLINT(runtime/printf)
+    strcat(line, " ");  // NOLINT(runtime/printf)
+  } else {
+    if (*(strstr(line, "\n") + 1) == '?') {
+      char* straddr = Safe::ptoa(addr, *memory);
+      strcpy(strstr(line, "\n") + 1, image);  // NOLINT(runtime/printf)
+      strcat(line, ":");  // NOLINT(runtime/printf)
+      strcat(line, straddr);  // NOLINT(runtime/printf)
+      strcat(line, "\n");  // NOLINT(runtime/printf)
+    }
+  }
+  return line;
+}
+
+#ifdef __linux__
+/// @brief Finds the difference between the addresses in memory and
+/// the virtual addresses inside the ELF image loaded at base.
+/// Async-signal-safe.
+CRASH_PATH
+static bool ElfLoadBias(const void* base, uintptr_t* bias) {
+  const ElfW(Ehdr)* ehdr = reinterpret_cast<const ElfW(Ehdr)*>(base);
+  if (base == NULL || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0) {
+    return false;
+  }
+  const ElfW(Phdr)* phdrs = reinterpret_cast<const ElfW(Phdr)*>(
+      reinterpret_cast<const char*>(base) + ehdr->e_phoff);
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    if (phdrs[i].p_type == PT_LOAD) {
+      *bias = reinterpret_cast<uintptr_t>(base) -
+          (phdrs[i].p_vaddr & ~(phdrs[i].p_align - 1));
+      return true;
+    }
+  }
+  return false;
+}
+
+/// @brief Writes the hex GNU build id of the ELF image loaded at base.
+/// Async-signal-safe.
+CRASH_PATH
+static char* ReadBuildId(const void* base, char* memory) {
+  uintptr_t bias;
+  memory[0] = 0;
+  if (!ElfLoadBias(base, &bias)) {
+    return memory;
+  }
+  const ElfW(Ehdr)* ehdr = reinterpret_cast<const ElfW(Ehdr)*>(base);
+  const ElfW(Phdr)* phdrs = reinterpret_cast<const ElfW(Phdr)*>(
+      reinterpret_cast<const char*>(base) + ehdr->e_phoff);
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    if (phdrs[i].p_type != PT_NOTE) {
+      continue;
+    }
+    const char* note = reinterpret_cast<const char*>(bias + phdrs[i].p_vaddr);
+    const char* end = note + phdrs[i].p_memsz;
+    while (note + sizeof(ElfW(Nhdr)) <= end) {
+      const ElfW(Nhdr)* nhdr = reinterpret_cast<const ElfW(Nhdr)*>(note);
+      const char* name = note + sizeof(*nhdr);
+      const unsigned char* desc = reinterpret_cast<const unsigned char*>(
+          name + ((nhdr->n_namesz + 3) & ~3));
+      if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+          !memcmp(name, "GNU", 4) && nhdr->n_descsz <= 64) {
+        for (unsigned j = 0; j < nhdr->n_descsz; j++) {
+          memory[j * 2] = "0123456789abcdef"[desc[j] >> 4];
+          memory[j * 2 + 1] = "0123456789abcdef"[desc[j] & 0xF];
+        }
+        memory[nhdr->n_descsz * 2] = 0;
+        return memory;
+      }
+      note = reinterpret_cast<const char*>(desc) + ((nhdr->n_descsz + 3) & ~3);
+    }
+  }
+  return memory;
+}
+
+/// @brief Formats "#<n> 0x<address> <module> build-id=<hex>" without
+/// symbolizing, the address being relative to the module's ELF image.
+/// Async-signal-safe.
+CRASH_PATH
+static char* FormatRawFrame(int index, void* address, const char* image,
+                            char* memory) {
+  char* line = memory;
+  char buffer[160];
+  Dl_info dlinf;
+  uintptr_t bias = 0;
+  bool found = dladdr(address, &dlinf) != 0 &&
+      ElfLoadBias(dlinf.dli_fbase, &bias);
+  strcpy(line, "#");  // NOLINT(runtime/printf)
+  strcat(line, Safe::itoa(index, buffer));  // NOLINT(runtime/printf)
+  strcat(line, " ");  // NOLINT(runtime/printf)
+  strcat(line, Safe::ptoa(reinterpret_cast<void*>(  // NOLINT(*)
+      reinterpret_cast<uintptr_t>(address) - bias), buffer));
+  if (!found) {
+    strcat(line, " ??\n");  // NOLINT(runtime/printf)
+    return line;
+  }
+  strcat(line, " ");  // NOLINT(runtime/printf)
+  strncat(line, dlinf.dli_fname[0] == '/'? dlinf.dli_fname : image,  // NOLINT
+          768);
+  strcat(line, " build-id=");  // NOLINT(runtime/printf)
+  strcat(line, ReadBuildId(dlinf.dli_fbase, buffer));  // NOLINT(*)
+  strcat(line, "\n");  // NOLINT(runtime/printf)
+  return line;
+}
+
+/// @brief Returns the address of the instruction interrupted by a signal.
+INLINE static void* InstructionPointer(void* secret) {
+  ucontext_t *uc = reinterpret_cast<ucontext_t *>(secret);
+#if defined(__arm__)
+  return reinterpret_cast<void *>(uc->uc_mcontext.arm_pc);
+#elif defined(__aarch64__)
+  return reinterpret_cast<void *>(uc->uc_mcontext.pc);
+#elif defined(__x86_64__)
+  return reinterpret_cast<void *>(uc->uc_mcontext.gregs[REG_RIP]);
+#elif defined(__i386__)
+  return reinterpret_cast<void *>(uc->uc_mcontext.gregs[REG_EIP]);
+#else
+#error Only ARM, AARCH64, x86 and x86-64 are supported
+#endif
+}
+
+/// @brief Returns the stack pointer of the code interrupted by a signal.
+INLINE static uintptr_t StackPointer(void* secret) {
+  ucontext_t *uc = reinterpret_cast<ucontext_t *>(secret);
+#if defined(__arm__)
+  return uc->uc_mcontext.arm_sp;
+#elif defined(__aarch64__)
+  return uc->uc_mcontext.sp;
+#elif defined(__x86_64__)
+  return uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__i386__)
+  return uc->uc_mcontext.gregs[REG_ESP];
+#endif
+}
+
+/// @brief The upper bound of the stack scan, so that it finishes in
+/// a fraction of a millisecond.
+static const size_t kMaxScannedStackSize = 256 << 10;
+static const int kMaxCodeRanges = 512;
+
+static const char kScannedHighConfidence[] = " (scanned, high confidence)";
+static const char kScannedLowConfidence[] = " (scanned, low confidence)";
+
+/// @brief Reads the executable mappings from /proc/self/maps into ranges as
+/// sorted [start, end) pairs and the end of the mapping which contains
+/// stack_pointer into stack_end. Async-signal-safe.
+/// @return The number of ranges.
+CRASH_PATH
+static int ReadCodeRanges(uintptr_t stack_pointer, uintptr_t* ranges,
+                          uintptr_t* stack_end, char* memory) {
+  int fd = open("/proc/self/maps", O_RDONLY);
+  if (fd < 0) {
+    return 0;
+  }
+  // Parse the lines as they stream in: "start-end perms ..."
+  const size_t buffer_size = 4096;
+  uintptr_t start = 0, end = 0;
+  int field = 0, count = 0;
+  char perms[4] = {0};
+  int perms_length = 0;
+  ssize_t size;
+  while ((size = read(fd, memory, buffer_size)) > 0) {
+    for (ssize_t i = 0; i < size; i++) {
+      char c = memory[i];
+      if (c == '\n') {
+        // [vsyscall] is execute-only and cannot be inspected
+        if (perms[0] == 'r' && perms[2] == 'x' && count < kMaxCodeRanges) {
+          ranges[count * 2] = start;
+          ranges[count * 2 + 1] = end;
+          count++;
+        }
+        if (start <= stack_pointer && stack_pointer < end) {
+          *stack_end = end;
+        }
+        start = end = 0;
+        field = perms_length = 0;
+        perms[0] = perms[2] = 0;
+        continue;
+      }
+      if (field == 0) {
+        if (c == '-') {
+          field = 1;
+        } else {
+          start = (start << 4) | (c <= '9'? c - '0' : c - 'a' + 10);
+        }
+      } else if (field == 1) {
+        if (c == ' ') {
+          field = 2;
+        } else {
+          end = (end << 4) | (c <= '9'? c - '0' : c - 'a' + 10);
+        }
+      } else if (field == 2) {
+        if (c == ' ') {
+          field = 3;
+        } else if (perms_length < 4) {
+          perms[perms_length++] = c;
+        }
+      }
+    }
+  }
+  close(fd);
+  return count;
+}
+
+/// @brief Returns the index of the range which contains address or -1.
+CRASH_PATH
+static int FindCodeRange(uintptr_t address, const uintptr_t* ranges,
+                         int count) {
+  int low = 0, high = count;
+  while (low < high) {
+    int middle = (low + high) / 2;
+    if (address < ranges[middle * 2]) {
+      high = middle;
+    } else if (address >= ranges[middle * 2 + 1]) {
+      low = middle + 1;
+    } else {
+      return middle;
+    }
+  }
+  return -1;
+}
+
+/// @brief Tells CallSiteConfidence() whether a call target is in the code
+/// ranges.
+struct CodeRangeLookup {
+  bool operator()(uintptr_t address) const;
+
+  const uintptr_t* ranges;
+  int count;
+};
+
+CRASH_PATH
+bool CodeRangeLookup::operator()(uintptr_t address) const {
+  return FindCodeRange(address, ranges, count) >= 0;
+}
+
+/// @brief Checks whether address follows a call instruction.
+/// @return 2 for a direct call to a known code range, 1 for an indirect
+/// call, 0 otherwise.
+CRASH_PATH
+static int CallConfidence(uintptr_t address, const uintptr_t* ranges,
+                          int count) {
+  int range = FindCodeRange(address - 1, ranges, count);
+  if (range < 0) {
+    return 0;
+  }
+  // The number of the instruction bytes which may be read before address
+  uintptr_t available = address - ranges[range * 2];
+  CodeRangeLookup lookup = { ranges, count };
+  return CallSiteConfidence(reinterpret_cast<const unsigned char*>(address),
+                            available, address, lookup);
+}
+
+/// @brief Recovers the call chain when backtrace() fails on a smashed or
+/// frame-pointer-less stack: every word between the stack pointer and the
+/// top of the stack which points right after a call instruction is taken
+/// for a return address. Bounded by kMaxScannedStackSize. Async-signal-safe.
+/// @param ranges The code ranges returned by ReadCodeRanges().
+/// @param notes Receives the confidence marker of each frame.
+/// @return The number of frames written to trace.
+CRASH_PATH
+static int ScanStack(uintptr_t stack_pointer, uintptr_t stack_end,
+                     const uintptr_t* ranges, int count, void** trace,
+                     const char** notes, int max_frames) {
+  if (stack_end - stack_pointer > kMaxScannedStackSize) {
+    stack_end = stack_pointer + kMaxScannedStackSize;
+  }
+  int frames = 0;
+  for (const uintptr_t* word = reinterpret_cast<const uintptr_t*>(
+           stack_pointer & ~(sizeof(uintptr_t) - 1));
+       word < reinterpret_cast<const uintptr_t*>(stack_end) &&
+       frames < max_frames; word++) {
+    int confidence = CallConfidence(*word, ranges, count);
+    if (confidence == 0) {
+      continue;
+    }
+    trace[frames] = reinterpret_cast<void*>(*word);
+    notes[frames] = confidence > 1? kScannedHighConfidence :
+                                    kScannedLowConfidence;
+    frames++;
+  }
+  return frames;
+}
+
+#if defined(__arm__)
+/// @brief The .ARM.exidx entry of the functions which cannot be unwound.
+static const uint32_t kExidxCantUnwind = 1;
+
+/// @brief Decodes the 31-bit place-relative address stored at word.
+CRASH_PATH
+static uintptr_t Prel31(const uint32_t* word) {
+  int32_t offset = static_cast<int32_t>(*word << 1) >> 1;
+  return reinterpret_cast<uintptr_t>(word) + offset;
+}
+
+/// @brief Binary-searches the .ARM.exidx table, which is sorted by
+/// the function addresses, for the entry which covers pc.
+CRASH_PATH
+static const uint32_t* SearchExidx(const uint32_t* table, size_t count,
+                                   uintptr_t pc) {
+  size_t low = 0, high = count;
+  while (low < high) {
+    size_t middle = (low + high) / 2;
+    if (Prel31(table + middle * 2) <= pc) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low > 0? table + (low - 1) * 2 : NULL;
+}
+
+/// @brief Finds the .ARM.exidx entry of the function which contains pc
+/// in the PT_ARM_EXIDX segment of its image. Async-signal-safe.
+CRASH_PATH
+static const uint32_t* FindExidxEntry(uintptr_t pc) {
+  Dl_info info;
+  uintptr_t bias;
+  if (dladdr(reinterpret_cast<void*>(pc), &info) == 0 ||
+      !ElfLoadBias(info.dli_fbase, &bias)) {
+    return NULL;
+  }
+  const ElfW(Ehdr)* ehdr = reinterpret_cast<const ElfW(Ehdr)*>(
+      info.dli_fbase);
+  const ElfW(Phdr)* phdrs = reinterpret_cast<const ElfW(Phdr)*>(
+      reinterpret_cast<const char*>(info.dli_fbase) + ehdr->e_phoff);
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    if (phdrs[i].p_type == PT_ARM_EXIDX) {
+      return SearchExidx(
+          reinterpret_cast<const uint32_t*>(bias + phdrs[i].p_vaddr),
+          phdrs[i].p_memsz / 8, pc);
+    }
+  }
+  return NULL;
+}
+
+/// @brief The unwind opcodes of a function, packed most significant byte
+/// first into the words of its exception table entry.
+struct EhabiOpcodes {
+  const uint32_t* word;
+  /// @brief The index of the next byte in word, 0 being the highest.
+  int byte;
+  int remaining;
+};
+
+CRASH_PATH
+static bool NextEhabiOpcode(EhabiOpcodes* opcodes, uint32_t* opcode) {
+  if (opcodes->remaining == 0) {
+    return false;
+  }
+  *opcode = (*opcodes->word >> (24 - opcodes->byte * 8)) & 0xFF;
+  if (++opcodes->byte == 4) {
+    opcodes->byte = 0;
+    opcodes->word++;
+  }
+  opcodes->remaining--;
+  return true;
+}
+
+/// @brief Locates the unwind opcodes of an .ARM.exidx entry, either inline
+/// or in .ARM.extab. Handles the compact models of __aeabi_unwind_cpp_pr0,
+/// pr1 and pr2 and the generic model used by __gxx_personality_v0, which
+/// keeps the opcodes after the routine's address in the pr1 layout.
+CRASH_PATH
+static bool FindEhabiOpcodes(const uint32_t* entry, EhabiOpcodes* opcodes) {
+  if (entry[1] == kExidxCantUnwind) {
+    return false;
+  }
+  const uint32_t* data = entry + 1;
+  if ((*data & 0x80000000) == 0) {
+    data = reinterpret_cast<const uint32_t*>(Prel31(data));
+  }
+  if ((*data & 0x80000000) == 0) {
+    data++;
+    opcodes->word = data;
+    opcodes->byte = 1;
+    opcodes->remaining = 3 + (*data >> 24) * 4;
+    return true;
+  }
+  opcodes->word = data;
+  switch ((*data >> 24) & 0xF) {
+    case 0:
+      opcodes->byte = 1;
+      opcodes->remaining = 3;
+      return true;
+    case 1:
+    case 2:
+      opcodes->byte = 2;
+      opcodes->remaining = 2 + ((*data >> 16) & 0xFF) * 4;
+      return true;
+    default:
+      return false;
+  }
+}
+
+/// @brief Loads the core registers in mask from the virtual stack pointer.
+/// The reads outside [stack_start, stack_end) fail.
+CRASH_PATH
+static bool PopRegisters(uint32_t mask, uint32_t* registers, uint32_t* vsp,
+                         uintptr_t stack_start, uintptr_t stack_end) {
+  for (int i = 0; i < 16; i++) {
+    if ((mask & (1u << i)) == 0) {
+      continue;
+    }
+    if (*vsp < stack_start || *vsp + 4 > stack_end) {
+      return false;
+    }
+    registers[i] = *reinterpret_cast<const uint32_t*>(
+        static_cast<uintptr_t>(*vsp));
+    *vsp += 4;
+  }
+  if (mask & (1u << 13)) {
+    *vsp = registers[13];
+  }
+  return true;
+}
+
+/// @brief Interprets the EHABI unwind opcodes of a frame on r0-r15,
+/// leaving the caller's registers. The VFP and iWMMX registers are
+/// skipped, since only the return addresses are needed.
+CRASH_PATH
+static bool ExecuteEhabiOpcodes(EhabiOpcodes* opcodes, uint32_t* registers,
+                                uintptr_t stack_start, uintptr_t stack_end) {
+  uint32_t vsp = registers[13];
+  uint32_t popped = 0;
+  uint32_t opcode, operand;
+  while (NextEhabiOpcode(opcodes, &opcode)) {
+    uint32_t mask = 0;
+    if ((opcode & 0xC0) == 0x00) {
+      vsp += ((opcode & 0x3F) << 2) + 4;
+    } else if ((opcode & 0xC0) == 0x40) {
+      vsp -= ((opcode & 0x3F) << 2) + 4;
+    } else if ((opcode & 0xF0) == 0x80) {
+      if (!NextEhabiOpcode(opcodes, &operand)) {
+        return false;
+      }
+      mask = (((opcode & 0x0F) << 8) | operand) << 4;
+      if (mask == 0) {
+        return false;  // refuse to unwind
+      }
+    } else if ((opcode & 0xF0) == 0x90) {
+      if ((opcode & 0x0D) == 0x0D) {
+        return false;  // reserved for r13 and r15
+      }
+      vsp = registers[opcode & 0x0F];
+    } else if ((opcode & 0xF0) == 0xA0) {
+      // pop r4-r[4+nnn], plus r14 if bit 3 is set
+      mask = ((2u << (opcode & 7)) - 1) << 4;
+      if (opcode & 8) {
+        mask |= 1u << 14;
+      }
+    } else if (opcode == 0xB0) {
+      break;
+    } else if (opcode == 0xB1) {
+      if (!NextEhabiOpcode(opcodes, &operand) || operand == 0 ||
+          (operand & 0xF0) != 0) {
+        return false;
+      }
+      mask = operand;
+    } else if (opcode == 0xB2) {
+      uint32_t value = 0;
+      int shift = 0;
+      do {
+        if (!NextEhabiOpcode(opcodes, &operand) || shift > 28) {
+          return false;
+        }
+        value |= (operand & 0x7F) << shift;
+        shift += 7;
+      } while (operand & 0x80);
+      vsp += 0x204 + (value << 2);
+    } else if (opcode == 0xB3 || opcode == 0xC6 || opcode == 0xC8 ||
+               opcode == 0xC9) {
+      // D[ssss]-D[ssss+cccc], FSTMFDX adds a format word
+      if (!NextEhabiOpcode(opcodes, &operand)) {
+        return false;
+      }
+      vsp += ((operand & 0x0F) + 1) * 8 + (opcode == 0xB3? 4 : 0);
+    } else if ((opcode & 0xF8) == 0xB8 || (opcode & 0xF8) == 0xD0 ||
+               (opcode >= 0xC0 && opcode <= 0xC5)) {
+      // D[8]-D[8+nnn] or wR[10]-wR[10+nnn]
+      vsp += ((opcode & 7) + 1) * 8 + ((opcode & 0xF8) == 0xB8? 4 : 0);
+    } else if (opcode == 0xC7) {
+      if (!NextEhabiOpcode(opcodes, &operand) || operand == 0 ||
+          (operand & 0xF0) != 0) {
+        return false;
+      }
+      vsp += __builtin_popcount(operand) * 4;
+    } else {
+      return false;  // spare
+    }
+    if (mask != 0) {
+      if (!PopRegisters(mask, registers, &vsp, stack_start, stack_end)) {
+        return false;
+      }
+      popped |= mask;
+    }
+  }
+  registers[13] = vsp;
+  if ((popped & (1u << 15)) == 0) {
+    registers[15] = registers[14];
+  }
+  return true;
+}
+
+/// @brief Unwinds the stack with the .ARM.exidx tables of the loaded images,
+/// starting from r0-r15 of the interrupted code: backtrace() does not get
+/// past the signal frame on ARM. Each frame costs a dladdr() and a binary
+/// search. Async-signal-safe.
+/// @param stack_end The stack is read only up to it.
+/// @return The number of frames written to trace, starting with the pc.
+CRASH_PATH
+static int UnwindExidx(uint32_t* registers, uintptr_t stack_end, void** trace,
+                       int max_frames) {
+  uintptr_t stack_start = registers[13];
+  int frames = 0;
+  while (frames < max_frames && registers[15] != 0) {
+    trace[frames++] = reinterpret_cast<void*>(registers[15]);
+    // A return address points after the call, which may be in the next
+    // function; the lowest bit marks Thumb
+    uintptr_t pc = (registers[15] & ~1u) - (frames > 1? 2 : 0);
+    const uint32_t* entry = FindExidxEntry(pc);
+    EhabiOpcodes opcodes;
+    if (entry == NULL || !FindEhabiOpcodes(entry, &opcodes)) {
+      break;
+    }
+    uint32_t sp = registers[13], previous_pc = registers[15];
+    if (!ExecuteEhabiOpcodes(&opcodes, registers, stack_start, stack_end) ||
+        registers[13] < sp ||
+        (registers[13] == sp && registers[15] == previous_pc)) {
+      break;
+    }
+  }
+  return frames;
+}
+
+/// @brief Copies r0-r15 from the context of a signal handler.
+INLINE static void ContextRegisters(void* secret, uint32_t* registers) {
+  ucontext_t *uc = reinterpret_cast<ucontext_t *>(secret);
+  // arm_r0 ... arm_r10, arm_fp, arm_ip, arm_sp, arm_lr, arm_pc
+  const unsigned long* gregs = &uc->uc_mcontext.arm_r0;  // NOLINT(runtime/int)
+  for (int i = 0; i < 16; i++) {
+    registers[i] = gregs[i];
+  }
+}
+#endif  // #if defined(__arm__)
+
+/// @brief The stack trace of a thread interrupted by the shutdown watchdog.
+struct ThreadTrace {
+  pid_t tid;
+  /// @brief -1 until the thread's signal handler fills frames.
+  volatile int size;
+  void* frames[102];
+};
+
+struct LinuxDirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;  // NOLINT(runtime/int)
+  unsigned char d_type;
+  char d_name[1];
+};
+
+static const int kMaxDumpedThreads = 256;
+/// @brief kMaxDumpedThreads entries, mapped when the watchdog is started.
+static ThreadTrace* thread_traces = NULL;
+static int dumped_threads = 0;
+static int dump_frames_count = 0;
+static int dump_signal = 0;
+static int shutdown_armed = 0;
+static bool shutdown_watchdog_started = false;
+static bool sigterm_handler_installed = false;
+static struct sigaction previous_sigterm_action;
+static sem_t shutdown_semaphore;
+
+/// @brief Saves the stack trace of the current thread into its slot in
+/// thread_traces.
+CRASH_PATH
+static void HandleDumpSignal(int, siginfo_t*, void* secret) {
+  int saved_errno = errno;
+  pid_t tid = syscall(SYS_gettid);
+  for (int i = 0; i < dumped_threads; i++) {
+    ThreadTrace& trace = thread_traces[i];
+    if (trace.tid != tid) {
+      continue;
+    }
+#if defined(__arm__)
+    // The thread is healthy, so the bound only stops a runaway unwinding
+    uint32_t registers[16];
+    ContextRegisters(secret, registers);
+    int size = 1 + UnwindExidx(registers,
+                               registers[13] + kMaxScannedStackSize,
+                               trace.frames + 1, dump_frames_count - 1);
+    trace.frames[0] = trace.frames[1];
+    if (size <= 2) {
+      size = backtrace(trace.frames, dump_frames_count);
+    }
+#else
+    int size = backtrace(trace.frames, dump_frames_count);
+#endif
+    if (size > 1) {
+      trace.frames[1] = InstructionPointer(secret);
+    }
+    __sync_synchronize();
+    trace.size = size;
+    break;
+  }
+  errno = saved_errno;
+}
+
+/// @brief The contents of /proc/self/task/<tid>/status, preallocated.
+static char thread_status_text[4096];
+
+/// @brief Appends " <key> <value>" from "key:\t<value>" in a status file.
+static void AppendStatusValue(char* msg, const char* text, const char* key,
+                              const char* name) {
+  const char* line = strstr(text, key);
+  if (line == NULL) {
+    return;
+  }
+  char buffer[32];
+  strcat(msg, " ");  // NOLINT(runtime/printf)
+  strcat(msg, Safe::utoa(  // NOLINT(runtime/printf)
+      Safe::atou(line + strlen(key) + 1), buffer));
+  strcat(msg, name);  // NOLINT(runtime/printf)
+}
+
+/// @brief Appends the clock ticks as seconds with millisecond precision.
+static void AppendTicks(char* msg, uint64_t ticks, uint64_t ticks_per_second) {
+  char buffer[32];
+  uint64_t milliseconds = ticks * 1000 / ticks_per_second;
+  strcat(msg, Safe::utoa(milliseconds / 1000, buffer));  // NOLINT(*)
+  char fraction[] = ".000 s";
+  fraction[1] = '0' + milliseconds / 100 % 10;
+  fraction[2] = '0' + milliseconds / 10 % 10;
+  fraction[3] = '0' + milliseconds % 10;
+  strcat(msg, fraction);  // NOLINT(runtime/printf)
+}
+
+/// @brief Formats the scheduler state and the CPU time of a thread from
+/// its stat and status files relative to task_fd, e.g. " state R,
+/// user 1.520 s, system 0.010 s, switches 3 voluntary / 120 involuntary,
+/// last CPU 2". Returns an empty string if they are not readable.
+static char* FormatThreadStats(int task_fd, pid_t tid, char* msg) {
+  char buffer[32];
+  char file[48];
+  msg[0] = 0;
+  if (task_fd < 0) {
+    return msg;
+  }
+  strcpy(file, Safe::itoa(tid, buffer));  // NOLINT(runtime/printf)
+  size_t file_length = strlen(file);
+  strcpy(file + file_length, "/stat");  // NOLINT(runtime/printf)
+  int fd = openat(task_fd, file, O_RDONLY | O_CLOEXEC);
+  bool read_stat = ReadResourceFile(fd, thread_status_text,
+                                    sizeof(thread_status_text));
+  if (fd >= 0) {
+    close(fd);
+  }
+  // tid (comm) state ppid ... utime stime ... processor
+  const char* fields = read_stat? strrchr(thread_status_text, ')') : NULL;
+  if (fields == NULL) {
+    return msg;
+  }
+  fields += 2;
+  uint64_t ticks_per_second = sysconf(_SC_CLK_TCK);
+  strcpy(msg, " state ");  // NOLINT(runtime/printf)
+  strncat(msg, fields, 1);  // NOLINT(runtime/printf)
+  strcat(msg, ", user ");  // NOLINT(runtime/printf)
+  AppendTicks(msg, Safe::atou(SkipFields(fields, 14 - 3)), ticks_per_second);
+  strcat(msg, ", system ");  // NOLINT(runtime/printf)
+  AppendTicks(msg, Safe::atou(SkipFields(fields, 15 - 3)), ticks_per_second);
+  uint64_t processor = Safe::atou(SkipFields(fields, 39 - 3));
+  strcpy(file + file_length, "/status");  // NOLINT(runtime/printf)
+  fd = openat(task_fd, file, O_RDONLY | O_CLOEXEC);
+  if (ReadResourceFile(fd, thread_status_text, sizeof(thread_status_text))) {
+    strcat(msg, ", switches");  // NOLINT(runtime/printf)
+    AppendStatusValue(msg, thread_status_text, "\nvoluntary_ctxt_switches:",
+                      " voluntary /");
+    AppendStatusValue(msg, thread_status_text,
+                      "\nnonvoluntary_ctxt_switches:", " involuntary");
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  strcat(msg, ", last CPU ");  // NOLINT(runtime/printf)
+  strcat(msg, Safe::utoa(processor, buffer));  // NOLINT(runtime/printf)
+  return msg;
+}
+
+int DeathHandler::shutdown_timeout() const {
+  return shutdown_timeout_;
+}
+
+void DeathHandler::set_shutdown_timeout(int value) {
+  assert(value >= 0);
+  shutdown_timeout_ = value;
+  if (value == 0) {
+    if (sigterm_handler_installed) {
+      sigaction(SIGTERM, &previous_sigterm_action, NULL);
+      sigterm_handler_installed = false;
+    }
+    return;
+  }
+  if (!shutdown_watchdog_started) {
+    if (thread_traces == NULL) {
+      void* traces = mmap(NULL, kMaxDumpedThreads * sizeof(ThreadTrace),
+                          PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                          -1, 0);
+      if (traces == MAP_FAILED) {
+        perror("DeathHandler - mmap()");
+        return;
+      }
+      thread_traces = reinterpret_cast<ThreadTrace*>(traces);
+    }
+    dump_signal = SIGRTMIN + 4;
+    struct sigaction sa;
+    sa.sa_sigaction = HandleDumpSignal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_SIGINFO | SA_ONSTACK;
+    if (sigaction(dump_signal, &sa, NULL) < 0) {
+      perror("DeathHandler - sigaction(SIGRTMIN + 4)");
+    }
+    sem_init(&shutdown_semaphore, 0, 0);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, ShutdownWatchdog, NULL) != 0) {
+      perror("DeathHandler - pthread_create()");
+    } else {
+      shutdown_watchdog_started = true;
+    }
+    pthread_attr_destroy(&attr);
+  }
+  if (!sigterm_handler_installed) {
+    struct sigaction sa;
+    sa.sa_sigaction = (sa_sigaction_handler)HandleTermination;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART | SA_SIGINFO;
+    if (sigaction(SIGTERM, &sa, &previous_sigterm_action) < 0) {
+      perror("DeathHandler - sigaction(SIGTERM)");
+    } else {
+      sigterm_handler_installed = true;
+    }
+  }
+}
+
+bool DeathHandler::shutdown_force_exit() const {
+  return shutdown_force_exit_;
+}
+
+void DeathHandler::set_shutdown_force_exit(bool value) {
+  shutdown_force_exit_ = value;
+}
+
+void DeathHandler::ArmShutdownWatchdog() const {
+  ArmShutdown();
+}
+
+void DeathHandler::ArmShutdown() {
+  if (shutdown_timeout_ > 0 && shutdown_watchdog_started &&
+      __sync_bool_compare_and_swap(&shutdown_armed, 0, 1)) {
+    sem_post(&shutdown_semaphore);
+  }
+}
+
+void DeathHandler::HandleTermination(int sig, void* info, void* secret) {
+  ArmShutdown();
+  const struct sigaction& previous = previous_sigterm_action;
+  if (previous.sa_flags & SA_SIGINFO) {
+    previous.sa_sigaction(sig, reinterpret_cast<siginfo_t*>(info), secret);
+  } else if (previous.sa_handler == SIG_DFL) {
+    // Terminate as if there was no handler
+    sigaction(SIGTERM, &previous, NULL);
+    raise(SIGTERM);
+  } else if (previous.sa_handler != SIG_IGN) {
+    previous.sa_handler(sig);
+  }
+}
+
+void* DeathHandler::ShutdownWatchdog(void*) {
+  // The signals must be handled by the threads which are watched
+  sigset_t signals;
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  // backtrace() allocates on its first call, so do it now
+  void* frames[2];
+  backtrace(frames, 2);
+  char memory[kNeededMemory];
+  while (sem_wait(&shutdown_semaphore) != 0) {}
+  int timeout = shutdown_timeout_;
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)) {}
+  DumpThreads(timeout, memory);
+  if (shutdown_force_exit_) {
+    _Exit(EXIT_FAILURE);
+  }
+  return NULL;
+}
+
+void DeathHandler::DumpThreads(int timeout, char* memory) {
+  pid_t pid = getpid();
+  pid_t self = syscall(SYS_gettid);
+  int threads = 0;
+  int omitted = 0;
+  int fd = open("/proc/self/task", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd >= 0) {
+    char* entries = memory;
+    const int entries_max_length = 4096;
+    long len;  // NOLINT(runtime/int)
+    while ((len = syscall(SYS_getdents64, fd, entries,
+                          entries_max_length)) > 0) {
+      for (long pos = 0; pos < len;) {  // NOLINT(runtime/int)
+        LinuxDirent64* entry = reinterpret_cast<LinuxDirent64*>(
+            entries + pos);
+        pos += entry->d_reclen;
+        pid_t tid = Safe::atou(entry->d_name);
+        if (tid == 0 || tid == self) {
+          continue;
+        }
+        if (threads == kMaxDumpedThreads) {
+          omitted++;
+          continue;
+        }
+        thread_traces[threads].tid = tid;
+        thread_traces[threads].size = -1;
+        threads++;
+      }
+    }
+    close(fd);
+  }
+  dump_frames_count = frames_count_ + 2;
+  dumped_threads = threads;
+  __sync_synchronize();
+  for (int i = 0; i < threads; i++) {
+    if (syscall(SYS_tgkill, pid, thread_traces[i].tid, dump_signal) != 0) {
+      // The thread has already exited
+      thread_traces[i].size = 0;
+    }
+  }
+  // Give the threads a second to respond
+  for (int attempt = 0; attempt < 100; attempt++) {
+    int pending = 0;
+    for (int i = 0; i < threads; i++) {
+      pending += thread_traces[i].size < 0;
+    }
+    if (pending == 0) {
+      break;
+    }
+    struct timespec delay = { 0, 10 * 1000 * 1000 };
+    nanosleep(&delay, NULL);
+  }
+  __sync_synchronize();
+
+  if (metrics_ != NULL) {
+    CountMetric(&metrics_->live_dumps, 1);
+  }
+  print("Shutdown stalled (pid ");
+  print(Safe::itoa(pid, memory));
+  print("): still running ");
+  print(Safe::itoa(timeout, memory));
+  print(" seconds after the termination request\n");
+  for (int i = 0; i < threads; i++) {
+    const ThreadTrace& trace = thread_traces[i];
+    if (trace.size == 0) {
+      continue;
+    }
+    print("\nThread ");
+    print(Safe::itoa(trace.tid, memory));
+    print(" (");
+    print(ReadThreadName(pid, trace.tid, memory));
+    print("):");
+    print(FormatThreadStats(task_fd_, trace.tid, memory));
+    print("\n");
+    if (trace.size < 0) {
+      print("no response, the signal is blocked\n");
+    } else if (trace.size <= 2) {
+      print("no stack trace\n");
+    } else {
+      trace_printer_(const_cast<void**>(trace.frames), NULL, trace.size, pid,
+                     !symbolize_, true, memory);
+    }
+  }
+  if (omitted > 0) {
+    print("\n");
+    print(Safe::itoa(omitted, memory));
+    print(" more threads omitted\n");
+  }
+  FlushOutput();
+}
+
+/// @brief A stack trace captured by DEATH_HANDLER_WARN_ONCE(), which
+/// waits in warn_queue for the symbolizer thread.
+struct WarnReport {
+  enum State {
+    kFree,
+    kWriting,
+    kReady
+  };
+
+  int state;
+  WarnSite* site;
+  const char* message;
+  const char* file;
+  int line;
+  pid_t tid;
+  int size;
+  void* frames[66];
+};
+
+static const int kWarnQueueSize = 16;
+static const int kMaxRearmedWarnSites = 256;
+static WarnReport warn_queue[kWarnQueueSize];
+static unsigned warn_queue_next = 0;
+static sem_t warn_semaphore;
+static bool warn_symbolizer_started = false;
+
+int DeathHandler::warn_interval() const {
+  return warn_interval_;
+}
+
+void DeathHandler::set_warn_interval(int value) {
+  assert(value >= -1);
+  if (value >= 0 && !warn_symbolizer_started) {
+    // backtrace() allocates on its first call, so do it now
+    void* frames[2];
+    backtrace(frames, 2);
+    sem_init(&warn_semaphore, 0, 0);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    if (pthread_create(&thread, &attr, WarnSymbolizer, NULL) != 0) {
+      perror("DeathHandler - pthread_create()");
+      pthread_attr_destroy(&attr);
+      return;
+    }
+    pthread_attr_destroy(&attr);
+    warn_symbolizer_started = true;
+  }
+  warn_interval_ = value;
+}
+
+void DeathHandler::Warn(WarnSite* site, const char* message,
+                        const char* file, int line) {
+  if (!__sync_bool_compare_and_swap(&site->fired, 0, 1) ||
+      warn_interval_ < 0) {
+    return;
+  }
+  WarnReport& report = warn_queue[
+      __sync_fetch_and_add(&warn_queue_next, 1) % kWarnQueueSize];
+  if (!__sync_bool_compare_and_swap(&report.state, WarnReport::kFree,
+                                    WarnReport::kWriting)) {
+    // The symbolizer lags behind, retry on the next occurrence
+    __atomic_store_n(&site->fired, 0, __ATOMIC_RELAXED);
+    return;
+  }
+  report.site = site;
+  report.message = message;
+  report.file = file;
+  report.line = line;
+  report.tid = syscall(SYS_gettid);
+  int frames = frames_count_ + 2;
+  if (frames > static_cast<int>(sizeof(report.frames) / sizeof(void*))) {
+    frames = sizeof(report.frames) / sizeof(void*);
+  }
+  report.size = backtrace(report.frames, frames);
+  __atomic_store_n(&report.state, WarnReport::kReady, __ATOMIC_RELEASE);
+  sem_post(&warn_semaphore);
+}
+
+void* DeathHandler::WarnSymbolizer(void*) {
+  sigset_t signals;
+  sigfillset(&signals);
+  pthread_sigmask(SIG_BLOCK, &signals, NULL);
+  char memory[kNeededMemory];
+  // The call sites which fired and wait for the rate limit window
+  WarnSite* rearmed_sites[kMaxRearmedWarnSites];
+  struct timespec rearm_times[kMaxRearmedWarnSites];
+  int rearmed_count = 0;
+  pid_t pid = getpid();
+  for (;;) {
+    struct timespec deadline;
+    if (rearmed_count > 0) {
+      deadline = rearm_times[0];
+      for (int i = 1; i < rearmed_count; i++) {
+        if (rearm_times[i].tv_sec < deadline.tv_sec) {
+          deadline = rearm_times[i];
+        }
+      }
+      sem_timedwait(&warn_semaphore, &deadline);
+    } else {
+      sem_wait(&warn_semaphore);
+    }
+    for (int i = 0; i < kWarnQueueSize; i++) {
+      WarnReport& report = warn_queue[i];
+      if (__atomic_load_n(&report.state, __ATOMIC_ACQUIRE) !=
+          WarnReport::kReady) {
+        continue;
+      }
+      print("\nWarning: ");
+      print(report.message);
+      print(" (thread ");
+      print(Safe::itoa(report.tid, memory));
+      print(", pid ");
+      print(Safe::itoa(pid, memory));
+      print(")\n");
+      print(report.file);
+      print(":");
+      print(Safe::itoa(report.line, memory));
+      print("\n");
+      if (report.size > 2) {
+        trace_printer_(report.frames, NULL, report.size, pid, !symbolize_,
+                       true, memory);
+      }
+      FlushOutput();
+      if (warn_interval_ > 0 && rearmed_count < kMaxRearmedWarnSites) {
+        clock_gettime(CLOCK_REALTIME, &rearm_times[rearmed_count]);
+        rearm_times[rearmed_count].tv_sec += warn_interval_;
+        rearmed_sites[rearmed_count++] = report.site;
+      }
+      __atomic_store_n(&report.state, WarnReport::kFree, __ATOMIC_RELEASE);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    for (int i = 0; i < rearmed_count;) {
+      if (rearm_times[i].tv_sec > now.tv_sec ||
+          (rearm_times[i].tv_sec == now.tv_sec &&
+           rearm_times[i].tv_nsec > now.tv_nsec)) {
+        i++;
+        continue;
+      }
+      __atomic_store_n(&rearmed_sites[i]->fired, 0, __ATOMIC_RELAXED);
+      rearmed_count--;
+      rearmed_sites[i] = rearmed_sites[rearmed_count];
+      rearm_times[i] = rearm_times[rearmed_count];
+    }
+  }
+  return NULL;
+}
+
+/// @brief The DWARF constants used by the line table decoder.
+enum {
+  kDwFormData2 = 0x05,
+  kDwFormData4 = 0x06,
+  kDwFormData8 = 0x07,
+  kDwFormString = 0x08,
+  kDwFormBlock = 0x09,
+  kDwFormData1 = 0x0b,
+  kDwFormStrp = 0x0e,
+  kDwFormUdata = 0x0f,
+  kDwFormData16 = 0x1e,
+  kDwFormLineStrp = 0x1f,
+  kDwLnctPath = 1,
+  kDwLnctDirectoryIndex = 2,
+  kDwLnsCopy = 1,
+  kDwLnsAdvancePc = 2,
+  kDwLnsAdvanceLine = 3,
+  kDwLnsSetFile = 4,
+  kDwLnsConstAddPc = 8,
+  kDwLnsFixedAdvancePc = 9,
+  kDwLneEndSequence = 1,
+  kDwLneSetAddress = 2
+};
+
+/// @brief The number of rows encoded relative to the first one of a block.
+static const unsigned kLineTableBlockRows = 16;
+static const int kMaxLineTableModules = 128;
+static const unsigned kFileNameBuckets = 1 << 16;
+static const int kMaxLineTableThreads = 64;
+/// @brief The number of symbol names front-coded relative to the first
+/// one of a block.
+static const unsigned kSymbolNameBlockNames = 16;
+/// @brief The longer mangled names are truncated.
+static const size_t kMaxSymbolNameLength = 1023;
+
+/// @brief A growable buffer of anonymous memory addressed by offsets,
+/// since growing it may move it.
+struct MappedArena {
+  char* data;
+  size_t size;
+  size_t capacity;
+};
+
+/// @brief The first row of a block of the compact line table.
+struct LineTableBlock {
+  uint64_t address;
+  uint32_t offset;
+  uint32_t reserved;
+};
+
+struct LineTableFunction {
+  uint64_t address;
+  uint32_t size;
+  /// @brief The index of the mangled name in the sorted symbol names.
+  uint32_t name;
+};
+
+/// @brief The part of the line table which belongs to a loaded ELF image.
+/// The addresses are the virtual addresses inside the image, the offsets
+/// point inside line_table.
+struct LineTableModule {
+  uintptr_t bias;
+  uintptr_t low;
+  uintptr_t high;
+  size_t blocks;
+  unsigned block_count;
+  unsigned row_count;
+  size_t data;
+  size_t files;
+  unsigned file_count;
+  size_t functions;
+  unsigned function_count;
+  size_t name_blocks;
+  size_t name_data;
+  unsigned name_count;
+};
+
+/// @brief A decoded row of a DWARF line program.
+struct LineRow {
+  uint64_t address;
+  uint32_t file;
+  /// @brief 0 marks the end of a sequence.
+  uint32_t line;
+  uint32_t order;
+  /// @brief The index of the unit in .debug_line.
+  uint32_t unit;
+};
+
+struct SymbolRow {
+  uint64_t address;
+  uint32_t size;
+  uint32_t name;
+  uint32_t rank;
+  uint32_t order;
+};
+
+struct SymbolName {
+  const char* name;
+  uint32_t function;
+};
+
+static LineTableModule line_table_modules[kMaxLineTableModules];
+static int line_table_module_count = 0;
+static MappedArena line_table = { NULL, 0, 0 };
+
+/// @brief Reserves size bytes at the end of the arena, aligned to the
+/// lowest set bit of size (at most 8), so that the consecutive
+/// allocations of the same type form an array.
+/// @return The pointer to the reserved bytes, valid until the next call,
+/// or NULL if the arena cannot grow.
+static char* ArenaAlloc(MappedArena* arena, size_t size, size_t* offset) {
+  size_t alignment = size & (~size + 1);
+  if (alignment == 0 || alignment > 8) {
+    alignment = 8;
+  }
+  arena->size = (arena->size + alignment - 1) & ~(alignment - 1);
+  if (arena->size + size > arena->capacity) {
+    size_t capacity = arena->capacity == 0? 1 << 20 : arena->capacity;
+    while (capacity < arena->size + size) {
+      capacity *= 2;
+    }
+    void* data = arena->data == NULL?
+        mmap(NULL, capacity, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) :
+        mremap(arena->data, arena->capacity, capacity, MREMAP_MAYMOVE);
+    if (data == MAP_FAILED) {
+      return NULL;
+    }
+    arena->data = reinterpret_cast<char*>(data);
+    arena->capacity = capacity;
+  }
+  if (offset != NULL) {
+    *offset = arena->size;
+  }
+  arena->size += size;
+  return arena->data + arena->size - size;
+}
+
+static void ArenaFree(MappedArena* arena) {
+  if (arena->data != NULL) {
+    munmap(arena->data, arena->capacity);
+  }
+  arena->data = NULL;
+  arena->size = 0;
+  arena->capacity = 0;
+}
+
+/// @brief Reads the DWARF encoded values; any read past the end sets error.
+struct DwarfReader {
+  const unsigned char* pos;
+  const unsigned char* end;
+  bool error;
+
+  uint64_t Fixed(int size) {
+    if (end - pos < size) {
+      error = true;
+      pos = end;
+      return 0;
+    }
+    uint64_t value = 0;
+    for (int i = 0; i < size; i++) {
+      value |= static_cast<uint64_t>(pos[i]) << (i * 8);
+    }
+    pos += size;
+    return value;
+  }
+
+  uint64_t Uleb() {
+    uint64_t value = 0;
+    for (int shift = 0; pos < end; shift += 7) {
+      unsigned char byte = *pos++;
+      if (shift < 64) {
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      }
+      if ((byte & 0x80) == 0) {
+        return value;
+      }
+    }
+    error = true;
+    return value;
+  }
+
+  int64_t Sleb() {
+    int64_t value = 0;
+    for (int shift = 0; pos < end; shift += 7) {
+      unsigned char byte = *pos++;
+      if (shift < 64) {
+        value |= static_cast<int64_t>(byte & 0x7f) << shift;
+      }
+      if ((byte & 0x80) == 0) {
+        if (shift + 7 < 64 && (byte & 0x40)) {
+          value |= -(static_cast<int64_t>(1) << (shift + 7));
+        }
+        return value;
+      }
+    }
+    error = true;
+    return value;
+  }
+
+  const char* String() {
+    const char* str = reinterpret_cast<const char*>(pos);
+    while (pos < end && *pos != 0) {
+      pos++;
+    }
+    if (pos == end) {
+      error = true;
+      return "";
+    }
+    pos++;
+    return str;
+  }
+
+  void Skip(uint64_t size) {
+    if (static_cast<uint64_t>(end - pos) < size) {
+      error = true;
+      pos = end;
+    } else {
+      pos += size;
+    }
+  }
+};
+
+/// @brief The sections of an ELF image needed to build its line table.
+struct DwarfSections {
+  const unsigned char* line;
+  size_t line_size;
+  const char* line_str;
+  size_t line_str_size;
+  const char* str;
+  size_t str_size;
+};
+
+/// @brief The state of the line table construction of a single image.
+struct LineTableBuilder {
+  DwarfSections sections;
+  /// @brief The index of the unit being decoded.
+  uint32_t unit;
+  MappedArena rows;
+  /// @brief The current unit's directories (const char*) and files (global
+  /// file indices).
+  MappedArena unit_directories;
+  MappedArena unit_files;
+  /// @brief The open addressing hash table of the interned file names,
+  /// each bucket keeps the file index + 1.
+  MappedArena file_buckets;
+  /// @brief The arena the file names are copied to, line_table unless
+  /// the units are decoded in parallel.
+  MappedArena* names;
+  /// @brief The offsets of the file names inside names.
+  MappedArena file_names;
+  unsigned file_count;
+  bool error;
+};
+
+static uint32_t HashFileName(const char* name) {
+  uint32_t hash = 2166136261U;
+  for (; *name != 0; name++) {
+    hash = (hash ^ static_cast<unsigned char>(*name)) * 16777619U;
+  }
+  return hash;
+}
+
+/// @brief Returns the index of the file name "directory/name", adding it
+/// to builder->names if needed.
+static uint32_t InternFileName(LineTableBuilder* builder,
+                               const char* directory, const char* name) {
+  char path[PATH_MAX];
+  path[0] = 0;
+  if (name[0] != '/' && directory != NULL && directory[0] != 0) {
+    strncat(path, directory, sizeof(path) - 2);
+    strcat(path, "/");  // NOLINT(runtime/printf)
+  }
+  strncat(path, name, sizeof(path) - strlen(path) - 1);
+  uint32_t* buckets = reinterpret_cast<uint32_t*>(
+      builder->file_buckets.data);
+  const uint32_t* names = reinterpret_cast<const uint32_t*>(
+      builder->file_names.data);
+  uint32_t bucket = HashFileName(path) & (kFileNameBuckets - 1);
+  for (; buckets[bucket] != 0; bucket = (bucket + 1) & (kFileNameBuckets - 1)) {
+    if (!strcmp(builder->names->data + names[buckets[bucket] - 1], path)) {
+      return buckets[bucket] - 1;
+    }
+  }
+  size_t offset;
+  char* copy = builder->file_count < kFileNameBuckets / 2?
+      ArenaAlloc(builder->names, strlen(path) + 1, &offset) : NULL;
+  uint32_t* name_offset = copy == NULL? NULL : reinterpret_cast<uint32_t*>(
+      ArenaAlloc(&builder->file_names, sizeof(uint32_t), NULL));
+  if (name_offset == NULL) {
+    builder->error = true;
+    return 0;
+  }
+  strcpy(copy, path);  // NOLINT(runtime/printf)
+  *name_offset = offset;
+  buckets[bucket] = ++builder->file_count;
+  return builder->file_count - 1;
+}
+
+/// @brief Reads an attribute of a DWARF 5 directory or file entry.
+static void ReadLineForm(DwarfReader* reader, uint64_t form, bool dwarf64,
+                         const DwarfSections& sections, uint64_t* number,
+                         const char** string) {
+  *number = 0;
+  *string = NULL;
+  switch (form) {
+    case kDwFormString:
+      *string = reader->String();
+      break;
+    case kDwFormStrp:
+    case kDwFormLineStrp: {
+      uint64_t offset = reader->Fixed(dwarf64? 8 : 4);
+      const char* base = form == kDwFormStrp?
+          sections.str : sections.line_str;
+      size_t size = form == kDwFormStrp?
+          sections.str_size : sections.line_str_size;
+      if (base != NULL && offset < size) {
+        *string = base + offset;
+      }
+      break;
+    }
+    case kDwFormUdata:
+      *number = reader->Uleb();
+      break;
+    case kDwFormData1:
+      *number = reader->Fixed(1);
+      break;
+    case kDwFormData2:
+      *number = reader->Fixed(2);
+      break;
+    case kDwFormData4:
+      *number = reader->Fixed(4);
+      break;
+    case kDwFormData8:
+      *number = reader->Fixed(8);
+      break;
+    case kDwFormData16:
+      reader->Skip(16);
+      break;
+    case kDwFormBlock:
+      reader->Skip(reader->Uleb());
+      break;
+    default:
+      reader->error = true;
+      break;
+  }
+}
+
+/// @brief Reads a DWARF 5 directory or file table: the directories are
+/// appended to unit_directories, the files are interned into unit_files.
+static void ReadEntryTable(DwarfReader* reader, bool dwarf64, bool files,
+                           LineTableBuilder* builder) {
+  uint64_t formats[32];
+  unsigned format_count = reader->Fixed(1);
+  if (format_count > 16) {
+    reader->error = true;
+    return;
+  }
+  for (unsigned i = 0; i < format_count * 2; i++) {
+    formats[i] = reader->Uleb();
+  }
+  uint64_t count = reader->Uleb();
+  for (uint64_t i = 0; i < count && !reader->error; i++) {
+    const char* path = "";
+    uint64_t directory = 0;
+    for (unsigned j = 0; j < format_count; j++) {
+      uint64_t number;
+      const char* string;
+      ReadLineForm(reader, formats[j * 2 + 1], dwarf64, builder->sections,
+                   &number, &string);
+      if (formats[j * 2] == kDwLnctPath && string != NULL) {
+        path = string;
+      } else if (formats[j * 2] == kDwLnctDirectoryIndex) {
+        directory = number;
+      }
+    }
+    if (!files) {
+      const char** entry = reinterpret_cast<const char**>(ArenaAlloc(
+          &builder->unit_directories, sizeof(const char*), NULL));
+      if (entry == NULL) {
+        builder->error = true;
+        return;
+      }
+      *entry = path;
+      continue;
+    }
+    const char** directories = reinterpret_cast<const char**>(
+        builder->unit_directories.data);
+    size_t directory_count = builder->unit_directories.size / sizeof(path);
+    uint32_t file = InternFileName(
+        builder, directory < directory_count? directories[directory] : NULL,
+        path);
+    uint32_t* entry = reinterpret_cast<uint32_t*>(ArenaAlloc(
+        &builder->unit_files, sizeof(uint32_t), NULL));
+    if (entry == NULL) {
+      builder->error = true;
+      return;
+    }
+    *entry = file;
+  }
+}
+
+static void AppendLineRow(LineTableBuilder* builder, uint64_t address,
+                          uint64_t file, uint64_t line) {
+  LineRow* row = reinterpret_cast<LineRow*>(
+      ArenaAlloc(&builder->rows, sizeof(LineRow), NULL));
+  if (row == NULL) {
+    builder->error = true;
+    return;
+  }
+  size_t file_count = builder->unit_files.size / sizeof(uint32_t);
+  row->address = address;
+  row->file = file < file_count?
+      reinterpret_cast<uint32_t*>(builder->unit_files.data)[file] : 0;
+  row->line = line;
+  row->order = builder->rows.size / sizeof(LineRow);
+  row->unit = builder->unit;
+}
+
+/// @brief Runs the line number program of a unit, appending the rows
+/// to builder->rows.
+static void DecodeLineProgram(DwarfReader* unit, bool dwarf64,
+                              LineTableBuilder* builder) {
+  unsigned version = unit->Fixed(2);
+  if (version < 2 || version > 5) {
+    return;
+  }
+  unsigned address_size = sizeof(void*);
+  if (version >= 5) {
+    address_size = unit->Fixed(1);
+    unit->Fixed(1);  // segment selector size
+  }
+  uint64_t header_length = unit->Fixed(dwarf64? 8 : 4);
+  DwarfReader program = { unit->pos, unit->end, false };
+  program.Skip(header_length);
+  unsigned min_instruction_length = unit->Fixed(1);
+  if (version >= 4) {
+    unit->Fixed(1);  // maximum operations per instruction
+  }
+  unit->Fixed(1);  // default is_stmt
+  int line_base = static_cast<signed char>(unit->Fixed(1));
+  unsigned line_range = unit->Fixed(1);
+  unsigned opcode_base = unit->Fixed(1);
+  const unsigned char* opcode_lengths = unit->pos;
+  if (line_range == 0 || opcode_base == 0) {
+    return;
+  }
+  unit->Skip(opcode_base - 1);
+
+  builder->unit_directories.size = 0;
+  builder->unit_files.size = 0;
+  if (version >= 5) {
+    ReadEntryTable(unit, dwarf64, false, builder);
+    ReadEntryTable(unit, dwarf64, true, builder);
+  } else {
+    // The compilation directory is only known from .debug_info
+    const char** entry = reinterpret_cast<const char**>(ArenaAlloc(
+        &builder->unit_directories, sizeof(const char*), NULL));
+    uint32_t* file = reinterpret_cast<uint32_t*>(ArenaAlloc(
+        &builder->unit_files, sizeof(uint32_t), NULL));
+    if (entry == NULL || file == NULL) {
+      builder->error = true;
+      return;
+    }
+    *entry = "";
+    *file = 0;
+    for (const char* path = unit->String(); path[0] != 0;
+         path = unit->String()) {
+      entry = reinterpret_cast<const char**>(ArenaAlloc(
+          &builder->unit_directories, sizeof(const char*), NULL));
+      if (entry == NULL) {
+        builder->error = true;
+        return;
+      }
+      *entry = path;
+    }
+    for (const char* path = unit->String(); path[0] != 0;
+         path = unit->String()) {
+      uint64_t directory = unit->Uleb();
+      unit->Uleb();  // modification time
+      unit->Uleb();  // length
+      const char** directories = reinterpret_cast<const char**>(
+          builder->unit_directories.data);
+      size_t directory_count = builder->unit_directories.size / sizeof(path);
+      file = reinterpret_cast<uint32_t*>(ArenaAlloc(
+          &builder->unit_files, sizeof(uint32_t), NULL));
+      if (file == NULL) {
+        builder->error = true;
+        return;
+      }
+      // Interning may have moved unit_files
+      uint32_t index = InternFileName(
+          builder, directory < directory_count? directories[directory] : NULL,
+          path);
+      reinterpret_cast<uint32_t*>(builder->unit_files.data)[
+          builder->unit_files.size / sizeof(uint32_t) - 1] = index;
+    }
+  }
+  if (unit->error || builder->error) {
+    return;
+  }
+
+  uint64_t address = 0;
+  uint64_t file = 1;
+  int64_t line = 1;
+  size_t sequence_start = builder->rows.size;
+  bool sequence_at_zero = false;
+  while (program.pos < program.end && !program.error && !builder->error) {
+    unsigned opcode = *program.pos++;
+    bool append = false;
+    if (opcode >= opcode_base) {
+      unsigned adjusted = opcode - opcode_base;
+      address += (adjusted / line_range) * min_instruction_length;
+      line += line_base + static_cast<int>(adjusted % line_range);
+      append = true;
+    } else if (opcode == 0) {
+      uint64_t length = program.Uleb();
+      const unsigned char* next = program.pos + length;
+      if (length == 0 || static_cast<uint64_t>(program.end - program.pos) <
+          length) {
+        break;
+      }
+      unsigned extended = *program.pos++;
+      if (extended == kDwLneEndSequence) {
+        AppendLineRow(builder, address, file, 0);
+        // Discarded functions are left at address 0
+        if (sequence_at_zero) {
+          builder->rows.size = sequence_start;
+        }
+        sequence_start = builder->rows.size;
+        sequence_at_zero = false;
+        address = 0;
+        file = 1;
+        line = 1;
+      } else if (extended == kDwLneSetAddress) {
+        address = program.Fixed(address_size);
+        if (builder->rows.size == sequence_start) {
+          sequence_at_zero = address == 0;
+        }
+      }
+      program.pos = next;
+    } else if (opcode == kDwLnsCopy) {
+      append = true;
+    } else if (opcode == kDwLnsAdvancePc) {
+      address += program.Uleb() * min_instruction_length;
+    } else if (opcode == kDwLnsAdvanceLine) {
+      line += program.Sleb();
+    } else if (opcode == kDwLnsSetFile) {
+      file = program.Uleb();
+    } else if (opcode == kDwLnsConstAddPc) {
+      address += ((255 - opcode_base) / line_range) * min_instruction_length;
+    } else if (opcode == kDwLnsFixedAdvancePc) {
+      address += program.Fixed(2);
+    } else {
+      for (unsigned i = 0; i < opcode_lengths[opcode - 1]; i++) {
+        program.Uleb();
+      }
+    }
+    // Line 0 marks the code without a source location
+    if (append) {
+      AppendLineRow(builder, address, file, line > 0? line : 0);
+    }
+  }
+}
+
+static int CompareLineRows(const void* a, const void* b) {
+  const LineRow* left = reinterpret_cast<const LineRow*>(a);
+  const LineRow* right = reinterpret_cast<const LineRow*>(b);
+  if (left->address != right->address) {
+    return left->address < right->address? -1 : 1;
+  }
+  // The end of a sequence yields to the start of the next one
+  if ((left->line == 0) != (right->line == 0)) {
+    return left->line == 0? -1 : 1;
+  }
+  if (left->unit != right->unit) {
+    return left->unit < right->unit? -1 : 1;
+  }
+  return left->order < right->order? -1 : 1;
+}
+
+static int CompareSymbolRows(const void* a, const void* b) {
+  const SymbolRow* left = reinterpret_cast<const SymbolRow*>(a);
+  const SymbolRow* right = reinterpret_cast<const SymbolRow*>(b);
+  if (left->address != right->address) {
+    return left->address < right->address? -1 : 1;
+  }
+  if (left->rank != right->rank) {
+    return left->rank < right->rank? -1 : 1;
+  }
+  return left->order < right->order? -1 : 1;
+}
+
+static int CompareSymbolNames(const void* a, const void* b) {
+  const SymbolName* left = reinterpret_cast<const SymbolName*>(a);
+  const SymbolName* right = reinterpret_cast<const SymbolName*>(b);
+  int result = strncmp(left->name, right->name, kMaxSymbolNameLength);
+  if (result != 0) {
+    return result;
+  }
+  return left->function < right->function? -1 : 1;
+}
+
+static void AppendUleb(char* data, size_t* size, uint64_t value) {
+  do {
+    unsigned char byte = value & 0x7f;
+    value >>= 7;
+    data[(*size)++] = byte | (value != 0? 0x80 : 0);
+  } while (value != 0);
+}
+
+static void AppendSleb(char* data, size_t* size, int64_t value) {
+  bool more = true;
+  while (more) {
+    unsigned char byte = value & 0x7f;
+    value >>= 7;
+    more = !((value == 0 && !(byte & 0x40)) || (value == -1 && (byte & 0x40)));
+    data[(*size)++] = byte | (more? 0x80 : 0);
+  }
+}
+
+/// @brief Encodes the sorted rows into line_table: every
+/// kLineTableBlockRows rows start a block indexed by its first address,
+/// the rest store the deltas from the previous row.
+static bool EncodeLineRows(LineRow* rows, size_t count,
+                           LineTableModule* module) {
+  // Only the last row at each address matters, and only the rows
+  // which change the location
+  size_t kept = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (i + 1 < count && rows[i + 1].address == rows[i].address) {
+      continue;
+    }
+    if (kept > 0 && rows[kept - 1].file == rows[i].file &&
+        rows[kept - 1].line == rows[i].line) {
+      continue;
+    }
+    rows[kept++] = rows[i];
+  }
+  module->row_count = kept;
+  module->block_count = (kept + kLineTableBlockRows - 1) / kLineTableBlockRows;
+  if (ArenaAlloc(&line_table, module->block_count * sizeof(LineTableBlock),
+                 &module->blocks) == NULL ||
+      ArenaAlloc(&line_table, kept * 3 * 10, &module->data) == NULL) {
+    return false;
+  }
+  LineTableBlock* blocks = reinterpret_cast<LineTableBlock*>(
+      line_table.data + module->blocks);
+  char* data = line_table.data + module->data;
+  size_t size = 0;
+  for (size_t i = 0; i < kept; i++) {
+    if (i % kLineTableBlockRows == 0) {
+      blocks[i / kLineTableBlockRows].address = rows[i].address;
+      blocks[i / kLineTableBlockRows].offset = size;
+      AppendUleb(data, &size, rows[i].file);
+      AppendUleb(data, &size, rows[i].line);
+      continue;
+    }
+    bool file_changed = rows[i].file != rows[i - 1].file;
+    AppendUleb(data, &size,
+               ((rows[i].address - rows[i - 1].address) << 1) | file_changed);
+    if (file_changed) {
+      AppendUleb(data, &size, rows[i].file);
+    }
+    AppendSleb(data, &size, static_cast<int64_t>(rows[i].line) -
+               static_cast<int64_t>(rows[i - 1].line));
+  }
+  // Give back the unused part of the reservation
+  line_table.size = module->data + ((size + 7) & ~static_cast<size_t>(7));
+  return true;
+}
+
+/// @brief The bounds of a unit of .debug_line.
+struct LineUnit {
+  const unsigned char* begin;
+  const unsigned char* end;
+  bool dwarf64;
+};
+
+/// @brief Splits .debug_line into units, stopping at the first malformed
+/// one.
+/// @return false if the arena cannot grow.
+static bool CollectLineUnits(const DwarfSections& sections,
+                             MappedArena* units) {
+  DwarfReader reader = { sections.line, sections.line + sections.line_size,
+                         false };
+  while (reader.pos < reader.end) {
+    uint64_t length = reader.Fixed(4);
+    bool dwarf64 = length == 0xffffffff;
+    if (dwarf64) {
+      length = reader.Fixed(8);
+    }
+    if (reader.error ||
+        static_cast<uint64_t>(reader.end - reader.pos) < length) {
+      break;
+    }
+    LineUnit* unit = reinterpret_cast<LineUnit*>(
+        ArenaAlloc(units, sizeof(LineUnit), NULL));
+    if (unit == NULL) {
+      return false;
+    }
+    unit->begin = reader.pos;
+    unit->end = reader.pos + length;
+    unit->dwarf64 = dwarf64;
+    reader.pos += length;
+  }
+  return true;
+}
+
+static bool InitLineTableBuilder(const DwarfSections& sections,
+                                 MappedArena* names,
+                                 LineTableBuilder* builder) {
+  memset(builder, 0, sizeof(*builder));
+  builder->sections = sections;
+  builder->names = names;
+  if (ArenaAlloc(&builder->file_buckets, kFileNameBuckets * sizeof(uint32_t),
+                 NULL) == NULL) {
+    return false;
+  }
+  memset(builder->file_buckets.data, 0, builder->file_buckets.size);
+  return true;
+}
+
+static void FreeLineTableBuilder(LineTableBuilder* builder) {
+  ArenaFree(&builder->rows);
+  ArenaFree(&builder->unit_directories);
+  ArenaFree(&builder->unit_files);
+  ArenaFree(&builder->file_buckets);
+  ArenaFree(&builder->file_names);
+}
+
+static void DecodeLineUnit(const LineUnit& unit, uint32_t index,
+                           LineTableBuilder* builder) {
+  DwarfReader reader = { unit.begin, unit.end, false };
+  builder->unit = index;
+  DecodeLineProgram(&reader, unit.dwarf64, builder);
+}
+
+/// @brief Decodes the units one by one and sorts the rows.
+static bool DecodeLineUnitsInOrder(const LineUnit* units, size_t count,
+                                   LineTableBuilder* builder) {
+  for (size_t i = 0; i < count && !builder->error; i++) {
+    DecodeLineUnit(units[i], i, builder);
+  }
+  qsort(builder->rows.data, builder->rows.size / sizeof(LineRow),
+        sizeof(LineRow), CompareLineRows);
+  return !builder->error;
+}
+
+/// @brief The state of a thread which decodes a share of the units.
+struct LineTableWorker {
+  /// @brief Interns the file names into names instead of line_table.
+  LineTableBuilder builder;
+  MappedArena names;
+  /// @brief The first (low half) and the end (high half) of the units left
+  /// to this worker; it takes them from the front, the idle workers steal
+  /// them from the back.
+  uint64_t range;
+  const LineUnit* units;
+  LineTableWorker* workers;
+  int worker_count;
+  int index;
+  pthread_t thread;
+  bool started;
+};
+
+static uint64_t PackLineUnitRange(uint32_t first, uint32_t end) {
+  return first | (static_cast<uint64_t>(end) << 32);
+}
+
+/// @brief Takes the next unit of the worker's own range or, if it is
+/// exhausted, steals the last unit of another worker's range.
+/// @return false if no units are left.
+static bool TakeLineUnit(LineTableWorker* worker, uint32_t* unit) {
+  for (int i = 0; i < worker->worker_count; i++) {
+    LineTableWorker* victim =
+        worker->workers + (worker->index + i) % worker->worker_count;
+    for (;;) {
+      uint64_t range = __atomic_load_n(&victim->range, __ATOMIC_ACQUIRE);
+      uint32_t first = range, end = range >> 32;
+      if (first >= end) {
+        break;
+      }
+      uint64_t rest = victim == worker?
+          PackLineUnitRange(first + 1, end) :
+          PackLineUnitRange(first, end - 1);
+      if (__sync_bool_compare_and_swap(&victim->range, range, rest)) {
+        *unit = victim == worker? first : end - 1;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+static void* DecodeLineUnitsInWorker(void* arg) {
+  LineTableWorker* worker = reinterpret_cast<LineTableWorker*>(arg);
+  uint32_t unit;
+  while (!worker->builder.error && TakeLineUnit(worker, &unit)) {
+    DecodeLineUnit(worker->units[unit], unit, &worker->builder);
+  }
+  qsort(worker->builder.rows.data,
+        worker->builder.rows.size / sizeof(LineRow), sizeof(LineRow),
+        CompareLineRows);
+  return NULL;
+}
+
+static const LineRow* NextLineRow(const LineTableWorker& worker,
+                                  size_t next) {
+  return reinterpret_cast<const LineRow*>(worker.builder.rows.data) + next;
+}
+
+/// @brief Restores the order of the heap of workers by their next rows.
+static void SiftLineRowHeap(const LineTableWorker* workers,
+                            const size_t* next, int* heap, int size,
+                            int i) {
+  for (;;) {
+    int smallest = i;
+    for (int child = 2 * i + 1; child <= 2 * i + 2 && child < size;
+         child++) {
+      if (CompareLineRows(
+              NextLineRow(workers[heap[child]], next[heap[child]]),
+              NextLineRow(workers[heap[smallest]], next[heap[smallest]])) <
+          0) {
+        smallest = child;
+      }
+    }
+    if (smallest == i) {
+      return;
+    }
+    int swapped = heap[i];
+    heap[i] = heap[smallest];
+    heap[smallest] = swapped;
+    i = smallest;
+  }
+}
+
+/// @brief Merges the sorted rows of the workers into builder->rows,
+/// translating their file indices into those of builder.
+static void MergeLineRows(LineTableWorker* workers, int count,
+                          LineTableBuilder* builder) {
+  size_t total = 0;
+  int heap[kMaxLineTableThreads];
+  size_t next[kMaxLineTableThreads];
+  int heap_size = 0;
+  for (int i = 0; i < count; i++) {
+    // The name offsets are not needed anymore, so they are replaced with
+    // the file indices of builder
+    uint32_t* files = reinterpret_cast<uint32_t*>(
+        workers[i].builder.file_names.data);
+    for (unsigned j = 0; j < workers[i].builder.file_count; j++) {
+      files[j] = InternFileName(builder, NULL,
+                                workers[i].names.data + files[j]);
+    }
+    size_t rows = workers[i].builder.rows.size / sizeof(LineRow);
+    total += rows;
+    next[i] = 0;
+    if (rows > 0) {
+      heap[heap_size++] = i;
+    }
+  }
+  LineRow* merged = reinterpret_cast<LineRow*>(
+      ArenaAlloc(&builder->rows, total * sizeof(LineRow), NULL));
+  if (builder->error || merged == NULL) {
+    builder->error = true;
+    return;
+  }
+  for (int i = heap_size / 2 - 1; i >= 0; i--) {
+    SiftLineRowHeap(workers, next, heap, heap_size, i);
+  }
+  for (size_t i = 0; i < total; i++) {
+    const LineTableWorker& worker = workers[heap[0]];
+    merged[i] = *NextLineRow(worker, next[heap[0]]);
+    const uint32_t* files = reinterpret_cast<const uint32_t*>(
+        worker.builder.file_names.data);
+    merged[i].file = merged[i].file < worker.builder.file_count?
+        files[merged[i].file] : 0;
+    if (++next[heap[0]] == worker.builder.rows.size / sizeof(LineRow)) {
+      heap[0] = heap[--heap_size];
+    }
+    SiftLineRowHeap(workers, next, heap, heap_size, 0);
+  }
+}
+
+/// @brief Decodes the units with thread_count threads, including the
+/// calling one, and merges their sorted rows into builder->rows.
+/// @details Each thread starts with a contiguous range of units of about
+/// the same size in bytes; the ones which finish early steal the units
+/// left to the others, so that a few huge units do not serialize the work.
+static bool DecodeLineUnitsInParallel(const LineUnit* units, size_t count,
+                                      int thread_count,
+                                      LineTableBuilder* builder) {
+  LineTableWorker workers[kMaxLineTableThreads];
+  uint64_t total = units[count - 1].end - units[0].begin;
+  uint32_t first = 0;
+  bool result = true;
+  for (int i = 0; i < thread_count; i++) {
+    LineTableWorker& worker = workers[i];
+    memset(&worker, 0, sizeof(worker));
+    uint64_t bound = total * (i + 1) / thread_count;
+    uint32_t end = first;
+    while (end < count && (i == thread_count - 1 ||
+        static_cast<uint64_t>(units[end].end - units[0].begin) <= bound)) {
+      end++;
+    }
+    worker.range = PackLineUnitRange(first, end);
+    first = end;
+    worker.units = units;
+    worker.workers = workers;
+    worker.worker_count = thread_count;
+    worker.index = i;
+    if (!InitLineTableBuilder(builder->sections, &worker.names,
+                              &worker.builder)) {
+      result = false;
+    }
+  }
+  if (result) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_INHERIT_SCHED);
+    // The units of the workers which could not be started are stolen
+    for (int i = 1; i < thread_count; i++) {
+      workers[i].started = pthread_create(
+          &workers[i].thread, &attr, DecodeLineUnitsInWorker,
+          &workers[i]) == 0;
+    }
+    pthread_attr_destroy(&attr);
+    DecodeLineUnitsInWorker(&workers[0]);
+    for (int i = 1; i < thread_count; i++) {
+      if (workers[i].started) {
+        pthread_join(workers[i].thread, NULL);
+      }
+    }
+    for (int i = 0; i < thread_count; i++) {
+      result = result && !workers[i].builder.error;
+    }
+  }
+  if (result) {
+    MergeLineRows(workers, thread_count, builder);
+    result = !builder->error;
+  }
+  for (int i = 0; i < thread_count; i++) {
+    FreeLineTableBuilder(&workers[i].builder);
+    ArenaFree(&workers[i].names);
+  }
+  return result;
+}
+
+/// @brief Collects the function symbols of the image, sorted by address,
+/// into line_table. The unique mangled names are sorted and front-coded:
+/// every kSymbolNameBlockNames names start a block with the full name,
+/// the rest store the length of the prefix shared with the previous name
+/// and the remaining suffix.
+static bool IndexFunctions(const ElfW(Sym)* symbols, size_t symbol_count,
+                           const char* names, size_t names_size,
+                           LineTableModule* module) {
+  MappedArena rows = { NULL, 0, 0 };
+  for (size_t i = 0; i < symbol_count; i++) {
+    const ElfW(Sym)& symbol = symbols[i];
+    // st_info is encoded the same way in both ELF classes
+    int type = ELF32_ST_TYPE(symbol.st_info);
+    if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+        symbol.st_shndx == SHN_UNDEF || symbol.st_value == 0 ||
+        symbol.st_size == 0 || symbol.st_name >= names_size) {
+      continue;
+    }
+    SymbolRow* row = reinterpret_cast<SymbolRow*>(
+        ArenaAlloc(&rows, sizeof(SymbolRow), NULL));
+    if (row == NULL) {
+      ArenaFree(&rows);
+      return false;
+    }
+    int binding = ELF32_ST_BIND(symbol.st_info);
+    row->address = symbol.st_value;
+    row->size = symbol.st_size;
+    row->name = symbol.st_name;
+    row->rank = binding == STB_GLOBAL? 0 : binding == STB_WEAK? 1 : 2;
+    row->order = i;
+  }
+  SymbolRow* sorted = reinterpret_cast<SymbolRow*>(rows.data);
+  size_t count = rows.size / sizeof(SymbolRow);
+  qsort(sorted, count, sizeof(SymbolRow), CompareSymbolRows);
+  size_t kept = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (kept == 0 || sorted[kept - 1].address != sorted[i].address) {
+      sorted[kept++] = sorted[i];
+    }
+  }
+  module->function_count = kept;
+  if (kept == 0) {
+    ArenaFree(&rows);
+    return true;
+  }
+  MappedArena name_rows = { NULL, 0, 0 };
+  SymbolName* by_name = ArenaAlloc(
+      &line_table, kept * sizeof(LineTableFunction),
+      &module->functions) == NULL? NULL : reinterpret_cast<SymbolName*>(
+          ArenaAlloc(&name_rows, kept * sizeof(SymbolName), NULL));
+  if (by_name == NULL) {
+    ArenaFree(&rows);
+    ArenaFree(&name_rows);
+    return false;
+  }
+  for (size_t i = 0; i < kept; i++) {
+    LineTableFunction* function = reinterpret_cast<LineTableFunction*>(
+        line_table.data + module->functions) + i;
+    function->address = sorted[i].address;
+    function->size = sorted[i].size;
+    by_name[i].name = names + sorted[i].name;
+    by_name[i].function = i;
+  }
+  ArenaFree(&rows);
+  qsort(by_name, kept, sizeof(SymbolName), CompareSymbolNames);
+
+  // A shared prefix takes at most 2 bytes
+  size_t unique = 0, bound = 0;
+  for (size_t i = 0; i < kept; i++) {
+    if (i == 0 || strncmp(by_name[i - 1].name, by_name[i].name,
+                          kMaxSymbolNameLength)) {
+      unique++;
+      bound += strnlen(by_name[i].name, kMaxSymbolNameLength) + 3;
+    }
+  }
+  module->name_count = unique;
+  size_t block_count = (unique + kSymbolNameBlockNames - 1) /
+      kSymbolNameBlockNames;
+  bool result = ArenaAlloc(&line_table, block_count * sizeof(uint32_t),
+                           &module->name_blocks) != NULL &&
+      ArenaAlloc(&line_table, bound, &module->name_data) != NULL;
+  if (result) {
+    LineTableFunction* functions = reinterpret_cast<LineTableFunction*>(
+        line_table.data + module->functions);
+    uint32_t* blocks = reinterpret_cast<uint32_t*>(
+        line_table.data + module->name_blocks);
+    char* data = line_table.data + module->name_data;
+    size_t size = 0;
+    const char* previous = NULL;
+    size_t previous_length = 0;
+    uint32_t index = 0;
+    for (size_t i = 0; i < kept; i++) {
+      const char* name = by_name[i].name;
+      if (previous == NULL ||
+          strncmp(previous, name, kMaxSymbolNameLength)) {
+        index += previous != NULL;
+        size_t length = strnlen(name, kMaxSymbolNameLength);
+        size_t prefix = 0;
+        if (index % kSymbolNameBlockNames == 0) {
+          blocks[index / kSymbolNameBlockNames] = size;
+        } else {
+          while (prefix < length && prefix < previous_length &&
+                 name[prefix] == previous[prefix]) {
+            prefix++;
+          }
+          AppendUleb(data, &size, prefix);
+        }
+        memcpy(data + size, name + prefix, length - prefix);
+        size += length - prefix;
+        data[size++] = 0;
+        previous = name;
+        previous_length = length;
+      }
+      functions[by_name[i].function].name = index;
+    }
+    line_table.size = module->name_data + size;
+  }
+  ArenaFree(&name_rows);
+  return result;
+}
+
+/// @brief Maps the ELF file at path and checks its section headers.
+/// @return NULL on failure, otherwise the mapping of *size bytes.
+static const ElfW(Ehdr)* MapElfFile(const char* path, size_t* size) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  void* file = fstat(fd, &st) == 0 && st.st_size > 0?
+      mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (file == MAP_FAILED) {
+    return NULL;
+  }
+  *size = st.st_size;
+  const ElfW(Ehdr)* ehdr = reinterpret_cast<const ElfW(Ehdr)*>(file);
+  const int elf_class = sizeof(void*) == 8? ELFCLASS64 : ELFCLASS32;
+  if (*size < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+      ehdr->e_ident[EI_CLASS] != elf_class ||
+      ehdr->e_shoff == 0 || ehdr->e_shstrndx >= ehdr->e_shnum ||
+      ehdr->e_shoff + ehdr->e_shnum * sizeof(ElfW(Shdr)) > *size) {
+    munmap(file, *size);
+    return NULL;
+  }
+  return ehdr;
+}
+
+/// @brief Indexes the line programs and the function symbols of the ELF
+/// file at path into line_table.
+/// @param threads The number of threads to decode the line programs with.
+static bool IndexImage(const char* path, int threads,
+                       LineTableModule* module) {
+  size_t image_size;
+  const ElfW(Ehdr)* ehdr = MapElfFile(path, &image_size);
+  if (ehdr == NULL) {
+    return false;
+  }
+  const char* image = reinterpret_cast<const char*>(ehdr);
+  const ElfW(Shdr)* shdrs = reinterpret_cast<const ElfW(Shdr)*>(
+      image + ehdr->e_shoff);
+  const char* section_names = image + shdrs[ehdr->e_shstrndx].sh_offset;
+  DwarfSections sections;
+  memset(&sections, 0, sizeof(sections));
+  const ElfW(Shdr)* symtab = NULL;
+  const ElfW(Shdr)* dynsym = NULL;
+  for (int i = 0; i < ehdr->e_shnum; i++) {
+    const ElfW(Shdr)& shdr = shdrs[i];
+    if (shdr.sh_type == SHT_NOBITS ||
+        shdr.sh_offset + shdr.sh_size > image_size) {
+      continue;
+    }
+    const char* name = section_names + shdr.sh_name;
+    const char* data = image + shdr.sh_offset;
+    // Compressed debug sections are not supported
+    if (shdr.sh_flags & SHF_COMPRESSED) {
+      continue;
+    }
+    if (!strcmp(name, ".debug_line")) {
+      sections.line = reinterpret_cast<const unsigned char*>(data);
+      sections.line_size = shdr.sh_size;
+    } else if (!strcmp(name, ".debug_line_str")) {
+      sections.line_str = data;
+      sections.line_str_size = shdr.sh_size;
+    } else if (!strcmp(name, ".debug_str")) {
+      sections.str = data;
+      sections.str_size = shdr.sh_size;
+    } else if (shdr.sh_type == SHT_SYMTAB && shdr.sh_link < ehdr->e_shnum) {
+      symtab = &shdr;
+    } else if (shdr.sh_type == SHT_DYNSYM && shdr.sh_link < ehdr->e_shnum) {
+      dynsym = &shdr;
+    }
+  }
+
+  bool result = true;
+  if (sections.line != NULL) {
+    LineTableBuilder builder;
+    MappedArena units = { NULL, 0, 0 };
+    result = InitLineTableBuilder(sections, &line_table, &builder) &&
+        CollectLineUnits(sections, &units);
+    const LineUnit* unit_data = reinterpret_cast<const LineUnit*>(units.data);
+    size_t unit_count = units.size / sizeof(LineUnit);
+    if (static_cast<size_t>(threads) > unit_count) {
+      threads = unit_count;
+    }
+    if (result) {
+      result = threads > 1?
+          DecodeLineUnitsInParallel(unit_data, unit_count, threads,
+                                    &builder) :
+          DecodeLineUnitsInOrder(unit_data, unit_count, &builder);
+    }
+    result = result && EncodeLineRows(
+        reinterpret_cast<LineRow*>(builder.rows.data),
+        builder.rows.size / sizeof(LineRow), module);
+    module->file_count = builder.file_count;
+    if (result && builder.file_count > 0) {
+      result = ArenaAlloc(&line_table, builder.file_names.size,
+                          &module->files) != NULL;
+      if (result) {
+        memcpy(line_table.data + module->files, builder.file_names.data,
+               builder.file_names.size);
+      }
+    }
+    FreeLineTableBuilder(&builder);
+    ArenaFree(&units);
+  }
+  if (symtab == NULL) {
+    symtab = dynsym;
+  }
+  if (result && symtab != NULL) {
+    const ElfW(Shdr)& strtab = shdrs[symtab->sh_link];
+    if (strtab.sh_offset + strtab.sh_size <= image_size) {
+      result = IndexFunctions(
+          reinterpret_cast<const ElfW(Sym)*>(image + symtab->sh_offset),
+          symtab->sh_size / sizeof(ElfW(Sym)), image + strtab.sh_offset,
+          strtab.sh_size, module);
+    }
+  }
+  munmap(const_cast<ElfW(Ehdr)*>(ehdr), image_size);
+  return result && (module->row_count > 0 || module->function_count > 0);
+}
+
+/// @brief The loaded images, as reported by dl_iterate_phdr().
+struct LoadedImage {
+  const char* path;
+  uintptr_t bias;
+  uintptr_t low;
+  uintptr_t high;
+};
+
+struct LoadedImages {
+  LoadedImage images[kMaxLineTableModules];
+  int count;
+  char executable[PATH_MAX];
+};
+
+static int CollectLoadedImage(struct dl_phdr_info* info, size_t,
+                              void* data) {
+  LoadedImages* loaded = reinterpret_cast<LoadedImages*>(data);
+  const char* path = info->dlpi_name;
+  if (path[0] == 0 && loaded->count == 0 && loaded->executable[0] != 0) {
+    path = loaded->executable;
+  }
+  if (path[0] != '/' || loaded->count == kMaxLineTableModules) {
+    return 0;
+  }
+  LoadedImage& image = loaded->images[loaded->count];
+  image.path = path;
+  image.bias = info->dlpi_addr;
+  image.low = ~static_cast<uintptr_t>(0);
+  image.high = 0;
+  for (int i = 0; i < info->dlpi_phnum; i++) {
+    const ElfW(Phdr)& phdr = info->dlpi_phdr[i];
+    if (phdr.p_type == PT_LOAD) {
+      if (phdr.p_vaddr < image.low) {
+        image.low = phdr.p_vaddr;
+      }
+      if (phdr.p_vaddr + phdr.p_memsz > image.high) {
+        image.high = phdr.p_vaddr + phdr.p_memsz;
+      }
+    }
+  }
+  loaded->count += image.low < image.high;
+  return 0;
+}
+
+/// @brief An image opened by PinModules(), identified by its load bias.
+struct PinnedModule {
+  uintptr_t bias;
+  int fd;
+};
+
+static PinnedModule pinned_modules[kMaxLineTableModules];
+static int pinned_module_count = 0;
+
+int DeathHandler::PinModules() {
+  LoadedImages loaded;
+  loaded.count = 0;
+  // Unlike readlink(), this always resolves to the executable which runs
+  strcpy(loaded.executable, "/proc/self/exe");  // NOLINT(runtime/printf)
+  dl_iterate_phdr(CollectLoadedImage, &loaded);
+
+  PinnedModule previous[kMaxLineTableModules];
+  int previous_count = pinned_module_count;
+  memcpy(previous, pinned_modules, previous_count * sizeof(PinnedModule));
+  // The signal handler must not see the table being replaced
+  pinned_module_count = 0;
+  __sync_synchronize();
+  int count = 0;
+  for (int i = 0; i < loaded.count; i++) {
+    int fd = -1;
+    for (int j = 0; j < previous_count; j++) {
+      if (previous[j].bias == loaded.images[i].bias && previous[j].fd >= 0) {
+        fd = previous[j].fd;
+        previous[j].fd = -1;
+        break;
+      }
+    }
+    if (fd < 0) {
+      fd = open(loaded.images[i].path, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd >= 0) {
+      pinned_modules[count].bias = loaded.images[i].bias;
+      pinned_modules[count].fd = fd;
+      count++;
+    }
+  }
+  __sync_synchronize();
+  pinned_module_count = count;
+  for (int i = 0; i < previous_count; i++) {
+    if (previous[i].fd >= 0) {
+      close(previous[i].fd);
+    }
+  }
+  return count;
+}
+
+void DeathHandler::UnpinModules() {
+  int count = pinned_module_count;
+  pinned_module_count = 0;
+  __sync_synchronize();
+  for (int i = 0; i < count; i++) {
+    close(pinned_modules[i].fd);
+  }
+}
+
+/// @brief Formats "/proc/<pid>/fd/<n>" of the image pinned with the
+/// specified load bias. Async-signal-safe.
+/// @return NULL if the image is not pinned.
+CRASH_PATH
+static const char* PinnedModulePath(uintptr_t bias, pid_t pid,
+                                    char* buffer) {
+  for (int i = 0; i < pinned_module_count; i++) {
+    if (pinned_modules[i].bias != bias) {
+      continue;
+    }
+    char number[32];
+    strcpy(buffer, "/proc/");  // NOLINT(runtime/printf)
+    strcat(buffer, Safe::itoa(pid, number));  // NOLINT(runtime/printf)
+    strcat(buffer, "/fd/");  // NOLINT(runtime/printf)
+    strcat(buffer, Safe::itoa(pinned_modules[i].fd, number));  // NOLINT(*)
+    return buffer;
+  }
+  return NULL;
+}
+
+int DeathHandler::line_table_threads() const {
+  return line_table_threads_;
+}
+
+void DeathHandler::set_line_table_threads(int value) {
+  assert(value >= 0);
+  line_table_threads_ = value;
+}
+
+bool DeathHandler::LoadLineTable() {
+  LoadedImages loaded;
+  loaded.count = 0;
+  ssize_t len = readlink("/proc/self/exe", loaded.executable,
+                         sizeof(loaded.executable) - 1);
+  loaded.executable[len > 0? len : 0] = 0;
+  dl_iterate_phdr(CollectLoadedImage, &loaded);
+
+  // The signal handler must not see the table being replaced
+  line_table_module_count = 0;
+  __sync_synchronize();
+  ArenaFree(&line_table);
+  int threads = line_table_threads_ > 0?
+      line_table_threads_ : sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > kMaxLineTableThreads) {
+    threads = kMaxLineTableThreads;
+  }
+  int count = 0;
+  for (int i = 0; i < loaded.count; i++) {
+    LineTableModule& module = line_table_modules[count];
+    memset(&module, 0, sizeof(module));
+    module.bias = loaded.images[i].bias;
+    module.low = loaded.images[i].low;
+    module.high = loaded.images[i].high;
+    size_t rollback = line_table.size;
+    char pinned[48];
+    const char* path = PinnedModulePath(module.bias, getpid(), pinned);
+    if (IndexImage(path != NULL? path : loaded.images[i].path, threads,
+                   &module)) {
+      count++;
+    } else {
+      line_table.size = rollback;
+    }
+  }
+  if (line_table.data != NULL) {
+    mprotect(line_table.data, line_table.capacity, PROT_READ);
+  }
+  __sync_synchronize();
+  line_table_module_count = count;
+  if (lock_crash_path_) {
+    LockCrashPath();
+  }
+  return count > 0;
+}
+
+static const int kMaxDemangleDepth = 48;
+static const int kMaxSubstitutions = 128;
+static const int kMaxTemplateArgs = 32;
+
+/// @brief The kinds of the demangled fragments which can be referenced later.
+enum FragmentKind {
+  kFragmentPlain,
+  kFragmentReference,
+  kFragmentRvalueReference,
+  /// @brief A function, or a pointer or a reference to a function or an
+  /// array, "void (*)(int)" or "char (&&) [4]", which cannot be wrapped by
+  /// appending to it.
+  kFragmentFunction,
+  /// @brief An lvalue reference to a function or an array, which the
+  /// references to it collapse to.
+  kFragmentFunctionReference,
+  /// @brief An array, "char [4]", which is qualified and referenced by
+  /// inserting before its dimensions.
+  kFragmentArray,
+  /// @brief A fragment which has no contiguous text, e.g. a function type.
+  kFragmentInvalid,
+  /// @brief A substituted template parameter, which is looked up again
+  /// in the current template arguments, as libiberty does; begin is its
+  /// index.
+  kFragmentTemplateParam,
+  /// @brief A template argument pack; [begin, end) are its elements
+  /// in Demangler::pack_elements.
+  kFragmentPack
+};
+
+/// @brief The output range of a substitution candidate or a template
+/// argument.
+struct Fragment {
+  uint16_t begin;
+  uint16_t end;
+  uint8_t kind;
+};
+
+/// @brief The state of DemangleName(): the mangled name is parsed with
+/// recursive descent and printed as it goes, the substitutions and the
+/// template parameters are copied from the text printed before.
+struct Demangler {
+  const char* pos;
+  char* out;
+  size_t size;
+  size_t length;
+  /// @brief The last character appended, which stays the same when
+  /// the separator of an empty argument pack is removed, as in libiberty.
+  char last_char;
+  bool error;
+  int depth;
+  /// @brief The type of a conversion operator is being parsed, where
+  /// the template parameters refer to the operator's own arguments.
+  bool conversion;
+  Fragment substitutions[kMaxSubstitutions];
+  int substitution_count;
+  Fragment template_args[kMaxTemplateArgs];
+  int template_arg_count;
+  Fragment pack_elements[kMaxTemplateArgs];
+  int pack_element_count;
+  /// @brief The element of the packs printed by the pack expansion being
+  /// parsed, or -1; pack_length is the size of the packs, -1 until the
+  /// pattern refers to one.
+  int pack_index;
+  int pack_length;
+  /// @brief The last unqualified name, which constructors and destructors
+  /// repeat: either a static string or an output range.
+  const char* last_name;
+  size_t last_name_begin;
+  size_t last_name_end;
+};
+
+/// @brief What the caller of DemangleName() needs to know about a name.
+struct DemangledName {
+  /// @brief The name ends with template arguments.
+  bool template_args;
+  /// @brief The name is a constructor, a destructor or a conversion
+  /// operator, which have no return type.
+  bool no_return;
+  /// @brief The cv-qualifiers and the ref-qualifier of a member function.
+  const char* qualifiers[4];
+  int qualifier_count;
+};
+
+CRASH_PATH
+static void DemangleAppend(Demangler* d, const char* str, size_t len) {
+  if (d->length + len >= d->size || d->length + len > 0xffff) {
+    d->error = true;
+    return;
+  }
+  for (size_t i = 0; i < len; i++) {
+    d->out[d->length++] = str[i];
+  }
+  if (len > 0) {
+    d->last_char = str[len - 1];
+  }
+}
+
+CRASH_PATH
+static void DemangleAppend(Demangler* d, const char* str) {
+  DemangleAppend(d, str, strlen(str));
+}
+
+/// @brief Appends a copy of the text printed before.
+CRASH_PATH
+static void DemangleAppendFragment(Demangler* d, const Fragment& fragment) {
+  if (fragment.kind == kFragmentInvalid) {
+    d->error = true;
+    return;
+  }
+  size_t len = fragment.end - fragment.begin;
+  if (d->length + len >= d->size || d->length + len > 0xffff) {
+    d->error = true;
+    return;
+  }
+  for (size_t i = 0; i < len; i++) {
+    d->out[d->length++] = d->out[fragment.begin + i];
+  }
+  if (len > 0) {
+    d->last_char = d->out[d->length - 1];
+  }
+}
+
+
+/// @brief Records the text printed since begin as a substitution candidate.
+CRASH_PATH
+static void DemangleAddSubstitution(Demangler* d, size_t begin,
+                                    FragmentKind kind) {
+  if (d->substitution_count == kMaxSubstitutions) {
+    d->error = true;
+    return;
+  }
+  Fragment& fragment = d->substitutions[d->substitution_count++];
+  fragment.begin = begin;
+  fragment.end = d->length;
+  fragment.kind = kind;
+}
+
+CRASH_PATH
+static uint64_t DemangleNumber(Demangler* d) {
+  if (*d->pos < '0' || *d->pos > '9') {
+    d->error = true;
+    return 0;
+  }
+  uint64_t value = 0;
+  while (*d->pos >= '0' && *d->pos <= '9') {
+    if (value > 0xffffffff) {
+      d->error = true;
+      return 0;
+    }
+    value = value * 10 + (*d->pos++ - '0');
+  }
+  return value;
+}
+
+/// @brief Parses "_" as 0 and "<number>_" as number + 1, where digits are
+/// base 10 or base 36 (seq-id).
+CRASH_PATH
+static size_t DemangleIndex(Demangler* d, bool seq_id) {
+  if (*d->pos == '_') {
+    d->pos++;
+    return 0;
+  }
+  size_t value = 0;
+  for (;;) {
+    char c = *d->pos;
+    size_t digit;
+    if (c >= '0' && c <= '9') {
+      digit = c - '0';
+    } else if (seq_id && c >= 'A' && c <= 'Z') {
+      digit = c - 'A' + 10;
+    } else {
+      break;
+    }
+    if (value > 0xffff) {
+      d->error = true;
+      return 0;
+    }
+    value = value * (seq_id? 36 : 10) + digit;
+    d->pos++;
+  }
+  if (*d->pos != '_') {
+    d->error = true;
+    return 0;
+  }
+  d->pos++;
+  return value + 1;
+}
+
+CRASH_PATH
+static const char* DemangleBuiltinType(char c) {
+  switch (c) {
+    case 'a': return "signed char";
+    case 'b': return "bool";
+    case 'c': return "char";
+    case 'd': return "double";
+    case 'e': return "long double";
+    case 'f': return "float";
+    case 'g': return "__float128";
+    case 'h': return "unsigned char";
+    case 'i': return "int";
+    case 'j': return "unsigned int";
+    case 'l': return "long";
+    case 'm': return "unsigned long";
+    case 'n': return "__int128";
+    case 'o': return "unsigned __int128";
+    case 's': return "short";
+    case 't': return "unsigned short";
+    case 'v': return "void";
+    case 'w': return "wchar_t";
+    case 'x': return "long long";
+    case 'y': return "unsigned long long";
+    case 'z': return "...";
+    default: return NULL;
+  }
+}
+
+CRASH_PATH
+static const char* DemangleOperator(const char* code) {
+  static const char* const operators[] = {
+    "nwnew", "nanew[]", "dldelete", "dadelete[]", "ps+", "ng-", "ad&", "de*",
+    "co~", "pl+", "mi-", "ml*", "dv/", "rm%", "an&", "or|", "eo^", "aS=",
+    "pL+=", "mI-=", "mL*=", "dV/=", "rM%=", "aN&=", "oR|=", "eO^=", "ls<<",
+    "rs>>", "lS<<=", "rS>>=", "eq==", "ne!=", "lt<", "gt>", "le<=", "ge>=",
+    "ss<=>", "nt!", "aa&&", "oo||", "pp++", "mm--", "cm,", "pm->*", "pt->",
+    "cl()", "ix[]", "qu?", "awco_await"
+  };
+  for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); i++) {
+    if (operators[i][0] == code[0] && operators[i][1] == code[1]) {
+      return operators[i] + 2;
+    }
+  }
+  return NULL;
+}
+
+/// @brief Whether a type of the kind can be printed before a name, as
+/// a return type or as the type of a conversion operator.
+CRASH_PATH
+static bool DemangleCanPrecedeName(FragmentKind kind) {
+  return kind == kFragmentPlain || kind == kFragmentReference ||
+      kind == kFragmentRvalueReference;
+}
+
+CRASH_PATH static FragmentKind DemangleType(Demangler* d);
+CRASH_PATH static void DemangleName(Demangler* d, bool function,
+                                    DemangledName* info);
+CRASH_PATH static void DemangleEncoding(Demangler* d, bool return_type);
+
+/// @brief Parses <source-name> ::= <length> <identifier>.
+CRASH_PATH
+static void DemangleSourceName(Demangler* d, bool last_name) {
+  uint64_t len = DemangleNumber(d);
+  for (uint64_t i = 0; i < len && !d->error; i++) {
+    if (d->pos[i] == 0) {
+      d->error = true;
+    }
+  }
+  if (d->error) {
+    return;
+  }
+  size_t begin = d->length;
+  if (len >= 10 && !strncmp(d->pos, "_GLOBAL_", 8) &&
+      (d->pos[8] == '.' || d->pos[8] == '_' || d->pos[8] == '$') &&
+      d->pos[9] == 'N') {
+    DemangleAppend(d, "(anonymous namespace)");
+  } else {
+    DemangleAppend(d, d->pos, len);
+  }
+  d->pos += len;
+  if (last_name) {
+    d->last_name = NULL;
+    d->last_name_begin = begin;
+    d->last_name_end = d->length;
+  }
+}
+
+/// @brief Parses the optional <discriminator> ::= _ <digit> | __ <number> _.
+CRASH_PATH
+static void DemangleDiscriminator(Demangler* d) {
+  if (*d->pos != '_') {
+    return;
+  }
+  d->pos++;
+  if (*d->pos == '_') {
+    d->pos++;
+    DemangleNumber(d);
+    if (*d->pos++ != '_') {
+      d->error = true;
+    }
+  } else {
+    DemangleNumber(d);
+  }
+}
+
+/// @brief Parses the types of the parameters up to "E", the end of the name
+/// or a clone suffix, printed as "(type, ...)".
+CRASH_PATH
+static void DemangleParameters(Demangler* d) {
+  DemangleAppend(d, "(");
+  if (d->pos[0] == 'v' &&
+      (d->pos[1] == 0 || d->pos[1] == 'E' || d->pos[1] == '.')) {
+    d->pos++;
+  } else {
+    bool first = true;
+    while (*d->pos != 0 && *d->pos != 'E' && *d->pos != '.' && !d->error) {
+      size_t separator = d->length;
+      if (!first) {
+        DemangleAppend(d, ", ");
+      }
+      first = false;
+      size_t begin = d->length;
+      DemangleType(d);
+      if (d->length == begin) {
+        // An empty pack expansion
+        d->length = separator;
+      }
+    }
+  }
+  DemangleAppend(d, ")");
+}
+
+/// @brief Parses <expr-primary> ::= L <type> <value number> E, printed
+/// the way libiberty does: "true", "42u" or "(Enum)2".
+CRASH_PATH
+static void DemangleLiteral(Demangler* d) {
+  d->pos++;
+  char type = *d->pos;
+  const char* name = DemangleBuiltinType(type);
+  if (name == NULL) {
+    // An enumerator or nullptr
+    DemangleAppend(d, "(");
+    if (type == '_' || DemangleType(d) != kFragmentPlain) {
+      d->error = true;
+      return;
+    }
+    DemangleAppend(d, ")");
+    type = 0;
+  } else {
+    d->pos++;
+  }
+  bool negative = *d->pos == 'n';
+  if (negative) {
+    d->pos++;
+  }
+  const char* digits = d->pos;
+  while (*d->pos >= '0' && *d->pos <= '9') {
+    d->pos++;
+  }
+  size_t digit_count = d->pos - digits;
+  if (digit_count == 0 || *d->pos++ != 'E') {
+    d->error = true;
+    return;
+  }
+  const char* suffix = "";
+  switch (type) {
+    case 'b':
+      if (negative || digit_count != 1 || digits[0] > '1') {
+        d->error = true;
+      }
+      DemangleAppend(d, digits[0] == '1'? "true" : "false");
+      return;
+    case 'j':
+      suffix = "u";
+      break;
+    case 'l':
+      suffix = "l";
+      break;
+    case 'm':
+      suffix = "ul";
+      break;
+    case 'x':
+      suffix = "ll";
+      break;
+    case 'y':
+      suffix = "ull";
+      break;
+    case 'i':
+    case 0:
+      break;
+    default:
+      if (type == 'v' || type == 'z') {
+        d->error = true;
+        return;
+      }
+      DemangleAppend(d, "(");
+      DemangleAppend(d, name);
+      DemangleAppend(d, ")");
+      break;
+  }
+  if (negative) {
+    DemangleAppend(d, "-");
+  }
+  DemangleAppend(d, digits, digit_count);
+  DemangleAppend(d, suffix);
+}
+
+/// @brief Parses a <template-arg> other than an argument pack.
+CRASH_PATH
+static FragmentKind DemangleTemplateArg(Demangler* d) {
+  if (*d->pos == 'L') {
+    DemangleLiteral(d);
+    return kFragmentPlain;
+  }
+  if (*d->pos == 'X' || *d->pos == 'J' || *d->pos == 0) {
+    d->error = true;
+    return kFragmentInvalid;
+  }
+  return DemangleType(d);
+}
+
+/// @brief Parses <template-args> ::= I <template-arg>+ E.
+/// @param function The arguments belong to the function being demangled
+/// and are referenced by <template-param>.
+CRASH_PATH
+static void DemangleTemplateArgs(Demangler* d, bool function) {
+  d->pos++;
+  const char* last_name = d->last_name;
+  size_t last_name_begin = d->last_name_begin;
+  size_t last_name_end = d->last_name_end;
+  if (function) {
+    d->template_arg_count = 0;
+    d->pack_element_count = 0;
+  }
+  if (d->last_char == '<') {
+    DemangleAppend(d, " ");
+  }
+  DemangleAppend(d, "<");
+  bool first = true;
+  while (*d->pos != 'E' && !d->error) {
+    if (*d->pos == 0) {
+      d->error = true;
+      break;
+    }
+    size_t separator = d->length;
+    if (!first) {
+      DemangleAppend(d, ", ");
+    }
+    first = false;
+    Fragment arg;
+    if (*d->pos == 'J') {
+      // An argument pack, its elements are referenced one by one
+      d->pos++;
+      arg.kind = kFragmentPack;
+      arg.begin = d->pack_element_count;
+      size_t pack_begin = d->length;
+      bool first_in_pack = true;
+      while (*d->pos != 'E' && !d->error) {
+        size_t element_separator = d->length;
+        if (!first_in_pack) {
+          DemangleAppend(d, ", ");
+        }
+        first_in_pack = false;
+        size_t begin = d->length;
+        FragmentKind kind = DemangleTemplateArg(d);
+        if (d->length == begin) {
+          // An empty pack expansion
+          d->length = element_separator;
+        }
+        if (!function) {
+          continue;
+        }
+        if (d->pack_element_count == kMaxTemplateArgs) {
+          d->error = true;
+          break;
+        }
+        Fragment& element = d->pack_elements[d->pack_element_count++];
+        element.begin = begin;
+        element.end = d->length;
+        element.kind = kind;
+      }
+      d->pos++;
+      arg.end = d->pack_element_count;
+      if (d->length == pack_begin) {
+        d->length = separator;
+      }
+    } else {
+      arg.begin = d->length;
+      arg.kind = DemangleTemplateArg(d);
+      arg.end = d->length;
+    }
+    if (function) {
+      if (d->template_arg_count == kMaxTemplateArgs) {
+        d->error = true;
+        break;
+      }
+      d->template_args[d->template_arg_count++] = arg;
+    }
+  }
+  d->pos++;
+  if (d->last_char == '>') {
+    DemangleAppend(d, " ");
+  }
+  DemangleAppend(d, ">");
+  d->last_name = last_name;
+  d->last_name_begin = last_name_begin;
+  d->last_name_end = last_name_end;
+}
+
+/// @brief Appends the template argument number index; an argument pack is
+/// printed whole, or its current element inside a pack expansion.
+CRASH_PATH
+static FragmentKind DemangleAppendTemplateArg(Demangler* d, size_t index) {
+  if (d->conversion || static_cast<int>(index) >= d->template_arg_count) {
+    d->error = true;
+    return kFragmentInvalid;
+  }
+  const Fragment& arg = d->template_args[index];
+  if (arg.kind != kFragmentPack) {
+    DemangleAppendFragment(d, arg);
+    return static_cast<FragmentKind>(arg.kind);
+  }
+  int length = arg.end - arg.begin;
+  if (d->pack_index >= 0) {
+    if (d->pack_length != -1 && d->pack_length != length) {
+      d->error = true;
+      return kFragmentInvalid;
+    }
+    d->pack_length = length;
+    if (length == 0) {
+      // The expansion is removed
+      return kFragmentPlain;
+    }
+    const Fragment& element = d->pack_elements[arg.begin + d->pack_index];
+    DemangleAppendFragment(d, element);
+    return static_cast<FragmentKind>(element.kind);
+  }
+  for (int i = arg.begin; i < arg.end; i++) {
+    if (i > arg.begin) {
+      DemangleAppend(d, ", ");
+    }
+    DemangleAppendFragment(d, d->pack_elements[i]);
+  }
+  if (length != 1) {
+    return kFragmentInvalid;
+  }
+  return static_cast<FragmentKind>(d->pack_elements[arg.begin].kind);
+}
+
+/// @brief Parses <template-param> ::= T_ | T <number> _.
+CRASH_PATH
+static FragmentKind DemangleTemplateParam(Demangler* d, size_t* index) {
+  d->pos++;
+  *index = DemangleIndex(d, false);
+  if (d->error) {
+    return kFragmentInvalid;
+  }
+  return DemangleAppendTemplateArg(d, *index);
+}
+
+/// @brief Parses <substitution>, including the std:: abbreviations, which
+/// are expanded in full the way c++filt prints them.
+CRASH_PATH
+static FragmentKind DemangleSubstitution(Demangler* d) {
+  d->pos++;
+  char c = *d->pos;
+  if ((c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || c == '_') {
+    size_t index = DemangleIndex(d, true);
+    if (d->error || static_cast<int>(index) >= d->substitution_count) {
+      d->error = true;
+      return kFragmentInvalid;
+    }
+    const Fragment& fragment = d->substitutions[index];
+    d->last_name = NULL;
+    d->last_name_begin = d->last_name_end = 0;
+    if (fragment.kind == kFragmentTemplateParam) {
+      return DemangleAppendTemplateArg(d, fragment.begin);
+    }
+    DemangleAppendFragment(d, fragment);
+    return static_cast<FragmentKind>(fragment.kind);
+  }
+  d->pos++;
+  switch (c) {
+    case 'a':
+      DemangleAppend(d, "std::allocator");
+      d->last_name = "allocator";
+      break;
+    case 'b':
+      DemangleAppend(d, "std::basic_string");
+      d->last_name = "basic_string";
+      break;
+    case 's':
+      DemangleAppend(d, "std::basic_string<char, std::char_traits"
+                     "<char>, std::allocator<char> >");
+      d->last_name = "basic_string";
+      break;
+    case 'i':
+      DemangleAppend(d, "std::basic_istream<char, std::char_traits"
+                     "<char> >");
+      d->last_name = "basic_istream";
+      break;
+    case 'o':
+      DemangleAppend(d, "std::basic_ostream<char, std::char_traits"
+                     "<char> >");
+      d->last_name = "basic_ostream";
+      break;
+    case 'd':
+      DemangleAppend(d, "std::basic_iostream<char, std::char_traits"
+                     "<char> >");
+      d->last_name = "basic_iostream";
+      break;
+    default:
+      d->error = true;
+      break;
+  }
+  return kFragmentPlain;
+}
+
+/// @brief Parses <unqualified-name> with its ABI tags.
+CRASH_PATH
+static void DemangleUnqualifiedName(Demangler* d, DemangledName* info) {
+  info->no_return = false;
+  char c = *d->pos;
+  if (c == 'L' && d->pos[1] >= '0' && d->pos[1] <= '9') {
+    // Internal linkage
+    d->pos++;
+    c = *d->pos;
+  }
+  if (c >= '0' && c <= '9') {
+    DemangleSourceName(d, true);
+  } else if (c == 'C' || c == 'D') {
+    char kind = d->pos[1];
+    if ((c == 'C' && (kind < '1' || kind > '5')) ||
+        (c == 'D' && kind != '0' && kind != '1' && kind != '2' &&
+         kind != '4' && kind != '5') ||
+        (d->last_name == NULL && d->last_name_begin == d->last_name_end)) {
+      d->error = true;
+      return;
+    }
+    d->pos += 2;
+    if (c == 'D') {
+      DemangleAppend(d, "~");
+    }
+    if (d->last_name != NULL) {
+      DemangleAppend(d, d->last_name);
+    } else {
+      Fragment name = { static_cast<uint16_t>(d->last_name_begin),
+                        static_cast<uint16_t>(d->last_name_end),
+                        kFragmentPlain };
+      DemangleAppendFragment(d, name);
+    }
+    info->no_return = true;
+  } else if (c == 'U' && d->pos[1] == 'l') {
+    // A lambda: Ul <parameters> E [<number>] _
+    d->pos += 2;
+    DemangleAppend(d, "{lambda");
+    DemangleParameters(d);
+    if (*d->pos++ != 'E') {
+      d->error = true;
+      return;
+    }
+    size_t index = DemangleIndex(d, false);
+    char number[32];
+    DemangleAppend(d, "#");
+    DemangleAppend(d, Safe::utoa(index + 1, number));
+    DemangleAppend(d, "}");
+  } else if (c == 'U' && d->pos[1] == 't') {
+    d->pos += 2;
+    size_t index = DemangleIndex(d, false);
+    char number[32];
+    DemangleAppend(d, "{unnamed type#");
+    DemangleAppend(d, Safe::utoa(index + 1, number));
+    DemangleAppend(d, "}");
+  } else if (c == 'c' && d->pos[1] == 'v') {
+    d->pos += 2;
+    if (*d->pos == 'T') {
+      // The template parameters of conversion operators are special
+      d->error = true;
+      return;
+    }
+    DemangleAppend(d, "operator ");
+    d->conversion = true;
+    FragmentKind kind = DemangleType(d);
+    d->conversion = false;
+    if (kind == kFragmentInvalid) {
+      d->error = true;
+    }
+    info->no_return = true;
+  } else if (c >= 'a' && c <= 'z' && d->pos[1] != 0) {
+    const char* name = DemangleOperator(d->pos);
+    if (name == NULL) {
+      d->error = true;
+      return;
+    }
+    d->pos += 2;
+    DemangleAppend(d, "operator");
+    if (name[0] >= 'a' && name[0] <= 'z') {
+      DemangleAppend(d, " ");
+    }
+    DemangleAppend(d, name);
+  } else {
+    d->error = true;
+    return;
+  }
+  while (*d->pos == 'B' && !d->error) {
+    d->pos++;
+    DemangleAppend(d, "[abi:");
+    DemangleSourceName(d, false);
+    DemangleAppend(d, "]");
+  }
+}
+
+/// @brief Parses <nested-name> ::= N [<CV-qualifiers>] [<ref-qualifier>]
+/// <prefix> <unqualified-name> E.
+CRASH_PATH
+static void DemangleNestedName(Demangler* d, bool function,
+                               DemangledName* info) {
+  d->pos++;
+  info->qualifier_count = 0;
+  const char* cv[3] = { NULL, NULL, NULL };
+  for (;; d->pos++) {
+    if (*d->pos == 'r') {
+      cv[2] = " restrict";
+    } else if (*d->pos == 'V') {
+      cv[1] = " volatile";
+    } else if (*d->pos == 'K') {
+      cv[0] = " const";
+    } else {
+      break;
+    }
+  }
+  for (int i = 0; i < 3; i++) {
+    if (cv[i] != NULL) {
+      info->qualifiers[info->qualifier_count++] = cv[i];
+    }
+  }
+  if (*d->pos == 'R' || *d->pos == 'O') {
+    info->qualifiers[info->qualifier_count++] =
+        *d->pos == 'R'? " &" : " &&";
+    d->pos++;
+  }
+  size_t begin = d->length;
+  bool separator = false;
+  info->template_args = false;
+  while (*d->pos != 'E' && !d->error) {
+    bool candidate = true;
+    if (*d->pos == 'M' && d->length != begin) {
+      // The closures in a member initializer are scoped by the member
+      d->pos++;
+      continue;
+    }
+    if (*d->pos == 'I') {
+      if (d->length == begin) {
+        d->error = true;
+        break;
+      }
+      DemangleTemplateArgs(d, function);
+      info->template_args = true;
+    } else {
+      if (separator) {
+        DemangleAppend(d, "::");
+      }
+      separator = true;
+      info->template_args = false;
+      if (d->pos[0] == 'S' && d->pos[1] == 't' && d->length == begin) {
+        d->pos += 2;
+        DemangleAppend(d, "std");
+        candidate = false;
+      } else if (*d->pos == 'S') {
+        if (DemangleSubstitution(d) != kFragmentPlain) {
+          d->error = true;
+        }
+        candidate = false;
+      } else if (*d->pos == 'T') {
+        size_t index;
+        if (DemangleTemplateParam(d, &index) != kFragmentPlain) {
+          d->error = true;
+        }
+      } else if (*d->pos == 0) {
+        d->error = true;
+      } else {
+        DemangleUnqualifiedName(d, info);
+      }
+    }
+    if (candidate && *d->pos != 'E') {
+      DemangleAddSubstitution(d, begin, kFragmentPlain);
+    }
+  }
+  d->pos++;
+}
+
+/// @brief Parses <local-name> ::= Z <encoding> E <entity name>
+/// [<discriminator>] | Z <encoding> E s [<discriminator>].
+CRASH_PATH
+static void DemangleLocalName(Demangler* d, DemangledName* info) {
+  d->pos++;
+  // The function may be a template of its own
+  Fragment template_args[kMaxTemplateArgs];
+  Fragment pack_elements[kMaxTemplateArgs];
+  int template_arg_count = d->template_arg_count;
+  int pack_element_count = d->pack_element_count;
+  memcpy(template_args, d->template_args,
+         template_arg_count * sizeof(Fragment));
+  memcpy(pack_elements, d->pack_elements,
+         pack_element_count * sizeof(Fragment));
+  DemangleEncoding(d, false);
+  memcpy(d->template_args, template_args,
+         template_arg_count * sizeof(Fragment));
+  memcpy(d->pack_elements, pack_elements,
+         pack_element_count * sizeof(Fragment));
+  d->template_arg_count = template_arg_count;
+  d->pack_element_count = pack_element_count;
+  if (*d->pos++ != 'E') {
+    d->error = true;
+    return;
+  }
+  DemangleAppend(d, "::");
+  if (*d->pos == 's') {
+    d->pos++;
+    DemangleAppend(d, "string literal");
+    info->template_args = false;
+    info->no_return = false;
+    info->qualifier_count = 0;
+  } else if (*d->pos == 'd') {
+    d->error = true;
+    return;
+  } else {
+    DemangleName(d, true, info);
+  }
+  DemangleDiscriminator(d);
+}
+
+/// @brief Parses <name>.
+/// @param function The name is the name of a function or a variable rather
+/// than a type, and its template arguments are the template parameters.
+CRASH_PATH
+static void DemangleName(Demangler* d, bool function, DemangledName* info) {
+  if (++d->depth > kMaxDemangleDepth) {
+    d->error = true;
+    return;
+  }
+  info->template_args = false;
+  info->no_return = false;
+  info->qualifier_count = 0;
+  if (*d->pos == 'N') {
+    DemangleNestedName(d, function, info);
+  } else if (*d->pos == 'Z') {
+    DemangleLocalName(d, info);
+  } else {
+    size_t begin = d->length;
+    bool substitution = false;
+    if (d->pos[0] == 'S' && d->pos[1] == 't') {
+      d->pos += 2;
+      DemangleAppend(d, "std::");
+      DemangleUnqualifiedName(d, info);
+    } else if (*d->pos == 'S') {
+      substitution = true;
+      if (DemangleSubstitution(d) != kFragmentPlain ||
+          *d->pos != 'I') {
+        d->error = true;
+      }
+    } else {
+      DemangleUnqualifiedName(d, info);
+    }
+    if (*d->pos == 'I' && !d->error) {
+      if (!substitution) {
+        DemangleAddSubstitution(d, begin, kFragmentPlain);
+      }
+      DemangleTemplateArgs(d, function);
+      info->template_args = true;
+    }
+  }
+  d->depth--;
+}
+
+/// @brief Reverses the text in [begin, end) of the output.
+CRASH_PATH
+static void DemangleReverse(Demangler* d, size_t begin, size_t end) {
+  for (; begin + 1 < end; begin++, end--) {
+    char c = d->out[begin];
+    d->out[begin] = d->out[end - 1];
+    d->out[end - 1] = c;
+  }
+}
+
+/// @brief Moves the return type printed at [middle, length) before the
+/// function name printed at [begin, middle), updating the fragments.
+CRASH_PATH
+static void DemangleMoveReturnType(Demangler* d, size_t begin,
+                                   size_t middle) {
+  DemangleReverse(d, begin, middle);
+  DemangleReverse(d, middle, d->length);
+  DemangleReverse(d, begin, d->length);
+  Fragment* fragments[3] = {
+    d->substitutions, d->template_args, d->pack_elements
+  };
+  int counts[3] = {
+    d->substitution_count, d->template_arg_count, d->pack_element_count
+  };
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < counts[i]; j++) {
+      Fragment& fragment = fragments[i][j];
+      if (fragment.begin < begin ||
+          fragment.kind == kFragmentTemplateParam ||
+          fragment.kind == kFragmentPack) {
+        continue;
+      }
+      if (fragment.begin >= middle) {
+        fragment.begin -= middle - begin;
+        fragment.end -= middle - begin;
+      } else {
+        fragment.begin += d->length - middle;
+        fragment.end += d->length - middle;
+      }
+    }
+  }
+}
+
+/// @brief Parses <array-type> ::= A [<number>] _ <type> for each
+/// dimension, printed as "int [2][3]".
+CRASH_PATH
+static void DemangleArray(Demangler* d) {
+  const char* dimensions[4];
+  int lengths[4];
+  int count = 0;
+  while (*d->pos == 'A' && !d->error) {
+    if (count == 4) {
+      d->error = true;
+      return;
+    }
+    dimensions[count] = ++d->pos;
+    while (*d->pos >= '0' && *d->pos <= '9') {
+      d->pos++;
+    }
+    lengths[count] = d->pos - dimensions[count];
+    count++;
+    if (*d->pos++ != '_') {
+      d->error = true;
+    }
+  }
+  if (DemangleType(d) != kFragmentPlain) {
+    d->error = true;
+  }
+  DemangleAppend(d, " ");
+  for (int i = 0; i < count; i++) {
+    DemangleAppend(d, "[");
+    DemangleAppend(d, dimensions[i], lengths[i]);
+    DemangleAppend(d, "]");
+  }
+  // The inner dimensions have no text of their own
+  for (int i = 1; i < count; i++) {
+    DemangleAddSubstitution(d, 0, kFragmentInvalid);
+  }
+}
+
+/// @brief Inserts the text before the dimensions of the array printed
+/// since begin: "char [4]" becomes "char const [4]" or "char (&) [4]".
+CRASH_PATH
+static void DemangleInsertBeforeDimensions(Demangler* d, size_t begin,
+                                           const char* text) {
+  size_t pos = d->length;
+  while (pos > begin && d->out[pos - 1] == ']') {
+    for (pos--; pos > begin && d->out[pos] != '['; pos--) {}
+  }
+  size_t len = strlen(text);
+  if (pos <= begin || d->length + len >= d->size ||
+      d->length + len > 0xffff) {
+    d->error = true;
+    return;
+  }
+  // Before the space which separates the element type
+  pos--;
+  memmove(d->out + pos + len, d->out + pos, d->length - pos);
+  memcpy(d->out + pos, text, len);
+  d->length += len;
+}
+
+/// @brief Parses <pointer-to-member-type> ::= M <class type> <member type>,
+/// printed as "int X::*" or "void (X::*)(int) const".
+CRASH_PATH
+static FragmentKind DemangleMemberPointer(Demangler* d) {
+  size_t begin = d->length;
+  d->pos++;
+  if (DemangleType(d) != kFragmentPlain) {
+    d->error = true;
+  }
+  const char* type = d->pos;
+  const char* cv[3] = { NULL, NULL, NULL };
+  for (;; d->pos++) {
+    if (*d->pos == 'r') {
+      cv[2] = " restrict";
+    } else if (*d->pos == 'V') {
+      cv[1] = " volatile";
+    } else if (*d->pos == 'K') {
+      cv[0] = " const";
+    } else {
+      break;
+    }
+  }
+  if (*d->pos != 'F') {
+    d->pos = type;
+    DemangleAppend(d, "::*");
+    size_t middle = d->length;
+    if (DemangleType(d) != kFragmentPlain) {
+      d->error = true;
+    }
+    DemangleAppend(d, " ");
+    if (!d->error) {
+      DemangleMoveReturnType(d, begin, middle);
+    }
+    return kFragmentPlain;
+  }
+  d->pos++;
+  DemangleAppend(d, "::*)");
+  size_t middle = d->length;
+  FragmentKind result = DemangleType(d);
+  if (!DemangleCanPrecedeName(result)) {
+    d->error = true;
+  }
+  DemangleAppend(d, " (");
+  if (!d->error) {
+    DemangleMoveReturnType(d, begin, middle);
+  }
+  DemangleParameters(d);
+  if (*d->pos++ != 'E') {
+    d->error = true;
+  }
+  for (int i = 0; i < 3; i++) {
+    if (cv[i] != NULL) {
+      DemangleAppend(d, cv[i]);
+    }
+  }
+  // The qualified function type is never printed alone
+  DemangleAddSubstitution(d, begin, kFragmentInvalid);
+  return kFragmentFunction;
+}
+
+/// @brief Parses the pack expansion Dp <type>: the pattern is printed for
+/// each element of the pack it refers to, "int&&, long&&"; only the first
+/// one adds the substitution candidates.
+CRASH_PATH
+static FragmentKind DemanglePackExpansion(Demangler* d) {
+  size_t begin = d->length;
+  d->pos += 2;
+  if (d->pack_index >= 0) {
+    d->error = true;
+    return kFragmentInvalid;
+  }
+  const char* pattern = d->pos;
+  d->pack_index = 0;
+  d->pack_length = -1;
+  int substitution_count = d->substitution_count;
+  FragmentKind kind = DemangleType(d);
+  const char* end = d->pos;
+  int first_count = d->substitution_count;
+  if (d->pack_length == -1) {
+    d->error = true;
+  }
+  for (d->pack_index = 1; d->pack_index < d->pack_length && !d->error;
+       d->pack_index++) {
+    DemangleAppend(d, ", ");
+    d->pos = pattern;
+    DemangleType(d);
+    d->substitution_count = first_count;
+  }
+  if (d->pack_length == 0) {
+    d->length = begin;
+    for (int i = substitution_count; i < first_count; i++) {
+      if (d->substitutions[i].kind != kFragmentTemplateParam) {
+        d->substitutions[i].kind = kFragmentInvalid;
+      }
+    }
+  }
+  d->pos = end;
+  int length = d->pack_length;
+  d->pack_index = d->pack_length = -1;
+  return length == 1? kind : kFragmentInvalid;
+}
 
-    // Append pid
-    if (append_pid_) {
-      // %s\033[33;1m(%i)\033[0m\n
-      strcat(line, " ");  // NOLINT(runtime/printf)
-      if (color_output_) {
-        strcat(line, "\033[33;1m");  // NOLINT(runtime/printf)
+/// @brief Parses <type>.
+/// @return The kind of the printed type.
+CRASH_PATH
+static FragmentKind DemangleType(Demangler* d) {
+  if (++d->depth > kMaxDemangleDepth) {
+    d->error = true;
+    return kFragmentInvalid;
+  }
+  size_t begin = d->length;
+  FragmentKind kind = kFragmentPlain;
+  bool candidate = true;
+  char c = *d->pos;
+  const char* builtin = DemangleBuiltinType(c);
+  if (builtin != NULL) {
+    d->pos++;
+    DemangleAppend(d, builtin);
+    candidate = false;
+  } else if (c == 'D' && d->pos[1] == 'p') {
+    kind = DemanglePackExpansion(d);
+  } else if (c == 'D') {
+    const char* name = NULL;
+    switch (d->pos[1]) {
+      case 'n': name = "decltype(nullptr)"; break;
+      case 'a': name = "auto"; break;
+      case 'c': name = "decltype(auto)"; break;
+      case 's': name = "char16_t"; break;
+      case 'i': name = "char32_t"; break;
+      case 'u': name = "char8_t"; break;
+      case 'd': name = "decimal64"; break;
+      case 'e': name = "decimal128"; break;
+      case 'f': name = "decimal32"; break;
+      case 'h': name = "half"; break;
+      default: d->error = true; break;
+    }
+    if (name != NULL) {
+      d->pos += 2;
+      DemangleAppend(d, name);
+    }
+    candidate = false;
+  } else if (c == 'r' || c == 'V' || c == 'K') {
+    const char* cv[3] = { NULL, NULL, NULL };
+    for (;; d->pos++) {
+      if (*d->pos == 'r') {
+        cv[2] = " restrict";
+      } else if (*d->pos == 'V') {
+        cv[1] = " volatile";
+      } else if (*d->pos == 'K') {
+        cv[0] = " const";
+      } else {
+        break;
+      }
+    }
+    size_t inner = d->length;
+    bool function = *d->pos == 'F';
+    FragmentKind qualified = DemangleType(d);
+    if (function && !d->error) {
+      // Only the qualified function type is a candidate, as in libiberty
+      d->substitution_count--;
+      kind = kFragmentFunction;
+    } else if (qualified == kFragmentArray) {
+      for (int i = 0; i < 3; i++) {
+        if (cv[i] != NULL) {
+          DemangleInsertBeforeDimensions(d, inner, cv[i]);
+        }
+      }
+      cv[0] = cv[1] = cv[2] = NULL;
+      kind = kFragmentArray;
+    } else if (qualified != kFragmentPlain) {
+      d->error = true;
+    }
+    // A template parameter may already have the qualifiers
+    static const char* const qualifiers[] = {
+      " const", " volatile", " restrict"
+    };
+    for (int i = 0; i < 3 && !d->error && kind == kFragmentPlain; i++) {
+      size_t len = strlen(qualifiers[i]);
+      if (d->length - inner > len &&
+          !strncmp(d->out + d->length - len, qualifiers[i], len)) {
+        if (i > 0 || cv[1] != NULL || cv[2] != NULL) {
+          d->error = true;
+        }
+        cv[0] = NULL;
+      }
+    }
+    for (int i = 0; i < 3; i++) {
+      if (cv[i] != NULL) {
+        DemangleAppend(d, cv[i]);
+      }
+    }
+  } else if (c == 'P' || c == 'R' || c == 'O') {
+    const char* modifier = c == 'P'? "*" : c == 'R'? "&" : "&&";
+    d->pos++;
+    if (*d->pos == 'F') {
+      // A pointer to a function: return (*)(parameters)
+      d->pos++;
+      if (*d->pos == 'Y') {
+        d->error = true;
+      }
+      FragmentKind result = DemangleType(d);
+      if (!DemangleCanPrecedeName(result)) {
+        d->error = true;
+      }
+      DemangleAppend(d, " (");
+      DemangleAppend(d, modifier);
+      DemangleAppend(d, ")");
+      DemangleParameters(d);
+      if (*d->pos++ != 'E') {
+        d->error = true;
       }
-      strcat(line, "(");  // NOLINT(runtime/printf)
-      strcat(line, Safe::itoa(getppid(), memory));  // NOLINT(runtime/printf)
-      strcat(line, ")");  // NOLINT(runtime/printf)
-      if (color_output_) {
-        strcat(line, "\033[0m");  // NOLINT(runtime/printf)
+      // The function type itself is never printed alone
+      DemangleAddSubstitution(d, begin, kFragmentInvalid);
+      kind = c == 'R'? kFragmentFunctionReference : kFragmentFunction;
+    } else {
+      FragmentKind inner = DemangleType(d);
+      if (inner == kFragmentArray) {
+        // A pointer or a reference to an array: element (*) [size]
+        DemangleInsertBeforeDimensions(d, begin, c == 'P'? " (*)" :
+                                       c == 'R'? " (&)" : " (&&)");
+        kind = c == 'R'? kFragmentFunctionReference : kFragmentFunction;
+      } else if (c == 'P' || inner == kFragmentPlain) {
+        if (inner != kFragmentPlain) {
+          d->error = true;
+        }
+        DemangleAppend(d, modifier);
+        kind = c == 'P'? kFragmentPlain : c == 'R'?
+            kFragmentReference : kFragmentRvalueReference;
+      } else if (inner == kFragmentRvalueReference && c == 'R') {
+        // Reference collapsing: & && is &
+        d->length--;
+        kind = kFragmentReference;
+      } else if (inner == kFragmentReference ||
+                 inner == kFragmentRvalueReference ||
+                 inner == kFragmentFunctionReference) {
+        kind = inner;
+      } else {
+        d->error = true;
       }
     }
+  } else if (c == 'F') {
+    d->pos++;
+    if (*d->pos == 'Y') {
+      d->error = true;
+    }
+    FragmentKind result = DemangleType(d);
+    if (!DemangleCanPrecedeName(result)) {
+      d->error = true;
+    }
+    DemangleAppend(d, " ");
+    DemangleParameters(d);
+    if (*d->pos++ != 'E') {
+      d->error = true;
+    }
+    kind = kFragmentFunction;
+  } else if (c == 'A') {
+    DemangleArray(d);
+    kind = kFragmentArray;
+  } else if (c == 'M') {
+    kind = DemangleMemberPointer(d);
+  } else if (c == 'T') {
+    size_t index;
+    kind = DemangleTemplateParam(d, &index);
+    if (!d->error) {
+      DemangleAddSubstitution(d, index, kFragmentTemplateParam);
+    }
+    if (*d->pos == 'I' && !d->error) {
+      DemangleTemplateArgs(d, false);
+    } else {
+      candidate = false;
+    }
+  } else if (c == 'S' && d->pos[1] != 't') {
+    kind = DemangleSubstitution(d);
+    if (*d->pos == 'I' && !d->error) {
+      DemangleTemplateArgs(d, false);
+    } else {
+      candidate = false;
+    }
+  } else if (c == 'N' || c == 'Z' || c == 'S' || (c >= '0' && c <= '9')) {
+    DemangledName info;
+    DemangleName(d, false, &info);
+    if (info.qualifier_count > 0) {
+      d->error = true;
+    }
+  } else {
+    d->error = true;
+  }
+  if (candidate && !d->error) {
+    DemangleAddSubstitution(d, begin, kind);
+  }
+  d->depth--;
+  return d->error? kFragmentInvalid : kind;
+}
 
-    strcat(line, "\n");  // NOLINT(runtime/printf)
-    print(line);
+/// @brief Returns the prefix of the <special-name>s T <letter> <type>.
+CRASH_PATH
+static const char* DemangleSpecialName(char c) {
+  switch (c) {
+    case 'V': return "vtable for ";
+    case 'T': return "VTT for ";
+    case 'I': return "typeinfo for ";
+    case 'S': return "typeinfo name for ";
+    default: return NULL;
+  }
+}
+
+/// @brief Parses <encoding> ::= <name> [<bare-function-type>] |
+/// <special-name>.
+/// @param return_type Whether to print the return type of a function
+/// template; the functions which enclose local names omit it.
+CRASH_PATH
+static void DemangleEncoding(Demangler* d, bool return_type) {
+  if (++d->depth > kMaxDemangleDepth) {
+    d->error = true;
+    return;
+  }
+  if (d->pos[0] == 'T' && (d->pos[1] == 'h' || d->pos[1] == 'v')) {
+    bool virtual_thunk = d->pos[1] == 'v';
+    d->pos += 2;
+    for (int i = 0; i < (virtual_thunk? 2 : 1) && !d->error; i++) {
+      if (*d->pos == 'n') {
+        d->pos++;
+      }
+      DemangleNumber(d);
+      if (*d->pos++ != '_') {
+        d->error = true;
+      }
+    }
+    DemangleAppend(d, virtual_thunk? "virtual thunk to " :
+                   "non-virtual thunk to ");
+    DemangleEncoding(d, return_type);
+  } else if (d->pos[0] == 'T' && (d->pos[1] == 'W' || d->pos[1] == 'H')) {
+    DemangleAppend(d, d->pos[1] == 'W'? "TLS wrapper function for " :
+                   "TLS init function for ");
+    d->pos += 2;
+    DemangledName info;
+    DemangleName(d, true, &info);
+  } else if (d->pos[0] == 'T' && DemangleSpecialName(d->pos[1]) != NULL) {
+    DemangleAppend(d, DemangleSpecialName(d->pos[1]));
+    d->pos += 2;
+    DemangleType(d);
+  } else if (d->pos[0] == 'T' && d->pos[1] == 'C') {
+    // TC <derived type> <offset> _ <base type>, printed base first
+    DemangleAppend(d, "construction vtable for ");
+    d->pos += 2;
+    size_t begin = d->length;
+    DemangleType(d);
+    DemangleNumber(d);
+    if (*d->pos++ != '_') {
+      d->error = true;
+    }
+    size_t middle = d->length;
+    DemangleType(d);
+    DemangleAppend(d, "-in-");
+    if (!d->error) {
+      DemangleMoveReturnType(d, begin, middle);
+    }
+  } else if (d->pos[0] == 'G' && d->pos[1] == 'V') {
+    DemangleAppend(d, "guard variable for ");
+    d->pos += 2;
+    DemangledName info;
+    DemangleName(d, true, &info);
+  } else if (d->pos[0] == 'G' && d->pos[1] == 'T' &&
+             (d->pos[2] == 't' || d->pos[2] == 'n')) {
+    DemangleAppend(d, d->pos[2] == 't'? "transaction clone for " :
+                   "non-transaction clone for ");
+    d->pos += 3;
+    DemangleEncoding(d, return_type);
+  } else if (d->pos[0] == 'T' || d->pos[0] == 'G') {
+    d->error = true;
+  } else {
+    size_t begin = d->length;
+    DemangledName info;
+    DemangleName(d, true, &info);
+    if (*d->pos != 0 && *d->pos != 'E' && *d->pos != '.' && !d->error) {
+      if (info.template_args && !info.no_return) {
+        size_t middle = d->length;
+        FragmentKind result = DemangleType(d);
+        if (!DemangleCanPrecedeName(result)) {
+          d->error = true;
+        }
+        DemangleAppend(d, " ");
+        if (!return_type) {
+          // The candidates inside the return type cannot be printed
+          for (int i = 0; i < d->substitution_count; i++) {
+            if (d->substitutions[i].begin >= middle &&
+                d->substitutions[i].kind != kFragmentTemplateParam) {
+              d->substitutions[i].kind = kFragmentInvalid;
+            }
+          }
+          d->length = middle;
+        } else if (!d->error) {
+          DemangleMoveReturnType(d, begin, middle);
+        }
+      }
+      DemangleParameters(d);
+      for (int i = 0; i < info.qualifier_count; i++) {
+        DemangleAppend(d, info.qualifiers[i]);
+      }
+    }
+  }
+  d->depth--;
+}
+
+/// @brief Demangles a C++ symbol name the way c++filt does.
+/// Async-signal-safe.
+/// @return false if the name is not mangled, does not fit or uses the
+/// constructs which are not supported, e.g. expressions.
+CRASH_PATH
+static bool Demangle(const char* mangled, char* buffer, size_t size) {
+  if (strncmp(mangled, "_Z", 2)) {
+    return false;
+  }
+  Demangler d;
+  d.pos = mangled + 2;
+  d.out = buffer;
+  d.size = size;
+  d.length = 0;
+  d.last_char = 0;
+  d.error = false;
+  d.depth = 0;
+  d.conversion = false;
+  d.substitution_count = 0;
+  d.template_arg_count = 0;
+  d.pack_element_count = 0;
+  d.pack_index = d.pack_length = -1;
+  d.last_name = NULL;
+  d.last_name_begin = d.last_name_end = 0;
+  DemangleEncoding(&d, true);
+  // Clone suffixes: .constprop.0, .isra.0, .part.0, .cold
+  while (d.pos[0] == '.' && !d.error &&
+         ((d.pos[1] >= 'a' && d.pos[1] <= 'z') || d.pos[1] == '_' ||
+          (d.pos[1] >= '0' && d.pos[1] <= '9'))) {
+    const char* suffix = d.pos;
+    d.pos += 2;
+    while ((*d.pos >= 'a' && *d.pos <= 'z') || *d.pos == '_' ||
+           (*d.pos >= '0' && *d.pos <= '9')) {
+      d.pos++;
+    }
+    while (d.pos[0] == '.' && d.pos[1] >= '0' && d.pos[1] <= '9') {
+      d.pos += 2;
+      while (*d.pos >= '0' && *d.pos <= '9') {
+        d.pos++;
+      }
+    }
+    DemangleAppend(&d, " [clone ");
+    DemangleAppend(&d, suffix, d.pos - suffix);
+    DemangleAppend(&d, "]");
+  }
+  if (d.error || *d.pos != 0) {
+    return false;
+  }
+  buffer[d.length] = 0;
+  return true;
+}
+
+/// @brief Copies the mangled name number index of the module into name,
+/// which must fit kMaxSymbolNameLength characters and the terminating
+/// null; at most kSymbolNameBlockNames names are decoded.
+CRASH_PATH
+static void DecodeSymbolName(const LineTableModule& module, uint32_t index,
+                             char* name) {
+  const unsigned char* data = reinterpret_cast<const unsigned char*>(
+      line_table.data + module.name_data + reinterpret_cast<const uint32_t*>(
+          line_table.data + module.name_blocks)[index / kSymbolNameBlockNames]);
+  DwarfReader reader = {
+      data, data + kSymbolNameBlockNames * (kMaxSymbolNameLength + 3), false };
+  size_t length = 0;
+  for (unsigned i = 0; i <= index % kSymbolNameBlockNames; i++) {
+    if (i > 0) {
+      uint64_t prefix = reader.Uleb();
+      length = prefix < length? prefix : length;
+    }
+    while (*reader.pos != 0 && length < kMaxSymbolNameLength) {
+      name[length++] = *reader.pos++;
+    }
+    reader.pos++;
+  }
+  name[length] = 0;
+}
+
+/// @brief Finds the location of the address in the line table and formats
+/// it the way addr2line does: "function\nfile:line\n", falling back to
+/// "function\nimage:image_address\n". Async-signal-safe.
+/// @param return_address If true, the address follows a call instruction.
+/// @return NULL if the function is not known or its name cannot be
+/// demangled, so that addr2line symbolizes the frame.
+CRASH_PATH
+static char* LookupLineTable(const void* address, bool return_address,
+                             const char* image, const void* image_address,
+                             char** memory) {
+  uintptr_t pc = reinterpret_cast<uintptr_t>(address) - return_address;
+  const LineTableModule* module = NULL;
+  for (int i = 0; i < line_table_module_count; i++) {
+    const LineTableModule& candidate = line_table_modules[i];
+    if (pc >= candidate.bias + candidate.low &&
+        pc < candidate.bias + candidate.high) {
+      module = &candidate;
+      break;
+    }
+  }
+  if (module == NULL || module->function_count == 0) {
+    return NULL;
+  }
+  uint64_t vaddr = pc - module->bias;
+  const LineTableFunction* functions =
+      reinterpret_cast<const LineTableFunction*>(
+          line_table.data + module->functions);
+  size_t low = 0, high = module->function_count;
+  while (high - low > 1) {
+    size_t middle = (low + high) / 2;
+    if (functions[middle].address <= vaddr) {
+      low = middle;
+    } else {
+      high = middle;
+    }
+  }
+  const LineTableFunction& function = functions[low];
+  if (vaddr < function.address || vaddr >= function.address + function.size) {
+    return NULL;
+  }
+
+  const char* file = NULL;
+  uint64_t line_number = 0;
+  if (module->block_count > 0) {
+    const LineTableBlock* blocks = reinterpret_cast<const LineTableBlock*>(
+        line_table.data + module->blocks);
+    low = 0;
+    high = module->block_count;
+    while (high - low > 1) {
+      size_t middle = (low + high) / 2;
+      if (blocks[middle].address <= vaddr) {
+        low = middle;
+      } else {
+        high = middle;
+      }
+    }
+    if (blocks[low].address <= vaddr) {
+      const unsigned char* data = reinterpret_cast<const unsigned char*>(
+          line_table.data + module->data + blocks[low].offset);
+      DwarfReader reader = { data, data + kLineTableBlockRows * 30, false };
+      uint64_t row_address = blocks[low].address;
+      uint64_t row_file = reader.Uleb();
+      uint64_t row_line = reader.Uleb();
+      unsigned rows = module->row_count - low * kLineTableBlockRows;
+      if (rows > kLineTableBlockRows) {
+        rows = kLineTableBlockRows;
+      }
+      for (unsigned i = 1; i < rows; i++) {
+        uint64_t delta = reader.Uleb();
+        uint64_t next_file = row_file;
+        if (delta & 1) {
+          next_file = reader.Uleb();
+        }
+        int64_t line_delta = reader.Sleb();
+        if (row_address + (delta >> 1) > vaddr) {
+          break;
+        }
+        row_address += delta >> 1;
+        row_file = next_file;
+        row_line += line_delta;
+      }
+      if (row_line != 0 && row_file < module->file_count) {
+        file = line_table.data + reinterpret_cast<const uint32_t*>(
+            line_table.data + module->files)[row_file];
+        line_number = row_line;
+      }
+    }
+  }
+
+  char* line = *memory;
+  const int line_max_length = 4096;
+  // The name is only needed until it is demangled
+  char* name = line + line_max_length;
+  DecodeSymbolName(*module, function.name, name);
+  if (!Demangle(name, line, 2000)) {
+    if (!strncmp(name, "_Z", 2)) {
+      // A construct the demangler does not support, let addr2line do it
+      return NULL;
+    }
+    line[0] = 0;
+    strncat(line, name, 2000);
+  }
+  *memory += line_max_length;
+  strcat(line, "\n");  // NOLINT(runtime/printf)
+  if (file != NULL) {
+    strncat(line, file, 1800);
+    strcat(line, ":");  // NOLINT(runtime/printf)
+    strcat(line, Safe::utoa(line_number, *memory));  // NOLINT(*)
+  } else {
+    strncat(line, image, 1800);
+    strcat(line, ":");  // NOLINT(runtime/printf)
+    strcat(line, Safe::ptoa(image_address, *memory));  // NOLINT(*)
+  }
+  strcat(line, "\n");  // NOLINT(runtime/printf)
+  return line;
+}
+
+/// @brief The memory ranges locked by LockCrashPath().
+struct LockedRange {
+  uintptr_t start;
+  size_t size;
+};
+
+static const int kMaxLockedRanges = 16;
+static LockedRange locked_ranges[kMaxLockedRanges];
+static int locked_range_count = 0;
+
+/// @brief Adds the page aligned range to locked_ranges, merging it with
+/// an overlapping one.
+static void AddLockedRange(const void* start, size_t size) {
+  const uintptr_t page_size = getpagesize();
+  uintptr_t begin = reinterpret_cast<uintptr_t>(start) & ~(page_size - 1);
+  uintptr_t end = (reinterpret_cast<uintptr_t>(start) + size + page_size - 1) &
+      ~(page_size - 1);
+  if (start == NULL || size == 0 || locked_range_count == kMaxLockedRanges) {
+    return;
+  }
+  for (int i = 0; i < locked_range_count; i++) {
+    LockedRange& range = locked_ranges[i];
+    if (begin <= range.start + range.size && end >= range.start) {
+      uintptr_t range_end = range.start + range.size;
+      range.start = begin < range.start? begin : range.start;
+      range.size = (end > range_end? end : range_end) - range.start;
+      return;
+    }
+  }
+  locked_ranges[locked_range_count].start = begin;
+  locked_ranges[locked_range_count].size = end - begin;
+  locked_range_count++;
+}
+
+/// @brief Adds the executable segment of the ELF image which contains
+/// the specified function.
+static void AddExecutableSegment(const void* function) {
+  Dl_info info;
+  uintptr_t bias;
+  if (function == NULL || dladdr(function, &info) == 0 ||
+      !ElfLoadBias(info.dli_fbase, &bias)) {
+    return;
+  }
+  const ElfW(Ehdr)* ehdr = reinterpret_cast<const ElfW(Ehdr)*>(
+      info.dli_fbase);
+  const ElfW(Phdr)* phdrs = reinterpret_cast<const ElfW(Phdr)*>(
+      reinterpret_cast<const char*>(info.dli_fbase) + ehdr->e_phoff);
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    if (phdrs[i].p_type == PT_LOAD && (phdrs[i].p_flags & PF_X)) {
+      AddLockedRange(reinterpret_cast<const void*>(bias + phdrs[i].p_vaddr),
+                     phdrs[i].p_memsz);
+    }
+  }
+}
+
+/// @brief Adds the code of the specified function, its size being looked up
+/// in the symbol table of the image.
+static void AddFunction(const void* function) {
+  Dl_info info;
+  uintptr_t bias;
+  if (function == NULL || dladdr(function, &info) == 0 ||
+      !ElfLoadBias(info.dli_fbase, &bias)) {
+    return;
+  }
+  const char* path = info.dli_fname;
+  char executable[PATH_MAX];
+  if (path[0] != '/') {
+    ssize_t len = readlink("/proc/self/exe", executable,
+                           sizeof(executable) - 1);
+    executable[len > 0? len : 0] = 0;
+    path = executable;
+  }
+  size_t image_size;
+  const ElfW(Ehdr)* ehdr = MapElfFile(path, &image_size);
+  if (ehdr == NULL) {
+    return;
+  }
+  const char* image = reinterpret_cast<const char*>(ehdr);
+  const ElfW(Shdr)* shdrs = reinterpret_cast<const ElfW(Shdr)*>(
+      image + ehdr->e_shoff);
+  uintptr_t address = reinterpret_cast<uintptr_t>(function) - bias;
+  size_t size = 0;
+  for (int i = 0; i < ehdr->e_shnum && size == 0; i++) {
+    if ((shdrs[i].sh_type != SHT_SYMTAB && shdrs[i].sh_type != SHT_DYNSYM) ||
+        shdrs[i].sh_offset + shdrs[i].sh_size > image_size) {
+      continue;
+    }
+    const ElfW(Sym)* symbols = reinterpret_cast<const ElfW(Sym)*>(
+        image + shdrs[i].sh_offset);
+    for (size_t j = 0; j < shdrs[i].sh_size / sizeof(ElfW(Sym)); j++) {
+      if (symbols[j].st_value == address && symbols[j].st_size > 0) {
+        size = symbols[j].st_size;
+        break;
+      }
+    }
+  }
+  munmap(const_cast<ElfW(Ehdr)*>(ehdr), image_size);
+  AddLockedRange(function, size);
+}
+
+bool DeathHandler::lock_crash_path() const {
+  return lock_crash_path_;
+}
+
+bool DeathHandler::set_lock_crash_path(bool value) {
+  lock_crash_path_ = value;
+  return LockCrashPath();
+}
+
+size_t DeathHandler::locked_memory() const {
+  return locked_memory_;
+}
+
+bool DeathHandler::LockCrashPath() {
+  for (int i = 0; i < locked_range_count; i++) {
+    munlock(reinterpret_cast<void*>(locked_ranges[i].start),
+            locked_ranges[i].size);
+  }
+  locked_range_count = 0;
+  locked_memory_ = 0;
+  if (!lock_crash_path_) {
+    return true;
+  }
+  AddLockedRange(__start_death_handler_text,
+                 __stop_death_handler_text - __start_death_handler_text);
+  AddFunction(reinterpret_cast<void*>(signal_handler_));
+  AddFunction(reinterpret_cast<void*>(trace_printer_));
+  AddLockedRange(memory_, kNeededMemory);
+  stack_t altstack;
+  if (sigaltstack(NULL, &altstack) == 0 && altstack.ss_sp == altstack_) {
+    AddLockedRange(altstack_, sizeof(altstack_));
+  }
+  AddLockedRange(line_table.data, line_table.size);
+  AddLockedRange(crash_loop_state_, sizeof(CrashLoopState));
+  AddLockedRange(metrics_, sizeof(HandlerMetrics));
+  if (compress_output_) {
+    AddLockedRange(&compression, sizeof(compression));
+  }
+  AddExecutableSegment(reinterpret_cast<void*>(write));
+  // backtrace() has already loaded the unwinder
+  AddExecutableSegment(dlsym(RTLD_DEFAULT, "_Unwind_Backtrace"));
+
+  bool result = true;
+  const size_t page_size = getpagesize();
+  for (int i = 0; i < locked_range_count; i++) {
+    const LockedRange& range = locked_ranges[i];
+    if (mlock(reinterpret_cast<void*>(range.start), range.size) == 0) {
+      locked_memory_ += range.size;
+      continue;
+    }
+    if (result) {
+      perror("DeathHandler - mlock()");
+      result = false;
+    }
+    // At least fault the pages in
+    for (size_t offset = 0; offset < range.size; offset += page_size) {
+      *reinterpret_cast<volatile const char*>(range.start + offset);
+    }
+  }
+  return result;
+}
+#endif  // #ifdef __linux__
+
+#if (__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#endif
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+#endif
+
+#ifdef __linux__
+/// @brief When the current report started, for the metrics.
+static struct timespec handler_started;
+#endif
+
+CRASH_PATH
+bool DeathHandler::BeginHandling() {
+#ifdef __linux__
+  clock_gettime(CLOCK_MONOTONIC, &handler_started);
+  if (resource_snapshot_) {
+    ReopenResourceFiles();
+  }
+#endif
+  // Give the memory back before fork() and addr2line need it
+  void* ballast = __sync_lock_test_and_set(&ballast_, NULL);
+  if (ballast != NULL) {
+    munmap(ballast, ballast_size_);
+  }
+#ifdef __linux__
+  bool minimal = UpdateCrashLoopState();
+  if (metrics_ != NULL) {
+    CountMetric(&metrics_->crashes_handled, 1);
+  }
+  return minimal;
+#else
+  return false;
+#endif
+}
+
+CRASH_PATH
+void DeathHandler::EndHandling() {
+#ifdef __linux__
+  // The stack usage has already been reported by the child
+  stack_usage_tracking_ = false;
+#endif
+#ifdef QUICK_EXIT
+  if (quick_exit_) {
+    ::quick_exit(EXIT_FAILURE);
+  }
+#endif
+}
+
+CRASH_PATH
+void DeathHandler::AbortWithCoreDump() {
+  struct sigaction sa;
+  sigaction(SIGABRT, NULL, &sa);
+  sa.sa_handler = SIG_DFL;
+  sigaction(SIGABRT, &sa, NULL);
+  abort();
+}
+
+CRASH_PATH
+char* DeathHandler::FormatNumber(uint64_t value, char* memory) {
+  return Safe::utoa(value, memory);
+}
+
+CRASH_PATH
+char* DeathHandler::FormatPointer(const void* value, char* memory) {
+  return Safe::ptoa(value, memory);
+}
+
+CRASH_PATH __attribute__((noinline))
+int DeathHandler::CaptureStackTrace(void* secret, int frames_count,
+                                    void*** trace_ptr, const char*** notes,
+                                    char** memory) {
+  void** trace = reinterpret_cast<void**>(*memory);
+  *trace_ptr = trace;
+  *notes = NULL;
+  *memory += (frames_count + 3) * sizeof(void*);
+#ifdef __linux__
+  uintptr_t* code_ranges = reinterpret_cast<uintptr_t*>(*memory);
+  *memory += kMaxCodeRanges * 2 * sizeof(uintptr_t);
+  uintptr_t stack_end = 0;
+  int code_range_count = ReadCodeRanges(StackPointer(secret), code_ranges,
+                                        &stack_end, *memory);
+  // The unwinder reads the interrupted instruction and faults on a jump
+  // to garbage, e.g. through a smashed return address
+  bool unwindable = code_range_count == 0 || FindCodeRange(
+      reinterpret_cast<uintptr_t>(InstructionPointer(secret)), code_ranges,
+      code_range_count) >= 0;
+#else
+  (void)secret;
+  bool unwindable = true;
+#endif
+  // Workaround malloc() inside backtrace()
+  heap_trap_active_ = true;
+#if defined(__arm__) && defined(__linux__)
+  int trace_size = 0;
+  if (unwindable && stack_end != 0) {
+    uint32_t registers[16];
+    ContextRegisters(secret, registers);
+    // Laid out as backtrace() would do it from this function
+    trace_size = 2 + UnwindExidx(registers, stack_end, trace + 2,
+                                 frames_count + 1);
+    trace[0] = trace[1] = trace[2];
+  }
+  if (trace_size <= 3 && unwindable) {
+    trace_size = backtrace(trace, frames_count + 3);
+  }
+#else
+  int trace_size = unwindable? backtrace(trace, frames_count + 3) : 0;
+#endif
+  heap_trap_active_ = false;
+  // trace[0] is this function, the signal handler comes next
+  if (trace_size > 0) {
+    memmove(trace, trace + 1, --trace_size * sizeof(void*));
+  }
+
+#ifdef __linux__
+  if (trace_size <= 2 && stack_end != 0) {
+    // The stack is corrupted, fall back to scanning
+    *notes = reinterpret_cast<const char**>(*memory);
+    *memory += (frames_count + 2) * sizeof(char*);
+    (*notes)[0] = (*notes)[1] = NULL;
+    trace_size = 2 + ScanStack(StackPointer(secret), stack_end, code_ranges,
+                               code_range_count, trace + 2, *notes + 2,
+                               frames_count);
+  } else if (trace_size < 2) {
+    trace_size = 2;
   }
 
+  // Overwrite sigaction with caller's address
+  trace[1] = InstructionPointer(secret);
+#elif defined(__APPLE__)
+  if (trace_size <= 2) {
+    safe_abort();
+  }
+#endif
+  return trace_size;
+}
+
+CRASH_PATH
+void DeathHandler::EndReport(void* info, bool truncated, bool minimal,
+                             bool color_output) {
+#ifdef __linux__
+  if (resource_snapshot_ && !minimal) {
+    PrintResourceSnapshot();
+  }
+  if (stack_usage_tracking_ && !minimal) {
+    PrintStackUsageReport(reinterpret_cast<siginfo_t*>(info)->si_addr,
+                          color_output);
+  }
+
+  FlushOutput();
+  if (metrics_ != NULL) {
+    if (minimal || truncated) {
+      CountMetric(&metrics_->reports_truncated, 1);
+    }
+    RecordHandlerDuration(metrics_, handler_started);
+  }
   // Write '\0' to indicate the end of the output
   char end = '\0';
   ssize_t ret = write(STDERR_FILENO, &end, 1);
   (void)ret;
+#else
+  (void)info;
+  (void)truncated;
+  (void)minimal;
+  (void)color_output;
+  FlushOutput();
+#endif
+}
 
-#elif defined(__APPLE__)
-  for (int i = 0; i < trace_size; i++) {
-    Safe::ptoa(trace[i], memory);
-    strcat(memory, "\n");
-    print(memory);
+#ifdef __linux__
+CRASH_PATH
+char* DeathHandler::BeginStackTrace(char* memory, char** executable,
+                                    char** cwd, bool live) {
+  const int path_max_length = 2048;
+  char* name_buf = memory;
+  ssize_t name_buf_length = readlink("/proc/self/exe", name_buf,
+                                     path_max_length - 1);
+  if (name_buf_length < 1) {
+    SymbolizationFailed(live);
+    strcpy(name_buf, "?");  // NOLINT(runtime/printf)
+    name_buf_length = 1;
   }
-#endif
-  if (thread_safe_) {
-    // Resume the parent process
-    kill(getppid(), SIGCONT);
+  name_buf[name_buf_length] = 0;
+  memory += name_buf_length + 1;
+  *executable = name_buf;
+  *cwd = memory;
+  if (getcwd(*cwd, path_max_length) == NULL) {
+    // E.g. the directory was removed by a deployment
+    SymbolizationFailed(live);
+    (*cwd)[0] = 0;
+  }
+  strcat(*cwd, "/");  // NOLINT(runtime/printf)
+  return memory + strlen(*cwd) + 1;
+}
+
+CRASH_PATH
+void DeathHandler::PrintRawFrame(int index, void* address, const char* note,
+                                 const char* executable, char* memory) {
+  char* line = FormatRawFrame(index, address, executable, memory);
+  if (note != NULL) {
+    line[strlen(line) - 1] = 0;
+    strcat(line, note);  // NOLINT(runtime/printf)
+    strcat(line, "\n");  // NOLINT(runtime/printf)
   }
+  print(line);
+}
 
-  // This is called in the child process
-  _Exit(EXIT_SUCCESS);
+CRASH_PATH
+char* DeathHandler::SymbolizeFrame(void* address, bool return_address,
+                                   const char* executable, bool color_output,
+                                   bool live, char** memory) {
+  const char* image = executable;
+  const char* image_file = NULL;
+  char pinned[48];
+  void* image_address = address;
+  Dl_info dlinf;
+  uintptr_t bias;
+  if (dladdr(address, &dlinf) != 0 &&
+      ElfLoadBias(dlinf.dli_fbase, &bias)) {
+    if (dlinf.dli_fname[0] == '/' && strcmp(executable, dlinf.dli_fname)) {
+      image = dlinf.dli_fname;
+    }
+    // Position independent executables are relocated, too
+    image_address = reinterpret_cast<void *>(
+        reinterpret_cast<uintptr_t>(address) - bias);
+    image_file = PinnedModulePath(bias, getpid(), pinned);
+  }
+  char *line = LookupLineTable(address, return_address, image,
+                               image_address, memory);
+  if (line == NULL) {
+    line = addr2line(image, image_file != NULL? image_file : image,
+                     image_address, color_output, live, memory);
+  }
+  if (metrics_ != NULL) {
+    CountMetric(line != NULL && strncmp(line, "??", 2)?
+                &metrics_->symbolization_hits :
+                &metrics_->symbolization_misses, 1);
+  }
+  return line;
 }
+#endif  // #ifdef __linux__
 
 #if (__GNUC__ > 4) || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6)
 #pragma GCC diagnostic pop
@@ -737,3 +6161,48 @@ void DeathHandler::HandleSignal(int sig, void * /* info */, void *secret) {
 #endif
 
 }  // namespace Debug
+
+#ifdef __linux__
+int pthread_create(pthread_t* thread, const pthread_attr_t* attr,
+                   void* (*start_routine)(void*), void* arg) throw() {
+  typedef int (*pthread_create_func)(pthread_t*, const pthread_attr_t*,
+                                     void* (*)(void*), void*);
+  if (Debug::DeathHandler::pthread_create_ == NULL) {
+    Debug::DeathHandler::pthread_create_ = dlsym(RTLD_NEXT, "pthread_create");
+  }
+  pthread_create_func original = reinterpret_cast<pthread_create_func>(
+      Debug::DeathHandler::pthread_create_);
+  if (!Debug::DeathHandler::stack_usage_tracking_) {
+    return original(thread, attr, start_routine, arg);
+  }
+  Debug::TrackedThread* tracked = NULL;
+  for (int i = 0; i < Debug::kMaxTrackedThreads; i++) {
+    if (__sync_bool_compare_and_swap(&Debug::tracked_threads[i].state,
+                                     Debug::TrackedThread::kFree,
+                                     Debug::TrackedThread::kStarting)) {
+      tracked = &Debug::tracked_threads[i];
+      break;
+    }
+  }
+  if (tracked == NULL) {
+    return original(thread, attr, start_routine, arg);
+  }
+  void* stack_addr = NULL;
+  size_t stack_size;
+  if (attr != NULL) {
+    pthread_attr_getstack(attr, &stack_addr, &stack_size);
+  }
+  tracked->start_routine = start_routine;
+  tracked->arg = arg;
+  tracked->own_stack = stack_addr == NULL;
+  tracked->stack_low = NULL;
+  tracked->stack_high = NULL;
+  tracked->guard_size = 0;
+  tracked->altstack = NULL;
+  int res = original(thread, attr, Debug::TrackedThreadStart, tracked);
+  if (res != 0) {
+    tracked->state = Debug::TrackedThread::kFree;
+  }
+  return res;
+}
+#endif  // #ifdef __linux__
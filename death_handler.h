@@ -54,7 +54,9 @@
 #ifndef DEATH_HANDLER_H_
 #define DEATH_HANDLER_H_
 
+#include <pthread.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <unistd.h>
 
 // We have to override malloc() and free()
@@ -63,6 +65,9 @@ void* __malloc_impl(size_t size);
 #ifdef __linux__
 void* malloc(size_t size) throw();
 void free(void* ptr) throw();
+// pthread_create() is overridden to measure the thread stacks usage
+int pthread_create(pthread_t* thread, const pthread_attr_t* attr,
+                   void* (*start_routine)(void*), void* arg) throw();
 #elif defined(__APPLE__)
 void* __malloc_zone(struct _malloc_zone_t* zone, size_t size);
 void __free_zone(struct _malloc_zone_t* zone, void* ptr);
@@ -76,6 +81,43 @@ void __free_zone(struct _malloc_zone_t* zone, void* ptr);
 
 namespace Debug {
 
+struct RuntimePolicy;
+template <class Policy> class BasicDeathHandler;
+
+/// @brief The layout of the shared memory metrics page, see
+/// DeathHandler::set_metrics_page(). The counters only grow and are updated
+/// with relaxed atomic increments, so an exporter may read them at any time.
+struct HandlerMetrics {
+  static const uint32_t kMagic = 0x52544D44;  // "DMTR"
+  static const int kDurationBuckets = 16;
+
+  uint32_t magic;
+  /// @brief sizeof(HandlerMetrics), the fields are only ever appended.
+  uint32_t size;
+  uint64_t crashes_handled;
+  /// @brief The reports cut short: the stack was deeper than frames_count
+  /// or the crash loop detection switched to the minimal mode.
+  uint64_t reports_truncated;
+  /// @brief The frames resolved to a function and the frames which failed
+  /// to resolve, printed as "??" or as raw addresses. The frames printed
+  /// raw on purpose, with symbolize off or under a crash loop, are not
+  /// counted.
+  uint64_t symbolization_hits;
+  uint64_t symbolization_misses;
+  /// @brief The all-thread dumps printed by the shutdown watchdog.
+  uint64_t live_dumps;
+  /// @brief Bucket i counts the reports which took less than 2^i
+  /// milliseconds, the last one counts the rest.
+  uint64_t handler_duration[kDurationBuckets];
+};
+
+/// @brief The state of a DEATH_HANDLER_WARN_ONCE() call site, zero until
+/// it fires. The warning symbolizer thread resets it when the rate limit
+/// window opens.
+struct WarnSite {
+  int fired;
+};
+
 /// @brief This class installs a SEGFAULT signal handler to print
 /// a nice stack trace and (if requested) generate a core dump.
 /// @details In DeathHandler's constructor, a SEGFAULT signal handler
@@ -210,6 +252,97 @@ class DeathHandler {
   /// @note Default value is true.
   void set_thread_safe(bool value);
 
+  /// @brief Returns the value indicating whether to convert the addresses
+  /// to function names and line numbers with addr2line.
+  /// @note Default value is true.
+  bool symbolize() const;
+
+  /// @brief Sets the value indicating whether to convert the addresses
+  /// to function names and line numbers with addr2line.
+  /// @details If symbolize is set to false, each frame is printed as
+  /// "#<n> 0x<address> <module> build-id=<hex>", where the address is
+  /// relative to the module's ELF image, and the report starts with
+  /// the Unix time of the crash. Such raw reports are cheap to produce and
+  /// can be symbolized and aggregated later with tools/crash_aggregate.
+  /// @note Default value is true.
+  void set_symbolize(bool value);
+
+#ifdef __linux__
+  /// @brief Returns the path to the file which keeps the recent crash times
+  /// to detect crash loops, or NULL if the detection is disabled.
+  /// @note Default value is NULL.
+  const char* crash_loop_file() const;
+
+  /// @brief Sets the path to the file which keeps the recent crash times
+  /// to detect crash loops. NULL disables the detection.
+  /// @details The file is created if needed and mapped into memory right
+  /// away; it is supposed to survive the restarts of the process. When
+  /// at least crash_loop_threshold crashes happen within
+  /// crash_loop_window seconds, the signal handler switches to the minimal
+  /// mode: the raw addresses are printed without forking, and the process
+  /// exits right away with EXIT_FAILURE, overriding generate_core_dump and
+  /// cleanup, so that the loop does not keep writing cores.
+  /// The full reports are resumed after crash_loop_quiet_period seconds
+  /// without crashes.
+  /// @return false if the file could not be opened or mapped.
+  bool set_crash_loop_file(const char* path);
+
+  /// @brief Returns the number of crashes within crash_loop_window which
+  /// enables the minimal mode.
+  /// @note Default value is 5.
+  int crash_loop_threshold() const;
+
+  /// @brief Sets the number of crashes within crash_loop_window which
+  /// enables the minimal mode. Accepted range is 1..32.
+  /// @note Default value is 5.
+  void set_crash_loop_threshold(int value);
+
+  /// @brief Returns the time window in seconds to count the crashes in.
+  /// @note Default value is 60.
+  int crash_loop_window() const;
+
+  /// @brief Sets the time window in seconds to count the crashes in.
+  /// @note Default value is 60.
+  void set_crash_loop_window(int value);
+
+  /// @brief Returns the time without crashes in seconds after which
+  /// the minimal mode is disabled.
+  /// @note Default value is 300.
+  int crash_loop_quiet_period() const;
+
+  /// @brief Sets the time without crashes in seconds after which
+  /// the minimal mode is disabled.
+  /// @note Default value is 300.
+  void set_crash_loop_quiet_period(int value);
+
+  /// @brief Returns the name of the shared memory object with the handler's
+  /// metrics, or NULL if they are not collected.
+  /// @note Default value is NULL.
+  const char* metrics_page() const;
+
+  /// @brief Sets the name of the shared memory object, e.g. "/myservice",
+  /// which is mapped to count the handled crashes, the symbolization hits
+  /// and misses, the live dumps and the handler durations. NULL disables
+  /// the metrics.
+  /// @details The object has the fixed HandlerMetrics layout, is created
+  /// if needed and may be shared by several processes; an exporter reads it
+  /// from /dev/shm without touching them.
+  /// @return false if the object could not be opened or mapped.
+  bool set_metrics_page(const char* name);
+#endif
+
+  /// @brief Returns the size of the memory ballast in bytes.
+  /// @note Default value is 0.
+  size_t memory_ballast() const;
+
+  /// @brief Sets the size of the memory ballast in bytes. 0 releases it.
+  /// @details The ballast is mapped and touched right away, so that it is
+  /// charged to the process and its cgroup, and the signal handler unmaps it
+  /// before doing anything else. When the process crashes close to its
+  /// memory limit, the released memory lets fork() and addr2line succeed.
+  /// @note Default value is 0.
+  void set_memory_ballast(size_t value);
+
   /// @brief Returns the current output callback.
   /// @note Default value is write to stderr.
   OutputCallback output_callback() const;
@@ -218,23 +351,338 @@ class DeathHandler {
   /// @note Default value is write to stderr.
   void set_output_callback(OutputCallback value);
 
+  /// @brief Returns the value indicating whether the reports are compressed
+  /// before they are passed to the output callback.
+  /// @note Default value is false.
+  bool compress_output() const;
+
+  /// @brief Sets the value indicating whether the reports are compressed
+  /// before they are passed to the output callback.
+  /// @details The compressor emits the LZ4 block format in 16 KiB blocks
+  /// with a 64 KiB window kept in static memory, so large all-thread dumps
+  /// shrink several times. tools/decompress_report restores the text.
+  /// @note Default value is false.
+  void set_compress_output(bool value);
+
+#ifdef __linux__
+  /// @brief Returns the value indicating whether to append the process
+  /// resources snapshot (RSS, page faults, threads, cgroup memory events and
+  /// pressure) to the stack trace.
+  /// @note Default value is true.
+  bool resource_snapshot() const;
+
+  /// @brief Sets the value indicating whether to append the process
+  /// resources snapshot (RSS, page faults, threads, cgroup memory events and
+  /// pressure) to the stack trace.
+  /// @details The corresponding /proc and cgroup files are opened in the
+  /// constructor, so that only pread() is needed in the signal handler.
+  /// A child forked afterwards reopens them when it crashes.
+  /// @note Default value is true.
+  void set_resource_snapshot(bool value);
+
+  /// @brief Returns the value indicating whether to measure the stack
+  /// high-water mark of the threads created with pthread_create().
+  /// @note Default value is false.
+  bool stack_usage_tracking() const;
+
+  /// @brief Sets the value indicating whether to measure the stack
+  /// high-water mark of the threads created with pthread_create().
+  /// @details Only the threads started after this property is set to true
+  /// are tracked. Each of them gets its unused stack pages discarded at
+  /// start, so that the deepest resident page reveals how far the stack grew,
+  /// and a dedicated signal handler stack, so that a stack overflow is still
+  /// reported. The usage is aggregated per thread name on thread exit and
+  /// printed at program exit, by PrintStackUsage() and in the crash report.
+  /// The bookkeeping of up to 4096 threads is mapped the first time the
+  /// tracking is enabled, so that it costs nothing otherwise.
+  /// @note Default value is false.
+  void set_stack_usage_tracking(bool value);
+
+  /// @brief Returns the percentage of the stack size starting from which
+  /// the thread is flagged as being close to overflow.
+  /// @note Default value is 90.
+  int stack_usage_threshold() const;
+
+  /// @brief Sets the percentage of the stack size starting from which
+  /// the thread is flagged as being close to overflow. Accepted range is
+  /// 1..100.
+  /// @note Default value is 90.
+  void set_stack_usage_threshold(int value);
+
+  /// @brief Prints the stack high-water marks of the tracked threads, both
+  /// exited (aggregated per thread name) and running, to the output callback.
+  void PrintStackUsage() const;
+
+  /// @brief Returns one in how many malloc() and free() calls of each thread
+  /// are timed. 0 disables the sampling.
+  /// @note Default value is 0.
+  int malloc_sampling() const;
+
+  /// @brief Sets one in how many malloc() and free() calls of each thread
+  /// are timed. 0 disables the sampling.
+  /// @details The sampled calls are timed with the cycle counter and counted
+  /// in per-thread histograms by size class and by the power of two of
+  /// the latency, so that the calls take no locks. The merged histograms are
+  /// printed at program exit and by PrintMallocLatency(). calloc() and
+  /// realloc() are not intercepted.
+  /// @note Default value is 0.
+  void set_malloc_sampling(int value);
+
+  /// @brief Returns the number of the slowest sampled calls whose stack
+  /// traces are kept.
+  /// @note Default value is 0.
+  int malloc_outliers() const;
+
+  /// @brief Sets the number of the slowest sampled calls whose stack traces
+  /// are kept. Accepted range is 0..16.
+  /// @note Default value is 0.
+  void set_malloc_outliers(int value);
+
+  /// @brief Prints the merged malloc() and free() latency histograms and
+  /// the stack traces of the slowest calls to the output callback.
+  void PrintMallocLatency() const;
+
+  /// @brief Returns the value indicating whether the code and the memory
+  /// used by the signal handler are locked in RAM.
+  /// @note Default value is false.
+  bool lock_crash_path() const;
+
+  /// @brief Sets the value indicating whether the code and the memory
+  /// used by the signal handler are locked in RAM.
+  /// @details Under memory pressure, the pages of the signal handler may be
+  /// evicted, so that the report takes major faults exactly when the system
+  /// is struggling. If set to true, the handler's own code section,
+  /// the preallocated memory, the signal handler stack, the line table and
+  /// the executable segments of libc and of the unwinder are faulted in and
+  /// locked with mlock(). If locking fails, e.g., because of RLIMIT_MEMLOCK,
+  /// the pages are only faulted in. The signal handler instantiation in use
+  /// is located through the symbol table, so it is not locked in stripped
+  /// binaries. Link with -Wl,-z,now so that the handler does not resolve
+  /// symbols lazily.
+  /// @return false if some of the ranges could not be locked.
+  bool set_lock_crash_path(bool value);
+
+  /// @brief Returns the number of bytes locked because of lock_crash_path.
+  size_t locked_memory() const;
+
+  /// @brief Decodes the DWARF line tables and the function symbols of all
+  /// the loaded ELF images into a compact in-memory table, so that the stack
+  /// traces are symbolized without running addr2line.
+  /// @details This is slow for large binaries and should be called off
+  /// the critical path, e.g. from a background thread at startup, and again
+  /// after dlopen(). The table is sorted by address and delta-encoded in
+  /// blocks of 16 rows, so that resolving a frame takes a binary search
+  /// over the block index and a short decode. The frames which are not
+  /// found in the table are still passed to addr2line.
+  /// @return false if nothing could be indexed.
+  bool LoadLineTable();
+
+  /// @brief Returns the number of threads LoadLineTable() decodes the line
+  /// programs of an image with; 0 means one per online CPU.
+  /// @note Default value is 1.
+  int line_table_threads() const;
+
+  /// @brief Sets the number of threads LoadLineTable() decodes the line
+  /// programs of an image with; 0 means one per online CPU.
+  /// @details The compilation units are distributed between the threads,
+  /// which steal the remaining units from each other when they run out,
+  /// and the sorted rows of each thread are merged at the end. The threads
+  /// inherit the scheduling policy of the caller, so LoadLineTable() should
+  /// be called from a low priority thread, e.g. one with SCHED_IDLE.
+  /// @note Default value is 1.
+  void set_line_table_threads(int value);
+
+  /// @brief Opens a read-only descriptor to each loaded ELF image, so that
+  /// the images are symbolized from the very files which are mapped, even
+  /// if they have been replaced on disk since.
+  /// @details addr2line and LoadLineTable() read the pinned files through
+  /// /proc/<pid>/fd. Call it at startup and again after dlopen(); the
+  /// descriptors of the unloaded images are closed.
+  /// @return The number of pinned images.
+  int PinModules();
+
+  /// @brief Returns the number of seconds the process is given to exit after
+  /// a termination request before the stacks of all its threads are dumped.
+  /// 0 means the shutdown is not watched.
+  /// @note Default value is 0.
+  int shutdown_timeout() const;
+
+  /// @brief Sets the number of seconds the process is given to exit after
+  /// a termination request before the stacks of all its threads are dumped.
+  /// 0 stops watching the shutdown.
+  /// @details A positive value starts a watchdog thread and installs
+  /// a SIGTERM handler which arms it and then calls the previous SIGTERM
+  /// handler. If the process is still alive shutdown_timeout seconds later,
+  /// every thread is interrupted with a real-time signal to collect its stack
+  /// trace, and the traces are printed to the output callback. At most 256
+  /// threads are dumped, the number of the others is printed. Note that
+  /// the signal makes some blocking calls of the stalled threads return EINTR.
+  /// Programs which install their own SIGTERM handler later on or shut
+  /// down for other reasons should call ArmShutdownWatchdog() themselves.
+  /// @note Default value is 0.
+  void set_shutdown_timeout(int value);
+
+  /// @brief Returns the value indicating whether to terminate the process
+  /// with _Exit(EXIT_FAILURE) after the stalled shutdown is reported.
+  /// @note Default value is false.
+  bool shutdown_force_exit() const;
+
+  /// @brief Sets the value indicating whether to terminate the process
+  /// with _Exit(EXIT_FAILURE) after the stalled shutdown is reported.
+  /// @note Default value is false.
+  void set_shutdown_force_exit(bool value);
+
+  /// @brief Starts the shutdown_timeout countdown, if it has not been started
+  /// yet. Async-signal-safe.
+  void ArmShutdownWatchdog() const;
+
+  /// @brief Returns the minimal number of seconds between the warnings from
+  /// the same DEATH_HANDLER_WARN_ONCE() call site, 0 if each one warns once,
+  /// or -1 if the warnings are disabled.
+  /// @note Default value is -1.
+  int warn_interval() const;
+
+  /// @brief Sets the minimal number of seconds between the warnings from
+  /// the same DEATH_HANDLER_WARN_ONCE() call site. 0 makes each one warn
+  /// only once, -1 disables the warnings.
+  /// @details The first call starts the thread which symbolizes and prints
+  /// the captured stack traces, so that the warning threads never fork or
+  /// block. The call sites which fire while the warnings are disabled stay
+  /// quiet afterwards.
+  /// @note Default value is -1.
+  void set_warn_interval(int value);
+
+  /// @brief Captures the stack trace of the DEATH_HANDLER_WARN_ONCE() call
+  /// site which has just fired and queues it for the symbolizer thread.
+  /// Never blocks.
+  static void Warn(WarnSite* site, const char* message, const char* file,
+                   int line) __attribute__((noinline, cold));
+#endif
+
+ protected:
+  typedef void (*SignalHandler)(int, void*, void*);
+  typedef void (*TracePrinter)(void**, const char* const*, int, pid_t, bool,
+                               bool, char*);
+
+  /// @brief Installs the specified instantiations of HandleSignal() and
+  /// PrintStackTrace().
+  DeathHandler(bool altstack, SignalHandler handler, TracePrinter printer);
+
  private:
+  friend struct RuntimePolicy;
+  template <class Policy> friend class BasicDeathHandler;
   friend void* ::__malloc_impl(size_t);
 #ifdef __linux__
   friend void* ::malloc(size_t) throw();
   friend void ::free(void*) throw();
+  friend int ::pthread_create(pthread_t*, const pthread_attr_t*,
+                              void* (*)(void*), void*) throw();
 #elif defined(__APPLE__)
   friend void* ::__malloc_zone(struct _malloc_zone_t*, size_t);
   friend void ::__free_zone(struct _malloc_zone_t*, void*);
 #endif
   /// @brief Reentrant printing to stderr.
-  inline static void print(const char* msg, size_t len = 0);
+  static void print(const char* msg, size_t len = 0);
+  /// @brief Ends the compressed stream of the report, if any.
+  static void FlushOutput();
 
   /// @brief The size of the statically preallocated memory available for
   /// the fallback shim malloc(). This value is readonly, apparently.
   static const size_t kNeededMemory;
 
+  void Install(bool altstack, SignalHandler handler, TracePrinter printer);
+
+  /// @brief The signal handler; Policy decides which formatting options are
+  /// applied. Defined in death_handler-inl.h, the parts which do not depend
+  /// on Policy are the members below.
+  template <class Policy>
   static void HandleSignal(int sig, void* info, void* secret);
+  /// @brief Releases the ballast and decides whether the process is crash
+  /// looping. Async-signal-safe.
+  /// @return true if the report must be minimal and printed without forking.
+  static bool BeginHandling();
+  /// @brief Runs in the crashed process after the report has been printed
+  /// and before it exits: calls quick_exit() if requested.
+  static void EndHandling();
+  /// @brief Restores the default SIGABRT action and aborts.
+  static void AbortWithCoreDump() __attribute__((noreturn));
+  /// @brief Unwinds the interrupted stack into memory, scanning it if
+  /// backtrace() fails; *notes is NULL unless the stack was scanned.
+  /// @return The number of entries in *trace; trace[1] is the interrupted
+  /// instruction.
+  static int CaptureStackTrace(void* secret, int frames_count, void*** trace,
+                               const char*** notes, char** memory);
+  /// @brief Prints the sections which follow the stack trace and ends
+  /// the output.
+  /// @param truncated The stack was deeper than frames_count.
+  static void EndReport(void* info, bool truncated, bool minimal,
+                        bool color_output);
+  static char* FormatNumber(uint64_t value, char* memory);
+  static char* FormatPointer(const void* value, char* memory);
+
+  /// @brief Symbolizes and prints the frames of a stack trace obtained
+  /// with backtrace() in a signal handler: trace[0] is skipped and trace[1]
+  /// is the interrupted instruction. Async-signal-safe.
+  /// @param notes If not NULL, the non-NULL entries are appended to the
+  /// respective frames.
+  /// @param raw If true, the frames are printed without symbolizing.
+  /// @param live If true, the process keeps running after the trace is
+  /// printed, so the frames which fail to symbolize are printed raw instead
+  /// of aborting.
+  template <class Policy>
+  static void PrintStackTrace(void** trace, const char* const* notes,
+                              int trace_size, pid_t pid, bool raw, bool live,
+                              char* memory);
+  /// @brief Reads the executable path and the current directory.
+  /// @param live If true, the failures are not fatal: the unknown paths
+  /// are "?" and "/".
+  /// @return The memory after them.
+  static char* BeginStackTrace(char* memory, char** executable, char** cwd,
+                               bool live);
+  static void PrintRawFrame(int index, void* address, const char* note,
+                            const char* executable, char* memory);
+  /// @brief Resolves the address with the line table or addr2line.
+  /// @param live If true, a failure to run addr2line is not fatal.
+  /// @return "function\nfile:line\n", or NULL if live and addr2line failed.
+  static char* SymbolizeFrame(void* address, bool return_address,
+                              const char* executable, bool color_output,
+                              bool live, char** memory);
+
+#ifdef __linux__
+  /// @brief Records the crash time and decides whether the process is
+  /// crash looping. Async-signal-safe.
+  static bool UpdateCrashLoopState();
+  /// @brief Opens the files read by PrintResourceSnapshot().
+  static void OpenResourceFiles();
+  static void CloseResourceFiles();
+  /// @brief Reopens the resource files if they were opened by another
+  /// process: the /proc/self descriptors keep referring to the process which
+  /// opened them, so a forked worker needs its own. Called when the crash
+  /// is handled, to spare the cost to the forks which never crash.
+  /// Async-signal-safe.
+  static void ReopenResourceFiles();
+  /// @brief Closes the descriptors opened by PinModules().
+  static void UnpinModules();
+  /// @brief Prints the resources section of the report. Async-signal-safe.
+  static void PrintResourceSnapshot();
+  /// @brief Prints the stack usage section of the report. Async-signal-safe.
+  static void PrintStackUsageReport(const void* fault_address,
+                                    bool color_output);
+  static void PrintStackUsageAtExit();
+  static void PrintMallocLatencyReport();
+  static void PrintMallocLatencyAtExit();
+  /// @brief Calls the previous SIGTERM handler after arming the watchdog.
+  static void HandleTermination(int sig, void* info, void* secret);
+  static void ArmShutdown();
+  static void* ShutdownWatchdog(void* arg);
+  static void* WarnSymbolizer(void* arg);
+  /// @brief Prints the stack traces of all the threads but the current one,
+  /// up to 256 of them.
+  static void DumpThreads(int timeout, char* memory);
+  /// @brief Locks the ranges used by the signal handler, unlocking
+  /// the previously locked ones.
+  static bool LockCrashPath();
+#endif
 
   /// @brief Used to workaround backtrace() usage of malloc().
   static void* malloc_;
@@ -252,10 +700,140 @@ class DeathHandler {
   static bool append_pid_;
   static bool color_output_;
   static bool thread_safe_;
+  static bool symbolize_;
   static OutputCallback output_callback_;
+  static bool compress_output_;
+  static SignalHandler signal_handler_;
+  static void* ballast_;
+  static size_t ballast_size_;
+  static TracePrinter trace_printer_;
+#ifdef __linux__
+  static bool resource_snapshot_;
+  /// @brief /proc/self/statm, /proc/self/stat, memory.events and
+  /// memory.pressure of the process cgroup, opened in advance.
+  static int statm_fd_;
+  static int stat_fd_;
+  static int memory_events_fd_;
+  static int memory_pressure_fd_;
+  /// @brief /proc/self/task, the threads' stat and status are opened
+  /// relative to it in the all-thread dumps.
+  static int task_fd_;
+  static bool stack_usage_tracking_;
+  static int stack_usage_threshold_;
+  static int malloc_sampling_;
+  static int malloc_outliers_;
+  static char crash_loop_file_[];
+  /// @brief The mapped contents of crash_loop_file_.
+  static void* crash_loop_state_;
+  static char metrics_page_name_[];
+  static HandlerMetrics* metrics_;
+  static int crash_loop_threshold_;
+  static int crash_loop_window_;
+  static int crash_loop_quiet_period_;
+  static int shutdown_timeout_;
+  static int warn_interval_;
+  static int line_table_threads_;
+  static bool shutdown_force_exit_;
+  static bool lock_crash_path_;
+  static size_t locked_memory_;
+  /// @brief The original pthread_create().
+  static void* pthread_create_;
+#endif
   /// @brief The preallocated memory to use in the signal handler.
   static char memory_[];
+  /// @brief The signal handler stack used if altstack is true.
+  static char altstack_[];
+};
+
+/// @brief The policy of DeathHandler: the options are read from
+/// the properties every time.
+struct RuntimePolicy {
+  static bool color_output() { return DeathHandler::color_output_; }
+  static bool append_pid() { return DeathHandler::append_pid_; }
+  static bool cut_common_path_root() {
+    return DeathHandler::cut_common_path_root_;
+  }
+  static bool cut_relative_paths() {
+    return DeathHandler::cut_relative_paths_;
+  }
+  static bool thread_safe() { return DeathHandler::thread_safe_; }
+  static bool symbolize() { return DeathHandler::symbolize_; }
+  static bool generate_core_dump() {
+    return DeathHandler::generate_core_dump_;
+  }
+  static bool cleanup() { return DeathHandler::cleanup_; }
+  static int frames_count() { return DeathHandler::frames_count_; }
+};
+
+/// @brief The policy which fixes the options at compile time, so that
+/// the disabled code paths are removed from the signal handler.
+/// @details The defaults of the last four match those of the properties;
+/// kFramesCount must be between 1 and 100.
+template <bool kColorOutput, bool kAppendPid, bool kCutCommonPathRoot,
+          bool kCutRelativePaths, bool kThreadSafe, bool kSymbolize = true,
+          bool kGenerateCoreDump = true, bool kCleanup = true,
+          int kFramesCount = 16>
+struct StaticPolicy {
+  static bool color_output() { return kColorOutput; }
+  static bool append_pid() { return kAppendPid; }
+  static bool cut_common_path_root() { return kCutCommonPathRoot; }
+  static bool cut_relative_paths() { return kCutRelativePaths; }
+  static bool thread_safe() { return kThreadSafe; }
+  static bool symbolize() { return kSymbolize; }
+  static bool generate_core_dump() { return kGenerateCoreDump; }
+  static bool cleanup() { return kCleanup; }
+  static int frames_count() { return kFramesCount; }
+};
+
+/// @brief DeathHandler with the options fixed by Policy.
+/// @details The corresponding properties (color_output, append_pid,
+/// cut_common_path_root, cut_relative_paths, thread_safe, symbolize,
+/// generate_core_dump, cleanup, frames_count) are ignored by the signal
+/// handler. Only the policies which are used are instantiated.
+/// ~~~~{.cc}
+/// // No colors, no pids, cut the paths, fork without stopping the threads
+/// Debug::BasicDeathHandler<
+///     Debug::StaticPolicy<false, false, true, true, false> > dh;
+/// ~~~~
+template <class Policy>
+class BasicDeathHandler : public DeathHandler {
+ public:
+  /// @brief Installs the SIGSEGV/etc. signal handler.
+  /// @param altstack If true, allocate and use a dedicated signal handler
+  /// stack.
+  explicit BasicDeathHandler(bool altstack = false)
+      : DeathHandler(altstack, &DeathHandler::HandleSignal<Policy>,
+                     &DeathHandler::PrintStackTrace<Policy>) {}
 };
 
 }  // namespace Debug
+
+#include "death_handler-inl.h"
+
+/// @brief Prints the message and the stack trace the first time condition
+/// is true at this call site, and afterwards at most once in
+/// warn_interval seconds.
+/// @details While the call site is quiet, the only cost is a single relaxed
+/// load of its static state. The trace is captured in the calling thread
+/// and symbolized in the background, see DeathHandler::set_warn_interval().
+/// ~~~~{.cc}
+/// DEATH_HANDLER_WARN_ONCE(queue.size() > limit, "the queue overflows");
+/// ~~~~
+#ifdef __linux__
+#define DEATH_HANDLER_WARN_ONCE(condition, message) \
+  do { \
+    static ::Debug::WarnSite death_handler_warn_site; \
+    if (__builtin_expect((condition) && __atomic_load_n( \
+        &death_handler_warn_site.fired, __ATOMIC_RELAXED) == 0, 0)) { \
+      ::Debug::DeathHandler::Warn(&death_handler_warn_site, message, \
+                                  __FILE__, __LINE__); \
+    } \
+  } while (false)
+#else
+#define DEATH_HANDLER_WARN_ONCE(condition, message) \
+  do { \
+    (void)(condition); \
+  } while (false)
+#endif
+
 #endif  // DEATH_HANDLER_H_
@@ -0,0 +1,142 @@
+/*
+
+  Copyright (c) 2012, Samsung R&D Institute Russia
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*! @file death_handler_call_site.h
+ *  @brief The call instruction decoder which validates the return address
+ *  candidates of the stack scanners. Shared by death_handler.cc and
+ *  the offline unwinder of the tools.
+ *  @author Markovtsev Vadim <gmarkhor@gmail.com>
+ *  @version 1.0
+ *  @license Simplified BSD License
+ *  @copyright 2012 Samsung R&D Institute Russia, 2016 Moscow Institute of Physics and Technology
+ */
+
+#ifndef DEATH_HANDLER_CALL_SITE_H_
+#define DEATH_HANDLER_CALL_SITE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+namespace Debug {
+
+/// @brief The longest call instruction which CallSiteConfidence() checks.
+static const int kMaxCallSiteSize = 7;
+
+/// @brief Checks whether the code before a return address is a call.
+/// @details Always inlined, so that the signal handler keeps it in its own
+/// section. Async-signal-safe.
+/// @param code Points to the byte at address; the available bytes before
+/// it are readable.
+/// @param address The return address, which gives the target of relative
+/// calls and the Thumb bit.
+/// @param is_code Tells whether the target of a direct call is code.
+/// @return 2 for a direct call to code, 1 for an indirect call, 0 otherwise.
+template <class IsCode>
+inline __attribute__((always_inline))
+int CallSiteConfidence(const unsigned char* code, uint64_t available,
+                       uint64_t address, const IsCode& is_code) {
+#if defined(__x86_64__) || defined(__i386__)
+  if (available >= 5 && code[-5] == 0xE8) {
+    int32_t offset;
+    memcpy(&offset, code - 4, sizeof(offset));
+    if (is_code(static_cast<uintptr_t>(address + offset))) {
+      return 2;
+    }
+  }
+  // call r/m: FF /2 with the ModRM byte's reg field equal to 2
+  if (available >= 2 && code[-2] == 0xFF && ((code[-1] & 0xF8) == 0xD0 ||
+      ((code[-1] & 0xF8) == 0x10 && (code[-1] & 7) != 4 &&
+       (code[-1] & 7) != 5))) {
+    return 1;  // call reg, call [reg]
+  }
+  if (available >= 3 && code[-3] == 0xFF &&
+      (((code[-2] & 0xF8) == 0x50 && code[-2] != 0x54) || code[-2] == 0x14)) {
+    return 1;  // call [reg + disp8], call [sib]
+  }
+  if (available >= 4 && code[-4] == 0xFF && code[-3] == 0x54) {
+    return 1;  // call [sib + disp8]
+  }
+  if (available >= 6 && code[-6] == 0xFF &&
+      (((code[-5] & 0xF8) == 0x90 && code[-5] != 0x94) || code[-5] == 0x15)) {
+    return 1;  // call [reg + disp32], call [rip + disp32]
+  }
+  if (available >= 7 && code[-7] == 0xFF && code[-6] == 0x94) {
+    return 1;  // call [sib + disp32]
+  }
+#elif defined(__aarch64__)
+  (void)address;
+  (void)is_code;
+  uint32_t insn;
+  if (available >= 4) {
+    memcpy(&insn, code - 4, sizeof(insn));
+    if ((insn & 0xFC000000) == 0x94000000) {
+      return 2;  // bl
+    }
+    if ((insn & 0xFFFFFC1F) == 0xD63F0000) {
+      return 1;  // blr
+    }
+  }
+#elif defined(__arm__)
+  (void)is_code;
+  if (address & 1) {
+    // Thumb: the return address has the lowest bit set
+    uint16_t insn[2];
+    if (available >= 5) {
+      memcpy(insn, code - 5, sizeof(insn));
+      if ((insn[0] & 0xF800) == 0xF000 && (insn[1] & 0xC000) == 0xC000) {
+        return 2;  // bl, blx
+      }
+    }
+    if (available >= 3) {
+      memcpy(insn, code - 3, sizeof(insn[0]));
+      if ((insn[0] & 0xFF87) == 0x4780) {
+        return 1;  // blx reg
+      }
+    }
+  } else if (available >= 4) {
+    uint32_t insn;
+    memcpy(&insn, code - 4, sizeof(insn));
+    if ((insn & 0x0F000000) == 0x0B000000 ||
+        (insn & 0xFE000000) == 0xFA000000) {
+      return 2;  // bl, blx
+    }
+    if ((insn & 0x0FFFFFF0) == 0x012FFF30) {
+      return 1;  // blx reg
+    }
+  }
+#else
+  (void)code;
+  (void)available;
+  (void)address;
+  (void)is_code;
+#endif
+  return 0;
+}
+
+}  // namespace Debug
+
+#endif  // DEATH_HANDLER_CALL_SITE_H_
@@ -0,0 +1,149 @@
+/*
+
+  Copyright (c) 2012, Samsung R&D Institute Russia
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*! @file death_handler_preload.cc
+ *  @brief Installs DeathHandler from a shared library loaded with LD_PRELOAD.
+ *  @author Markovtsev Vadim <gmarkhor@gmail.com>
+ *  @version 1.0
+ *  @license Simplified BSD License
+ *  @copyright 2012 Samsung R&D Institute Russia, 2016 Moscow Institute of Physics and Technology
+ */
+
+/*! Build and use:
+ *  ~~~~{.sh}
+ *  g++ -shared -fPIC -O2 death_handler.cc death_handler_preload.cc -ldl -pthread -o libdeath_handler.so
+ *  DEATH_HANDLER_OUTPUT=/var/log/crash.log LD_PRELOAD=/path/to/libdeath_handler.so ./service
+ *  ~~~~
+ *
+ *  The handler is installed from an ELF constructor before main() and
+ *  configured with the environment variables:
+ *  - DEATH_HANDLER=0 disables it;
+ *  - DEATH_HANDLER_FRAMES sets frames_count();
+ *  - DEATH_HANDLER_OUTPUT is the file the reports are appended to instead
+ *    of stderr;
+ *  - DEATH_HANDLER_SYMBOLIZE is "addr2line" (the default), "raw" for
+ *    set_symbolize(false) or "table" to build the line table in
+ *    the background;
+ *  - DEATH_HANDLER_COLOR, DEATH_HANDLER_CORE_DUMP, DEATH_HANDLER_THREAD_SAFE,
+ *    DEATH_HANDLER_COMPRESS and DEATH_HANDLER_ALTSTACK are 0 or 1 and set
+ *    the corresponding properties; the colors are enabled by default only
+ *    if stderr is a terminal.
+ *  Nothing expensive happens before main(): the line table is decoded by
+ *  background threads with the idle priority, one per CPU, and addr2line is
+ *  started only after a crash.
+ */
+
+#include "death_handler.h"
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <new>
+
+namespace Debug {
+
+/// @brief The storage of the preloaded handler, which must not depend on
+/// the order of the static initialization.
+static void* handler_storage[sizeof(DeathHandler) / sizeof(void*) + 1];
+static DeathHandler* handler = NULL;
+static int output_fd = -1;
+
+static ssize_t WriteOutput(const char* msg, size_t len) {
+  return write(output_fd, msg, len);
+}
+
+/// @brief Reads a 0/1 environment variable.
+static bool ReadFlag(const char* name, bool default_value) {
+  const char* value = getenv(name);
+  if (value == NULL || *value == 0) {
+    return default_value;
+  }
+  return strcmp(value, "0") != 0;
+}
+
+static void* LoadLineTableInBackground(void*) {
+  struct sched_param param;
+  memset(&param, 0, sizeof(param));
+  pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+  // The helper threads inherit SCHED_IDLE, so they may use every CPU
+  handler->set_line_table_threads(0);
+  handler->LoadLineTable();
+  return NULL;
+}
+
+__attribute__((constructor))
+static void InstallPreloadedHandler() {
+  if (!ReadFlag("DEATH_HANDLER", true)) {
+    return;
+  }
+  handler = new(handler_storage) DeathHandler(
+      ReadFlag("DEATH_HANDLER_ALTSTACK", false));
+  const char* frames = getenv("DEATH_HANDLER_FRAMES");
+  if (frames != NULL && atoi(frames) > 0) {
+    handler->set_frames_count(atoi(frames));
+  }
+  handler->set_generate_core_dump(ReadFlag("DEATH_HANDLER_CORE_DUMP",
+                                           handler->generate_core_dump()));
+  handler->set_thread_safe(ReadFlag("DEATH_HANDLER_THREAD_SAFE",
+                                    handler->thread_safe()));
+  handler->set_compress_output(ReadFlag("DEATH_HANDLER_COMPRESS",
+                                        handler->compress_output()));
+  const char* output = getenv("DEATH_HANDLER_OUTPUT");
+  if (output != NULL && *output != 0) {
+    output_fd = open(output, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                     0644);
+    if (output_fd >= 0) {
+      handler->set_output_callback(WriteOutput);
+    }
+  }
+  // The escape sequences are only useful on a terminal
+  handler->set_color_output(ReadFlag(
+      "DEATH_HANDLER_COLOR", output_fd < 0 && isatty(STDERR_FILENO)));
+  const char* symbolize = getenv("DEATH_HANDLER_SYMBOLIZE");
+  if (symbolize != NULL && !strcmp(symbolize, "raw")) {
+    handler->set_symbolize(false);
+  } else if (symbolize != NULL && !strcmp(symbolize, "table")) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_t thread;
+    pthread_create(&thread, &attr, LoadLineTableInBackground, NULL);
+    pthread_attr_destroy(&attr);
+  }
+}
+
+__attribute__((destructor))
+static void UninstallPreloadedHandler() {
+  if (handler != NULL) {
+    handler->~DeathHandler();
+    handler = NULL;
+  }
+}
+
+}  // namespace Debug
@@ -38,10 +38,21 @@
  */
 
 #include "death_handler.h"
+#include <fcntl.h>
 #include <malloc.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <string>
+#include <vector>
 #include <gtest/gtest.h>
 #pragma GCC diagnostic ignored "-Wdeprecated-declarations"
 
+// The decoder of set_compress_output(true) reports
+#define main decompress_report_main
+#include "tools/decompress_report.cc"
+#undef main
+
 using Debug::DeathHandler;
 
 #define SEGMENTATION_FAULT() do { \
@@ -125,6 +136,947 @@ TEST(DeathHandler, SimpleSIGSEGVWithoutColors) {
   ASSERT_LT(glineno - lineno - 7, 2);
 }
 
+TEST(DeathHandler, LineTable) {
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+
+  int lineno = __LINE__;
+  int pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    DeathHandler dh;
+    dh.set_color_output(false);
+    bool loaded = dh.LoadLineTable();
+    assert(loaded);
+    SEGMENTATION_FAULT();
+  }
+  close(pipefd[1]);
+  wait(NULL);
+  char text[4096];
+  int bytesRead;
+  int totalBytesRead = 0;
+  while ((bytesRead = read(pipefd[0], &text[totalBytesRead],
+                           sizeof(text) - totalBytesRead)) > 0) {
+    totalBytesRead += bytesRead;
+  }
+  close(pipefd[0]);
+  printf("%s", text);
+  char* posstr = strstr(text, "Segmentation fault");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  posstr = strstr(text, "[DeathHandler_LineTable_Test::TestBody()]");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  posstr = strstr(posstr, "death_handler_test.cc:");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  int rlineno = atoi(posstr + strlen("death_handler_test.cc:"));
+  ASSERT_EQ(lineno + 10, rlineno);
+}
+
+TEST(DeathHandler, ParallelLineTable) {
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+
+  int lineno = __LINE__;
+  int pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    DeathHandler dh;
+    dh.set_color_output(false);
+    dh.set_line_table_threads(4);
+    bool loaded = dh.LoadLineTable();
+    assert(loaded);
+    SEGMENTATION_FAULT();
+  }
+  close(pipefd[1]);
+  wait(NULL);
+  char text[4096];
+  int bytesRead;
+  int totalBytesRead = 0;
+  while ((bytesRead = read(pipefd[0], &text[totalBytesRead],
+                           sizeof(text) - totalBytesRead)) > 0) {
+    totalBytesRead += bytesRead;
+  }
+  close(pipefd[0]);
+  printf("%s", text);
+  char* posstr = strstr(
+      text, "[DeathHandler_ParallelLineTable_Test::TestBody()]");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  posstr = strstr(posstr, "death_handler_test.cc:");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  int rlineno = atoi(posstr + strlen("death_handler_test.cc:"));
+  ASSERT_EQ(lineno + 11, rlineno);
+}
+
+template <typename T>
+__attribute__((noinline)) static void CrashInTemplate(
+    const std::vector<T>& values) {
+  if (values.empty()) {
+    SEGMENTATION_FAULT();
+  }
+}
+
+TEST(DeathHandler, DemangledLineTable) {
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+
+  int pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    DeathHandler dh;
+    dh.set_color_output(false);
+    bool loaded = dh.LoadLineTable();
+    assert(loaded);
+    CrashInTemplate(std::vector<int>());
+  }
+  close(pipefd[1]);
+  wait(NULL);
+  char text[4096];
+  int bytesRead;
+  int totalBytesRead = 0;
+  while ((bytesRead = read(pipefd[0], &text[totalBytesRead],
+                           sizeof(text) - totalBytesRead)) > 0) {
+    totalBytesRead += bytesRead;
+  }
+  close(pipefd[0]);
+  printf("%s", text);
+  const char* posstr = strstr(
+      text, "[void CrashInTemplate<int>(std::vector<int, "
+      "std::allocator<int> > const&)]");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+}
+
+TEST(DeathHandler, StaticPolicy) {
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+
+  int pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    // No colors and raw frames, whatever the properties say
+    Debug::BasicDeathHandler<Debug::StaticPolicy<
+        false, false, true, true, false, false, false, false, 4> > dh;
+    dh.set_color_output(true);
+    dh.set_symbolize(true);
+    SEGMENTATION_FAULT();
+  }
+  close(pipefd[1]);
+  wait(NULL);
+  char text[4096];
+  int bytesRead;
+  int totalBytesRead = 0;
+  while ((bytesRead = read(pipefd[0], &text[totalBytesRead],
+                           sizeof(text) - totalBytesRead)) > 0) {
+    totalBytesRead += bytesRead;
+  }
+  close(pipefd[0]);
+  printf("%s", text);
+  const char* posstr = strstr(text, "Segmentation fault (thread ");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  ASSERT_EQ(static_cast<const char*>(NULL), strstr(text, "\033["));
+  posstr = strstr(text, "#0 0x");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  ASSERT_NE(static_cast<const char*>(NULL), strstr(posstr, " build-id="));
+  // frames_count is 4
+  ASSERT_EQ(static_cast<const char*>(NULL), strstr(text, "\n#4 "));
+}
+
+/// Copies the file with the permissions given by mode.
+static bool CopyFile(const char* from, const char* to, mode_t mode) {
+  int in = open(from, O_RDONLY);
+  int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, mode);
+  char buffer[65536];
+  ssize_t size = 0;
+  while (in >= 0 && out >= 0 && (size = read(in, buffer, sizeof(buffer))) > 0 &&
+         write(out, buffer, size) == size) {}
+  if (in >= 0) {
+    close(in);
+  }
+  if (out >= 0) {
+    close(out);
+  }
+  return in >= 0 && out >= 0 && size == 0;
+}
+
+TEST(DeathHandler, PinnedModules) {
+  const char* deployed = getenv("DEATH_HANDLER_TEST_PINNED");
+  if (deployed != NULL) {
+    // This is the copy of the test binary, which is about to be replaced
+    DeathHandler dh;
+    dh.set_color_output(false);
+    dh.set_thread_safe(false);
+    dh.set_generate_core_dump(false);
+    int pinned = dh.PinModules();
+    assert(pinned > 0);
+    // Deploy another binary over it, the way package managers do
+    std::string next = std::string(deployed) + ".next";
+    assert(CopyFile("/bin/true", next.c_str(), 0755));
+    assert(rename(next.c_str(), deployed) == 0);
+    SEGMENTATION_FAULT();
+  }
+  char dir[] = "/tmp/death_handler_pinned.XXXXXX";
+  ASSERT_NE(static_cast<char*>(NULL), mkdtemp(dir));
+  std::string copy = std::string(dir) + "/death_handler_test";
+  ASSERT_TRUE(CopyFile("/proc/self/exe", copy.c_str(), 0755));
+
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+
+  int pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    setenv("DEATH_HANDLER_TEST_PINNED", copy.c_str(), 1);
+    execl(copy.c_str(), copy.c_str(),
+          "--gtest_filter=DeathHandler.PinnedModules",
+          reinterpret_cast<char*>(NULL));
+    _exit(EXIT_FAILURE);
+  }
+  close(pipefd[1]);
+  wait(NULL);
+  char text[8192] = {0};
+  int bytesRead;
+  int totalBytesRead = 0;
+  while ((bytesRead = read(pipefd[0], &text[totalBytesRead],
+                           sizeof(text) - 1 - totalBytesRead)) > 0) {
+    totalBytesRead += bytesRead;
+  }
+  close(pipefd[0]);
+  unlink(copy.c_str());
+  rmdir(dir);
+  printf("%s", text);
+  char* posstr = strstr(text, "Segmentation fault");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  // The frame is resolved from the binary which crashed, not /bin/true
+  posstr = strstr(text, "[DeathHandler_PinnedModules_Test::TestBody()]");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  posstr = strstr(posstr, "death_handler_test.cc:");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+}
+
+TEST(DeathHandler, CompressedOutput) {
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+
+  int pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    DeathHandler dh;
+    dh.set_compress_output(true);
+    SEGMENTATION_FAULT();
+  }
+  close(pipefd[1]);
+  wait(NULL);
+  std::string data;
+  char buffer[4096];
+  int bytesRead;
+  while ((bytesRead = read(pipefd[0], buffer, sizeof(buffer))) > 0) {
+    data.append(buffer, bytesRead);
+  }
+  close(pipefd[0]);
+  ASSERT_EQ(0, data.compare(0, 4, "DHZ1"));
+  // The empty block ends the stream before the terminating '\0'
+  ASSERT_GT(data.size(), 13u);
+  ASSERT_EQ(std::string(9, '\0'), data.substr(data.size() - 9));
+  std::string text;
+  ASSERT_TRUE(Debug::Decompress(data, "report", &text));
+  printf("%s", text.c_str());
+  ASSERT_EQ(std::string::npos, text.find("DHZ1"));
+  size_t pos = text.find("Segmentation fault");
+  ASSERT_NE(std::string::npos, pos);
+  pos = text.find("[DeathHandler_CompressedOutput_Test::TestBody()]", pos);
+  ASSERT_NE(std::string::npos, pos);
+  // The '\0' which ends the report follows the stream
+  ASSERT_EQ('\0', text[text.size() - 1]);
+}
+
+TEST(DeathHandler, MallocLatency) {
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+
+  int pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    DeathHandler dh;
+    dh.set_color_output(false);
+    dh.set_malloc_sampling(1);
+    dh.set_malloc_outliers(1);
+    for (int i = 0; i < 100; i++) {
+      void* volatile ptr = malloc(1000);
+      free(ptr);
+    }
+    dh.set_malloc_sampling(0);
+    dh.PrintMallocLatency();
+    _Exit(EXIT_SUCCESS);
+  }
+  close(pipefd[1]);
+  wait(NULL);
+  char text[4096];
+  int bytesRead;
+  int totalBytesRead = 0;
+  while ((bytesRead = read(pipefd[0], &text[totalBytesRead],
+                           sizeof(text) - totalBytesRead - 1)) > 0) {
+    totalBytesRead += bytesRead;
+  }
+  close(pipefd[0]);
+  text[totalBytesRead] = 0;
+  printf("%s", text);
+  ASSERT_NE(static_cast<const char*>(NULL),
+            strstr(text, "malloc <= 1024 bytes: 100 samples"));
+  ASSERT_NE(static_cast<const char*>(NULL),
+            strstr(text, "free <= 1024 bytes: 100 samples"));
+  ASSERT_NE(static_cast<const char*>(NULL),
+            strstr(text, "Slowest sampled calls:"));
+}
+
+TEST(DeathHandler, MallocLatencyWithoutAddr2line) {
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+
+  int pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    setenv("PATH", "/nonexistent", 1);
+    DeathHandler dh;
+    dh.set_color_output(false);
+    dh.set_malloc_sampling(1);
+    dh.set_malloc_outliers(1);
+    for (int i = 0; i < 100; i++) {
+      void* volatile ptr = malloc(1000);
+      free(ptr);
+    }
+    dh.set_malloc_sampling(0);
+    dh.PrintMallocLatency();
+    printf("still running\n");
+    fflush(stdout);
+    _Exit(EXIT_SUCCESS);
+  }
+  close(pipefd[1]);
+  int status;
+  waitpid(pid, &status, 0);
+  char text[4096];
+  int bytesRead;
+  int totalBytesRead = 0;
+  while ((bytesRead = read(pipefd[0], &text[totalBytesRead],
+                           sizeof(text) - totalBytesRead - 1)) > 0) {
+    totalBytesRead += bytesRead;
+  }
+  close(pipefd[0]);
+  text[totalBytesRead] = 0;
+  printf("%s", text);
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
+  char* posstr = strstr(text, "Slowest sampled calls:");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  // The outlier's frames are printed raw
+  posstr = strstr(posstr, "\n#0 0x");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  ASSERT_NE(static_cast<const char*>(NULL), strstr(posstr, "still running\n"));
+}
+
+TEST(DeathHandler, ThreadStats) {
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+
+  int pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    DeathHandler dh;
+    dh.set_color_output(false);
+    dh.set_shutdown_timeout(1);
+    dh.set_shutdown_force_exit(true);
+    dh.ArmShutdownWatchdog();
+    for (int i = 0; i < 50; i++) {
+      usleep(100 * 1000);
+    }
+    _Exit(EXIT_SUCCESS);
+  }
+  close(pipefd[1]);
+  wait(NULL);
+  char text[8192];
+  int bytesRead;
+  int totalBytesRead = 0;
+  while ((bytesRead = read(pipefd[0], &text[totalBytesRead],
+                           sizeof(text) - totalBytesRead - 1)) > 0) {
+    totalBytesRead += bytesRead;
+  }
+  close(pipefd[0]);
+  text[totalBytesRead] = 0;
+  printf("%s", text);
+  ASSERT_NE(static_cast<const char*>(NULL), strstr(text, "Shutdown stalled"));
+  // The main thread sleeps
+  char* posstr = strstr(text, "): state S, user ");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  ASSERT_NE(static_cast<const char*>(NULL), strstr(posstr, " voluntary / "));
+  ASSERT_NE(static_cast<const char*>(NULL), strstr(posstr, ", last CPU "));
+}
+
+static void* SleepForever(void*) {
+  for (;;) {
+    pause();
+  }
+  return NULL;
+}
+
+static volatile sig_atomic_t shutdown_requested = 0;
+
+static void RequestShutdown(int) {
+  shutdown_requested = 1;
+}
+
+TEST(DeathHandler, ShutdownStall) {
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+
+  int pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    // The application's own graceful shutdown, which never completes
+    signal(SIGTERM, RequestShutdown);
+    DeathHandler dh;
+    dh.set_color_output(false);
+    dh.set_symbolize(false);
+    dh.set_shutdown_timeout(1);
+    dh.set_shutdown_force_exit(true);
+    // More threads than the watchdog dumps
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 64 << 10);
+    for (int i = 0; i < 300; i++) {
+      pthread_t thread;
+      assert(pthread_create(&thread, &attr, SleepForever, NULL) == 0);
+    }
+    pthread_attr_destroy(&attr);
+    kill(getpid(), SIGTERM);
+    while (!shutdown_requested) {
+      pause();
+    }
+    SleepForever(NULL);
+  }
+  close(pipefd[1]);
+  std::string text;
+  char buffer[4096];
+  int bytesRead;
+  while ((bytesRead = read(pipefd[0], buffer, sizeof(buffer))) > 0) {
+    text.append(buffer, bytesRead);
+  }
+  close(pipefd[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  printf("%s", text.c_str());
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(EXIT_FAILURE, WEXITSTATUS(status));
+  ASSERT_NE(std::string::npos, text.find(
+      "still running 1 seconds after the termination request\n"));
+  int dumped = 0;
+  for (size_t pos = text.find("\nThread "); pos != std::string::npos;
+       pos = text.find("\nThread ", pos + 1)) {
+    dumped++;
+  }
+  ASSERT_EQ(256, dumped);
+  // The main thread and the 300 sleeping ones, the watchdog is not counted
+  ASSERT_NE(std::string::npos, text.find("\n45 more threads omitted\n"));
+}
+
+TEST(DeathHandler, ShutdownStallWithoutAddr2line) {
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+
+  int pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    setenv("PATH", "/nonexistent", 1);
+    DeathHandler dh;
+    dh.set_color_output(false);
+    dh.set_shutdown_timeout(1);
+    dh.ArmShutdownWatchdog();
+    pthread_t thread;
+    pthread_create(&thread, NULL, SleepForever, NULL);
+    // The dump interrupts the sleep
+    for (int i = 0; i < 30; i++) {
+      usleep(100 * 1000);
+    }
+    // The shutdown goes on after the dump
+    printf("still running\n");
+    fflush(stdout);
+    _Exit(EXIT_SUCCESS);
+  }
+  close(pipefd[1]);
+  std::string text;
+  char buffer[4096];
+  int bytesRead;
+  while ((bytesRead = read(pipefd[0], buffer, sizeof(buffer))) > 0) {
+    text.append(buffer, bytesRead);
+  }
+  close(pipefd[0]);
+  int status;
+  waitpid(pid, &status, 0);
+  printf("%s", text.c_str());
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
+  size_t pos = text.find("Shutdown stalled");
+  ASSERT_NE(std::string::npos, pos);
+  pos = text.find("\n#0 0x", pos);
+  ASSERT_NE(std::string::npos, pos);
+  ASSERT_NE(std::string::npos, text.find("still running\n", pos));
+  // Only a crash report ends with '\0'
+  ASSERT_EQ(std::string::npos, text.find('\0'));
+}
+
+TEST(DeathHandler, MetricsPage) {
+  const char* name = "/death_handler_test_metrics";
+  char path[64];
+  strcpy(path, "/dev/shm");  // NOLINT(runtime/printf)
+  strcat(path, name);  // NOLINT(runtime/printf)
+  // A page left by an interrupted run would add up
+  unlink(path);
+  int pid = fork();
+  if (pid == 0) {
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    dup2(devnull, STDERR_FILENO);
+    DeathHandler dh;
+    dh.set_symbolize(false);
+    // The report child may resume the parent before it stops itself
+    dh.set_thread_safe(false);
+    if (!dh.set_metrics_page(name)) {
+      _Exit(EXIT_FAILURE);
+    }
+    int* p = reinterpret_cast<int*>(strtol("0", NULL, 10));
+    *p = 0;
+  }
+  wait(NULL);
+  int fd = open(path, O_RDONLY);
+  ASSERT_GE(fd, 0);
+  Debug::HandlerMetrics metrics;
+  ASSERT_EQ(static_cast<ssize_t>(sizeof(metrics)),
+            read(fd, &metrics, sizeof(metrics)));
+  close(fd);
+  unlink(path);
+  ASSERT_EQ(Debug::HandlerMetrics::kMagic, metrics.magic);
+  ASSERT_EQ(1u, metrics.crashes_handled);
+  // The raw frames are not symbolization failures
+  ASSERT_EQ(0u, metrics.symbolization_hits);
+  ASSERT_EQ(0u, metrics.symbolization_misses);
+  uint64_t durations = 0;
+  for (int i = 0; i < Debug::HandlerMetrics::kDurationBuckets; i++) {
+    durations += metrics.handler_duration[i];
+  }
+  ASSERT_EQ(1u, durations);
+}
+
+TEST(DeathHandler, WarnOnce) {
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+
+  int pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    DeathHandler dh;
+    dh.set_color_output(false);
+    dh.set_warn_interval(0);
+    for (int i = 0; i < 3; i++) {
+      DEATH_HANDLER_WARN_ONCE(i >= 0, "unexpected condition");
+    }
+    // Give the symbolizer thread time to print
+    sleep(2);
+    _Exit(EXIT_SUCCESS);
+  }
+  close(pipefd[1]);
+  wait(NULL);
+  char text[4096];
+  int bytesRead;
+  int totalBytesRead = 0;
+  while ((bytesRead = read(pipefd[0], &text[totalBytesRead],
+                           sizeof(text) - totalBytesRead - 1)) > 0) {
+    totalBytesRead += bytesRead;
+  }
+  close(pipefd[0]);
+  text[totalBytesRead] = 0;
+  printf("%s", text);
+  char* posstr = strstr(text, "Warning: unexpected condition");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  ASSERT_EQ(static_cast<const char*>(NULL),
+            strstr(posstr + 1, "Warning: unexpected condition"));
+  ASSERT_NE(static_cast<const char*>(NULL),
+            strstr(posstr, "[DeathHandler_WarnOnce_Test::TestBody()]"));
+}
+
+TEST(DeathHandler, WarnOnceWithoutAddr2line) {
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+
+  int pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    // addr2line cannot be found and the working directory is gone
+    setenv("PATH", "/nonexistent", 1);
+    char cwd[] = "/tmp/death_handler_cwd.XXXXXX";
+    assert(mkdtemp(cwd) != NULL);
+    assert(chdir(cwd) == 0);
+    assert(rmdir(cwd) == 0);
+    DeathHandler dh;
+    dh.set_color_output(false);
+    dh.set_warn_interval(0);
+    DEATH_HANDLER_WARN_ONCE(true, "unexpected condition");
+    // Give the symbolizer thread time to print
+    sleep(2);
+    printf("still running\n");
+    fflush(stdout);
+    _Exit(EXIT_SUCCESS);
+  }
+  close(pipefd[1]);
+  int status;
+  waitpid(pid, &status, 0);
+  char text[4096];
+  int bytesRead;
+  int totalBytesRead = 0;
+  while ((bytesRead = read(pipefd[0], &text[totalBytesRead],
+                           sizeof(text) - totalBytesRead - 1)) > 0) {
+    totalBytesRead += bytesRead;
+  }
+  close(pipefd[0]);
+  text[totalBytesRead] = 0;
+  printf("%s", text);
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(EXIT_SUCCESS, WEXITSTATUS(status));
+  char* posstr = strstr(text, "Warning: unexpected condition");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  // The frames are printed raw
+  posstr = strstr(posstr, "\n#0 0x");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  ASSERT_NE(static_cast<const char*>(NULL), strstr(posstr, " build-id="));
+  ASSERT_NE(static_cast<const char*>(NULL), strstr(posstr, "still running\n"));
+}
+
+TEST(DeathHandler, MemoryBallast) {
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+
+  int pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    DeathHandler dh;
+    dh.set_color_output(false);
+    dh.set_memory_ballast(16 << 20);
+    // A stand-in for the cgroup limit: leave no address space but
+    // the ballast
+    char statm[64] = {0};
+    int fd = open("/proc/self/statm", O_RDONLY);
+    assert(read(fd, statm, sizeof(statm) - 1) > 0);
+    close(fd);
+    struct rlimit limit;
+    getrlimit(RLIMIT_AS, &limit);
+    limit.rlim_cur = atol(statm) * getpagesize() + (1 << 20);
+    assert(setrlimit(RLIMIT_AS, &limit) == 0);
+    while (mmap(NULL, 1 << 16, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0) != MAP_FAILED) {}
+    SEGMENTATION_FAULT();
+  }
+  close(pipefd[1]);
+  wait(NULL);
+  char text[4096];
+  int bytesRead;
+  int totalBytesRead = 0;
+  while ((bytesRead = read(pipefd[0], &text[totalBytesRead],
+                           sizeof(text) - totalBytesRead)) > 0) {
+    totalBytesRead += bytesRead;
+  }
+  close(pipefd[0]);
+  printf("%s", text);
+  char* posstr = strstr(text, "Segmentation fault");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  posstr = strstr(text, "[DeathHandler_MemoryBallast_Test::TestBody()]");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+}
+
+TEST(DeathHandler, StackScan) {
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+
+  int pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    DeathHandler dh;
+    dh.set_color_output(false);
+    // Jump to garbage as if returning through a smashed stack
+    void (*garbage)() = reinterpret_cast<void (*)()>(
+        strtol("dead0000", NULL, 16));
+    garbage();
+  }
+  close(pipefd[1]);
+  wait(NULL);
+  char text[4096];
+  int bytesRead;
+  int totalBytesRead = 0;
+  while ((bytesRead = read(pipefd[0], &text[totalBytesRead],
+                           sizeof(text) - totalBytesRead)) > 0) {
+    totalBytesRead += bytesRead;
+  }
+  close(pipefd[0]);
+  printf("%s", text);
+  char* posstr = strstr(text, "Segmentation fault");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  posstr = strstr(text, "[DeathHandler_StackScan_Test::TestBody()]");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  posstr = strstr(posstr, "(scanned, ");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+}
+
+TEST(DeathHandler, ForkedWorkerResources) {
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+
+  int pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    DeathHandler dh;
+    dh.set_color_output(false);
+    dh.set_thread_safe(false);
+    // A prefork server: the worker crashes with threads of its own
+    int worker = fork();
+    if (worker == 0) {
+      pthread_t threads[2];
+      for (int i = 0; i < 2; i++) {
+        pthread_create(&threads[i], NULL, SleepForever, NULL);
+      }
+      SEGMENTATION_FAULT();
+    }
+    waitpid(worker, NULL, 0);
+    _exit(EXIT_SUCCESS);
+  }
+  close(pipefd[1]);
+  wait(NULL);
+  char text[4096];
+  int bytesRead;
+  int totalBytesRead = 0;
+  while ((bytesRead = read(pipefd[0], &text[totalBytesRead],
+                           sizeof(text) - totalBytesRead)) > 0) {
+    totalBytesRead += bytesRead;
+  }
+  close(pipefd[0]);
+  printf("%s", text);
+  char* posstr = strstr(text, "Segmentation fault");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  posstr = strstr(text, ", threads 3\n");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+}
+
+/// Grows the stack of a thread named "deep" by 192 KiB.
+static void* FillStack(void*) {
+  prctl(PR_SET_NAME, "deep", 0, 0, 0);
+  char buffer[192 << 10];
+  memset(buffer, 1, sizeof(buffer));
+  __asm__ __volatile__("" : : "r"(buffer) : "memory");  // NOLINT
+  return NULL;
+}
+
+static volatile int idle_started = 0;
+
+static void* IdleThread(void*) {
+  prctl(PR_SET_NAME, "idle", 0, 0, 0);
+  idle_started = 1;
+  return SleepForever(NULL);
+}
+
+TEST(DeathHandler, StackUsage) {
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+
+  int pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    DeathHandler dh;
+    dh.set_color_output(false);
+    dh.set_thread_safe(false);
+    dh.set_stack_usage_tracking(true);
+    dh.set_stack_usage_threshold(50);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 256 << 10);
+    pthread_t thread;
+    pthread_create(&thread, &attr, FillStack, NULL);
+    pthread_join(thread, NULL);
+    pthread_create(&thread, &attr, IdleThread, NULL);
+    pthread_attr_destroy(&attr);
+    while (!idle_started) {
+      sched_yield();
+    }
+    SEGMENTATION_FAULT();
+  }
+  close(pipefd[1]);
+  wait(NULL);
+  char text[4096] = {0};
+  int bytesRead;
+  int totalBytesRead = 0;
+  while ((bytesRead = read(pipefd[0], &text[totalBytesRead],
+                           sizeof(text) - 1 - totalBytesRead)) > 0) {
+    totalBytesRead += bytesRead;
+  }
+  close(pipefd[0]);
+  printf("%s", text);
+  char* posstr = strstr(text, "Stack usage (high-water mark):\n");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  // The exited thread used three quarters of its stack
+  char* line = strstr(posstr, "  deep (1 exited): ");
+  ASSERT_NE(static_cast<const char*>(NULL), line);
+  char* end = strchr(line, '\n');
+  ASSERT_NE(static_cast<const char*>(NULL), end);
+  *end = 0;
+  ASSERT_NE(static_cast<const char*>(NULL), strstr(line, " NEAR OVERFLOW"));
+  *end = '\n';
+  // The running one barely started
+  line = strstr(posstr, "  idle (tid ");
+  ASSERT_NE(static_cast<const char*>(NULL), line);
+  end = strchr(line, '\n');
+  ASSERT_NE(static_cast<const char*>(NULL), end);
+  *end = 0;
+  ASSERT_NE(static_cast<const char*>(NULL), strstr(line, " of 262144 bytes"));
+  ASSERT_EQ(static_cast<const char*>(NULL), strstr(line, "NEAR OVERFLOW"));
+}
+
+/// Crashes a child which keeps the crash times in path, reads its report
+/// into text and returns its wait status.
+static int CrashWithLoopFile(const char* path, char* text, int size) {
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+
+  int pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    // Abort without writing the core
+    struct rlimit limit = { 0, 0 };
+    setrlimit(RLIMIT_CORE, &limit);
+    DeathHandler dh;
+    dh.set_color_output(false);
+    dh.set_thread_safe(false);
+    dh.set_generate_core_dump(true);
+    dh.set_crash_loop_threshold(2);
+    dh.set_crash_loop_quiet_period(2);
+    assert(dh.set_crash_loop_file(path));
+    SEGMENTATION_FAULT();
+  }
+  close(pipefd[1]);
+  int status;
+  waitpid(pid, &status, 0);
+  memset(text, 0, size);
+  int bytesRead;
+  int totalBytesRead = 0;
+  while ((bytesRead = read(pipefd[0], &text[totalBytesRead],
+                           size - 1 - totalBytesRead)) > 0) {
+    totalBytesRead += bytesRead;
+  }
+  close(pipefd[0]);
+  printf("%s", text);
+  return status;
+}
+
+TEST(DeathHandler, CrashLoop) {
+  char path[] = "/tmp/death_handler_crash_loop.XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT_NE(-1, fd);
+  close(fd);
+  char text[4096];
+  int status = CrashWithLoopFile(path, text, sizeof(text));
+  ASSERT_NE(static_cast<const char*>(NULL),
+            strstr(text, "Segmentation fault"));
+  ASSERT_EQ(static_cast<const char*>(NULL),
+            strstr(text, "Crash loop detected"));
+  // The second crash in a row reaches the threshold
+  status = CrashWithLoopFile(path, text, sizeof(text));
+  ASSERT_NE(static_cast<const char*>(NULL),
+            strstr(text, "Crash loop detected"));
+  ASSERT_NE(static_cast<const char*>(NULL), strstr(text, "\nTime: "));
+  // The minimal mode exits without the core dump
+  ASSERT_TRUE(WIFEXITED(status));
+  ASSERT_EQ(EXIT_FAILURE, WEXITSTATUS(status));
+  // The full reports are back after the quiet period
+  sleep(3);
+  status = CrashWithLoopFile(path, text, sizeof(text));
+  unlink(path);
+  ASSERT_NE(static_cast<const char*>(NULL),
+            strstr(text, "Segmentation fault"));
+  ASSERT_EQ(static_cast<const char*>(NULL),
+            strstr(text, "Crash loop detected"));
+  ASSERT_TRUE(WIFSIGNALED(status));
+  ASSERT_EQ(SIGABRT, WTERMSIG(status));
+}
+
+#if defined(__arm__)
+static int __attribute__((noinline)) CrashDeep(int depth, int* pointer) {
+  if (depth == 0) {
+    *pointer = 0;
+    return 0;
+  }
+  return CrashDeep(depth - 1, pointer) + 1;
+}
+
+TEST(DeathHandler, ExidxUnwinding) {
+  int pipefd[2];
+  assert(pipe(pipefd) == 0);
+
+  int pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    dup2(pipefd[1], STDOUT_FILENO);
+    dup2(pipefd[1], STDERR_FILENO);
+    DeathHandler dh;
+    dh.set_color_output(false);
+    int* p = reinterpret_cast<int*>(strtol("0", NULL, 10));
+    CrashDeep(5, p);
+  }
+  close(pipefd[1]);
+  wait(NULL);
+  char text[8192];
+  int bytesRead;
+  int totalBytesRead = 0;
+  while ((bytesRead = read(pipefd[0], &text[totalBytesRead],
+                           sizeof(text) - totalBytesRead)) > 0) {
+    totalBytesRead += bytesRead;
+  }
+  close(pipefd[0]);
+  printf("%s", text);
+  char* posstr = strstr(text, "Segmentation fault");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+  // The frames above the signal one are only reachable via .ARM.exidx
+  posstr = strstr(text, "[DeathHandler_ExidxUnwinding_Test::TestBody()]");
+  ASSERT_NE(static_cast<const char*>(NULL), posstr);
+}
+#endif
+
 TEST(DeathHandler, SimpleSIGABRT) {
   int pipefd[2];
   assert(pipe(pipefd) == 0);
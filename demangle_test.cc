@@ -0,0 +1,194 @@
+/*
+
+  Copyright (c) 2012, Samsung R&D Institute Russia
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*! @file demangle_test.cc
+ *  @brief Tests for the demangler of the line table, which compare it with
+ *  c++filt on the symbols of libstdc++, LLVM, gtest, abseil and gRPC.
+ *  @author Markovtsev Vadim <gmarkhor@gmail.com>
+ *  @version 1.0
+ *  @license Simplified BSD License
+ *  @copyright 2012 Samsung R&D Institute Russia, 2016 Moscow Institute of Physics and Technology
+ */
+
+/*! The internals are reached by including death_handler.cc, which poisons
+ *  the formatting functions, so gtest and main() come before it:
+ *
+ *  g++ -std=c++11 -g -O2 -pthread -I/usr/src/googletest/googletest demangle_test.cc -lgtest -ldl -o demangle_test
+ */
+
+#include <gtest/gtest.h>
+
+int main(int argc, char** argv) {
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
+
+#include "death_handler.cc"
+
+namespace {
+
+struct DemangleCase {
+  const char* mangled;
+  const char* demangled;
+};
+
+/// @brief The outputs of c++filt.
+const DemangleCase kDemangleCases[] = {
+  { "_ZNSs4swapERSs",
+    "std::basic_string<char, std::char_traits<char>, std::allocator<char> "
+    ">::swap(std::basic_string<char, std::char_traits<char>, "
+    "std::allocator<char> >&)" },
+  { "_ZNSsC1Ev",
+    "std::basic_string<char, std::char_traits<char>, std::allocator<char> "
+    ">::basic_string()" },
+  { "_ZNSolsEi",
+    "std::basic_ostream<char, std::char_traits<char> >::operator<<(int)" },
+  { "_ZSt4endlIcSt11char_traitsIcEERSt13basic_ostreamIT_T0_ES6_",
+    "std::basic_ostream<char, std::char_traits<char> >& std::endl<char, "
+    "std::char_traits<char> >(std::basic_ostream<char, std::char_traits<char> "
+    ">&)" },
+  { "_ZTVSt5ctypeIcE",
+    "vtable for std::ctype<char>" },
+  { "_ZTINSt6locale5facetE",
+    "typeinfo for std::locale::facet" },
+  { "_ZTSSt5ctypeIwE",
+    "typeinfo name for std::ctype<wchar_t>" },
+  { "_ZTTSo",
+    "VTT for std::basic_ostream<char, std::char_traits<char> >" },
+  { "_ZTIDn",
+    "typeinfo for decltype(nullptr)" },
+  { "_ZGVZN7testing8UnitTest11GetInstanceEvE8instance",
+    "guard variable for testing::UnitTest::GetInstance()::instance" },
+  { "_ZGTtNSt11logic_errorD1Ev",
+    "transaction clone for std::logic_error::~logic_error()" },
+  { "_ZThn16_NSdD1Ev",
+    "non-virtual thunk to std::basic_iostream<char, std::char_traits<char> "
+    ">::~basic_iostream()" },
+  { "_ZTv0_n24_NSdD0Ev",
+    "virtual thunk to std::basic_iostream<char, std::char_traits<char> "
+    ">::~basic_iostream()" },
+  { "_ZTISt11_Mutex_baseILN9__gnu_cxx12_Lock_policyE2EE",
+    "typeinfo for std::_Mutex_base<(__gnu_cxx::_Lock_policy)2>" },
+  { "_ZN4llvm5cflaa13hasCallerAttrESt6bitsetILm32EE",
+    "llvm::cflaa::hasCallerAttr(std::bitset<32ul>)" },
+  { "_ZNSt15__exception_ptr13exception_ptrC1EMS0_FvvE",
+    "std::__exception_ptr::exception_ptr::exception_ptr(void "
+    "(std::__exception_ptr::exception_ptr::*)())" },
+  { "_ZNKSt15__exception_ptr13exception_ptrcvMS0_FvvEEv",
+    "std::__exception_ptr::exception_ptr::operator void "
+    "(std::__exception_ptr::exception_ptr::*)()() const" },
+  { "_ZN7testing8internal35HandleExceptionsInMethodIfSupportedINS_4TestEvEET0"
+    "_PT_MS4_FS3_vEPKc",
+    "void testing::internal::HandleExceptionsInMethodIfSupported<testing::Te"
+    "st, void>(testing::Test*, void (testing::Test::*)(), char const*)" },
+  { "_ZN7testing8internalL20SumOverTestSuiteListERKSt6vectorIPNS_9TestSuiteES"
+    "aIS3_EEMS2_KFivE.constprop.0",
+    "testing::internal::SumOverTestSuiteList(std::vector<testing::TestSuite*"
+    ", std::allocator<testing::TestSuite*> > const&, int "
+    "(testing::TestSuite::*)() const) [clone .constprop.0]" },
+  { "_ZN7testing15AssertionResultlsIA11_cEERS0_RKT_",
+    "testing::AssertionResult& testing::AssertionResult::operator<< <char "
+    "[11]>(char const (&) [11])" },
+  { "_ZTIN4llvm6detail23provider_format_adapterIRA6_KcEE",
+    "typeinfo for llvm::detail::provider_format_adapter<char const (&) [6]>" },
+  { "_ZN4llvm10make_errorINS_8DWPErrorEJRA25_KcEEENS_5ErrorEDpOT0_",
+    "llvm::Error llvm::make_error<llvm::DWPError, char const (&) [25]>(char "
+    "const (&) [25])" },
+  { "_ZNSt6vectorIhSaIhEE12emplace_backIJhEEEvDpOT_",
+    "void std::vector<unsigned char, std::allocator<unsigned char> "
+    ">::emplace_back<unsigned char>(unsigned char&&)" },
+  { "_ZNSt5dequeIjSaIjEE16_M_push_back_auxIJRKjEEEvDpOT_",
+    "void std::deque<unsigned int, std::allocator<unsigned int> "
+    ">::_M_push_back_aux<unsigned int const&>(unsigned int const&)" },
+  { "_ZTSN9grpc_core14promise_detail16ActivityContextsIJEEE",
+    "typeinfo name for grpc_core::promise_detail::ActivityContexts<>" },
+  { "_ZNSt6thread11_State_implINS_8_InvokerISt5tupleIJPFvvEEEEEE6_M_runEv",
+    "std::thread::_State_impl<std::thread::_Invoker<std::tuple<void (*)()> "
+    "> >::_M_run()" },
+  { "_ZN4llvm9LocalizerC1ESt8functionIFbRKNS_15MachineFunctionEEE",
+    "llvm::Localizer::Localizer(std::function<bool (llvm::MachineFunction "
+    "const&)>)" },
+  { "_ZN4llvm3orc22LazyCallThroughManager31resolveTrampolineLandingAddressEmN"
+    "S_15unique_functionIKFvmEEE",
+    "llvm::orc::LazyCallThroughManager::resolveTrampolineLandingAddress(unsi"
+    "gned long, llvm::unique_function<void (unsigned long) const>)" },
+  { "_ZN15FLAGS_nofromenvMUlvE_4_FUNEv",
+    "FLAGS_nofromenv::{lambda()#1}::_FUN()" },
+  { "_ZN7testing4TestC2Ev.cold",
+    "testing::Test::Test() [clone .cold]" },
+  { "_ZN7testing8internalL14PrintOnOneLineEPKci.constprop.0",
+    "testing::internal::PrintOnOneLine(char const*, int) [clone "
+    ".constprop.0]" },
+  { "_ZNSt5dequeIN4llvm11SmallStringILj32EEESaIS2_EE16_M_push_back_auxIJEEEvD"
+    "pOT_",
+    "void std::deque<llvm::SmallString<32u>, "
+    "std::allocator<llvm::SmallString<32u> > >::_M_push_back_aux<>()" },
+  { "_ZN4absl7debian313base_internal12CallOnceImplIRFvvEJEEEvPSt6atomicIjENS1"
+    "_14SchedulingModeEOT_DpOT0_",
+    "void absl::debian3::base_internal::CallOnceImpl<void "
+    "(&)()>(std::atomic<unsigned int>*, "
+    "absl::debian3::base_internal::SchedulingMode, void (&)())" },
+  { "_ZN4llvm12hash_combineIJhhjEEENS_9hash_codeEDpRKT_",
+    "llvm::hash_code llvm::hash_combine<unsigned char, unsigned char, "
+    "unsigned int>(unsigned char const&, unsigned char const&, unsigned int "
+    "const&)" },
+};
+
+/// @brief The names which are left to addr2line.
+const char* const kUnsupported[] = {
+  // An expression in a template argument
+  "_ZN4absl7debian316strings_internal7CompareILi84ELi84EEEiRKNS1_"
+  "11BigUnsignedIXT_EEERKNS3_IXT0_EEE",
+  // Too long for the buffer
+  "_ZSt17__rotate_adaptiveIN9__gnu_cxx17__normal_iteratorIPSt6vectorIN4llvm"
+  "12IRSimilarity21IRSimilarityCandidateESaIS5_EES2_IS7_SaIS7_EEEES8_lET_SC_"
+  "SC_SC_T1_SD_T0_SD_",
+  "main",
+  "_Z",
+};
+
+}  // namespace
+
+TEST(Demangle, CxxFilt) {
+  char buffer[2000];
+  for (size_t i = 0; i < sizeof(kDemangleCases) / sizeof(kDemangleCases[0]);
+       i++) {
+    const DemangleCase& test = kDemangleCases[i];
+    ASSERT_TRUE(Debug::Demangle(test.mangled, buffer, sizeof(buffer)))
+        << test.mangled;
+    EXPECT_STREQ(test.demangled, buffer) << test.mangled;
+  }
+}
+
+TEST(Demangle, Unsupported) {
+  char buffer[2000];
+  for (size_t i = 0; i < sizeof(kUnsupported) / sizeof(kUnsupported[0]);
+       i++) {
+    EXPECT_FALSE(Debug::Demangle(kUnsupported[i], buffer, sizeof(buffer)))
+        << kUnsupported[i];
+  }
+}
@@ -0,0 +1,399 @@
+/*
+
+  Copyright (c) 2012, Samsung R&D Institute Russia
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*! @file core_helper.cc
+ *  @brief Symbolizes the ELF core piped by the kernel without storing it.
+ *  @author Markovtsev Vadim <gmarkhor@gmail.com>
+ *  @version 1.0
+ *  @license Simplified BSD License
+ *  @copyright 2012 Samsung R&D Institute Russia, 2016 Moscow Institute of Physics and Technology
+ */
+
+
+/*! Usage: echo "|/usr/local/bin/core_helper -o /var/crash %p %e" >
+ *         /proc/sys/kernel/core_pattern
+ *
+ *  core_helper [-o dir] [-m] [-s stack_kib] [pid [name]]
+ *
+ *  The core is read from the standard input in one pass: the notes give
+ *  the threads' registers and the mapped files, and of all the PT_LOAD
+ *  segments only the top stack_kib (default 256) KiB of each thread's stack
+ *  are kept. The stacks are unwound with the .eh_frame of the mapped files,
+ *  falling back to the frame pointers and then to scanning for the words
+ *  which point right after a call instruction, symbolized via addr2line
+ *  and written to dir/name.pid.txt. With -m, a minicore which contains
+ *  the notes and the captured stacks is written to dir/name.pid.core as
+ *  well; it can be loaded into gdb together with the executable. The rest
+ *  of the core is discarded, so it never hits the disk.
+ */
+
+#include <elf.h>
+#include <link.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/procfs.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "symbolizer.h"
+#include "unwinder.h"
+
+namespace Debug {
+
+/// @brief Sequential reader of the standard input which never seeks back.
+class StreamReader {
+ public:
+  StreamReader() : offset_(0) {}
+
+  bool Read(void* buffer, size_t size) {
+    char* ptr = static_cast<char*>(buffer);
+    while (size > 0) {
+      ssize_t len = read(STDIN_FILENO, ptr, size);
+      if (len <= 0) {
+        return false;
+      }
+      ptr += len;
+      size -= len;
+      offset_ += len;
+    }
+    return true;
+  }
+
+  bool SkipTo(uint64_t offset) {
+    char buffer[1 << 16];
+    while (offset_ < offset) {
+      size_t size = std::min<uint64_t>(sizeof(buffer), offset - offset_);
+      if (!Read(buffer, size)) {
+        return false;
+      }
+    }
+    return offset_ == offset;
+  }
+
+  uint64_t offset() const { return offset_; }
+
+ private:
+  uint64_t offset_;
+};
+
+/// @brief Parses NT_PRSTATUS, NT_PRPSINFO and NT_FILE.
+static void ParseNotes(const std::vector<char>& notes,
+                       std::vector<ThreadStack>* threads, ModuleMap* modules,
+                       CodeMap* code, std::string* name) {
+  size_t pos = 0;
+  while (pos + sizeof(ElfW(Nhdr)) <= notes.size()) {
+    const ElfW(Nhdr)* nhdr =
+        reinterpret_cast<const ElfW(Nhdr)*>(&notes[pos]);
+    size_t desc = pos + sizeof(*nhdr) + ((nhdr->n_namesz + 3) & ~3);
+    if (desc + nhdr->n_descsz > notes.size()) {
+      break;
+    }
+    const char* data = &notes[desc];
+    if (nhdr->n_type == NT_PRSTATUS &&
+        nhdr->n_descsz >= sizeof(elf_prstatus)) {
+      elf_prstatus status;
+      memcpy(&status, data, sizeof(status));
+      ThreadStack thread;
+      thread.tid = status.pr_pid;
+      thread.signal = status.pr_cursig;
+      thread.ReadRegisters(reinterpret_cast<const elf_greg_t*>(
+          &status.pr_reg));
+      threads->push_back(thread);
+    } else if (nhdr->n_type == NT_PRPSINFO &&
+               nhdr->n_descsz >= sizeof(elf_prpsinfo) && name->empty()) {
+      elf_prpsinfo info;
+      memcpy(&info, data, sizeof(info));
+      name->assign(info.pr_fname, strnlen(info.pr_fname,
+                                          sizeof(info.pr_fname)));
+    } else if (nhdr->n_type == NT_FILE) {
+      // count, page size, count * (start, end, page offset), names
+      const ElfW(Addr)* header = reinterpret_cast<const ElfW(Addr)*>(data);
+      uint64_t count = header[0], page_size = header[1];
+      const char* path = data + (2 + count * 3) * sizeof(ElfW(Addr));
+      const char* end = data + nhdr->n_descsz;
+      for (uint64_t i = 0; i < count && path < end; i++) {
+        const ElfW(Addr)* entry = header + 2 + i * 3;
+        modules->Add(entry[0], entry[1], entry[2] * page_size, path);
+        code->AddFile(entry[0], entry[1], entry[2] * page_size, path);
+        path += strnlen(path, end - path) + 1;
+      }
+    }
+    pos = desc + ((nhdr->n_descsz + 3) & ~3);
+  }
+}
+
+/// @brief Copies the part of a PT_LOAD segment which overlaps the captured
+/// stack windows.
+static void CaptureStacks(uint64_t address, const char* data, size_t size,
+                          std::vector<ThreadStack>* threads) {
+  for (size_t i = 0; i < threads->size(); i++) {
+    ThreadStack& thread = (*threads)[i];
+    uint64_t start = std::max(address, thread.stack_start);
+    uint64_t end = std::min(address + size,
+                            thread.stack_start + thread.stack.size());
+    if (start >= end) {
+      continue;
+    }
+    memcpy(&thread.stack[start - thread.stack_start],
+           data + (start - address), end - start);
+    if (thread.captured_start == thread.captured_end) {
+      thread.captured_start = start;
+    }
+    thread.captured_end = end;
+  }
+}
+
+static const char* SignalName(int signal) {
+  switch (signal) {
+    case SIGSEGV:
+      return "Segmentation fault";
+    case SIGABRT:
+      return "Aborted";
+    case SIGFPE:
+      return "Floating point exception";
+    case SIGBUS:
+      return "Bus error";
+    case SIGILL:
+      return "Illegal instruction";
+    default:
+      return "Caught signal";
+  }
+}
+
+/// @brief Writes the notes and the captured stacks as a valid ELF core.
+static bool WriteMinicore(const std::string& path, const ElfW(Ehdr)& input,
+                          const std::vector<char>& notes,
+                          const std::vector<ThreadStack>& threads) {
+  FILE* file = fopen(path.c_str(), "wb");
+  if (file == NULL) {
+    return false;
+  }
+  std::vector<ElfW(Phdr)> phdrs(1);
+  ElfW(Ehdr) ehdr = input;
+  ehdr.e_phoff = sizeof(ehdr);
+  ehdr.e_phentsize = sizeof(ElfW(Phdr));
+  ehdr.e_shoff = 0;
+  ehdr.e_shnum = 0;
+  ehdr.e_shstrndx = 0;
+  for (size_t i = 0; i < threads.size(); i++) {
+    if (threads[i].captured_end > threads[i].captured_start) {
+      phdrs.push_back(ElfW(Phdr)());
+    }
+  }
+  ehdr.e_phnum = phdrs.size();
+  uint64_t offset = sizeof(ehdr) + phdrs.size() * sizeof(ElfW(Phdr));
+  phdrs[0].p_type = PT_NOTE;
+  phdrs[0].p_offset = offset;
+  phdrs[0].p_filesz = notes.size();
+  offset += notes.size();
+  for (size_t i = 0, j = 1; i < threads.size(); i++) {
+    const ThreadStack& thread = threads[i];
+    if (thread.captured_end <= thread.captured_start) {
+      continue;
+    }
+    ElfW(Phdr)& phdr = phdrs[j++];
+    phdr.p_type = PT_LOAD;
+    phdr.p_flags = PF_R | PF_W;
+    phdr.p_offset = offset;
+    phdr.p_vaddr = thread.captured_start;
+    phdr.p_filesz = phdr.p_memsz =
+        thread.captured_end - thread.captured_start;
+    phdr.p_align = 1;
+    offset += phdr.p_filesz;
+  }
+  bool ok = fwrite(&ehdr, sizeof(ehdr), 1, file) == 1 &&
+      fwrite(phdrs.data(), sizeof(phdrs[0]), phdrs.size(), file) ==
+          phdrs.size() &&
+      fwrite(notes.data(), 1, notes.size(), file) == notes.size();
+  for (size_t i = 0; i < threads.size() && ok; i++) {
+    const ThreadStack& thread = threads[i];
+    size_t size = thread.captured_end - thread.captured_start;
+    ok = size == 0 || fwrite(
+        &thread.stack[thread.captured_start - thread.stack_start], 1, size,
+        file) == size;
+  }
+  return fclose(file) == 0 && ok;
+}
+
+static int Usage(const char* argv0) {
+  fprintf(stderr, "Usage: %s [-o dir] [-m] [-s stack_kib] [pid [name]] "
+          "< core\n", argv0);
+  return EXIT_FAILURE;
+}
+
+}  // namespace Debug
+
+int main(int argc, char** argv) {
+  using namespace Debug;  // NOLINT(build/namespaces)
+  std::string dir = ".", pid, name;
+  bool minicore = false;
+  uint64_t stack_size = 256 << 10;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      dir = argv[++i];
+    } else if (!strcmp(argv[i], "-m")) {
+      minicore = true;
+    } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      stack_size = strtoull(argv[++i], NULL, 10) << 10;
+    } else if (argv[i][0] == '-') {
+      return Usage(argv[0]);
+    } else if (pid.empty()) {
+      pid = argv[i];
+    } else {
+      name = argv[i];
+    }
+  }
+
+  StreamReader reader;
+  ElfW(Ehdr) ehdr;
+  if (!reader.Read(&ehdr, sizeof(ehdr)) ||
+      memcmp(ehdr.e_ident, ELFMAG, SELFMAG) || ehdr.e_type != ET_CORE ||
+      ehdr.e_phentsize != sizeof(ElfW(Phdr)) ||
+      !reader.SkipTo(ehdr.e_phoff)) {
+    fprintf(stderr, "core_helper: the input is not an ELF core\n");
+    return EXIT_FAILURE;
+  }
+  // With PN_XNUM, the real number is in the section header at the end of
+  // the file, but the notes always follow the program headers immediately
+  std::vector<ElfW(Phdr)> phdrs(1);
+  if (!reader.Read(&phdrs[0], sizeof(phdrs[0]))) {
+    return EXIT_FAILURE;
+  }
+  size_t phnum = ehdr.e_phnum;
+  if (phnum == PN_XNUM && phdrs[0].p_type == PT_NOTE) {
+    phnum = (phdrs[0].p_offset - ehdr.e_phoff) / sizeof(ElfW(Phdr));
+  }
+  phdrs.resize(phnum);
+  if (phnum > 1 && !reader.Read(&phdrs[1], (phnum - 1) * sizeof(phdrs[0]))) {
+    return EXIT_FAILURE;
+  }
+
+  std::vector<char> notes;
+  std::vector<ThreadStack> threads;
+  ModuleMap modules;
+  CodeMap code;
+  for (size_t i = 0; i < phdrs.size(); i++) {
+    if (phdrs[i].p_type == PT_NOTE && notes.empty() &&
+        reader.SkipTo(phdrs[i].p_offset)) {
+      notes.resize(phdrs[i].p_filesz);
+      if (!reader.Read(notes.data(), notes.size())) {
+        return EXIT_FAILURE;
+      }
+      std::string core_name;
+      ParseNotes(notes, &threads, &modules, &code, &core_name);
+      if (name.empty()) {
+        name = core_name;
+      }
+    } else if (phdrs[i].p_type == PT_LOAD && (phdrs[i].p_flags & PF_X)) {
+      code.AddCode(phdrs[i].p_vaddr, phdrs[i].p_vaddr + phdrs[i].p_memsz);
+    }
+  }
+  for (size_t i = 0; i < threads.size(); i++) {
+    // Leave room for the red zone below sp
+    threads[i].stack_start = (threads[i].sp - 256) & ~15ULL;
+    threads[i].stack.resize(stack_size);
+  }
+
+  // Stream the memory segments in the file order, keeping only the stacks
+  std::vector<char> buffer(1 << 20);
+  for (size_t i = 0; i < phdrs.size(); i++) {
+    const ElfW(Phdr)& phdr = phdrs[i];
+    if (phdr.p_type != PT_LOAD || phdr.p_filesz == 0 ||
+        phdr.p_offset < reader.offset() || !reader.SkipTo(phdr.p_offset)) {
+      continue;
+    }
+    for (uint64_t done = 0; done < phdr.p_filesz;) {
+      size_t size = std::min<uint64_t>(buffer.size(), phdr.p_filesz - done);
+      if (!reader.Read(buffer.data(), size)) {
+        break;
+      }
+      CaptureStacks(phdr.p_vaddr + done, buffer.data(), size, &threads);
+      done += size;
+    }
+  }
+  // Drain the pipe so that the kernel finishes the dump
+  while (read(STDIN_FILENO, buffer.data(), buffer.size()) > 0) {}
+
+  std::vector<std::vector<StackFrame> > stacks(threads.size());
+  std::vector<Symbolizer::Key> keys;
+  Symbolizer symbolizer;
+  for (size_t i = 0; i < threads.size(); i++) {
+    stacks[i] = Unwind(threads[i], code);
+    for (size_t j = 0; j < stacks[i].size(); j++) {
+      std::string path;
+      uint64_t offset;
+      // Return addresses point after the call
+      if (modules.Resolve(stacks[i][j].address - (j > 0), &path, &offset)) {
+        keys.push_back(Symbolizer::Key(path, offset));
+      }
+    }
+  }
+  symbolizer.Resolve(keys);
+
+  std::string base = dir + "/" + (name.empty()? "core" : name) + "." +
+      (pid.empty() && !threads.empty()?
+       std::to_string(threads[0].tid) : pid);
+  FILE* report = fopen((base + ".txt").c_str(), "w");
+  if (report == NULL) {
+    perror("core_helper - fopen()");
+    return EXIT_FAILURE;
+  }
+  fprintf(report, "%s (core of %s, pid %s)\n",
+          SignalName(threads.empty()? 0 : threads[0].signal), name.c_str(),
+          pid.c_str());
+  for (size_t i = 0; i < threads.size(); i++) {
+    fprintf(report, "\nThread %d%s:\n", threads[i].tid,
+            i == 0? " (crashed)" : "");
+    for (size_t j = 0; j < stacks[i].size(); j++) {
+      const StackFrame& frame = stacks[i][j];
+      std::string path;
+      uint64_t offset;
+      SymbolInfo info;
+      fprintf(report, "#%zu 0x%llx", j,
+              static_cast<unsigned long long>(frame.address));  // NOLINT
+      if (modules.Resolve(frame.address - (j > 0), &path, &offset) &&
+          symbolizer.Lookup(Symbolizer::Key(path, offset), &info) &&
+          info.function != "??") {
+        fprintf(report, " [%s] %s", info.function.c_str(),
+                info.location.c_str());
+      } else if (!path.empty()) {
+        fprintf(report, " at %s", path.c_str());
+      }
+      fprintf(report, "%s\n", frame.note());
+    }
+  }
+  fclose(report);
+  if (minicore && !WriteMinicore(base + ".core", ehdr, notes, threads)) {
+    perror("core_helper - minicore");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,514 @@
+/*
+
+  Copyright (c) 2012, Samsung R&D Institute Russia
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*! @file crash_aggregate.cc
+ *  @brief Groups many raw or symbolized crash reports by the stack signature.
+ *  @author Markovtsev Vadim <gmarkhor@gmail.com>
+ *  @version 1.0
+ *  @license Simplified BSD License
+ *  @copyright 2012 Samsung R&D Institute Russia, 2016 Moscow Institute of Physics and Technology
+ */
+
+
+/*! Usage: crash_aggregate [-j jobs] [-n top] [-c cache] [path...]
+ *
+ *  Each path is a file or a directory (scanned recursively) with the reports
+ *  written by DeathHandler; several reports in the same file are separated
+ *  by the terminating zero byte or by the next report header. Without paths
+ *  or with "-", the reports are streamed from the standard input.
+ *  The reports are parsed by all cores, grouped by the stack signature, and
+ *  the frames of the raw reports (DeathHandler::set_symbolize(false)) are
+ *  symbolized once per unique (build id, offset) pair. The groups are printed
+ *  in the descending order of the number of crashes.
+ */
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "symbolizer.h"
+
+namespace Debug {
+
+/// @brief A single stack frame, either raw or already symbolized.
+struct Frame {
+  bool raw;
+  std::string module;  // build id or path
+  std::string path;
+  uint64_t offset;
+  std::string function;
+  std::string location;
+};
+
+/// @brief The crashes which share the same signal and stack signature.
+struct Group {
+  Group() : count(0), first(INT64_MAX), last(0) {}
+
+  uint64_t count;
+  int64_t first;
+  int64_t last;
+  std::string signal;
+  std::vector<Frame> frames;
+};
+
+typedef std::unordered_map<std::string, Group> Groups;
+
+/// @brief Removes the ANSI escape sequences written with color_output.
+static std::string StripColors(const std::string& text) {
+  std::string res;
+  res.reserve(text.size());
+  for (size_t i = 0; i < text.size(); i++) {
+    if (text[i] == '\033' && i + 1 < text.size() && text[i + 1] == '[') {
+      for (i += 2; i < text.size() && text[i] != 'm'; i++) {}
+      continue;
+    }
+    res += text[i];
+  }
+  return res;
+}
+
+static bool IsHeader(const std::string& line) {
+  return line.find(" (thread ") != std::string::npos &&
+      line.find(", pid ") != std::string::npos;
+}
+
+/// @brief Parses "#<n> 0x<offset> <module> build-id=<hex>[ (<note>)]".
+static bool ParseRawFrame(const std::string& line, Frame* frame) {
+  size_t address = line.find(" 0x");
+  if (line.empty() || line[0] != '#' || address == std::string::npos) {
+    return false;
+  }
+  char* end;
+  frame->raw = true;
+  frame->offset = strtoull(line.c_str() + address + 1, &end, 16);
+  std::string rest(end);
+  if (!rest.empty() && rest[0] == ' ') {
+    rest.erase(0, 1);
+  }
+  size_t build_id = rest.rfind(" build-id=");
+  if (build_id != std::string::npos) {
+    frame->path = rest.substr(0, build_id);
+    frame->module = rest.substr(build_id + 10);
+    frame->module = frame->module.substr(0, frame->module.find(' '));
+  } else {
+    frame->path = rest;
+  }
+  if (frame->module.empty()) {
+    frame->module = frame->path;
+  }
+  return true;
+}
+
+/// @brief Parses a single report and merges it into groups.
+static void AddReport(const std::string& text, int64_t default_time,
+                      Groups* groups) {
+  std::string signal, signature;
+  int64_t time = default_time;
+  std::vector<Frame> frames;
+  size_t pos = 0;
+  while (pos < text.size()) {
+    size_t end = text.find('\n', pos);
+    if (end == std::string::npos) {
+      end = text.size();
+    }
+    std::string line = text.substr(pos, end - pos);
+    pos = end + 1;
+    Frame frame;
+    if (signal.empty() && IsHeader(line)) {
+      signal = line.substr(0, line.find(" (thread "));
+    } else if (!line.compare(0, 6, "Time: ")) {
+      time = strtoll(line.c_str() + 6, NULL, 10);
+    } else if (ParseRawFrame(line, &frame)) {
+      char offset[32];
+      snprintf(offset, sizeof(offset), "+%llx;",
+               static_cast<unsigned long long>(frame.offset));  // NOLINT
+      signature += frame.module + offset;
+      frames.push_back(frame);
+    } else if (!line.empty() && line[0] == '[' &&
+               line.find(']') != std::string::npos) {
+      frame.raw = false;
+      frame.offset = 0;
+      frame.function = line.substr(1, line.rfind(']') - 1);
+      end = text.find('\n', pos);
+      if (end == std::string::npos) {
+        end = text.size();
+      }
+      frame.location = text.substr(pos, end - pos);
+      pos = end + 1;
+      size_t pid = frame.location.rfind(" (");
+      if (pid != std::string::npos) {
+        frame.location.erase(pid);
+      }
+      signature += frame.function + ";";
+      frames.push_back(frame);
+    }
+  }
+  if (signal.empty() && frames.empty()) {
+    return;
+  }
+  Group& group = (*groups)[signal + "|" + signature];
+  if (group.count++ == 0) {
+    group.signal = signal;
+    group.frames.swap(frames);
+  }
+  group.first = std::min(group.first, time);
+  group.last = std::max(group.last, time);
+}
+
+/// @brief Splits the stream of reports on the terminating zero bytes and
+/// on the report headers.
+class ReportSplitter {
+ public:
+  ReportSplitter(int64_t time, Groups* groups)
+      : time_(time), groups_(groups) {}
+
+  void Feed(const char* data, size_t size) {
+    const char* end = data + size;
+    while (data < end) {
+      const char* zero = static_cast<const char*>(memchr(data, 0, end - data));
+      if (zero == NULL) {
+        pending_.append(data, end);
+        break;
+      }
+      pending_.append(data, zero);
+      Flush();
+      data = zero + 1;
+    }
+  }
+
+  void Flush() {
+    std::string text = StripColors(pending_);
+    pending_.clear();
+    // Reports without the terminator are delimited by the next header
+    size_t start = 0, pos = 0;
+    while (pos < text.size()) {
+      size_t end = text.find('\n', pos);
+      if (end == std::string::npos) {
+        end = text.size();
+      }
+      if (pos > start && IsHeader(text.substr(pos, end - pos))) {
+        AddReport(text.substr(start, pos - start), time_, groups_);
+        start = pos;
+      }
+      pos = end + 1;
+    }
+    if (start < text.size()) {
+      AddReport(text.substr(start), time_, groups_);
+    }
+  }
+
+ private:
+  int64_t time_;
+  Groups* groups_;
+  std::string pending_;
+};
+
+/// @brief A file to parse or a piece of the standard input.
+struct Work {
+  std::string path;
+  std::string data;
+};
+
+/// @brief Bounded multi-producer multi-consumer queue, so that the input
+/// is streamed instead of being loaded into memory at once.
+class WorkQueue {
+ public:
+  explicit WorkQueue(size_t capacity) : capacity_(capacity), closed_(false) {}
+
+  void Push(Work* work) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_full_.wait(lock, [this] { return queue_.size() < capacity_; });
+    queue_.push_back(Work());
+    queue_.back().path.swap(work->path);
+    queue_.back().data.swap(work->data);
+    not_empty_.notify_one();
+  }
+
+  bool Pop(Work* work) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_.wait(lock, [this] { return closed_ || !queue_.empty(); });
+    if (queue_.empty()) {
+      return false;
+    }
+    work->path.swap(queue_.front().path);
+    work->data.swap(queue_.front().data);
+    queue_.pop_front();
+    not_full_.notify_one();
+    return true;
+  }
+
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    closed_ = true;
+    not_empty_.notify_all();
+  }
+
+ private:
+  size_t capacity_;
+  bool closed_;
+  std::deque<Work> queue_;
+  std::mutex mutex_;
+  std::condition_variable not_empty_;
+  std::condition_variable not_full_;
+};
+
+static void ParseFile(const std::string& path, Groups* groups) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "crash_aggregate: failed to read %s\n", path.c_str());
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+  ReportSplitter splitter(st.st_mtime, groups);
+  std::vector<char> buffer(1 << 20);
+  ssize_t len;
+  while ((len = read(fd, buffer.data(), buffer.size())) > 0) {
+    splitter.Feed(buffer.data(), len);
+  }
+  splitter.Flush();
+  close(fd);
+}
+
+static void Worker(WorkQueue* queue, Groups* groups) {
+  Work work;
+  while (queue->Pop(&work)) {
+    if (!work.path.empty()) {
+      ParseFile(work.path, groups);
+    } else {
+      ReportSplitter splitter(0, groups);
+      splitter.Feed(work.data.data(), work.data.size());
+      splitter.Flush();
+    }
+  }
+}
+
+static void EnqueuePath(const std::string& path, WorkQueue* queue) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    fprintf(stderr, "crash_aggregate: %s does not exist\n", path.c_str());
+    return;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    Work work;
+    work.path = path;
+    queue->Push(&work);
+    return;
+  }
+  DIR* dir = opendir(path.c_str());
+  if (dir == NULL) {
+    return;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, "..")) {
+      EnqueuePath(path + "/" + entry->d_name, queue);
+    }
+  }
+  closedir(dir);
+}
+
+/// @brief Reads the standard input in big pieces cut after the report
+/// terminators, so that each piece holds only whole reports.
+static void EnqueueStdin(WorkQueue* queue) {
+  static const size_t kPieceSize = 1 << 20;
+  Work work;
+  std::vector<char> buffer(kPieceSize);
+  ssize_t len;
+  while ((len = read(STDIN_FILENO, buffer.data(), buffer.size())) > 0) {
+    work.data.append(buffer.data(), len);
+    if (work.data.size() < kPieceSize) {
+      continue;
+    }
+    size_t cut = work.data.rfind('\0');
+    if (cut == std::string::npos) {
+      continue;
+    }
+    Work piece;
+    piece.data = work.data.substr(0, cut + 1);
+    work.data.erase(0, cut + 1);
+    queue->Push(&piece);
+  }
+  if (!work.data.empty()) {
+    queue->Push(&work);
+  }
+}
+
+static std::string FormatTime(int64_t time) {
+  if (time <= 0 || time == INT64_MAX) {
+    return "unknown";
+  }
+  time_t seconds = time;
+  struct tm tm;
+  char buffer[32];
+  gmtime_r(&seconds, &tm);
+  strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M:%S UTC", &tm);
+  return buffer;
+}
+
+static int Usage(const char* argv0) {
+  fprintf(stderr, "Usage: %s [-j jobs] [-n top] [-c cache] [path...]\n",
+          argv0);
+  return EXIT_FAILURE;
+}
+
+}  // namespace Debug
+
+int main(int argc, char** argv) {
+  using namespace Debug;  // NOLINT(build/namespaces)
+  unsigned jobs = 0;
+  size_t top = 20;
+  std::string cache;
+  std::vector<std::string> paths;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+      jobs = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      top = atoi(argv[++i]);
+    } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+      cache = argv[++i];
+    } else if (argv[i][0] == '-' && argv[i][1] != 0) {
+      return Usage(argv[0]);
+    } else {
+      paths.push_back(argv[i]);
+    }
+  }
+  if (jobs == 0) {
+    jobs = std::max(1U, std::thread::hardware_concurrency());
+  }
+
+  WorkQueue queue(jobs * 4);
+  std::vector<Groups> partial(jobs);
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < jobs; i++) {
+    workers.push_back(std::thread(Worker, &queue, &partial[i]));
+  }
+  if (paths.empty()) {
+    paths.push_back("-");
+  }
+  for (size_t i = 0; i < paths.size(); i++) {
+    if (paths[i] == "-") {
+      EnqueueStdin(&queue);
+    } else {
+      EnqueuePath(paths[i], &queue);
+    }
+  }
+  queue.Close();
+  for (size_t i = 0; i < workers.size(); i++) {
+    workers[i].join();
+  }
+
+  Groups groups;
+  for (size_t i = 0; i < partial.size(); i++) {
+    for (Groups::iterator it = partial[i].begin(); it != partial[i].end();
+         ++it) {
+      Group& group = groups[it->first];
+      if (group.count == 0) {
+        group.signal = it->second.signal;
+        group.frames.swap(it->second.frames);
+      }
+      group.count += it->second.count;
+      group.first = std::min(group.first, it->second.first);
+      group.last = std::max(group.last, it->second.last);
+    }
+    Groups().swap(partial[i]);
+  }
+  std::vector<const Group*> ranked;
+  uint64_t total = 0;
+  for (Groups::const_iterator it = groups.begin(); it != groups.end(); ++it) {
+    ranked.push_back(&it->second);
+    total += it->second.count;
+  }
+  std::sort(ranked.begin(), ranked.end(),
+            [](const Group* a, const Group* b) { return a->count > b->count; });
+  if (ranked.size() > top) {
+    ranked.resize(top);
+  }
+
+  Symbolizer symbolizer(jobs);
+  if (!cache.empty()) {
+    symbolizer.LoadCache(cache);
+  }
+  std::vector<Symbolizer::Key> keys;
+  for (size_t i = 0; i < ranked.size(); i++) {
+    for (size_t j = 0; j < ranked[i]->frames.size(); j++) {
+      const Frame& frame = ranked[i]->frames[j];
+      if (frame.raw) {
+        symbolizer.AddModule(frame.module, frame.path);
+        keys.push_back(Symbolizer::Key(frame.module, frame.offset));
+      }
+    }
+  }
+  symbolizer.Resolve(keys);
+  if (!cache.empty()) {
+    symbolizer.SaveCache(cache);
+  }
+
+  printf("%llu crashes, %zu unique stacks, %zu addresses symbolized\n\n",
+         static_cast<unsigned long long>(total), groups.size(),  // NOLINT
+         symbolizer.resolved());
+  for (size_t i = 0; i < ranked.size(); i++) {
+    const Group& group = *ranked[i];
+    printf("#%zu: %llu x %s\n  first seen %s, last seen %s\n", i + 1,
+           static_cast<unsigned long long>(group.count),  // NOLINT
+           group.signal.empty()? "unknown signal" : group.signal.c_str(),
+           FormatTime(group.first).c_str(), FormatTime(group.last).c_str());
+    for (size_t j = 0; j < group.frames.size(); j++) {
+      const Frame& frame = group.frames[j];
+      SymbolInfo info;
+      if (frame.raw && symbolizer.Lookup(
+          Symbolizer::Key(frame.module, frame.offset), &info) &&
+          info.function != "??") {
+        printf("  [%s] %s\n", info.function.c_str(), info.location.c_str());
+      } else if (frame.raw) {
+        printf("  0x%llx at %s\n",
+               static_cast<unsigned long long>(frame.offset),  // NOLINT
+               frame.path.c_str());
+      } else {
+        printf("  [%s] %s\n", frame.function.c_str(),
+               frame.location.c_str());
+      }
+    }
+    printf("\n");
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,195 @@
+/*
+
+  Copyright (c) 2012, Samsung R&D Institute Russia
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*! @file decompress_report.cc
+ *  @brief Restores the reports written with set_compress_output(true).
+ *  @author Markovtsev Vadim <gmarkhor@gmail.com>
+ *  @version 1.0
+ *  @license Simplified BSD License
+ *  @copyright 2012 Samsung R&D Institute Russia, 2016 Moscow Institute of Physics and Technology
+ */
+
+
+/*! Usage: decompress_report [file...]
+ *
+ *  Reads the files (or stdin) and writes them to stdout with every
+ *  compressed stream replaced by its text. A stream starts with "DHZ1" and
+ *  consists of the blocks in the LZ4 block format, each prefixed with its
+ *  compressed and raw sizes (32-bit little endian); the matches may refer to
+ *  the previous blocks of the same stream. The empty block ends the stream.
+ *  Everything outside the streams, e.g. the uncompressed log lines, is
+ *  copied as is. death_handler_test.cc includes this file with main()
+ *  renamed to check that the reports survive the round trip.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+
+namespace Debug {
+
+static const char kMagic[] = "DHZ1";
+
+static uint32_t ReadUint32(const unsigned char* data) {
+  return data[0] | (data[1] << 8) | (data[2] << 16) |
+      (static_cast<uint32_t>(data[3]) << 24);
+}
+
+/// @brief Reads the LZ4 length extension bytes.
+static bool ReadLength(const unsigned char** pos, const unsigned char* end,
+                       size_t* length) {
+  unsigned char byte;
+  do {
+    if (*pos >= end) {
+      return false;
+    }
+    byte = *(*pos)++;
+    *length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+/// @brief Decodes a single block, appending to text, which holds
+/// the stream decoded so far.
+static bool DecodeBlock(const unsigned char* pos, const unsigned char* end,
+                        size_t raw_size, std::string* text) {
+  size_t expected = text->size() + raw_size;
+  while (pos < end) {
+    unsigned char token = *pos++;
+    size_t literal_length = token >> 4;
+    if (literal_length == 15 && !ReadLength(&pos, end, &literal_length)) {
+      return false;
+    }
+    if (static_cast<size_t>(end - pos) < literal_length) {
+      return false;
+    }
+    text->append(reinterpret_cast<const char*>(pos), literal_length);
+    pos += literal_length;
+    if (pos == end) {
+      break;
+    }
+    if (end - pos < 2) {
+      return false;
+    }
+    size_t offset = pos[0] | (pos[1] << 8);
+    pos += 2;
+    size_t match_length = token & 15;
+    if (match_length == 15 && !ReadLength(&pos, end, &match_length)) {
+      return false;
+    }
+    match_length += 4;
+    if (offset == 0 || offset > text->size()) {
+      return false;
+    }
+    // The match may overlap the bytes it produces
+    size_t from = text->size() - offset;
+    for (size_t i = 0; i < match_length; i++) {
+      text->push_back((*text)[from + i]);
+    }
+  }
+  return text->size() == expected;
+}
+
+/// @brief Decodes the stream which starts at data[pos] after the magic.
+/// @return The position after the stream or std::string::npos.
+static size_t DecodeStream(const std::string& data, size_t pos,
+                           std::string* text) {
+  const unsigned char* bytes =
+      reinterpret_cast<const unsigned char*>(data.data());
+  while (pos + 8 <= data.size()) {
+    uint32_t compressed_size = ReadUint32(bytes + pos);
+    uint32_t raw_size = ReadUint32(bytes + pos + 4);
+    pos += 8;
+    if (compressed_size == 0 && raw_size == 0) {
+      return pos;
+    }
+    if (data.size() - pos < compressed_size ||
+        !DecodeBlock(bytes + pos, bytes + pos + compressed_size, raw_size,
+                     text)) {
+      return std::string::npos;
+    }
+    pos += compressed_size;
+  }
+  return std::string::npos;
+}
+
+/// @brief Appends data to output with the streams decoded.
+static bool Decompress(const std::string& data, const char* name,
+                       std::string* output) {
+  size_t pos = 0;
+  while (pos < data.size()) {
+    size_t magic = data.find(kMagic, pos);
+    output->append(data, pos,
+                   (magic == std::string::npos? data.size() : magic) - pos);
+    if (magic == std::string::npos) {
+      break;
+    }
+    std::string text;
+    size_t end = DecodeStream(data, magic + 4, &text);
+    output->append(text);
+    if (end == std::string::npos) {
+      fprintf(stderr, "decompress_report: %s: the stream at offset %zu is "
+              "truncated or corrupted\n", name, magic);
+      return false;
+    }
+    pos = end;
+  }
+  return true;
+}
+
+}  // namespace Debug
+
+int main(int argc, char** argv) {
+  using namespace Debug;  // NOLINT(build/namespaces)
+  bool ok = true;
+  if (argc == 1) {
+    std::string data((std::istreambuf_iterator<char>(std::cin)),
+                     std::istreambuf_iterator<char>());
+    std::string output;
+    ok = Decompress(data, "stdin", &output);
+    fwrite(output.data(), 1, output.size(), stdout);
+  }
+  for (int i = 1; i < argc; i++) {
+    std::ifstream file(argv[i], std::ios::binary);
+    if (!file) {
+      fprintf(stderr, "decompress_report: cannot open %s\n", argv[i]);
+      ok = false;
+      continue;
+    }
+    std::string data((std::istreambuf_iterator<char>(file)),
+                     std::istreambuf_iterator<char>());
+    std::string output;
+    ok &= Decompress(data, argv[i], &output);
+    fwrite(output.data(), 1, output.size(), stdout);
+  }
+  return ok? EXIT_SUCCESS : EXIT_FAILURE;
+}
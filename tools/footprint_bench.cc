@@ -0,0 +1,412 @@
+/*
+
+  Copyright (c) 2012, Samsung R&D Institute Russia
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*! @file footprint_bench.cc
+ *  @brief Measures the fixed costs which DeathHandler adds to a process.
+ *  @author Markovtsev Vadim <gmarkhor@gmail.com>
+ *  @version 1.0
+ *  @license Simplified BSD License
+ *  @copyright 2012 Samsung R&D Institute Russia, 2016 Moscow Institute of Physics and Technology
+ */
+
+
+/*! Usage: footprint_bench [-i iterations]
+ *
+ *  Prints a single JSON object to stdout:
+ *  - "static_storage": the .bss, .data and TLS bytes of the objects in
+ *    namespace Debug, read from the symbol table of this executable, and
+ *    the largest of them;
+ *  - "constructor": for every mode, the latency of the first construction
+ *    and the median of the following ones, and the RSS added by the first
+ *    one; each mode is measured in a fresh child process;
+ *  - "threads": the creation latency and the virtual and resident memory
+ *    per live thread without and with the stack usage tracking, which gives
+ *    each thread its own signal stack;
+ *  - "malloc": the nanoseconds per malloc() + free() pair through the shim,
+ *    directly through glibc and with the latency sampling enabled;
+ *  - "line_table": the time and the RSS of LoadLineTable().
+ *  Build with -g and without stripping for the symbols to be available.
+ */
+
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <new>
+#include <string>
+#include <vector>
+#include "../death_handler.h"
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void __libc_free(void* ptr);
+}
+
+namespace Debug {
+
+static uint64_t Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/// @brief Returns the virtual and the resident sizes of the process.
+static void ReadMemory(int64_t* virtual_bytes, int64_t* resident_bytes) {
+  *virtual_bytes = *resident_bytes = 0;
+  FILE* statm = fopen("/proc/self/statm", "r");
+  if (statm == NULL) {
+    return;
+  }
+  long pages[2] = {0, 0};  // NOLINT(runtime/int)
+  if (fscanf(statm, "%ld %ld", &pages[0], &pages[1]) == 2) {
+    *virtual_bytes = pages[0] * getpagesize();
+    *resident_bytes = pages[1] * getpagesize();
+  }
+  fclose(statm);
+}
+
+static int64_t ResidentBytes() {
+  int64_t virtual_bytes, resident_bytes;
+  ReadMemory(&virtual_bytes, &resident_bytes);
+  return resident_bytes;
+}
+
+static uint64_t Median(std::vector<uint64_t> values) {
+  if (values.empty()) {
+    return 0;
+  }
+  std::nth_element(values.begin(), values.begin() + values.size() / 2,
+                   values.end());
+  return values[values.size() / 2];
+}
+
+/// @brief Keeps the compiler from eliding the allocations.
+static inline void Escape(void* ptr) {
+  asm volatile("" : : "g"(ptr) : "memory");
+}
+
+/// @brief Sums the sizes of the objects in namespace Debug by section.
+static std::string MeasureStaticStorage() {
+  int fd = open("/proc/self/exe", O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    return "null";
+  }
+  void* image = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (image == MAP_FAILED) {
+    return "null";
+  }
+  const char* base = reinterpret_cast<const char*>(image);
+  const ElfW(Ehdr)* ehdr = reinterpret_cast<const ElfW(Ehdr)*>(base);
+  const ElfW(Shdr)* shdrs =
+      reinterpret_cast<const ElfW(Shdr)*>(base + ehdr->e_shoff);
+  uint64_t bss = 0, data = 0, tls = 0;
+  std::vector<std::pair<uint64_t, std::string> > objects;
+  for (int i = 0; i < ehdr->e_shnum; i++) {
+    if (shdrs[i].sh_type != SHT_SYMTAB) {
+      continue;
+    }
+    const ElfW(Sym)* symbols =
+        reinterpret_cast<const ElfW(Sym)*>(base + shdrs[i].sh_offset);
+    const char* names = base + shdrs[shdrs[i].sh_link].sh_offset;
+    size_t count = shdrs[i].sh_size / sizeof(ElfW(Sym));
+    for (size_t j = 0; j < count; j++) {
+      const ElfW(Sym)& symbol = symbols[j];
+      int type = ELF64_ST_TYPE(symbol.st_info);
+      if ((type != STT_OBJECT && type != STT_TLS) || symbol.st_size == 0 ||
+          symbol.st_shndx == SHN_UNDEF || symbol.st_shndx >= ehdr->e_shnum ||
+          strncmp(names + symbol.st_name, "_ZN5Debug", 9) != 0) {
+        continue;
+      }
+      const ElfW(Shdr)& section = shdrs[symbol.st_shndx];
+      if (section.sh_flags & SHF_TLS) {
+        tls += symbol.st_size;
+      } else if (section.sh_type == SHT_NOBITS) {
+        bss += symbol.st_size;
+      } else if (section.sh_flags & SHF_WRITE) {
+        data += symbol.st_size;
+      } else {
+        continue;
+      }
+      objects.push_back(std::make_pair(symbol.st_size,
+                                       names + symbol.st_name));
+    }
+  }
+  munmap(image, st.st_size);
+  std::sort(objects.rbegin(), objects.rend());
+  char buffer[256];
+  snprintf(buffer, sizeof(buffer),
+           "{\"bss_bytes\": %llu, \"data_bytes\": %llu, \"tls_bytes\": %llu, "
+           "\"largest\": [", static_cast<unsigned long long>(bss),  // NOLINT
+           static_cast<unsigned long long>(data),  // NOLINT
+           static_cast<unsigned long long>(tls));  // NOLINT
+  std::string json = buffer;
+  for (size_t i = 0; i < objects.size() && i < 8; i++) {
+    snprintf(buffer, sizeof(buffer), "%s{\"symbol\": \"%s\", \"bytes\": %llu}",
+             i > 0? ", " : "", objects[i].second.c_str(),
+             static_cast<unsigned long long>(objects[i].first));  // NOLINT
+    json += buffer;
+  }
+  return json + "]}";
+}
+
+/// @brief A constructor mode: how DeathHandler is created and destroyed.
+struct Mode {
+  const char* name;
+  void (*create)(void* storage);
+  void (*destroy)(void* storage);
+};
+
+typedef BasicDeathHandler<StaticPolicy<false, false, true, true, false> >
+    StaticDeathHandler;
+
+template <class Handler, bool kAltstack>
+static void Create(void* storage) {
+  new(storage) Handler(kAltstack);
+}
+
+template <class Handler>
+static void Destroy(void* storage) {
+  reinterpret_cast<Handler*>(storage)->~Handler();
+}
+
+static const Mode kModes[] = {
+  { "runtime", Create<DeathHandler, false>, Destroy<DeathHandler> },
+  { "runtime_altstack", Create<DeathHandler, true>, Destroy<DeathHandler> },
+  { "static_policy", Create<StaticDeathHandler, false>,
+    Destroy<StaticDeathHandler> },
+  { "static_policy_altstack", Create<StaticDeathHandler, true>,
+    Destroy<StaticDeathHandler> },
+};
+
+/// @brief Measures a mode in a child process, so that the first
+/// construction starts from the clean state.
+static std::string MeasureConstructor(const Mode& mode, int iterations) {
+  int pipefd[2];
+  if (pipe(pipefd) != 0) {
+    return "null";
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    static void* storage[sizeof(StaticDeathHandler) / sizeof(void*) + 1];
+    int64_t rss_before = ResidentBytes();
+    uint64_t start = Now();
+    mode.create(storage);
+    uint64_t first = Now() - start;
+    int64_t rss_after = ResidentBytes();
+    mode.destroy(storage);
+    std::vector<uint64_t> latencies;
+    for (int i = 0; i < iterations; i++) {
+      start = Now();
+      mode.create(storage);
+      latencies.push_back(Now() - start);
+      mode.destroy(storage);
+    }
+    char buffer[256];
+    int length = snprintf(
+        buffer, sizeof(buffer),
+        "{\"mode\": \"%s\", \"first_ns\": %llu, \"median_ns\": %llu, "
+        "\"rss_bytes\": %lld}", mode.name,
+        static_cast<unsigned long long>(first),  // NOLINT(runtime/int)
+        static_cast<unsigned long long>(Median(latencies)),  // NOLINT
+        static_cast<long long>(rss_after - rss_before));  // NOLINT
+    ssize_t written = write(pipefd[1], buffer, length);
+    (void)written;
+    _exit(EXIT_SUCCESS);
+  }
+  close(pipefd[1]);
+  std::string json;
+  char buffer[256];
+  ssize_t length;
+  while ((length = read(pipefd[0], buffer, sizeof(buffer))) > 0) {
+    json.append(buffer, length);
+  }
+  close(pipefd[0]);
+  waitpid(pid, NULL, 0);
+  return json.empty()? "null" : json;
+}
+
+static int live_threads_release[2];
+
+static void* Idle(void*) {
+  return NULL;
+}
+
+static void* WaitForRelease(void*) {
+  char byte;
+  ssize_t length = read(live_threads_release[0], &byte, 1);
+  (void)length;
+  return NULL;
+}
+
+/// @brief Measures the thread creation and the memory of live threads.
+static std::string MeasureThreads(bool tracking, int iterations) {
+  DeathHandler dh;
+  dh.set_stack_usage_tracking(tracking);
+  std::vector<uint64_t> latencies;
+  for (int i = 0; i < iterations; i++) {
+    pthread_t thread;
+    uint64_t start = Now();
+    if (pthread_create(&thread, NULL, Idle, NULL) != 0) {
+      break;
+    }
+    pthread_join(thread, NULL);
+    latencies.push_back(Now() - start);
+  }
+  const int kLiveThreads = 64;
+  if (pipe(live_threads_release) != 0) {
+    return "null";
+  }
+  int64_t virtual_before, resident_before;
+  ReadMemory(&virtual_before, &resident_before);
+  std::vector<pthread_t> threads;
+  for (int i = 0; i < kLiveThreads; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, WaitForRelease, NULL) == 0) {
+      threads.push_back(thread);
+    }
+  }
+  // Let the threads reach read()
+  struct timespec delay = { 0, 50 * 1000 * 1000 };
+  nanosleep(&delay, NULL);
+  int64_t virtual_after, resident_after;
+  ReadMemory(&virtual_after, &resident_after);
+  close(live_threads_release[1]);
+  for (size_t i = 0; i < threads.size(); i++) {
+    pthread_join(threads[i], NULL);
+  }
+  close(live_threads_release[0]);
+  dh.set_stack_usage_tracking(false);
+  int64_t count = std::max<int64_t>(threads.size(), 1);
+  char buffer[256];
+  snprintf(buffer, sizeof(buffer),
+           "{\"stack_usage_tracking\": %s, \"create_join_ns\": %llu, "
+           "\"virtual_bytes_per_thread\": %lld, "
+           "\"rss_bytes_per_thread\": %lld}", tracking? "true" : "false",
+           static_cast<unsigned long long>(Median(latencies)),  // NOLINT
+           static_cast<long long>(  // NOLINT(runtime/int)
+               (virtual_after - virtual_before) / count),
+           static_cast<long long>(  // NOLINT(runtime/int)
+               (resident_after - resident_before) / count));
+  return buffer;
+}
+
+/// @brief Returns the nanoseconds per malloc() + free() pair.
+static double MeasureMalloc(bool direct, int iterations) {
+  const int kSizes[] = { 16, 64, 256, 1024, 4096 };
+  const int kSizesCount = sizeof(kSizes) / sizeof(kSizes[0]);
+  uint64_t start = Now();
+  for (int i = 0; i < iterations; i++) {
+    size_t size = kSizes[i % kSizesCount];
+    void* ptr = direct? __libc_malloc(size) : malloc(size);
+    Escape(ptr);
+    if (direct) {
+      __libc_free(ptr);
+    } else {
+      free(ptr);
+    }
+  }
+  return static_cast<double>(Now() - start) / iterations;
+}
+
+static std::string MeasureMallocShim(int iterations) {
+  DeathHandler dh;
+  // Warm up the arenas and the shim's dlsym()
+  MeasureMalloc(false, iterations / 10 + 1);
+  double direct = MeasureMalloc(true, iterations);
+  double shim = MeasureMalloc(false, iterations);
+  char buffer[512];
+  int length = snprintf(buffer, sizeof(buffer),
+                        "{\"glibc_ns\": %.1f, \"shim_ns\": %.1f", direct,
+                        shim);
+  std::string json(buffer, length);
+  const int kRates[] = { 1024, 64, 1 };
+  for (size_t i = 0; i < sizeof(kRates) / sizeof(kRates[0]); i++) {
+    dh.set_malloc_sampling(kRates[i]);
+    double sampled = MeasureMalloc(false, iterations);
+    dh.set_malloc_sampling(0);
+    length = snprintf(buffer, sizeof(buffer), ", \"sampling_%d_ns\": %.1f",
+                      kRates[i], sampled);
+    json.append(buffer, length);
+  }
+  return json + "}";
+}
+
+static std::string MeasureLineTable() {
+  DeathHandler dh;
+  int64_t rss_before = ResidentBytes();
+  uint64_t start = Now();
+  bool loaded = dh.LoadLineTable();
+  uint64_t elapsed = Now() - start;
+  int64_t rss_after = ResidentBytes();
+  char buffer[256];
+  snprintf(buffer, sizeof(buffer),
+           "{\"loaded\": %s, \"load_ns\": %llu, \"rss_bytes\": %lld}",
+           loaded? "true" : "false",
+           static_cast<unsigned long long>(elapsed),  // NOLINT(runtime/int)
+           static_cast<long long>(rss_after - rss_before));  // NOLINT
+  return buffer;
+}
+
+}  // namespace Debug
+
+int main(int argc, char** argv) {
+  using namespace Debug;  // NOLINT(build/namespaces)
+  int iterations = 1000;
+  int opt;
+  while ((opt = getopt(argc, argv, "i:")) != -1) {
+    if (opt == 'i' && atoi(optarg) > 0) {
+      iterations = atoi(optarg);
+    } else {
+      fprintf(stderr, "Usage: %s [-i iterations]\n", argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  std::string json = "{\"static_storage\": " + MeasureStaticStorage();
+  json += ", \"constructor\": [";
+  for (size_t i = 0; i < sizeof(kModes) / sizeof(kModes[0]); i++) {
+    json += (i > 0? ", " : "") + MeasureConstructor(kModes[i], iterations);
+  }
+  json += "], \"threads\": [" + MeasureThreads(false, iterations / 10 + 1) +
+      ", " + MeasureThreads(true, iterations / 10 + 1) + "]";
+  json += ", \"malloc\": " + MeasureMallocShim(iterations * 1000);
+  json += ", \"line_table\": " + MeasureLineTable() + "}\n";
+  fputs(json.c_str(), stdout);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,260 @@
+/*
+
+  Copyright (c) 2012, Samsung R&D Institute Russia
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*! @file pstack.cc
+ *  @brief Prints the stack traces of all the threads of a running process.
+ *  @author Markovtsev Vadim <gmarkhor@gmail.com>
+ *  @version 1.0
+ *  @license Simplified BSD License
+ *  @copyright 2012 Samsung R&D Institute Russia, 2016 Moscow Institute of Physics and Technology
+ */
+
+
+/*! Usage: pstack [-s stack_kib] pid
+ *
+ *  Unlike gdb, the process is stopped only to copy the registers and the top
+ *  stack_kib (default 64) KiB of each thread's stack: all the threads are
+ *  seized with PTRACE_SEIZE, stopped with PTRACE_INTERRUPT, their registers
+ *  are read with PTRACE_GETREGSET and their stacks with process_vm_readv(),
+ *  and then they are detached at once. The unwinding and the symbolization
+ *  happen afterwards. The time the process was stopped is printed to stderr.
+ */
+
+#include <dirent.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "symbolizer.h"
+#include "unwinder.h"
+
+namespace Debug {
+
+/// @brief Reads the file-backed and the executable mappings; the code and
+/// the call frame information are read from the mapped files, and from
+/// the process memory if there are none.
+static bool ReadMaps(pid_t pid, ModuleMap* modules, CodeMap* code) {
+  std::string proc = "/proc/" + std::to_string(pid);
+  std::ifstream maps((proc + "/maps").c_str());
+  if (!maps) {
+    return false;
+  }
+  std::string line;
+  while (std::getline(maps, line)) {
+    // start-end perms offset dev inode path
+    std::istringstream fields(line);
+    std::string range, perms, offset, dev, inode, path;
+    fields >> range >> perms >> offset >> dev >> inode;
+    std::getline(fields >> std::ws, path);
+    uint64_t start = strtoull(range.c_str(), NULL, 16);
+    uint64_t end = strtoull(range.c_str() + range.find('-') + 1, NULL, 16);
+    // [vsyscall] is execute-only and cannot be inspected
+    if (perms.size() > 2 && perms[0] == 'r' && perms[2] == 'x') {
+      code->AddCode(start, end);
+      if (path.empty() || path[0] != '/' ||
+          path.find(" (deleted)") != std::string::npos) {
+        code->AddFile(start, end, start, proc + "/mem");
+      }
+    }
+    if (!path.empty() && path[0] == '/') {
+      modules->Add(start, end, strtoull(offset.c_str(), NULL, 16), path);
+      code->AddFile(start, end, strtoull(offset.c_str(), NULL, 16), path);
+    }
+  }
+  return true;
+}
+
+static std::vector<pid_t> ListThreads(pid_t pid) {
+  std::vector<pid_t> tids;
+  DIR* dir = opendir(("/proc/" + std::to_string(pid) + "/task").c_str());
+  if (dir == NULL) {
+    return tids;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] != '.') {
+      tids.push_back(atoi(entry->d_name));
+    }
+  }
+  closedir(dir);
+  return tids;
+}
+
+static std::string ReadThreadName(pid_t pid, pid_t tid) {
+  std::ifstream comm(("/proc/" + std::to_string(pid) + "/task/" +
+                      std::to_string(tid) + "/comm").c_str());
+  std::string name;
+  std::getline(comm, name);
+  return name;
+}
+
+/// @brief Copies the registers and the stack top of a stopped thread.
+static bool CaptureThread(pid_t pid, size_t stack_size, ThreadStack* thread) {
+  elf_gregset_t regs;
+  struct iovec regs_iov = { &regs, sizeof(regs) };
+  if (ptrace(PTRACE_GETREGSET, thread->tid, NT_PRSTATUS, &regs_iov) != 0) {
+    return false;
+  }
+  thread->ReadRegisters(regs);
+  // Leave room for the red zone below sp
+  thread->stack_start = (thread->sp - 256) & ~15ULL;
+  thread->stack.resize(stack_size);
+  struct iovec local = { thread->stack.data(), stack_size };
+  struct iovec remote = {
+    reinterpret_cast<void*>(thread->stack_start), stack_size
+  };
+  // Stops at the end of the stack mapping
+  ssize_t len = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+  thread->captured_start = thread->stack_start;
+  thread->captured_end = thread->stack_start + (len > 0? len : 0);
+  return true;
+}
+
+static int64_t Microseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+}  // namespace Debug
+
+int main(int argc, char** argv) {
+  using namespace Debug;  // NOLINT(build/namespaces)
+  size_t stack_size = 64 << 10;
+  pid_t pid = 0;
+  for (int i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+      stack_size = strtoull(argv[++i], NULL, 10) << 10;
+    } else if (argv[i][0] != '-' && pid == 0) {
+      pid = atoi(argv[i]);
+    } else {
+      pid = 0;
+      break;
+    }
+  }
+  if (pid <= 0) {
+    fprintf(stderr, "Usage: %s [-s stack_kib] pid\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  ModuleMap modules;
+  CodeMap code;
+  if (!ReadMaps(pid, &modules, &code)) {
+    fprintf(stderr, "pstack: failed to read /proc/%d/maps\n", pid);
+    return EXIT_FAILURE;
+  }
+  std::vector<ThreadStack> threads;
+  std::vector<std::string> names;
+  std::vector<pid_t> tids = ListThreads(pid);
+  for (size_t i = 0; i < tids.size(); i++) {
+    // Seizing does not stop the thread
+    if (ptrace(PTRACE_SEIZE, tids[i], NULL, NULL) != 0) {
+      perror("pstack - PTRACE_SEIZE");
+      continue;
+    }
+    threads.push_back(ThreadStack());
+    threads.back().tid = tids[i];
+    names.push_back(ReadThreadName(pid, tids[i]));
+  }
+
+  int64_t stop_start = Microseconds();
+  for (size_t i = 0; i < threads.size(); i++) {
+    ptrace(PTRACE_INTERRUPT, threads[i].tid, NULL, NULL);
+  }
+  std::vector<bool> captured(threads.size());
+  for (size_t i = 0; i < threads.size(); i++) {
+    int status;
+    if (waitpid(threads[i].tid, &status, __WALL) == threads[i].tid &&
+        WIFSTOPPED(status)) {
+      captured[i] = CaptureThread(pid, stack_size, &threads[i]);
+    }
+  }
+  for (size_t i = 0; i < threads.size(); i++) {
+    ptrace(PTRACE_DETACH, threads[i].tid, NULL, NULL);
+  }
+  int64_t stop_time = Microseconds() - stop_start;
+
+  std::vector<std::vector<StackFrame> > stacks(threads.size());
+  std::vector<Symbolizer::Key> keys;
+  for (size_t i = 0; i < threads.size(); i++) {
+    if (!captured[i]) {
+      continue;
+    }
+    stacks[i] = Unwind(threads[i], code);
+    for (size_t j = 0; j < stacks[i].size(); j++) {
+      std::string path;
+      uint64_t offset;
+      // Return addresses point after the call
+      if (modules.Resolve(stacks[i][j].address - (j > 0), &path, &offset)) {
+        keys.push_back(Symbolizer::Key(path, offset));
+      }
+    }
+  }
+  Symbolizer symbolizer;
+  symbolizer.Resolve(keys);
+
+  for (size_t i = 0; i < threads.size(); i++) {
+    printf("Thread %d (%s):\n", threads[i].tid, names[i].c_str());
+    if (!captured[i]) {
+      printf("  failed to stop the thread\n\n");
+      continue;
+    }
+    for (size_t j = 0; j < stacks[i].size(); j++) {
+      const StackFrame& frame = stacks[i][j];
+      std::string path;
+      uint64_t offset;
+      SymbolInfo info;
+      printf("#%zu 0x%llx", j,
+             static_cast<unsigned long long>(frame.address));  // NOLINT
+      if (modules.Resolve(frame.address - (j > 0), &path, &offset) &&
+          symbolizer.Lookup(Symbolizer::Key(path, offset), &info) &&
+          info.function != "??") {
+        printf(" [%s] %s", info.function.c_str(), info.location.c_str());
+      } else if (!path.empty()) {
+        printf(" at %s", path.c_str());
+      }
+      printf("%s\n", frame.note());
+    }
+    printf("\n");
+  }
+  fprintf(stderr, "pstack: %zu threads stopped for %lld us (%lld us per "
+          "thread)\n", threads.size(),
+          static_cast<long long>(stop_time),  // NOLINT(runtime/int)
+          static_cast<long long>(  // NOLINT(runtime/int)
+              threads.empty()? 0 : stop_time / threads.size()));
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,227 @@
+/*
+
+  Copyright (c) 2012, Samsung R&D Institute Russia
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*! @file symbol_table_bench.cc
+ *  @brief Measures the memory and the lookup latency of the symbol names
+ *  in the line table.
+ *  @author Markovtsev Vadim <gmarkhor@gmail.com>
+ *  @version 1.0
+ *  @license Simplified BSD License
+ *  @copyright 2012 Samsung R&D Institute Russia, 2016 Moscow Institute of Physics and Technology
+ */
+
+/*! Usage: symbol_table_bench [-n lookups] library.so
+ *
+ *  Loads the library, builds the line table and prints a single JSON
+ *  object to stdout for the image with the most functions:
+ *  - "functions" and "unique_names": the indexed function symbols and
+ *    their distinct mangled names;
+ *  - "name_bytes": the front-coded names with their block index, the same
+ *    names stored plainly, and the demangled name of every function, which
+ *    is what the table held before;
+ *  - "line_table_bytes": the whole table of all the loaded images;
+ *  - "lookup_ns", "decode_ns" and "demangle_ns": the p50 and p99 of
+ *    the full lookup of a random function address, of decoding its name
+ *    from its block and of demangling it;
+ *  - "demangled": the share of the names the handler demangles itself;
+ *    the frames of the others are left to addr2line.
+ *  The internals are reached by including death_handler.cc, which poisons
+ *  the formatting functions, so Format() is defined before it.
+ */
+
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+static std::string Format(const char* format, ...) {
+  char buffer[1024];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(buffer, sizeof(buffer), format, args);
+  va_end(args);
+  return std::string(buffer, length > 0? length : 0);
+}
+
+#include "../death_handler.cc"
+
+namespace Debug {
+
+static uint64_t Now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static std::string Percentiles(std::vector<uint64_t> values) {
+  if (values.empty()) {
+    return "null";
+  }
+  std::sort(values.begin(), values.end());
+  return Format("{\"p50\": %llu, \"p99\": %llu}",
+                static_cast<unsigned long long>(  // NOLINT(runtime/int)
+                    values[values.size() / 2]),
+                static_cast<unsigned long long>(  // NOLINT(runtime/int)
+                    values[values.size() * 99 / 100]));
+}
+
+static std::string MeasureSymbolTable(int lookups) {
+  const LineTableModule* module = NULL;
+  for (int i = 0; i < line_table_module_count; i++) {
+    if (module == NULL ||
+        line_table_modules[i].function_count > module->function_count) {
+      module = &line_table_modules[i];
+    }
+  }
+  if (module == NULL || module->function_count == 0) {
+    return "null";
+  }
+  const LineTableFunction* functions =
+      reinterpret_cast<const LineTableFunction*>(
+          line_table.data + module->functions);
+  std::vector<char> memory(1 << 16);
+  char* name = &memory[0];
+  char* demangled = name + kMaxSymbolNameLength + 1;
+  uint64_t mangled_bytes = 0, demangled_bytes = 0;
+  for (unsigned i = 0; i < module->name_count; i++) {
+    DecodeSymbolName(*module, i, name);
+    mangled_bytes += strlen(name) + 1;
+  }
+  unsigned demangled_count = 0;
+  for (unsigned i = 0; i < module->function_count; i++) {
+    DecodeSymbolName(*module, functions[i].name, name);
+    bool success = Demangle(name, demangled, 2000);
+    demangled_count += success;
+    demangled_bytes += strlen(success? demangled : name) + 1;
+  }
+  size_t block_count = (module->name_count + kSymbolNameBlockNames - 1) /
+      kSymbolNameBlockNames;
+  size_t front_coded_bytes = block_count * sizeof(uint32_t);
+  for (unsigned i = 0; i < block_count; i++) {
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(
+        line_table.data + module->name_data) +
+        reinterpret_cast<const uint32_t*>(
+            line_table.data + module->name_blocks)[i];
+    DwarfReader reader = { data, data + line_table.size, false };
+    for (unsigned j = 0; j < kSymbolNameBlockNames &&
+         i * kSymbolNameBlockNames + j < module->name_count; j++) {
+      if (j > 0) {
+        reader.Uleb();
+      }
+      reader.pos += strlen(reinterpret_cast<const char*>(reader.pos)) + 1;
+    }
+    front_coded_bytes += reader.pos - data;
+  }
+
+  std::vector<uint64_t> lookup_ns, decode_ns, demangle_ns;
+  uint64_t state = 88172645463325252ull;
+  for (int i = 0; i < lookups; i++) {
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    const LineTableFunction& function =
+        functions[state % module->function_count];
+    const void* address = reinterpret_cast<const void*>(
+        module->bias + function.address + function.size / 2);
+    char* scratch = &memory[0];
+    uint64_t start = Now();
+    char* line = LookupLineTable(address, false, "image", NULL, &scratch);
+    uint64_t lookup_end = Now();
+    if (line == NULL) {
+      continue;
+    }
+    lookup_ns.push_back(lookup_end - start);
+    start = Now();
+    DecodeSymbolName(*module, function.name, name);
+    uint64_t decode_end = Now();
+    Demangle(name, demangled, 2000);
+    uint64_t demangle_end = Now();
+    decode_ns.push_back(decode_end - start);
+    demangle_ns.push_back(demangle_end - decode_end);
+  }
+  return Format(
+      "{\"functions\": %u, \"unique_names\": %u, \"name_bytes\": "
+      "{\"front_coded\": %llu, \"mangled\": %llu, \"demangled\": %llu}, "
+      "\"line_table_bytes\": %llu, ",
+      module->function_count, module->name_count,
+      static_cast<unsigned long long>(front_coded_bytes),  // NOLINT
+      static_cast<unsigned long long>(mangled_bytes),  // NOLINT
+      static_cast<unsigned long long>(demangled_bytes),  // NOLINT
+      static_cast<unsigned long long>(line_table.size)) +  // NOLINT
+      "\"lookup_ns\": " + Percentiles(lookup_ns) +
+      ", \"decode_ns\": " + Percentiles(decode_ns) +
+      ", \"demangle_ns\": " + Percentiles(demangle_ns) +
+      Format(", \"demangled\": %.3f}",
+             static_cast<double>(demangled_count) / module->function_count);
+}
+
+}  // namespace Debug
+
+int main(int argc, char** argv) {
+  using namespace Debug;  // NOLINT(build/namespaces)
+  int lookups = 100000;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:")) != -1) {
+    if (opt == 'n' && atoi(optarg) > 0) {
+      lookups = atoi(optarg);
+    } else {
+      optind = argc + 1;
+      break;
+    }
+  }
+  if (optind != argc - 1) {
+    fputs("Usage: symbol_table_bench [-n lookups] library.so\n", stderr);
+    return EXIT_FAILURE;
+  }
+  if (dlopen(argv[optind], RTLD_NOW | RTLD_LOCAL) == NULL) {
+    fputs(dlerror(), stderr);
+    fputs("\n", stderr);
+    return EXIT_FAILURE;
+  }
+  DeathHandler dh;
+  uint64_t start = Now();
+  bool loaded = dh.LoadLineTable();
+  uint64_t elapsed = Now() - start;
+  if (!loaded) {
+    fputs("LoadLineTable() failed\n", stderr);
+    return EXIT_FAILURE;
+  }
+  std::string json = Format("{\"image\": \"%s\", \"load_ns\": %llu, ",
+                            argv[optind],
+                            static_cast<unsigned long long>(  // NOLINT
+                                elapsed)) +
+      "\"symbols\": " + MeasureSymbolTable(lookups) + "}\n";
+  fputs(json.c_str(), stdout);
+  return EXIT_SUCCESS;
+}
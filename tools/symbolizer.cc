@@ -0,0 +1,374 @@
+/*
+
+  Copyright (c) 2012, Samsung R&D Institute Russia
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*! @file symbolizer.cc
+ *  @brief Implementation of the offline symbolizer shared by the tools.
+ *  @author Markovtsev Vadim <gmarkhor@gmail.com>
+ *  @version 1.0
+ *  @license Simplified BSD License
+ *  @copyright 2012 Samsung R&D Institute Russia, 2016 Moscow Institute of Physics and Technology
+ */
+
+#include "symbolizer.h"
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <spawn.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <fstream>
+#include <sstream>
+#include <thread>
+
+extern char** environ;
+
+namespace Debug {
+
+Symbolizer::Symbolizer(unsigned jobs) : jobs_(jobs), resolved_(0) {
+  if (jobs_ == 0) {
+    jobs_ = std::thread::hardware_concurrency();
+  }
+  if (jobs_ == 0) {
+    jobs_ = 1;
+  }
+}
+
+void Symbolizer::AddModule(const std::string& key, const std::string& path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  modules_.insert(std::make_pair(key, path));
+}
+
+std::string Symbolizer::ModulePath(const std::string& key) const {
+  std::string path;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    std::map<std::string, std::string>::const_iterator it = modules_.find(key);
+    if (it != modules_.end()) {
+      path = it->second;
+    }
+  }
+  if (!key.empty() && key[0] == '/') {
+    return path.empty()? key : path;
+  }
+  if (!path.empty() && ReadBuildId(path) == key) {
+    return path;
+  }
+  if (key.size() > 2) {
+    std::string debug = "/usr/lib/debug/.build-id/" + key.substr(0, 2) + "/" +
+        key.substr(2) + ".debug";
+    if (access(debug.c_str(), R_OK) == 0) {
+      return debug;
+    }
+  }
+  // The file is of another build, its symbols would be wrong
+  return std::string();
+}
+
+void Symbolizer::Resolve(const std::vector<Key>& keys) {
+  std::map<std::string, std::vector<uint64_t> > missing;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (size_t i = 0; i < keys.size(); i++) {
+      if (cache_.find(keys[i]) == cache_.end()) {
+        missing[keys[i].first].push_back(keys[i].second);
+      }
+    }
+  }
+  // Split into the tasks of at most kChunk addresses to bound the command line
+  static const size_t kChunk = 1024;
+  struct Task {
+    std::string key;
+    std::vector<uint64_t> offsets;
+  };
+  std::vector<Task> tasks;
+  for (std::map<std::string, std::vector<uint64_t> >::iterator it =
+           missing.begin(); it != missing.end(); ++it) {
+    std::vector<uint64_t>& offsets = it->second;
+    std::sort(offsets.begin(), offsets.end());
+    offsets.erase(std::unique(offsets.begin(), offsets.end()), offsets.end());
+    for (size_t i = 0; i < offsets.size(); i += kChunk) {
+      Task task;
+      task.key = it->first;
+      task.offsets.assign(offsets.begin() + i,
+                          offsets.begin() + std::min(i + kChunk,
+                                                     offsets.size()));
+      tasks.push_back(task);
+    }
+  }
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < tasks.size(); i = next++) {
+      std::string path = ModulePath(tasks[i].key);
+      if (path.empty()) {
+        // Leave the frames raw, and uncached in case the file shows up later
+        continue;
+      }
+      std::vector<SymbolInfo> infos = Addr2Line(path, tasks[i].offsets);
+      infos.resize(tasks[i].offsets.size());
+      std::lock_guard<std::mutex> lock(mutex_);
+      for (size_t j = 0; j < infos.size(); j++) {
+        cache_[Key(tasks[i].key, tasks[i].offsets[j])] = infos[j];
+      }
+      resolved_ += infos.size();
+    }
+  };
+  std::vector<std::thread> threads;
+  for (unsigned i = 1; i < jobs_ && i < tasks.size(); i++) {
+    threads.push_back(std::thread(worker));
+  }
+  worker();
+  for (size_t i = 0; i < threads.size(); i++) {
+    threads[i].join();
+  }
+}
+
+bool Symbolizer::Lookup(const Key& key, SymbolInfo* info) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::map<Key, SymbolInfo>::const_iterator it = cache_.find(key);
+  if (it == cache_.end()) {
+    return false;
+  }
+  *info = it->second;
+  return true;
+}
+
+size_t Symbolizer::resolved() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return resolved_;
+}
+
+bool Symbolizer::LoadCache(const std::string& path) {
+  std::ifstream file(path.c_str());
+  if (!file) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string line;
+  while (std::getline(file, line)) {
+    // key \t offset \t function \t location
+    std::istringstream fields(line);
+    std::string key, offset;
+    SymbolInfo info;
+    if (std::getline(fields, key, '\t') && std::getline(fields, offset, '\t') &&
+        std::getline(fields, info.function, '\t') &&
+        std::getline(fields, info.location)) {
+      cache_[Key(key, strtoull(offset.c_str(), NULL, 16))] = info;
+    }
+  }
+  return true;
+}
+
+bool Symbolizer::SaveCache(const std::string& path) const {
+  std::ofstream file(path.c_str());
+  if (!file) {
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (std::map<Key, SymbolInfo>::const_iterator it = cache_.begin();
+       it != cache_.end(); ++it) {
+    file << it->first.first << '\t' << std::hex << it->first.second
+         << std::dec << '\t' << it->second.function << '\t'
+         << it->second.location << '\n';
+  }
+  return static_cast<bool>(file);
+}
+
+/// @brief Searches the ELF notes for NT_GNU_BUILD_ID.
+static std::string FindBuildIdNote(const std::vector<char>& notes) {
+  size_t pos = 0;
+  while (pos + sizeof(ElfW(Nhdr)) <= notes.size()) {
+    const ElfW(Nhdr)* nhdr =
+        reinterpret_cast<const ElfW(Nhdr)*>(&notes[pos]);
+    size_t name = pos + sizeof(*nhdr);
+    size_t desc = name + ((nhdr->n_namesz + 3) & ~3);
+    if (desc + nhdr->n_descsz > notes.size()) {
+      break;
+    }
+    if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+        !memcmp(&notes[name], "GNU", 4)) {
+      std::string hex;
+      for (unsigned i = 0; i < nhdr->n_descsz; i++) {
+        unsigned char byte = notes[desc + i];
+        hex += "0123456789abcdef"[byte >> 4];
+        hex += "0123456789abcdef"[byte & 0xF];
+      }
+      return hex;
+    }
+    pos = desc + ((nhdr->n_descsz + 3) & ~3);
+  }
+  return std::string();
+}
+
+std::string Symbolizer::ReadBuildId(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return std::string();
+  }
+  std::string build_id;
+  ElfW(Ehdr) ehdr;
+  if (pread(fd, &ehdr, sizeof(ehdr), 0) == sizeof(ehdr) &&
+      !memcmp(ehdr.e_ident, ELFMAG, SELFMAG) &&
+      ehdr.e_ident[EI_CLASS] == ELFCLASS64 - (sizeof(void*) == 4)) {
+    for (int i = 0; i < ehdr.e_shnum && build_id.empty(); i++) {
+      ElfW(Shdr) shdr;
+      if (pread(fd, &shdr, sizeof(shdr), ehdr.e_shoff +
+                i * ehdr.e_shentsize) != sizeof(shdr) ||
+          shdr.sh_type != SHT_NOTE || shdr.sh_size > (1 << 16)) {
+        continue;
+      }
+      std::vector<char> notes(shdr.sh_size);
+      if (pread(fd, notes.data(), notes.size(), shdr.sh_offset) ==
+          static_cast<ssize_t>(notes.size())) {
+        build_id = FindBuildIdNote(notes);
+      }
+    }
+  }
+  close(fd);
+  return build_id;
+}
+
+std::vector<SymbolInfo> Symbolizer::Addr2Line(
+    const std::string& path, const std::vector<uint64_t>& offsets) {
+  std::vector<SymbolInfo> infos;
+  std::vector<std::string> args;
+  args.push_back("addr2line");
+  args.push_back("-f");
+  args.push_back("-C");
+  args.push_back("-e");
+  args.push_back(path);
+  for (size_t i = 0; i < offsets.size(); i++) {
+    std::ostringstream address;
+    address << "0x" << std::hex << offsets[i];
+    args.push_back(address.str());
+  }
+  std::vector<char*> argv;
+  for (size_t i = 0; i < args.size(); i++) {
+    argv.push_back(const_cast<char*>(args[i].c_str()));
+  }
+  argv.push_back(NULL);
+  int pipefd[2];
+  if (pipe2(pipefd, O_CLOEXEC) != 0) {
+    return infos;
+  }
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init(&actions);
+  posix_spawn_file_actions_adddup2(&actions, pipefd[1], STDOUT_FILENO);
+  pid_t pid;
+  int res = posix_spawnp(&pid, "addr2line", &actions, NULL, argv.data(),
+                         environ);
+  posix_spawn_file_actions_destroy(&actions);
+  close(pipefd[1]);
+  std::string output;
+  char buffer[1 << 16];
+  ssize_t len;
+  while (res == 0 && (len = read(pipefd[0], buffer, sizeof(buffer))) > 0) {
+    output.append(buffer, len);
+  }
+  close(pipefd[0]);
+  if (res != 0) {
+    return infos;
+  }
+  waitpid(pid, NULL, 0);
+  std::istringstream lines(output);
+  SymbolInfo info;
+  while (std::getline(lines, info.function) &&
+         std::getline(lines, info.location)) {
+    infos.push_back(info);
+  }
+  return infos;
+}
+
+void ModuleMap::Add(uint64_t start, uint64_t end, uint64_t file_offset,
+                    const std::string& path) {
+  Mapping mapping;
+  mapping.start = start;
+  mapping.end = end;
+  mapping.file_offset = file_offset;
+  mapping.path = path;
+  mappings_.push_back(mapping);
+}
+
+bool ModuleMap::Resolve(uint64_t address, std::string* path,
+                        uint64_t* offset) const {
+  const Mapping* found = NULL;
+  for (size_t i = 0; i < mappings_.size() && found == NULL; i++) {
+    if (address >= mappings_[i].start && address < mappings_[i].end) {
+      found = &mappings_[i];
+    }
+  }
+  if (found == NULL) {
+    return false;
+  }
+  // The load bias is the distance between the mapping of the file's start
+  // and the first PT_LOAD segment
+  uint64_t load_start = found->start - found->file_offset;
+  for (size_t i = 0; i < mappings_.size(); i++) {
+    if (mappings_[i].file_offset == 0 && mappings_[i].path == found->path &&
+        mappings_[i].start <= found->start) {
+      load_start = mappings_[i].start;
+    }
+  }
+  std::map<std::string, uint64_t>::iterator base =
+      image_bases_.find(found->path);
+  if (base == image_bases_.end()) {
+    base = image_bases_.insert(std::make_pair(
+        found->path, ReadImageBase(found->path))).first;
+  }
+  *path = found->path;
+  *offset = address - load_start + base->second;
+  return true;
+}
+
+uint64_t ModuleMap::ReadImageBase(const std::string& path) {
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  uint64_t base = 0;
+  ElfW(Ehdr) ehdr;
+  if (pread(fd, &ehdr, sizeof(ehdr), 0) == sizeof(ehdr) &&
+      !memcmp(ehdr.e_ident, ELFMAG, SELFMAG)) {
+    for (int i = 0; i < ehdr.e_phnum; i++) {
+      ElfW(Phdr) phdr;
+      if (pread(fd, &phdr, sizeof(phdr), ehdr.e_phoff +
+                i * ehdr.e_phentsize) == sizeof(phdr) &&
+          phdr.p_type == PT_LOAD) {
+        base = phdr.p_align > 1? phdr.p_vaddr & ~(phdr.p_align - 1) :
+            phdr.p_vaddr;
+        break;
+      }
+    }
+  }
+  close(fd);
+  return base;
+}
+
+}  // namespace Debug
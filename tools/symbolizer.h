@@ -0,0 +1,137 @@
+/*
+
+  Copyright (c) 2012, Samsung R&D Institute Russia
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*! @file symbolizer.h
+ *  @brief Declaration of the offline symbolizer shared by the tools.
+ *  @author Markovtsev Vadim <gmarkhor@gmail.com>
+ *  @version 1.0
+ *  @license Simplified BSD License
+ *  @copyright 2012 Samsung R&D Institute Russia, 2016 Moscow Institute of Physics and Technology
+ */
+
+#ifndef TOOLS_SYMBOLIZER_H_
+#define TOOLS_SYMBOLIZER_H_
+
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Debug {
+
+/// @brief The function name and the source location of an address.
+struct SymbolInfo {
+  std::string function;
+  std::string location;
+};
+
+/// @brief Converts the (module, offset) pairs into function names and line
+/// numbers via addr2line, each unique pair exactly once.
+/// @details Modules are identified by their GNU build id if it is known and
+/// by the path otherwise. All the offsets of the same module are resolved by
+/// a single addr2line invocation, and different modules are processed in
+/// parallel. The results are kept in the cache shared by all the threads,
+/// which can be persisted between the runs with LoadCache() and SaveCache().
+class Symbolizer {
+ public:
+  typedef std::pair<std::string, uint64_t> Key;
+
+  /// @param jobs The number of addr2line processes to run at the same time;
+  /// 0 means the number of cores.
+  explicit Symbolizer(unsigned jobs = 0);
+
+  /// @brief Associates the module key (build id or path) with the file
+  /// to read the debug information from.
+  /// @details If the build id of the file does not match, the file is looked
+  /// up in /usr/lib/debug/.build-id instead. If it is not there either,
+  /// the offsets of the module are not resolved, so Lookup() fails for them
+  /// and nothing is cached.
+  void AddModule(const std::string& key, const std::string& path);
+
+  /// @brief Symbolizes all the keys which are not cached yet. Thread-safe.
+  void Resolve(const std::vector<Key>& keys);
+
+  /// @brief Returns the cached symbol info. Thread-safe.
+  bool Lookup(const Key& key, SymbolInfo* info) const;
+
+  /// @brief Returns the number of the addr2line lookups performed so far.
+  size_t resolved() const;
+
+  bool LoadCache(const std::string& path);
+  bool SaveCache(const std::string& path) const;
+
+  /// @brief Reads the hex GNU build id from the ELF file, or returns
+  /// an empty string.
+  static std::string ReadBuildId(const std::string& path);
+
+  /// @brief Runs addr2line over the offsets of one module.
+  static std::vector<SymbolInfo> Addr2Line(
+      const std::string& path, const std::vector<uint64_t>& offsets);
+
+ private:
+  std::string ModulePath(const std::string& key) const;
+
+  unsigned jobs_;
+  size_t resolved_;
+  mutable std::mutex mutex_;
+  std::map<std::string, std::string> modules_;
+  std::map<Key, SymbolInfo> cache_;
+};
+
+/// @brief The file-backed mappings of a process; converts the runtime
+/// addresses into (module path, ELF virtual address) pairs.
+class ModuleMap {
+ public:
+  /// @brief Registers the mapping of [start, end) from file_offset of path.
+  void Add(uint64_t start, uint64_t end, uint64_t file_offset,
+           const std::string& path);
+
+  /// @brief Finds the module which contains the address.
+  /// @param offset The virtual address inside the module's ELF image, which
+  /// is suitable for addr2line.
+  bool Resolve(uint64_t address, std::string* path, uint64_t* offset) const;
+
+  /// @brief Returns the page-aligned virtual address of the first PT_LOAD
+  /// segment of the ELF file.
+  static uint64_t ReadImageBase(const std::string& path);
+
+ private:
+  struct Mapping {
+    uint64_t start;
+    uint64_t end;
+    uint64_t file_offset;
+    std::string path;
+  };
+
+  std::vector<Mapping> mappings_;
+  mutable std::map<std::string, uint64_t> image_bases_;
+};
+
+}  // namespace Debug
+#endif  // TOOLS_SYMBOLIZER_H_
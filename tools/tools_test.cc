@@ -0,0 +1,246 @@
+/*
+
+  Copyright (c) 2012, Samsung R&D Institute Russia
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*! @file tools_test.cc
+ *  @brief Tests for the tools, which run them against child processes with
+ *  known stacks.
+ *  @author Markovtsev Vadim <gmarkhor@gmail.com>
+ *  @version 1.0
+ *  @license Simplified BSD License
+ *  @copyright 2012 Samsung R&D Institute Russia, 2016 Moscow Institute of Physics and Technology
+ */
+
+/*! The tools are looked up in the directory of the test binary:
+ *
+ *  g++ -std=c++11 -O2 -pthread tools/pstack.cc tools/symbolizer.cc tools/unwinder.cc -o pstack
+ *  g++ -std=c++11 -O2 -pthread tools/core_helper.cc tools/symbolizer.cc tools/unwinder.cc -o core_helper
+ *  g++ -std=c++11 -O2 -pthread tools/crash_aggregate.cc tools/symbolizer.cc -o crash_aggregate
+ *  g++ -std=c++11 -g -O2 -pthread -I/usr/src/googletest/googletest tools/tools_test.cc -lgtest -o tools_test
+ */
+
+#include <dlfcn.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <gtest/gtest.h>
+
+static std::string ToolPath(const char* name) {
+  char path[4096];
+  ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+  path[length > 0? length : 0] = 0;
+  char* slash = strrchr(path, '/');
+  if (slash != NULL) {
+    slash[1] = 0;
+  }
+  return std::string(path) + name;
+}
+
+static std::string RunTool(const std::string& command) {
+  FILE* output = popen(command.c_str(), "r");
+  std::string text;
+  if (output == NULL) {
+    return text;
+  }
+  char buffer[4096];
+  size_t length;
+  while ((length = fread(buffer, 1, sizeof(buffer), output)) > 0) {
+    text.append(buffer, length);
+  }
+  pclose(output);
+  return text;
+}
+
+static volatile bool stop_spinning;
+
+#define KNOWN_FRAME __attribute__((noinline, \
+                                   optimize("no-omit-frame-pointer")))
+
+static int KNOWN_FRAME StackInner(int fd) {
+  char ready = 1;
+  if (write(fd, &ready, 1) != 1) {
+    return 0;
+  }
+  // Keep the program counter inside this function
+  while (!stop_spinning) {}
+  return 1;
+}
+
+static int KNOWN_FRAME StackMiddle(int fd) {
+  return StackInner(fd) + 1;
+}
+
+static int KNOWN_FRAME StackOuter(int fd) {
+  return StackMiddle(fd) + 1;
+}
+
+TEST(Tools, PstackKnownStack) {
+  int pipefd[2];
+  ASSERT_EQ(0, pipe(pipefd));
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(pipefd[0]);
+    _exit(StackOuter(pipefd[1]));
+  }
+  close(pipefd[1]);
+  char ready;
+  ASSERT_EQ(1, read(pipefd[0], &ready, 1));
+  close(pipefd[0]);
+  std::string report = RunTool(ToolPath("pstack") + " " +
+                               std::to_string(pid) + " 2>&1");
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+  printf("%s", report.c_str());
+  // The thread stopped in StackInner()
+  size_t inner = report.find("#0 0x");
+  ASSERT_NE(std::string::npos, inner);
+  std::string top = report.substr(inner, report.find('\n', inner) - inner);
+  ASSERT_NE(std::string::npos, top.find("[StackInner(int)]"));
+  size_t middle = report.find("[StackMiddle(int)]", inner);
+  ASSERT_NE(std::string::npos, middle);
+  size_t outer = report.find("[StackOuter(int)]", middle);
+  ASSERT_NE(std::string::npos, outer);
+  // The frame chain links are not guesses
+  ASSERT_EQ(std::string::npos, report.substr(0, outer).find("(scanned"));
+}
+
+TEST(Tools, CrashAggregateMismatchedBuild) {
+  // A raw frame of this very binary, but of another build
+  Dl_info info;
+  ASSERT_NE(0, dladdr(reinterpret_cast<void*>(StackInner), &info));
+  char offset[32];
+  snprintf(offset, sizeof(offset), "0x%llx",
+           static_cast<unsigned long long>(  // NOLINT(runtime/int)
+               reinterpret_cast<uintptr_t>(StackInner) -
+               reinterpret_cast<uintptr_t>(info.dli_fbase)));
+  std::string exe = ToolPath("tools_test");
+  char dir[] = "/tmp/crash_aggregate_test.XXXXXX";
+  ASSERT_NE(static_cast<char*>(NULL), mkdtemp(dir));
+  std::string log = std::string(dir) + "/crash.log";
+  std::string cache = std::string(dir) + "/symbols.cache";
+  std::ofstream(log.c_str())
+      << "Segmentation fault (thread 1, pid 2)\nStack trace:\n#0 " << offset
+      << " " << exe << " build-id=0123456789abcdef0123456789abcdef01234567\n";
+  std::string report = RunTool(ToolPath("crash_aggregate") + " -c " +
+                               cache + " " + log + " 2>&1");
+  std::ifstream file(cache.c_str());
+  std::string cached((std::istreambuf_iterator<char>(file)),
+                     std::istreambuf_iterator<char>());
+  unlink(log.c_str());
+  unlink(cache.c_str());
+  rmdir(dir);
+  printf("%s", report.c_str());
+  // The frame stays raw instead of being resolved with the wrong build
+  ASSERT_NE(std::string::npos,
+            report.find(std::string("  ") + offset + " at " + exe + "\n"));
+  ASSERT_EQ(std::string::npos, report.find("StackInner"));
+  ASSERT_EQ(std::string::npos, cached.find("0123456789abcdef"));
+}
+
+#define NO_FRAME_POINTER __attribute__((noinline, \
+                                        optimize("omit-frame-pointer")))
+
+static int NO_FRAME_POINTER CoreInner(int* pointer) {
+  *pointer = 0;
+  return 1;
+}
+
+static int NO_FRAME_POINTER CoreMiddle(int* pointer) {
+  return CoreInner(pointer) + 1;
+}
+
+static int NO_FRAME_POINTER CoreOuter(int* pointer) {
+  return CoreMiddle(pointer) + 1;
+}
+
+TEST(Tools, CoreHelperWithoutFramePointers) {
+  std::string pattern;
+  std::ifstream("/proc/sys/kernel/core_pattern") >> pattern;
+  if (pattern.empty() || pattern[0] == '|' || pattern[0] == '/' ||
+      pattern.find('%') != std::string::npos) {
+    GTEST_SKIP() << "core_pattern is " << pattern;
+  }
+  int uses_pid = 0;
+  std::ifstream("/proc/sys/kernel/core_uses_pid") >> uses_pid;
+  char dir[] = "/tmp/core_helper_test.XXXXXX";
+  ASSERT_NE(static_cast<char*>(NULL), mkdtemp(dir));
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    struct rlimit limit = { RLIM_INFINITY, RLIM_INFINITY };
+    if (chdir(dir) != 0 || setrlimit(RLIMIT_CORE, &limit) != 0) {
+      _exit(EXIT_FAILURE);
+    }
+    prctl(PR_SET_DUMPABLE, 1);
+    signal(SIGSEGV, SIG_DFL);
+    _exit(CoreOuter(reinterpret_cast<int*>(strtol("0", NULL, 10))));
+  }
+  int status;
+  ASSERT_EQ(pid, waitpid(pid, &status, 0));
+  ASSERT_TRUE(WIFSIGNALED(status));
+  ASSERT_TRUE(WCOREDUMP(status));
+  std::string core = std::string(dir) + "/" + pattern;
+  if (uses_pid) {
+    core += "." + std::to_string(pid);
+  }
+  std::string report_path = std::string(dir) + "/tools_test." +
+                            std::to_string(pid) + ".txt";
+  std::string output = RunTool(ToolPath("core_helper") + " -o " + dir +
+                               " " + std::to_string(pid) +
+                               " tools_test < " + core + " 2>&1");
+  std::ifstream report_file(report_path.c_str());
+  std::string report((std::istreambuf_iterator<char>(report_file)),
+                     std::istreambuf_iterator<char>());
+  unlink(core.c_str());
+  unlink(report_path.c_str());
+  rmdir(dir);
+  printf("%s%s", output.c_str(), report.c_str());
+  ASSERT_EQ(0u, report.find("Segmentation fault"));
+  size_t inner = report.find("#0 0x");
+  ASSERT_NE(std::string::npos, inner);
+  std::string top = report.substr(inner, report.find('\n', inner) - inner);
+  ASSERT_NE(std::string::npos, top.find("[CoreInner(int*)]"));
+  // The frames without the frame pointers are unwound by their CFI
+  size_t middle = report.find("[CoreMiddle(int*)]", inner);
+  ASSERT_NE(std::string::npos, middle);
+  ASSERT_EQ(0, report.compare(report.rfind('\n', middle) + 1, 3, "#1 "));
+  size_t outer = report.find("[CoreOuter(int*)]", middle);
+  ASSERT_NE(std::string::npos, outer);
+  ASSERT_EQ(std::string::npos, report.substr(0, outer).find("(scanned"));
+}
+
+#include "src/gtest_main.cc"
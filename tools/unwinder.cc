@@ -0,0 +1,893 @@
+/*
+
+  Copyright (c) 2012, Samsung R&D Institute Russia
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*! @file unwinder.cc
+ *  @brief Implementation of the offline stack unwinder shared by the tools.
+ *  @author Markovtsev Vadim <gmarkhor@gmail.com>
+ *  @version 1.0
+ *  @license Simplified BSD License
+ *  @copyright 2012 Samsung R&D Institute Russia, 2016 Moscow Institute of Physics and Technology
+ */
+
+#include "unwinder.h"
+#include <fcntl.h>
+#include <link.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include "../death_handler_call_site.h"
+
+namespace Debug {
+
+void ThreadStack::ReadRegisters(const elf_greg_t* regs) {
+  lr = 0;
+#if defined(__x86_64__)
+  pc = regs[16];  // rip
+  sp = regs[19];  // rsp
+  fp = regs[4];  // rbp
+#elif defined(__i386__)
+  pc = regs[12];  // eip
+  sp = regs[15];  // uesp
+  fp = regs[5];  // ebp
+#elif defined(__aarch64__)
+  pc = regs[32];
+  sp = regs[31];
+  fp = regs[29];
+  lr = regs[30];
+#elif defined(__arm__)
+  pc = regs[15];
+  sp = regs[13];
+  fp = regs[11];
+  lr = regs[14];
+#else
+#error Only ARM, AARCH64, x86 and x86-64 are supported
+#endif
+}
+
+bool ThreadStack::ReadWord(uint64_t address, uint64_t* value) const {
+  if (address < captured_start ||
+      address + sizeof(ElfW(Addr)) > captured_end) {
+    return false;
+  }
+  ElfW(Addr) word;
+  memcpy(&word, &stack[address - stack_start], sizeof(word));
+  *value = word;
+  return true;
+}
+
+const char* StackFrame::note() const {
+  switch (scan_confidence) {
+    case 0:
+      return "";
+    case 1:
+      return " (scanned, low confidence)";
+    default:
+      return " (scanned, high confidence)";
+  }
+}
+
+/// @brief The pointer encodings of .eh_frame (LSB, "DWARF Extensions").
+enum {
+  DW_EH_PE_absptr = 0x00,
+  DW_EH_PE_uleb128 = 0x01,
+  DW_EH_PE_udata2 = 0x02,
+  DW_EH_PE_udata4 = 0x03,
+  DW_EH_PE_udata8 = 0x04,
+  DW_EH_PE_sleb128 = 0x09,
+  DW_EH_PE_sdata2 = 0x0A,
+  DW_EH_PE_sdata4 = 0x0B,
+  DW_EH_PE_sdata8 = 0x0C,
+  DW_EH_PE_pcrel = 0x10,
+  DW_EH_PE_datarel = 0x30,
+  DW_EH_PE_omit = 0xFF
+};
+
+/// @brief The call frame instructions (DWARF 4, section 7.23).
+enum {
+  DW_CFA_advance_loc = 0x40,
+  DW_CFA_offset = 0x80,
+  DW_CFA_restore = 0xC0,
+  DW_CFA_nop = 0x00,
+  DW_CFA_set_loc = 0x01,
+  DW_CFA_advance_loc1 = 0x02,
+  DW_CFA_advance_loc2 = 0x03,
+  DW_CFA_advance_loc4 = 0x04,
+  DW_CFA_offset_extended = 0x05,
+  DW_CFA_restore_extended = 0x06,
+  DW_CFA_undefined = 0x07,
+  DW_CFA_same_value = 0x08,
+  DW_CFA_register = 0x09,
+  DW_CFA_remember_state = 0x0A,
+  DW_CFA_restore_state = 0x0B,
+  DW_CFA_def_cfa = 0x0C,
+  DW_CFA_def_cfa_register = 0x0D,
+  DW_CFA_def_cfa_offset = 0x0E,
+  DW_CFA_def_cfa_expression = 0x0F,
+  DW_CFA_expression = 0x10,
+  DW_CFA_offset_extended_sf = 0x11,
+  DW_CFA_def_cfa_sf = 0x12,
+  DW_CFA_def_cfa_offset_sf = 0x13,
+  DW_CFA_val_offset = 0x14,
+  DW_CFA_val_offset_sf = 0x15,
+  DW_CFA_val_expression = 0x16,
+  DW_CFA_GNU_window_save = 0x2D,
+  DW_CFA_GNU_args_size = 0x2E,
+  DW_CFA_GNU_negative_offset_extended = 0x2F
+};
+
+#if defined(__x86_64__)
+static const int kSpRegister = 7;  // rsp
+static const int kFpRegister = 6;  // rbp
+static const int kRaRegister = 16;  // rip
+#elif defined(__i386__)
+static const int kSpRegister = 4;  // esp
+static const int kFpRegister = 5;  // ebp
+static const int kRaRegister = 8;  // eip
+#elif defined(__aarch64__)
+static const int kSpRegister = 31;
+static const int kFpRegister = 29;
+static const int kRaRegister = 30;  // lr
+#endif
+
+struct CodeMap::Image {
+  struct Segment {
+    uint64_t vaddr;
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  /// @brief Converts the file offset into the virtual address.
+  bool ToVaddr(uint64_t offset, uint64_t* vaddr) const {
+    for (size_t i = 0; i < segments.size(); i++) {
+      if (offset >= segments[i].offset &&
+          offset < segments[i].offset + segments[i].size) {
+        *vaddr = segments[i].vaddr + (offset - segments[i].offset);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /// @brief Reads size bytes at the virtual address.
+  bool Read(uint64_t vaddr, void* buffer, size_t size) const {
+    for (size_t i = 0; i < segments.size(); i++) {
+      if (vaddr >= segments[i].vaddr &&
+          vaddr + size <= segments[i].vaddr + segments[i].size) {
+        return pread(fd, buffer, size, segments[i].offset +
+                     (vaddr - segments[i].vaddr)) ==
+            static_cast<ssize_t>(size);
+      }
+    }
+    return false;
+  }
+
+  int fd;
+  std::vector<Segment> segments;
+  uint64_t eh_frame_hdr;
+  std::vector<unsigned char> eh_frame_hdr_data;
+};
+
+CodeMap::~CodeMap() {
+  for (std::map<std::string, int>::const_iterator it = descriptors_.begin();
+       it != descriptors_.end(); ++it) {
+    if (it->second >= 0) {
+      close(it->second);
+    }
+  }
+  for (std::map<std::string, Image*>::const_iterator it = images_.begin();
+       it != images_.end(); ++it) {
+    delete it->second;
+  }
+}
+
+void CodeMap::AddCode(uint64_t start, uint64_t end) {
+  code_.push_back(std::make_pair(start, end));
+}
+
+void CodeMap::AddFile(uint64_t start, uint64_t end, uint64_t file_offset,
+                      const std::string& path) {
+  File file = { start, end, file_offset, path };
+  files_.push_back(file);
+}
+
+bool CodeMap::Contains(uint64_t address) const {
+  for (size_t i = 0; i < code_.size(); i++) {
+    if (address >= code_[i].first && address < code_[i].second) {
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t CodeMap::ReadBefore(uint64_t address, unsigned char* buffer,
+                           size_t size) const {
+  for (size_t i = 0; i < files_.size(); i++) {
+    const File& file = files_[i];
+    if (address <= file.start || address > file.end) {
+      continue;
+    }
+    int fd = Open(file.path);
+    size_t length = std::min<uint64_t>(size, address - file.start);
+    if (fd < 0 || pread(fd, buffer + size - length, length,
+              file.file_offset + (address - length - file.start)) !=
+            static_cast<ssize_t>(length)) {
+      return 0;
+    }
+    return length;
+  }
+  return 0;
+}
+
+int CodeMap::Open(const std::string& path) const {
+  std::map<std::string, int>::iterator it = descriptors_.find(path);
+  if (it == descriptors_.end()) {
+    it = descriptors_.insert(std::make_pair(
+        path, open(path.c_str(), O_RDONLY | O_CLOEXEC))).first;
+  }
+  return it->second;
+}
+
+const CodeMap::Image* CodeMap::LoadImage(const std::string& path) const {
+  std::map<std::string, Image*>::iterator it = images_.find(path);
+  if (it != images_.end()) {
+    return it->second;
+  }
+  Image* image = new Image();
+  image->fd = Open(path);
+  image->eh_frame_hdr = 0;
+  ElfW(Ehdr) ehdr;
+  ElfW(Phdr) eh_frame_hdr = ElfW(Phdr)();
+  if (image->fd >= 0 &&
+      pread(image->fd, &ehdr, sizeof(ehdr), 0) == sizeof(ehdr) &&
+      !memcmp(ehdr.e_ident, ELFMAG, SELFMAG) &&
+      ehdr.e_ident[EI_CLASS] ==
+          (sizeof(ElfW(Addr)) == 8? ELFCLASS64 : ELFCLASS32)) {
+    for (int i = 0; i < ehdr.e_phnum; i++) {
+      ElfW(Phdr) phdr;
+      if (pread(image->fd, &phdr, sizeof(phdr),
+                ehdr.e_phoff + i * ehdr.e_phentsize) != sizeof(phdr)) {
+        break;
+      }
+      if (phdr.p_type == PT_LOAD) {
+        Image::Segment segment = { phdr.p_vaddr, phdr.p_offset,
+                                   phdr.p_filesz };
+        image->segments.push_back(segment);
+      } else if (phdr.p_type == PT_GNU_EH_FRAME) {
+        eh_frame_hdr = phdr;
+      }
+    }
+  }
+  // version 1, the table of the sdata4 offsets from .eh_frame_hdr
+  std::vector<unsigned char>& data = image->eh_frame_hdr_data;
+  data.resize(eh_frame_hdr.p_filesz);
+  if (data.size() < 4 ||
+      !image->Read(eh_frame_hdr.p_vaddr, &data[0], data.size()) ||
+      data[0] != 1 || data[3] != (DW_EH_PE_datarel | DW_EH_PE_sdata4)) {
+    data.clear();
+  }
+  image->eh_frame_hdr = eh_frame_hdr.p_vaddr;
+  images_[path] = image;
+  return image;
+}
+
+/// @brief Sequential reader of the DWARF call frame information.
+struct CfiReader {
+  uint8_t U8() {
+    if (pos >= end) {
+      ok = false;
+      return 0;
+    }
+    return *pos++;
+  }
+
+  uint64_t Fixed(size_t size) {
+    if (static_cast<size_t>(end - pos) < size) {
+      ok = false;
+      return 0;
+    }
+    uint64_t value = 0;
+    memcpy(&value, pos, size);
+    pos += size;
+    return value;
+  }
+
+  int64_t Signed(size_t size) {
+    uint64_t value = Fixed(size);
+    int shift = 64 - size * 8;
+    return static_cast<int64_t>(value << shift) >> shift;
+  }
+
+  uint64_t Uleb() {
+    uint64_t value = 0;
+    for (int shift = 0; ok && shift < 64; shift += 7) {
+      uint8_t byte = U8();
+      value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      if (!(byte & 0x80)) {
+        break;
+      }
+    }
+    return value;
+  }
+
+  int64_t Sleb() {
+    uint64_t value = 0;
+    int shift = 0;
+    uint8_t byte;
+    do {
+      byte = U8();
+      value |= static_cast<uint64_t>(byte & 0x7F) << shift;
+      shift += 7;
+    } while (ok && (byte & 0x80) && shift < 64);
+    if (shift < 64 && (byte & 0x40)) {
+      value |= ~0ULL << shift;
+    }
+    return static_cast<int64_t>(value);
+  }
+
+  /// @brief Reads a pointer in the DW_EH_PE_* encoding.
+  uint64_t Pointer(uint8_t encoding, uint64_t data_base) {
+    if (encoding == DW_EH_PE_omit) {
+      return 0;
+    }
+    uint64_t field = vaddr + (pos - start), value;
+    switch (encoding & 0x0F) {
+      case DW_EH_PE_absptr:
+        value = Fixed(sizeof(ElfW(Addr)));
+        break;
+      case DW_EH_PE_uleb128:
+        value = Uleb();
+        break;
+      case DW_EH_PE_udata2:
+        value = Fixed(2);
+        break;
+      case DW_EH_PE_udata4:
+        value = Fixed(4);
+        break;
+      case DW_EH_PE_udata8:
+        value = Fixed(8);
+        break;
+      case DW_EH_PE_sleb128:
+        value = Sleb();
+        break;
+      case DW_EH_PE_sdata2:
+        value = Signed(2);
+        break;
+      case DW_EH_PE_sdata4:
+        value = Signed(4);
+        break;
+      case DW_EH_PE_sdata8:
+        value = Signed(8);
+        break;
+      default:
+        ok = false;
+        return 0;
+    }
+    switch (encoding & 0x70) {
+      case DW_EH_PE_absptr:
+        break;
+      case DW_EH_PE_pcrel:
+        value += field;
+        break;
+      case DW_EH_PE_datarel:
+        value += data_base;
+        break;
+      default:
+        ok = false;
+    }
+    return value;
+  }
+
+  const unsigned char* start;
+  const unsigned char* pos;
+  const unsigned char* end;
+  /// @brief The virtual address of start.
+  uint64_t vaddr;
+  bool ok;
+};
+
+/// @brief How to recover a register of the caller.
+struct CfiRule {
+  enum Type {
+    kSameValue, kUndefined, kOffset, kValOffset, kRegister, kUnsupported
+  };
+
+  Type type;
+  int64_t value;
+};
+
+struct CfiState {
+  int cfa_register;
+  int64_t cfa_offset;
+  bool cfa_expression;
+  CfiRule rules[UnwindRegisters::kCount];
+};
+
+/// @brief The parts of a CIE and an FDE the interpreter needs.
+struct CfiEntry {
+  uint64_t code_alignment;
+  int64_t data_alignment;
+  int return_address;
+  uint8_t pointer_encoding;
+  bool signal_frame;
+  std::vector<unsigned char> cie;
+  CfiReader initial_instructions;
+  std::vector<unsigned char> fde;
+  CfiReader instructions;
+  uint64_t pc_begin;
+};
+
+/// @brief Reads the CIE or the FDE at vaddr into data.
+static bool ReadCfiRecord(const CodeMap::Image& image, uint64_t vaddr,
+                          std::vector<unsigned char>* data,
+                          CfiReader* reader) {
+  uint32_t length;
+  // The 64-bit DWARF records are never emitted into .eh_frame
+  if (!image.Read(vaddr, &length, sizeof(length)) || length == 0 ||
+      length == 0xFFFFFFFF || length > (1 << 20)) {
+    return false;
+  }
+  data->resize(length);
+  if (!image.Read(vaddr + 4, &(*data)[0], length)) {
+    return false;
+  }
+  CfiReader record = { &(*data)[0], &(*data)[0], &(*data)[0] + length,
+                       vaddr + 4, true };
+  *reader = record;
+  return true;
+}
+
+/// @brief Finds the FDE which covers vaddr and parses it with its CIE.
+static bool FindCfiEntry(const CodeMap::Image& image, uint64_t vaddr,
+                         CfiEntry* entry) {
+  const std::vector<unsigned char>& hdr = image.eh_frame_hdr_data;
+  if (hdr.empty()) {
+    return false;
+  }
+  CfiReader reader = { &hdr[0], &hdr[4], &hdr[0] + hdr.size(),
+                       image.eh_frame_hdr, true };
+  reader.Pointer(hdr[1], image.eh_frame_hdr);
+  uint64_t count = reader.Pointer(hdr[2], image.eh_frame_hdr);
+  if (!reader.ok ||
+      count > static_cast<uint64_t>(reader.end - reader.pos) / 8) {
+    return false;
+  }
+  // The table is sorted by the initial locations
+  const unsigned char* table = reader.pos;
+  int64_t target = vaddr - image.eh_frame_hdr;
+  uint64_t low = 0, high = count;
+  while (low < high) {
+    uint64_t middle = (low + high) / 2;
+    int32_t location;
+    memcpy(&location, table + middle * 8, sizeof(location));
+    if (location <= target) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  if (low == 0) {
+    return false;
+  }
+  int32_t fde_offset;
+  memcpy(&fde_offset, table + (low - 1) * 8 + 4, sizeof(fde_offset));
+  uint64_t fde = image.eh_frame_hdr + fde_offset;
+  CfiReader fde_reader, cie_reader;
+  if (!ReadCfiRecord(image, fde, &entry->fde, &fde_reader)) {
+    return false;
+  }
+  uint32_t cie_pointer = fde_reader.Fixed(4);
+  if (!fde_reader.ok || cie_pointer == 0 ||
+      !ReadCfiRecord(image, fde + 4 - cie_pointer, &entry->cie,
+                     &cie_reader) ||
+      cie_reader.Fixed(4) != 0) {
+    return false;
+  }
+
+  uint8_t version = cie_reader.U8();
+  const char* augmentation = reinterpret_cast<const char*>(cie_reader.pos);
+  size_t augmentation_length = strnlen(augmentation,
+                                       cie_reader.end - cie_reader.pos);
+  cie_reader.pos += augmentation_length + 1;
+  if (strstr(augmentation, "eh") != NULL) {
+    return false;
+  }
+  if (version >= 4) {
+    cie_reader.U8();  // address_size
+    cie_reader.U8();  // segment_size
+  }
+  entry->code_alignment = cie_reader.Uleb();
+  entry->data_alignment = cie_reader.Sleb();
+  entry->return_address = version == 1? cie_reader.U8() :
+                                        cie_reader.Uleb();
+  entry->pointer_encoding = DW_EH_PE_absptr;
+  entry->signal_frame = false;
+  bool has_length = augmentation[0] == 'z';
+  if (has_length) {
+    uint64_t length = cie_reader.Uleb();
+    const unsigned char* data_end = cie_reader.pos + length;
+    for (const char* c = augmentation + 1; *c != 0 && cie_reader.ok; c++) {
+      if (*c == 'R') {
+        entry->pointer_encoding = cie_reader.U8();
+      } else if (*c == 'P') {
+        cie_reader.Pointer(cie_reader.U8() & 0x7F, 0);
+      } else if (*c == 'L') {
+        cie_reader.U8();
+      } else if (*c == 'S') {
+        entry->signal_frame = true;
+      } else {
+        break;
+      }
+    }
+    cie_reader.pos = data_end;
+  } else if (augmentation[0] != 0) {
+    return false;
+  }
+  entry->initial_instructions = cie_reader;
+
+  entry->pc_begin = fde_reader.Pointer(entry->pointer_encoding, 0);
+  uint64_t pc_range = fde_reader.Pointer(entry->pointer_encoding & 0x0F, 0);
+  if (has_length) {
+    uint64_t length = fde_reader.Uleb();
+    fde_reader.pos += length;
+  }
+  entry->instructions = fde_reader;
+  return cie_reader.ok && fde_reader.ok &&
+      cie_reader.pos <= cie_reader.end && fde_reader.pos <= fde_reader.end &&
+      vaddr >= entry->pc_begin && vaddr < entry->pc_begin + pc_range;
+}
+
+/// @brief Runs the call frame instructions until the location passes
+/// target.
+/// @param initial The state after the CIE's instructions, which
+/// DW_CFA_restore returns to.
+static bool RunCfiProgram(const CfiEntry& entry, CfiReader reader,
+                          uint64_t target, const CfiState& initial,
+                          CfiState* state) {
+  uint64_t location = entry.pc_begin;
+  std::vector<CfiState> remembered;
+  while (reader.ok && reader.pos < reader.end) {
+    uint8_t op = reader.U8();
+    uint64_t reg = op & 0x3F, delta = 0;
+    CfiRule rule = { CfiRule::kUnsupported, 0 };
+    bool set_rule = false;
+    switch (op & 0xC0) {
+      case DW_CFA_advance_loc:
+        delta = (op & 0x3F) * entry.code_alignment;
+        break;
+      case DW_CFA_offset:
+        rule.type = CfiRule::kOffset;
+        rule.value = reader.Uleb() * entry.data_alignment;
+        set_rule = true;
+        break;
+      case DW_CFA_restore:
+        if (reg < UnwindRegisters::kCount) {
+          state->rules[reg] = initial.rules[reg];
+        }
+        break;
+      default:
+        switch (op) {
+          case DW_CFA_nop:
+          case DW_CFA_GNU_window_save:  // AArch64 return address signing
+            break;
+          case DW_CFA_set_loc:
+            location = reader.Pointer(entry.pointer_encoding, 0);
+            if (location > target) {
+              return true;
+            }
+            break;
+          case DW_CFA_advance_loc1:
+            delta = reader.Fixed(1) * entry.code_alignment;
+            break;
+          case DW_CFA_advance_loc2:
+            delta = reader.Fixed(2) * entry.code_alignment;
+            break;
+          case DW_CFA_advance_loc4:
+            delta = reader.Fixed(4) * entry.code_alignment;
+            break;
+          case DW_CFA_offset_extended:
+            reg = reader.Uleb();
+            rule.type = CfiRule::kOffset;
+            rule.value = reader.Uleb() * entry.data_alignment;
+            set_rule = true;
+            break;
+          case DW_CFA_restore_extended:
+            reg = reader.Uleb();
+            if (reg < UnwindRegisters::kCount) {
+              state->rules[reg] = initial.rules[reg];
+            }
+            break;
+          case DW_CFA_undefined:
+            reg = reader.Uleb();
+            rule.type = CfiRule::kUndefined;
+            set_rule = true;
+            break;
+          case DW_CFA_same_value:
+            reg = reader.Uleb();
+            rule.type = CfiRule::kSameValue;
+            set_rule = true;
+            break;
+          case DW_CFA_register:
+            reg = reader.Uleb();
+            rule.type = CfiRule::kRegister;
+            rule.value = reader.Uleb();
+            set_rule = true;
+            break;
+          case DW_CFA_remember_state:
+            remembered.push_back(*state);
+            break;
+          case DW_CFA_restore_state:
+            if (remembered.empty()) {
+              return false;
+            }
+            *state = remembered.back();
+            remembered.pop_back();
+            break;
+          case DW_CFA_def_cfa:
+            state->cfa_register = reader.Uleb();
+            state->cfa_offset = reader.Uleb();
+            state->cfa_expression = false;
+            break;
+          case DW_CFA_def_cfa_register:
+            state->cfa_register = reader.Uleb();
+            state->cfa_expression = false;
+            break;
+          case DW_CFA_def_cfa_offset:
+            state->cfa_offset = reader.Uleb();
+            break;
+          case DW_CFA_def_cfa_expression:
+            reader.pos += reader.Uleb();
+            state->cfa_expression = true;
+            break;
+          case DW_CFA_expression:
+          case DW_CFA_val_expression:
+            reg = reader.Uleb();
+            reader.pos += reader.Uleb();
+            set_rule = true;
+            break;
+          case DW_CFA_offset_extended_sf:
+            reg = reader.Uleb();
+            rule.type = CfiRule::kOffset;
+            rule.value = reader.Sleb() * entry.data_alignment;
+            set_rule = true;
+            break;
+          case DW_CFA_def_cfa_sf:
+            state->cfa_register = reader.Uleb();
+            state->cfa_offset = reader.Sleb() * entry.data_alignment;
+            state->cfa_expression = false;
+            break;
+          case DW_CFA_def_cfa_offset_sf:
+            state->cfa_offset = reader.Sleb() * entry.data_alignment;
+            break;
+          case DW_CFA_val_offset:
+            reg = reader.Uleb();
+            rule.type = CfiRule::kValOffset;
+            rule.value = reader.Uleb() * entry.data_alignment;
+            set_rule = true;
+            break;
+          case DW_CFA_val_offset_sf:
+            reg = reader.Uleb();
+            rule.type = CfiRule::kValOffset;
+            rule.value = reader.Sleb() * entry.data_alignment;
+            set_rule = true;
+            break;
+          case DW_CFA_GNU_args_size:
+            reader.Uleb();
+            break;
+          case DW_CFA_GNU_negative_offset_extended:
+            reg = reader.Uleb();
+            rule.type = CfiRule::kOffset;
+            rule.value = -static_cast<int64_t>(reader.Uleb());
+            set_rule = true;
+            break;
+          default:
+            return false;
+        }
+    }
+    if (set_rule && reg < UnwindRegisters::kCount) {
+      state->rules[reg] = rule;
+    }
+    if (delta != 0) {
+      location += delta;
+      if (location > target) {
+        return true;
+      }
+    }
+  }
+  return reader.ok;
+}
+
+bool CodeMap::StepCfi(const ThreadStack& thread, UnwindRegisters* regs,
+                      bool* outermost) const {
+  *outermost = false;
+#if defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)
+  // The call may be the last instruction of the function
+  uint64_t address = regs->caller? regs->pc - 1 : regs->pc;
+  const File* file = NULL;
+  for (size_t i = 0; i < files_.size() && file == NULL; i++) {
+    if (address >= files_[i].start && address < files_[i].end) {
+      file = &files_[i];
+    }
+  }
+  uint64_t vaddr;
+  const Image* image = file != NULL? LoadImage(file->path) : NULL;
+  CfiEntry entry;
+  if (image == NULL || !image->ToVaddr(
+          file->file_offset + (address - file->start), &vaddr) ||
+      !FindCfiEntry(*image, vaddr, &entry) ||
+      entry.return_address >= UnwindRegisters::kCount) {
+    return false;
+  }
+  CfiState initial = CfiState();
+  initial.cfa_register = -1;
+  if (!RunCfiProgram(entry, entry.initial_instructions, UINT64_MAX, initial,
+                     &initial)) {
+    return false;
+  }
+  CfiState state = initial;
+  if (!RunCfiProgram(entry, entry.instructions, vaddr, initial, &state) ||
+      state.cfa_expression || state.cfa_register < 0 ||
+      state.cfa_register >= UnwindRegisters::kCount ||
+      !regs->known[state.cfa_register]) {
+    return false;
+  }
+  uint64_t cfa = regs->values[state.cfa_register] + state.cfa_offset;
+  UnwindRegisters caller = *regs;
+  for (int i = 0; i < UnwindRegisters::kCount; i++) {
+    const CfiRule& rule = state.rules[i];
+    switch (rule.type) {
+      case CfiRule::kSameValue:
+        break;
+      case CfiRule::kOffset:
+        caller.known[i] = thread.ReadWord(cfa + rule.value,
+                                          &caller.values[i]);
+        break;
+      case CfiRule::kValOffset:
+        caller.values[i] = cfa + rule.value;
+        caller.known[i] = true;
+        break;
+      case CfiRule::kRegister:
+        caller.known[i] = rule.value < UnwindRegisters::kCount &&
+            regs->known[rule.value];
+        caller.values[i] = caller.known[i]? regs->values[rule.value] : 0;
+        break;
+      default:
+        caller.known[i] = false;
+    }
+  }
+  if (state.rules[entry.return_address].type == CfiRule::kUndefined) {
+    // The entry point marks the end of the stack this way
+    *outermost = true;
+    return true;
+  }
+  caller.values[kSpRegister] = cfa;
+  caller.known[kSpRegister] = true;
+  if (!caller.known[entry.return_address] ||
+      (regs->known[kSpRegister] && cfa <= regs->values[kSpRegister] &&
+       !entry.signal_frame)) {
+    return false;
+  }
+  caller.pc = caller.values[entry.return_address];
+  // The caller of a signal frame was interrupted rather than called
+  caller.caller = !entry.signal_frame;
+  *regs = caller;
+  return true;
+#else
+  (void)thread;
+  (void)regs;
+  return false;
+#endif
+}
+
+/// @brief Tells CallSiteConfidence() whether a call target is code.
+struct CodeLookup {
+  bool operator()(uint64_t address) const {
+    return code->Contains(address);
+  }
+
+  const CodeMap* code;
+};
+
+int CodeMap::CallConfidence(uint64_t address) const {
+  if (!Contains(address - 1)) {
+    return 0;
+  }
+  unsigned char buffer[kMaxCallSiteSize];
+  size_t available = ReadBefore(address, buffer, sizeof(buffer));
+  CodeLookup lookup = { this };
+  return CallSiteConfidence(buffer + sizeof(buffer), available, address,
+                            lookup);
+}
+
+std::vector<StackFrame> Unwind(const ThreadStack& thread,
+                               const CodeMap& code) {
+  static const size_t kMaxFrames = 128;
+  std::vector<StackFrame> frames;
+  StackFrame frame = { thread.pc, 0 };
+  frames.push_back(frame);
+  uint64_t ret, scan_from = thread.sp;
+  bool outermost = false;
+#if defined(__arm__)
+  // The link register duplicates the first return address unless the
+  // thread stopped in a leaf function; ARM is unwound by .ARM.exidx,
+  // which is not read here
+  if (thread.lr != 0 && code.Contains(thread.lr)) {
+    frame.address = thread.lr;
+    frames.push_back(frame);
+  }
+#else
+  UnwindRegisters regs;
+  memset(&regs, 0, sizeof(regs));
+  regs.pc = thread.pc;
+  regs.values[kSpRegister] = thread.sp;
+  regs.values[kFpRegister] = thread.fp;
+  regs.known[kSpRegister] = regs.known[kFpRegister] = true;
+#if defined(__aarch64__)
+  regs.values[kRaRegister] = thread.lr;
+  regs.known[kRaRegister] = true;
+#endif
+  while (frames.size() < kMaxFrames) {
+    if (!code.StepCfi(thread, &regs, &outermost)) {
+      // No call frame information: without the frame pointers, fp holds
+      // an arbitrary value, so follow it only to a return address which
+      // follows a call
+      uint64_t fp = regs.values[kFpRegister], next_fp;
+      if (!regs.known[kFpRegister] || fp < regs.values[kSpRegister] ||
+          !thread.ReadWord(fp, &next_fp) ||
+          !thread.ReadWord(fp + sizeof(ElfW(Addr)), &ret) ||
+          code.CallConfidence(ret) == 0) {
+        outermost = regs.known[kFpRegister] && fp == 0;
+        break;
+      }
+      regs.pc = ret;
+      regs.caller = true;
+      regs.values[kFpRegister] = next_fp;
+      regs.values[kSpRegister] = fp + 2 * sizeof(ElfW(Addr));
+    } else if (outermost || !code.Contains(regs.pc)) {
+      break;
+    }
+    frame.address = regs.pc;
+    frames.push_back(frame);
+    scan_from = regs.values[kSpRegister];
+  }
+#endif
+  if (outermost) {
+    return frames;
+  }
+  // The chain is broken: guess the rest of the frames
+  for (uint64_t address = scan_from & ~(sizeof(ElfW(Addr)) - 1);
+       frames.size() < kMaxFrames && thread.ReadWord(address, &ret);
+       address += sizeof(ElfW(Addr))) {
+    frame.scan_confidence = code.CallConfidence(ret);
+    if (frame.scan_confidence > 0) {
+      frame.address = ret;
+      frames.push_back(frame);
+    }
+  }
+  return frames;
+}
+
+}  // namespace Debug
@@ -0,0 +1,175 @@
+/*
+
+  Copyright (c) 2012, Samsung R&D Institute Russia
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions are met:
+
+  1. Redistributions of source code must retain the above copyright notice, this
+     list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright notice,
+     this list of conditions and the following disclaimer in the documentation
+     and/or other materials provided with the distribution.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+  WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+  DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR
+  ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+  (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+  ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+  (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+  SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+ */
+
+/*! @file unwinder.h
+ *  @brief Declaration of the offline stack unwinder shared by the tools.
+ *  @author Markovtsev Vadim <gmarkhor@gmail.com>
+ *  @version 1.0
+ *  @license Simplified BSD License
+ *  @copyright 2012 Samsung R&D Institute Russia, 2016 Moscow Institute of Physics and Technology
+ */
+
+
+#ifndef TOOLS_UNWINDER_H_
+#define TOOLS_UNWINDER_H_
+
+#include <stdint.h>
+#include <sys/procfs.h>
+#include <sys/types.h>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace Debug {
+
+/// @brief The registers of a thread and the copy of its stack top.
+struct ThreadStack {
+  ThreadStack()
+      : tid(0), signal(0), pc(0), sp(0), fp(0), lr(0), stack_start(0),
+        captured_start(0), captured_end(0) {}
+
+  /// @brief Takes pc, sp, the frame pointer and the link register from
+  /// the general registers (NT_PRSTATUS layout).
+  void ReadRegisters(const elf_greg_t* regs);
+
+  /// @brief Reads a word from the copied stack.
+  bool ReadWord(uint64_t address, uint64_t* value) const;
+
+  pid_t tid;
+  int signal;
+  uint64_t pc;
+  uint64_t sp;
+  uint64_t fp;
+  uint64_t lr;
+  /// @brief The address of stack[0].
+  uint64_t stack_start;
+  std::vector<char> stack;
+  /// @brief The part of stack which has been actually copied.
+  uint64_t captured_start;
+  uint64_t captured_end;
+};
+
+/// @brief A stack frame; scanned frames are the guesses of the stack
+/// scanner rather than the frame chain links.
+struct StackFrame {
+  /// @brief Returns the marker of the scanned frames, the same as
+  /// the signal handler prints, or "".
+  const char* note() const;
+
+  uint64_t address;
+  /// @brief 0 for the frame chain links; 2 for the scanned frames after
+  /// a direct call and 1 after an indirect one.
+  int scan_confidence;
+};
+
+/// @brief The registers of a frame in the DWARF numbering, as far as
+/// they are known.
+struct UnwindRegisters {
+  static const int kCount = 33;
+
+  uint64_t pc;
+  /// @brief pc is a return address rather than the interrupted instruction.
+  bool caller;
+  uint64_t values[kCount];
+  bool known[kCount];
+};
+
+/// @brief The executable mappings of a process and the files to read
+/// their code and call frame information from.
+class CodeMap {
+ public:
+  CodeMap() {}
+  ~CodeMap();
+
+  /// @brief Registers the executable mapping [start, end).
+  void AddCode(uint64_t start, uint64_t end);
+
+  /// @brief Tells that [start, end) is mapped from file_offset of path;
+  /// /proc/<pid>/mem with file_offset equal to start reads a live process.
+  void AddFile(uint64_t start, uint64_t end, uint64_t file_offset,
+               const std::string& path);
+
+  /// @brief Checks whether the address is inside an executable mapping.
+  bool Contains(uint64_t address) const;
+
+  /// @brief Checks whether address follows a call instruction, the same
+  /// way the signal handler validates the scanned frames.
+  /// @return 2 for a direct call to code, 1 for an indirect call,
+  /// 0 otherwise or if the code cannot be read.
+  int CallConfidence(uint64_t address) const;
+
+  /// @brief Unwinds one frame with the .eh_frame of the mapped file which
+  /// contains regs->pc.
+  /// @param outermost Set if the call frame information marks the frame as
+  /// the last one.
+  /// @return false if there is no usable call frame information for pc.
+  bool StepCfi(const ThreadStack& thread, UnwindRegisters* regs,
+               bool* outermost) const;
+
+  /// @brief The program headers and the .eh_frame_hdr of a mapped file.
+  struct Image;
+
+ private:
+  struct File {
+    uint64_t start;
+    uint64_t end;
+    uint64_t file_offset;
+    std::string path;
+  };
+
+  CodeMap(const CodeMap&);
+  CodeMap& operator=(const CodeMap&);
+
+  /// @brief Copies up to size bytes which precede address in the same
+  /// mapping to the end of buffer.
+  /// @return The number of bytes copied.
+  size_t ReadBefore(uint64_t address, unsigned char* buffer,
+                    size_t size) const;
+
+  /// @brief Returns the descriptor of path, opening it on the first call.
+  int Open(const std::string& path) const;
+
+  /// @brief Parses the program headers and the .eh_frame_hdr of path.
+  const Image* LoadImage(const std::string& path) const;
+
+  std::vector<std::pair<uint64_t, uint64_t> > code_;
+  std::vector<File> files_;
+  mutable std::map<std::string, int> descriptors_;
+  mutable std::map<std::string, Image*> images_;
+};
+
+/// @brief Unwinds the frames with the DWARF call frame information of
+/// the mapped files, falling back to the frame pointer links which
+/// follow call instructions. If the chain breaks before the outermost
+/// frame, scans the rest of the copied stack for the words which point
+/// right after a call.
+std::vector<StackFrame> Unwind(const ThreadStack& thread,
+                               const CodeMap& code);
+
+}  // namespace Debug
+#endif  // TOOLS_UNWINDER_H_